@@ -0,0 +1,528 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * agent.c - Run itsa over a roster of clients
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ *
+ * For agents acting on behalf of a number of taxpayers. Each client
+ * has its own config directory (laid out like ~/.config/itsa, i.e with
+ * a config.json and the libmtdac credentials) and gets its own libitsa
+ * context and libmtdac session. So a failure for one client has no
+ * bearing on any other.
+ *
+ * The clients are processed by a work-stealing thread pool, with all
+ * the requests to HMRC subject to a process wide rate limit.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+
+#include <jansson.h>
+
+#include <libmtdac/mtd.h>
+
+#include <libac.h>
+
+#include "color.h"
+#include "libitsa.h"
+#include "pool.h"
+#include "agent.h"
+
+#define AGENT_DEF_THREADS	4
+
+enum client_status {
+	CLIENT_FAILED = 0,
+	CLIENT_UP_TO_DATE,
+	CLIENT_DRY_RUN,
+	CLIENT_SUBMITTED,
+};
+
+static const char *client_status_str[] = {
+	[CLIENT_FAILED]		= "failed",
+	[CLIENT_UP_TO_DATE]	= "up-to-date",
+	[CLIENT_DRY_RUN]	= "dry-run",
+	[CLIENT_SUBMITTED]	= "submitted",
+};
+
+struct client {
+	const char *name;
+	const char *config_dir;
+
+	enum client_status status;
+	char *bid;
+	char start[ITSA_DATE_SZ + 1];
+	char end[ITSA_DATE_SZ + 1];
+	long income;
+	long expenses;
+	char *cid;
+	char *error;
+	char *error_detail;
+	double elapsed;
+};
+
+static struct {
+	unsigned int mtd_flags;
+	const struct mtd_cfg *cfg;
+	unsigned long deadline;	/* ms per client, 0 for none */
+	bool submit;
+} agent_cfg;
+
+static double elapsed_secs(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void client_error(struct client *client, const char *what,
+			 const char *err, const char *detail)
+{
+	client->status = CLIENT_FAILED;
+	if (asprintf(&client->error, "%s: %s", what, err) == -1)
+		client->error = NULL;
+	client->error_detail = detail && *detail ? strdup(detail) : NULL;
+}
+
+/*
+ * Read the clients config.json for the currently selected business.
+ * The strings in bus point into root.
+ */
+static json_t *read_client_config(struct client *client,
+				  struct itsa_business *bus)
+{
+	json_t *root;
+	json_t *bus_obj;
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/config.json", client->config_dir);
+	root = json_load_file(path, 0, NULL);
+	if (!root) {
+		client_error(client, "config", "Unable to open config", path);
+		return NULL;
+	}
+
+	bus_obj = json_array_get(json_object_get(root, "businesses"),
+				 json_integer_value(json_object_get(root,
+							"business_idx")));
+	bus->bid = json_string_value(json_object_get(bus_obj, "bid"));
+	bus->btype = json_string_value(json_object_get(bus_obj, "type"));
+	bus->bname = json_string_value(json_object_get(bus_obj, "name"));
+	bus->gnc = json_string_value(json_object_get(bus_obj, "gnc_sqlite"));
+	if (!bus->bid || !bus->btype || !bus->gnc) {
+		client_error(client, "config", "No valid business found",
+			     path);
+		json_decref(root);
+		return NULL;
+	}
+
+	return root;
+}
+
+/*
+ * Find the earliest period that hasn't been fulfilled, extract its
+ * totals from the clients GnuCash book and, if asked to, submit it
+ * and trigger a new calculation.
+ */
+static void process_client(struct itsa_ctx *ctx, struct client *client)
+{
+	struct itsa_obligation *obs;
+	struct itsa_period period;
+	char tax_year[ITSA_TAX_YEAR_SZ + 1];
+	size_t nr_obs;
+	size_t i;
+	int err;
+
+	err = itsa_list_obligations(ctx, ITSA_OB_PERIOD, NULL, NULL,
+				    &obs, &nr_obs);
+	if (err) {
+		client_error(client, "list-obligations", itsa_err2str(err),
+			     itsa_err_detail(ctx));
+		return;
+	}
+
+	client->status = CLIENT_UP_TO_DATE;
+	for (i = 0; i < nr_obs; i++) {
+		if (obs[i].status == 'F')
+			continue;
+
+		snprintf(client->start, sizeof(client->start), "%s",
+			 obs[i].start);
+		snprintf(client->end, sizeof(client->end), "%s", obs[i].end);
+		client->status = CLIENT_DRY_RUN;
+		break;
+	}
+	itsa_obligations_free(obs, nr_obs);
+	if (client->status == CLIENT_UP_TO_DATE)
+		return;
+
+	err = itsa_get_period(ctx, client->start, client->end, &period);
+	if (err) {
+		client_error(client, "get-period", itsa_err2str(err),
+			     itsa_err_detail(ctx));
+		return;
+	}
+	client->income = period.income;
+	client->expenses = period.expenses;
+
+	if (!agent_cfg.submit)
+		goto out_free_period;
+
+	err = itsa_set_period(ctx, &period, ITSA_PERIOD_CREATE);
+	if (err == ITSA_UNCHANGED) {
+		/* Already went in, HMRC just hasn't caught up yet */
+		client->status = CLIENT_UP_TO_DATE;
+		goto out_free_period;
+	} else if (err == ITSA_QUEUED) {
+		client_error(client, "create-period", "Queued",
+			     "Queued to be sent with flush-queue");
+		goto out_free_period;
+	} else if (err) {
+		client_error(client, "create-period", itsa_err2str(err),
+			     itsa_err_detail(ctx));
+		goto out_free_period;
+	}
+	client->status = CLIENT_SUBMITTED;
+
+	err = itsa_trigger_calculation(ctx, itsa_tax_year(client->end,
+							  tax_year),
+				       false, &client->cid);
+	if (err) {
+		client_error(client, "trigger-calculation", itsa_err2str(err),
+			     itsa_err_detail(ctx));
+		/* The period itself did go in */
+		client->status = CLIENT_SUBMITTED;
+	}
+
+out_free_period:
+	itsa_period_free(&period);
+}
+
+static void client_job(void *arg)
+{
+	struct client *client = arg;
+	struct itsa_business bus;
+	struct itsa_ctx *ctx;
+	struct mtd_cfg cfg = *agent_cfg.cfg;
+	struct timespec start;
+	json_t *root;
+	int err;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	root = read_client_config(client, &bus);
+	if (!root)
+		goto out;
+	client->bid = strdup(bus.bid);
+
+	cfg.config_dir = client->config_dir;
+	if (itsa_mtd_needed()) {
+		err = mtd_init(agent_cfg.mtd_flags, &cfg);
+		if (err) {
+			client_error(client, "mtd_init", mtd_err2str(err),
+				     NULL);
+			goto out_free_root;
+		}
+	}
+
+	/* Nothing the agent submits requires confirmation */
+	ctx = itsa_ctx_new(&bus, NULL, NULL);
+	/* Requests made from other threads must be as this client too */
+	if (ctx && itsa_ctx_set_mtd_cfg(ctx, agent_cfg.mtd_flags, &cfg)) {
+		itsa_ctx_free(ctx);
+		ctx = NULL;
+	}
+	if (ctx) {
+		itsa_ctx_set_deadline(ctx, agent_cfg.deadline);
+		process_client(ctx, client);
+		itsa_ctx_free(ctx);
+	} else {
+		client_error(client, "itsa_ctx_new", "Out of memory", NULL);
+	}
+
+	if (itsa_mtd_needed())
+		mtd_deinit();
+
+out_free_root:
+	json_decref(root);
+out:
+	client->elapsed = elapsed_secs(&start);
+
+	if (client->status == CLIENT_FAILED)
+		printec("%-24s %s\n", client->name,
+			client->error ? client->error : "");
+	else
+		printsc("%-24s %s %s %s\n", client->name,
+			client_status_str[client->status],
+			client->start, client->end);
+}
+
+static void thread_init(void *data __unused)
+{
+	/* The color state is per-thread */
+	set_colors();
+}
+
+static json_t *client_report(const struct client *client)
+{
+	json_t *obj;
+
+	obj = json_pack("{s:s, s:s, s:s*, s:s, s:f}",
+			"name", client->name,
+			"config_dir", client->config_dir,
+			"business_id", client->bid,
+			"status", client_status_str[client->status],
+			"elapsed", client->elapsed);
+
+	if (*client->start) {
+		json_object_set_new(obj, "period",
+				    json_pack("{s:s, s:s}",
+					      "start", client->start,
+					      "end", client->end));
+		json_object_set_new(obj, "income",
+				    json_real(client->income / 100.0));
+		json_object_set_new(obj, "expenses",
+				    json_real(client->expenses / 100.0));
+	}
+	if (client->cid)
+		json_object_set_new(obj, "calculation_id",
+				    json_string(client->cid));
+	if (client->error)
+		json_object_set_new(obj, "error", json_string(client->error));
+	if (client->error_detail) {
+		json_t *detail = json_loads(client->error_detail, 0, NULL);
+
+		if (!detail)
+			detail = json_string(client->error_detail);
+		json_object_set_new(obj, "error_detail", detail);
+	}
+
+	return obj;
+}
+
+static int write_report(const struct client *clients, size_t nr_clients,
+			const char *report, const char *started,
+			double elapsed)
+{
+	json_t *root;
+	json_t *jclients;
+	int counts[sizeof(client_status_str) /
+		   sizeof(client_status_str[0])] = { 0 };
+	size_t i;
+	int err;
+
+	jclients = json_array();
+	for (i = 0; i < nr_clients; i++) {
+		json_array_append_new(jclients, client_report(&clients[i]));
+		counts[clients[i].status]++;
+	}
+
+	root = json_pack("{s:s, s:f, s:b, s:{s:i, s:i, s:i, s:i}, s:o}",
+			 "started", started,
+			 "elapsed", elapsed,
+			 "submit", agent_cfg.submit,
+			 "summary",
+			 client_status_str[CLIENT_SUBMITTED],
+			 counts[CLIENT_SUBMITTED],
+			 client_status_str[CLIENT_DRY_RUN],
+			 counts[CLIENT_DRY_RUN],
+			 client_status_str[CLIENT_UP_TO_DATE],
+			 counts[CLIENT_UP_TO_DATE],
+			 client_status_str[CLIENT_FAILED],
+			 counts[CLIENT_FAILED],
+			 "clients", jclients);
+
+	if (report)
+		err = json_dump_file(root, report, JSON_INDENT(4));
+	else
+		err = json_dumpf(root, stdout, JSON_INDENT(4));
+	if (err)
+		printec("agent: Unable to write report to %s\n",
+			report ? report : "stdout");
+	else if (!report)
+		printf("\n");
+
+	json_decref(root);
+
+	return err;
+}
+
+static void free_clients(struct client *clients, size_t nr_clients)
+{
+	size_t i;
+
+	for (i = 0; i < nr_clients; i++) {
+		free(clients[i].bid);
+		free(clients[i].cid);
+		free(clients[i].error);
+		free(clients[i].error_detail);
+	}
+	free(clients);
+}
+
+/*
+ * itsa agent <roster> [--submit] [--report <file>]
+ *
+ * The roster is a JSON file like
+ *
+ * {
+ *     "threads": 4,
+ *     "rate_limit": { "rate": 3, "burst": 3 },
+ *     "deadline": 300,
+ *     "api_backend": "standin",
+ *     "standin": { ... },
+ *     "clients": [
+ *         { "name": "...", "config_dir": "..." },
+ *         ...
+ *     ]
+ * }
+ *
+ * Without --submit nothing is sent to HMRC, the report just shows what
+ * would be.
+ */
+int agent(int argc, char *argv[], unsigned int mtd_flags,
+	  const struct mtd_cfg *cfg)
+{
+	const struct pool_ops pool_ops = {
+		.thread_init = thread_init,
+	};
+	struct pool *pool;
+	struct client *clients;
+	struct timespec start;
+	struct tm tm;
+	json_t *roster;
+	json_t *jclients;
+	json_t *jclient;
+	json_t *jobj;
+	const char *report = NULL;
+	char started[32];
+	time_t now;
+	size_t nr_clients;
+	size_t index;
+	int nr_threads = AGENT_DEF_THREADS;
+	int nr_failed = 0;
+	int ret = -1;
+	int i;
+
+	if (argc < 3) {
+		printec("Usage: itsa agent <roster> [--submit] "
+			"[--report <file>]\n");
+		return -1;
+	}
+
+	agent_cfg.submit = false;
+	for (i = 3; i < argc; i++) {
+		if (strcmp(argv[i], "--submit") == 0) {
+			agent_cfg.submit = true;
+		} else if (strcmp(argv[i], "--report") == 0 && i + 1 < argc) {
+			report = argv[++i];
+		} else {
+			printec("agent: Unknown option : %s\n", argv[i]);
+			return -1;
+		}
+	}
+
+	roster = json_load_file(argv[2], 0, NULL);
+	if (!roster) {
+		printec("agent: Unable to open roster : %s\n", argv[2]);
+		return -1;
+	}
+
+	jclients = json_object_get(roster, "clients");
+	nr_clients = json_array_size(jclients);
+	if (nr_clients == 0) {
+		printec("agent: No 'clients' found in %s\n", argv[2]);
+		goto out_free_roster;
+	}
+
+	jobj = json_object_get(roster, "threads");
+	if (jobj)
+		nr_threads = json_integer_value(jobj);
+	jobj = json_object_get(roster, "deadline");
+	agent_cfg.deadline = json_integer_value(jobj) * 1000UL;
+	jobj = json_object_get(roster, "rate_limit");
+	if (jobj)
+		itsa_set_rate_limit(json_number_value(json_object_get(jobj,
+								      "rate")),
+				    json_integer_value(json_object_get(jobj,
+								       "burst")));
+	jobj = json_object_get(roster, "api_backend");
+	if (json_is_string(jobj) &&
+	    strcmp(json_string_value(jobj), "standin") == 0 &&
+	    itsa_use_standin(json_object_get(roster, "standin"))) {
+		printec("agent: Couldn't set up the stand-in\n");
+		goto out_free_roster;
+	}
+
+	clients = calloc(nr_clients, sizeof(struct client));
+	if (!clients)
+		goto out_free_roster;
+
+	json_array_foreach(jclients, index, jclient) {
+		struct client *client = &clients[index];
+
+		client->config_dir = json_string_value(
+				json_object_get(jclient, "config_dir"));
+		client->name = json_string_value(json_object_get(jclient,
+								 "name"));
+		if (!client->name)
+			client->name = client->config_dir;
+		if (!client->config_dir) {
+			printec("agent: No 'config_dir' for client %zu\n",
+				index);
+			goto out_free_clients;
+		}
+	}
+
+	agent_cfg.mtd_flags = mtd_flags;
+	agent_cfg.cfg = cfg;
+
+	now = time(NULL);
+	localtime_r(&now, &tm);
+	strftime(started, sizeof(started), "%FT%T", &tm);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	printic("Processing #BOLD#%zu#RST# client(s) with #BOLD#%d#RST# "
+		"thread(s)%s\n", nr_clients, nr_threads,
+		agent_cfg.submit ? "" : " #TANG#(dry-run)#RST#");
+
+	pool = pool_new(nr_threads, &pool_ops);
+	if (!pool) {
+		printec("agent: Couldn't create thread pool\n");
+		goto out_free_clients;
+	}
+	for (index = 0; index < nr_clients; index++) {
+		if (pool_submit(pool, client_job, &clients[index]) == 0)
+			continue;
+		client_error(&clients[index], "agent", "Couldn't queue job",
+			     NULL);
+	}
+	pool_wait(pool);
+	pool_free(pool);
+
+	for (index = 0; index < nr_clients; index++) {
+		if (clients[index].status == CLIENT_FAILED)
+			nr_failed++;
+	}
+
+	ret = write_report(clients, nr_clients, report, started,
+			   elapsed_secs(&start));
+	if (!ret && nr_failed)
+		ret = -1;
+
+out_free_clients:
+	free_clients(clients, nr_clients);
+out_free_roster:
+	json_decref(roster);
+
+	return ret;
+}
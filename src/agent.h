@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * agent.h - Run itsa over a roster of clients
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _AGENT_H_
+#define _AGENT_H_
+
+#include <libmtdac/mtd.h>
+
+extern int agent(int argc, char *argv[], unsigned int mtd_flags,
+		 const struct mtd_cfg *cfg);
+
+#endif /* _AGENT_H_ */
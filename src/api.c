@@ -0,0 +1,1024 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * api.c - Central point for making requests to HMRC
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ *
+ * All the requests libitsa makes go through api_exec(). This enforces a
+ * process wide token bucket rate limit, with interactive requests being
+ * let through ahead of any waiting background ones, and deals with HMRC
+ * telling us to back off (HTTP 429).
+ *
+ * Optionally, read-only requests can be hedged. If a request hasn't
+ * been answered within the recently observed p95 latency for that
+ * operation, a second identical request is sent (if the rate limit
+ * allows) and whichever answers first is used.
+ *
+ * Requests can have a deadline. If it passes while waiting on the rate
+ * limit, backing off or waiting on the response, the request is
+ * abandoned with -ITSA_ERR_DEADLINE. To be able to walk away from a
+ * hung connection, requests with a deadline are made from a separate
+ * thread. Note that an abandoned request may still have been acted upon
+ * by HMRC.
+ *
+ * Underneath all that, requests can be recorded or replayed from a
+ * previous recording (see record.c) and can go to a local stand-in
+ * rather than HMRC (see standin.c).
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+
+#include <jansson.h>
+
+#include <libmtdac/mtd.h>
+#include <libmtdac/mtd-biss.h>
+#include <libmtdac/mtd-ibeops.h>
+#include <libmtdac/mtd-ic.h>
+#include <libmtdac/mtd-ob.h>
+#include <libmtdac/mtd-sa.h>
+
+#include "libitsa.h"
+#include "api.h"
+#include "hist.h"
+#include "record.h"
+#include "standin.h"
+
+#define NS_SEC			API_NS_SEC
+
+#define HTTP_BAD_REQUEST	400
+#define HTTP_UNAUTHORIZED	401
+#define HTTP_FORBIDDEN		403
+#define HTTP_TOO_MANY_REQUESTS	429
+#define API_MAX_RETRIES		5
+
+#define LATENCY_WINDOW		64
+#define HEDGE_MIN_SAMPLES	10
+
+/*
+ * HMRC's default limit is 3 requests per second per application.
+ */
+#define API_DEF_RATE		3.0
+#define API_DEF_BURST		3
+
+static const char *api_op_names[] = {
+	[API_SE_CREATE_PERIOD]		= "se-create-period",
+	[API_SE_UPDATE_PERIOD]		= "se-update-period",
+	[API_SE_GET_ANNUAL_SUMMARY]	= "se-get-annual-summary",
+	[API_SE_UPDATE_ANNUAL_SUMMARY]	= "se-update-annual-summary",
+	[API_OB_LIST_PERIOD]		= "ob-list-period",
+	[API_OB_LIST_EOPS]		= "ob-list-eops",
+	[API_IC_TRIGGER_CALC]		= "ic-trigger-calculation",
+	[API_IC_GET_CALC]		= "ic-get-calculation",
+	[API_IC_LIST_CALCS]		= "ic-list-calculations",
+	[API_IC_FINAL_DECL]		= "ic-final-declaration",
+	[API_BISS_GET_SUMMARY]		= "biss-get-summary",
+	[API_IBEOPS_SUBMIT_EOPS]	= "ibeops-submit-eops",
+	[API_SA_LIST_ACCOUNTS]		= "sa-list-accounts",
+	[API_SA_CREATE_ACCOUNT]		= "sa-create-account",
+	[API_SA_GET_ANNUAL_SUMMARY]	= "sa-get-annual-summary",
+	[API_SA_UPDATE_ANNUAL_SUMMARY]	= "sa-update-annual-summary",
+};
+
+static const bool api_op_idempotent[] = {
+	[API_SE_GET_ANNUAL_SUMMARY]	= true,
+	[API_OB_LIST_PERIOD]		= true,
+	[API_OB_LIST_EOPS]		= true,
+	[API_IC_GET_CALC]		= true,
+	[API_IC_LIST_CALCS]		= true,
+	[API_BISS_GET_SUMMARY]		= true,
+	[API_SA_LIST_ACCOUNTS]		= true,
+	[API_SA_GET_ANNUAL_SUMMARY]	= true,
+	[API_OP_MAX]			= false,
+};
+
+/*
+ * Those that do no harm if sent twice, i.e the above plus those that
+ * replace something whole.
+ */
+static const bool api_op_repeatable[] = {
+	[API_SE_UPDATE_PERIOD]		= true,
+	[API_SE_GET_ANNUAL_SUMMARY]	= true,
+	[API_SE_UPDATE_ANNUAL_SUMMARY]	= true,
+	[API_OB_LIST_PERIOD]		= true,
+	[API_OB_LIST_EOPS]		= true,
+	[API_IC_GET_CALC]		= true,
+	[API_IC_LIST_CALCS]		= true,
+	[API_BISS_GET_SUMMARY]		= true,
+	[API_SA_LIST_ACCOUNTS]		= true,
+	[API_SA_GET_ANNUAL_SUMMARY]	= true,
+	[API_SA_UPDATE_ANNUAL_SUMMARY]	= true,
+	[API_OP_MAX]			= false,
+};
+
+/* Per operation statistics & recent latencies */
+static struct {
+	pthread_mutex_t lock;
+
+	struct {
+		unsigned long requests;
+		unsigned long errors;
+		unsigned long hedged;
+		unsigned long hedge_wins;
+
+		unsigned long long bytes_out;
+		unsigned long long bytes_in;
+
+		/* Of every attempt, in microseconds */
+		struct hist hist;
+
+		/* Recent successful ones, for hedging */
+		int64_t latency[LATENCY_WINDOW];
+		unsigned int nr_latency;
+		unsigned int next_latency;
+	} ops[API_OP_MAX];
+} stats = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+ * Requests made from new threads need to initialise libmtdac there,
+ * this is what to use for those that don't say.
+ */
+static struct {
+	unsigned int mtd_flags;
+	const struct mtd_cfg *cfg;
+} thread_cfg;
+
+static bool hedging;
+
+struct hedge_call;
+
+struct hedge_slot {
+	struct hedge_call *call;
+	int idx;
+};
+
+/*
+ * Shared between the caller and the (up to) two threads making the
+ * request. Whoever is last out (which may not be the caller if it hit
+ * its deadline) frees it.
+ */
+struct hedge_call {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* Our own copy of the request, the caller may be long gone */
+	struct api_req req;
+	char *args[API_MAX_ARGS];
+	char *body;
+
+	/* And of what the threads are to mtd_init() with */
+	unsigned int mtd_flags;
+	struct mtd_cfg mtd_cfg;
+	char *config_dir;
+
+	struct hedge_slot slots[2];
+	int refs;
+
+	bool done;
+	int winner;
+	int err;
+	char *jbuf;
+};
+
+static struct {
+	pthread_once_t once;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* set up in bucket_init() */
+
+	double rate;		/* tokens per second, 0 for no limit */
+	double burst;
+	double tokens;
+	int64_t last;		/* time of the last refill */
+
+	/* Nothing goes out until then, after a 429 */
+	int64_t hold_until;
+
+	unsigned int waiting[ITSA_PRIO_MAX];
+} bucket = {
+	.once = PTHREAD_ONCE_INIT,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.rate = API_DEF_RATE,
+	.burst = API_DEF_BURST,
+	.tokens = API_DEF_BURST,
+};
+
+const char *api_op_name(enum api_op op)
+{
+	return api_op_names[op];
+}
+
+/* Returns API_OP_MAX if there's no such op */
+enum api_op api_op_from_name(const char *name)
+{
+	int i;
+
+	for (i = 0; i < API_OP_MAX; i++) {
+		if (strcmp(api_op_names[i], name) == 0)
+			break;
+	}
+
+	return i;
+}
+
+/*
+ * Whether a failed request can be sent again later, i.e it might
+ * succeed then and there's no risk of it having gone in twice.
+ *
+ * That's anything that was never sent (sent being as set by
+ * api_exec()) or that HMRC turned away for going too fast. Otherwise,
+ * when we couldn't reach HMRC, ran out of time or they're having
+ * problems, it may still have been processed, so only those that do
+ * no harm if repeated qualify.
+ */
+bool api_resendable(const struct api_req *req, int err, const char *jbuf,
+		    bool sent)
+{
+	int status = jbuf ? (int)mtd_http_status_code(jbuf) : 0;
+
+	if (!sent || status == HTTP_TOO_MANY_REQUESTS)
+		return true;
+	if (!api_op_repeatable[req->op])
+		return false;
+
+	return err == -MTD_ERR_CURL || err == -ITSA_ERR_DEADLINE ||
+	       status >= 500;
+}
+
+/*
+ * Whether HMRC turned req down for what was in it, e.g failed
+ * validation, rather than who sent it or when. Sending the same thing
+ * again will only get the same answer.
+ */
+bool api_rejected(int err, const char *jbuf)
+{
+	int status = jbuf ? (int)mtd_http_status_code(jbuf) : 0;
+
+	if (err != -MTD_ERR_REQUEST || status < HTTP_BAD_REQUEST ||
+	    status >= 500)
+		return false;
+
+	return status != HTTP_UNAUTHORIZED && status != HTTP_FORBIDDEN &&
+	       status != HTTP_TOO_MANY_REQUESTS;
+}
+
+int64_t api_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * NS_SEC + ts.tv_nsec;
+}
+
+static void ns_to_timespec(int64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / NS_SEC;
+	ts->tv_nsec = ns % NS_SEC;
+}
+
+/*
+ * Timed waits are given api_now() times, so condition variables must
+ * use the same clock rather than the default CLOCK_REALTIME.
+ */
+void api_cond_init(pthread_cond_t *cond)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+static void bucket_init(void)
+{
+	api_cond_init(&bucket.cond);
+}
+
+/*
+ * Wait for ns nanoseconds, as if the request had taken that long.
+ *
+ * Returns -ITSA_ERR_DEADLINE (having waited until then) if that would
+ * take it past its deadline.
+ */
+int api_delay(const struct api_req *req, int64_t ns)
+{
+	struct timespec ts;
+	int64_t until;
+	int ret = 0;
+
+	if (ns <= 0)
+		return 0;
+
+	until = api_now() + ns;
+	if (req->deadline && until > req->deadline) {
+		until = req->deadline;
+		ret = -ITSA_ERR_DEADLINE;
+	}
+
+	ns_to_timespec(until, &ts);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+			       NULL) == EINTR)
+		;
+
+	return ret;
+}
+
+/*
+ * Set the rate limit to rate requests per second, allowing bursts of
+ * up to burst requests. A rate of 0 disables the limit.
+ */
+void itsa_set_rate_limit(double rate, int burst)
+{
+	pthread_once(&bucket.once, bucket_init);
+	pthread_mutex_lock(&bucket.lock);
+	bucket.rate = rate > 0.0 ? rate : 0.0;
+	bucket.burst = burst > 0 ? burst : 1;
+	if (bucket.tokens > bucket.burst)
+		bucket.tokens = bucket.burst;
+	pthread_cond_broadcast(&bucket.cond);
+	pthread_mutex_unlock(&bucket.lock);
+}
+
+static void refill(int64_t now)
+{
+	if (bucket.last)
+		bucket.tokens += (now - bucket.last) * bucket.rate / NS_SEC;
+	if (bucket.tokens > bucket.burst)
+		bucket.tokens = bucket.burst;
+	bucket.last = now;
+}
+
+static bool req_cancelled(const struct api_req *req)
+{
+	return req->cancelled &&
+	       __atomic_load_n(req->cancelled, __ATOMIC_ACQUIRE);
+}
+
+/* Wake up anything waiting on the rate limit, to notice a cancellation */
+void api_wake(void)
+{
+	pthread_once(&bucket.once, bucket_init);
+	pthread_mutex_lock(&bucket.lock);
+	pthread_cond_broadcast(&bucket.cond);
+	pthread_mutex_unlock(&bucket.lock);
+}
+
+/*
+ * Wait for a token. Background requests wait while there are any
+ * interactive requests waiting.
+ *
+ * Returns -ITSA_ERR_DEADLINE if the deadline (if any) passed while
+ * waiting or -ITSA_ERR_CANCELLED if the request was cancelled.
+ */
+static int acquire_token(const struct api_req *req)
+{
+	enum itsa_priority prio = req->prio;
+	int64_t deadline = req->deadline;
+	int ret = -ITSA_ERR_DEADLINE;
+
+	pthread_once(&bucket.once, bucket_init);
+	pthread_mutex_lock(&bucket.lock);
+	bucket.waiting[prio]++;
+
+	for (;;) {
+		struct timespec ts;
+		int64_t now = api_now();
+		int64_t wake;
+
+		refill(now);
+
+		if (req_cancelled(req)) {
+			ret = -ITSA_ERR_CANCELLED;
+			break;
+		}
+		if (now >= bucket.hold_until &&
+		    (prio == ITSA_PRIO_INTERACTIVE ||
+		     bucket.waiting[ITSA_PRIO_INTERACTIVE] == 0)) {
+			if (bucket.rate == 0.0) {
+				ret = 0;
+				break;
+			}
+			if (bucket.tokens >= 1.0) {
+				bucket.tokens -= 1.0;
+				ret = 0;
+				break;
+			}
+		}
+		if (deadline && now >= deadline)
+			break;
+
+		if (now < bucket.hold_until)
+			wake = bucket.hold_until;
+		else if (bucket.rate > 0.0 && bucket.tokens < 1.0)
+			wake = now + (1.0 - bucket.tokens) * NS_SEC /
+				bucket.rate;
+		else
+			wake = 0;	/* waiting on an interactive request */
+		if (deadline && (!wake || wake > deadline))
+			wake = deadline;
+
+		if (!wake) {
+			pthread_cond_wait(&bucket.cond, &bucket.lock);
+			continue;
+		}
+
+		ns_to_timespec(wake, &ts);
+		while (pthread_cond_timedwait(&bucket.cond, &bucket.lock,
+					      &ts) == EINTR)
+			;
+	}
+
+	bucket.waiting[prio]--;
+	pthread_cond_broadcast(&bucket.cond);
+	pthread_mutex_unlock(&bucket.lock);
+
+	return ret;
+}
+
+/*
+ * Take a token if one is available right now, for requests that are
+ * only worth making if they don't have to wait.
+ */
+static bool try_acquire_token(enum itsa_priority prio)
+{
+	bool got = false;
+
+	pthread_mutex_lock(&bucket.lock);
+	refill(api_now());
+	if (api_now() >= bucket.hold_until &&
+	    (prio == ITSA_PRIO_INTERACTIVE ||
+	     bucket.waiting[ITSA_PRIO_INTERACTIVE] == 0)) {
+		if (bucket.rate == 0.0) {
+			got = true;
+		} else if (bucket.tokens >= 1.0) {
+			bucket.tokens -= 1.0;
+			got = true;
+		}
+	}
+	pthread_mutex_unlock(&bucket.lock);
+
+	return got;
+}
+
+/* Stop all requests going out for the next secs seconds */
+static void hold(int secs)
+{
+	int64_t until = api_now() + secs * NS_SEC;
+
+	pthread_mutex_lock(&bucket.lock);
+	if (until > bucket.hold_until)
+		bucket.hold_until = until;
+	/* Don't come back with a full burst */
+	bucket.tokens = 0.0;
+	pthread_mutex_unlock(&bucket.lock);
+}
+
+/*
+ * Get the Retry-After value (in seconds) from the response record,
+ * if there is one.
+ */
+static int get_retry_after(const char *jbuf)
+{
+	json_t *jarray;
+	json_t *root;
+	json_t *hdrs;
+	json_t *ra;
+	const char *str;
+	int secs = -1;
+
+	jarray = json_loads(jbuf, 0, NULL);
+	root = json_array_get(jarray, json_array_size(jarray) - 1);
+	hdrs = json_object_get(root, "headers");
+	ra = json_object_get(hdrs, "Retry-After");
+	if (!ra)
+		ra = json_object_get(hdrs, "retry-after");
+
+	str = json_string_value(ra);
+	if (str && *str >= '0' && *str <= '9')
+		secs = atoi(str);
+	else if (json_is_integer(ra))
+		secs = json_integer_value(ra);
+	json_decref(jarray);
+
+	return secs;
+}
+
+static int mtd_req(const struct api_req *req, char **jbuf)
+{
+	struct mtd_dsrc_ctx dsctx;
+	const char * const *a = req->args;
+
+	dsctx.data_src.buf = req->body;
+	dsctx.data_len = -1;
+	dsctx.src_type = MTD_DATA_SRC_BUF;
+
+	switch (req->op) {
+	case API_SE_CREATE_PERIOD:
+		return mtd_sa_se_create_period(&dsctx, a[0], jbuf);
+	case API_SE_UPDATE_PERIOD:
+		return mtd_sa_se_update_period(&dsctx, a[0], a[1], jbuf);
+	case API_SE_GET_ANNUAL_SUMMARY:
+		return mtd_sa_se_get_annual_summary(a[0], a[1], jbuf);
+	case API_SE_UPDATE_ANNUAL_SUMMARY:
+		return mtd_sa_se_update_annual_summary(&dsctx, a[0], a[1],
+						       jbuf);
+	case API_OB_LIST_PERIOD:
+		return mtd_ob_list_inc_and_expend_obligations(a[0], jbuf);
+	case API_OB_LIST_EOPS:
+		return mtd_ob_list_end_of_period_obligations(a[0], jbuf);
+	case API_IC_TRIGGER_CALC:
+		return mtd_ic_trigger_calculation(a[0], a[1], jbuf);
+	case API_IC_GET_CALC:
+		return mtd_ic_get_calculation(a[0], a[1], jbuf);
+	case API_IC_LIST_CALCS:
+		return mtd_ic_list_calculations(a[0], jbuf);
+	case API_IC_FINAL_DECL:
+		return mtd_ic_final_decl(a[0], a[1], jbuf);
+	case API_BISS_GET_SUMMARY:
+		return mtd_biss_get_summary(a[0], a[1], a[2], jbuf);
+	case API_IBEOPS_SUBMIT_EOPS:
+		return mtd_ibeops_submit_eops(&dsctx, jbuf);
+	case API_SA_LIST_ACCOUNTS:
+		return mtd_sa_sa_list_accounts(jbuf);
+	case API_SA_CREATE_ACCOUNT:
+		return mtd_sa_sa_create_account(&dsctx, jbuf);
+	case API_SA_GET_ANNUAL_SUMMARY:
+		return mtd_sa_sa_get_annual_summary(a[0], a[1], jbuf);
+	case API_SA_UPDATE_ANNUAL_SUMMARY:
+		return mtd_sa_sa_update_annual_summary(&dsctx, a[0], a[1],
+						       jbuf);
+	case API_OP_MAX:
+		break;
+	}
+
+	*jbuf = NULL;
+
+	return -MTD_ERR_REQUEST;
+}
+
+static int do_req(const struct api_req *req, char **jbuf)
+{
+	int64_t start;
+	int err;
+
+	if (rec_replaying())
+		return rec_replay(req, jbuf);
+
+	start = api_now();
+	if (standin_enabled())
+		err = standin_req(req, jbuf);
+	else
+		err = mtd_req(req, jbuf);
+	if (rec_recording())
+		rec_record(req, err, *jbuf, api_now() - start);
+
+	return err;
+}
+
+static int timed_req(const struct api_req *req, char **jbuf)
+{
+	int64_t start = api_now();
+	int64_t tstart = itsa_trace_begin();
+	int64_t latency;
+	int err;
+
+	err = do_req(req, jbuf);
+	latency = api_now() - start;
+	itsa_trace_end("api", api_op_name(req->op), tstart);
+
+	pthread_mutex_lock(&stats.lock);
+	hist_record(&stats.ops[req->op].hist, latency / 1000);
+	if (!err) {
+		stats.ops[req->op].latency[stats.ops[req->op].next_latency++] =
+			latency;
+		stats.ops[req->op].next_latency %= LATENCY_WINDOW;
+		if (stats.ops[req->op].nr_latency < LATENCY_WINDOW)
+			stats.ops[req->op].nr_latency++;
+	}
+	pthread_mutex_unlock(&stats.lock);
+
+	return err;
+}
+
+static int int64_cmp(const void *p1, const void *p2)
+{
+	int64_t i1 = *(const int64_t *)p1;
+	int64_t i2 = *(const int64_t *)p2;
+
+	return (i1 > i2) - (i1 < i2);
+}
+
+/*
+ * The p95 latency of the recent requests for op, or -1 if we haven't
+ * seen enough of them yet.
+ */
+static int64_t p95_latency(enum api_op op)
+{
+	int64_t lat[LATENCY_WINDOW];
+	unsigned int nr;
+
+	pthread_mutex_lock(&stats.lock);
+	nr = stats.ops[op].nr_latency;
+	memcpy(lat, stats.ops[op].latency, sizeof(lat));
+	pthread_mutex_unlock(&stats.lock);
+
+	if (nr < HEDGE_MIN_SAMPLES)
+		return -1;
+
+	qsort(lat, nr, sizeof(int64_t), int64_cmp);
+
+	return lat[(nr * 95) / 100];
+}
+
+/*
+ * Hedged requests and those with a deadline are made from their own
+ * threads, which need to call mtd_init(). This is what they use unless
+ * the context the request is made with has its own, see
+ * itsa_ctx_set_mtd_cfg(). cfg must remain valid for as long as libitsa
+ * is in use. Without either, requests are always made directly from
+ * the calling thread, with deadlines only being checked between
+ * requests.
+ */
+void itsa_set_mtd_cfg(unsigned int mtd_flags, const struct mtd_cfg *cfg)
+{
+	thread_cfg.mtd_flags = mtd_flags & ~MTD_OPT_GLOBAL_INIT;
+	thread_cfg.cfg = cfg;
+}
+
+/*
+ * Whether requests are actually going to HMRC, i.e we're not replaying
+ * a recording or using the stand-in. If not, libmtdac doesn't need to
+ * be (and may not be able to be) initialised.
+ */
+bool itsa_mtd_needed(void)
+{
+	return !rec_replaying() && !standin_enabled();
+}
+
+/* Enable or disable hedging of read-only requests */
+void itsa_set_hedging(bool enable)
+{
+	hedging = enable;
+}
+
+static void hedge_call_put(struct hedge_call *call)
+{
+	bool last;
+	int i;
+
+	pthread_mutex_lock(&call->lock);
+	last = --call->refs == 0;
+	pthread_mutex_unlock(&call->lock);
+	if (!last)
+		return;
+
+	for (i = 0; i < API_MAX_ARGS; i++)
+		free(call->args[i]);
+	free(call->body);
+	free(call->config_dir);
+	pthread_cond_destroy(&call->cond);
+	pthread_mutex_destroy(&call->lock);
+	free(call);
+}
+
+static void *hedge_thread(void *arg)
+{
+	struct hedge_slot *slot = arg;
+	struct hedge_call *call = slot->call;
+	char *jbuf = NULL;
+	bool mtd = itsa_mtd_needed();
+	int err = 0;
+
+	if (mtd)
+		err = mtd_init(call->mtd_flags, &call->mtd_cfg);
+	if (!err) {
+		err = timed_req(&call->req, &jbuf);
+		if (mtd)
+			mtd_deinit();
+	}
+
+	pthread_mutex_lock(&call->lock);
+	if (!call->done) {
+		call->done = true;
+		call->winner = slot->idx;
+		call->err = err;
+		call->jbuf = jbuf;
+		pthread_cond_broadcast(&call->cond);
+	} else {
+		free(jbuf);
+	}
+	pthread_mutex_unlock(&call->lock);
+
+	hedge_call_put(call);
+
+	return NULL;
+}
+
+static bool hedge_spawn(struct hedge_call *call, int idx)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	int err;
+
+	pthread_mutex_lock(&call->lock);
+	call->refs++;
+	pthread_mutex_unlock(&call->lock);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&tid, &attr, hedge_thread, &call->slots[idx]);
+	pthread_attr_destroy(&attr);
+	if (err) {
+		hedge_call_put(call);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * What a thread making req needs to mtd_init() with, NULL if it can't
+ * be made from one.
+ */
+static const struct mtd_cfg *req_mtd_cfg(const struct api_req *req,
+					 unsigned int *mtd_flags)
+{
+	if (req->mtd_cfg) {
+		*mtd_flags = req->mtd_flags;
+		return req->mtd_cfg;
+	}
+
+	*mtd_flags = thread_cfg.mtd_flags;
+
+	return thread_cfg.cfg;
+}
+
+static struct hedge_call *hedge_call_new(const struct api_req *req)
+{
+	const struct mtd_cfg *cfg;
+	struct hedge_call *call;
+	int i;
+
+	call = calloc(1, sizeof(*call));
+	if (!call)
+		return NULL;
+
+	/* Not using the same config_dir could mean a different taxpayer */
+	cfg = req_mtd_cfg(req, &call->mtd_flags);
+	call->mtd_cfg = *cfg;
+	if (cfg->config_dir) {
+		call->config_dir = strdup(cfg->config_dir);
+		if (!call->config_dir) {
+			free(call);
+			return NULL;
+		}
+		call->mtd_cfg.config_dir = call->config_dir;
+	}
+
+	call->req = *req;
+	/* The caller (and what these point into) may be long gone */
+	call->req.cancelled = NULL;
+	call->req.mtd_cfg = NULL;
+	for (i = 0; i < API_MAX_ARGS; i++) {
+		if (!req->args[i])
+			continue;
+		call->args[i] = strdup(req->args[i]);
+		call->req.args[i] = call->args[i];
+	}
+	if (req->body) {
+		call->body = strdup(req->body);
+		call->req.body = call->body;
+	}
+
+	call->slots[0].call = call->slots[1].call = call;
+	call->slots[1].idx = 1;
+	call->refs = 1;
+	pthread_mutex_init(&call->lock, NULL);
+	api_cond_init(&call->cond);
+
+	return call;
+}
+
+/* Wait for the request to be answered, or until the given time */
+static void wait_call(struct hedge_call *call, int64_t until)
+{
+	struct timespec ts;
+
+	if (!until) {
+		while (!call->done)
+			pthread_cond_wait(&call->cond, &call->lock);
+		return;
+	}
+
+	ns_to_timespec(until, &ts);
+	while (!call->done &&
+	       pthread_cond_timedwait(&call->cond, &call->lock,
+				      &ts) != ETIMEDOUT)
+		;
+}
+
+/*
+ * Make the request from a separate thread. If hedge_after is >= 0 and
+ * it hasn't answered within that time, make it again from another,
+ * taking whichever answers first.
+ *
+ * If the request has a deadline and it passes, we walk away leaving
+ * the thread(s) to clean up after themselves.
+ */
+static int threaded_req(const struct api_req *req, int64_t hedge_after,
+			char **jbuf)
+{
+	struct hedge_call *call;
+	int64_t deadline = req->deadline;
+	int err;
+
+	call = hedge_call_new(req);
+	if (!call)
+		return timed_req(req, jbuf);
+	if (!hedge_spawn(call, 0)) {
+		hedge_call_put(call);
+		return timed_req(req, jbuf);
+	}
+
+	pthread_mutex_lock(&call->lock);
+	if (hedge_after >= 0) {
+		int64_t hedge_at = api_now() + hedge_after;
+
+		wait_call(call, deadline && deadline < hedge_at ?
+				deadline : hedge_at);
+		if (!call->done && (!deadline || api_now() < deadline)) {
+			pthread_mutex_unlock(&call->lock);
+
+			/* Only hedge if it doesn't cost us waiting on the limit */
+			if (try_acquire_token(req->prio) &&
+			    hedge_spawn(call, 1)) {
+				pthread_mutex_lock(&stats.lock);
+				stats.ops[req->op].hedged++;
+				pthread_mutex_unlock(&stats.lock);
+			}
+
+			pthread_mutex_lock(&call->lock);
+		}
+	}
+	wait_call(call, deadline);
+
+	if (call->done) {
+		err = call->err;
+		*jbuf = call->jbuf;
+		if (call->winner == 1) {
+			pthread_mutex_lock(&stats.lock);
+			stats.ops[req->op].hedge_wins++;
+			pthread_mutex_unlock(&stats.lock);
+		}
+	} else {
+		err = -ITSA_ERR_DEADLINE;
+		*jbuf = NULL;
+	}
+	pthread_mutex_unlock(&call->lock);
+
+	hedge_call_put(call);
+
+	return err;
+}
+
+static int make_req(const struct api_req *req, char **jbuf)
+{
+	unsigned int mtd_flags;
+	int64_t hedge_after = -1;
+
+	/* Replays honour the deadline themselves & don't need hedging */
+	if (!req_mtd_cfg(req, &mtd_flags) || rec_replaying())
+		return timed_req(req, jbuf);
+
+	if (hedging && api_op_idempotent[req->op])
+		hedge_after = p95_latency(req->op);
+	if (hedge_after < 0 && !req->deadline)
+		return timed_req(req, jbuf);
+
+	return threaded_req(req, hedge_after, jbuf);
+}
+
+static void account_bytes(const struct api_req *req, const char *jbuf)
+{
+	size_t out = req->body ? strlen(req->body) : 0;
+	size_t in = jbuf ? strlen(jbuf) : 0;
+
+	pthread_mutex_lock(&stats.lock);
+	stats.ops[req->op].bytes_out += out;
+	stats.ops[req->op].bytes_in += in;
+	pthread_mutex_unlock(&stats.lock);
+}
+
+/*
+ * Get a snapshot of the request statistics for each operation.
+ *
+ * stats should be free(3)'d
+ */
+int itsa_get_stats(struct itsa_op_stats **op_stats, size_t *nr)
+{
+	int i;
+
+	*op_stats = calloc(API_OP_MAX, sizeof(struct itsa_op_stats));
+	if (!*op_stats)
+		return -ITSA_ERR_OS;
+
+	pthread_mutex_lock(&stats.lock);
+	for (i = 0; i < API_OP_MAX; i++) {
+		struct itsa_op_stats *st = *op_stats + i;
+
+		st->name = api_op_names[i];
+		st->requests = stats.ops[i].requests;
+		st->errors = stats.ops[i].errors;
+		st->hedged = stats.ops[i].hedged;
+		st->hedge_wins = stats.ops[i].hedge_wins;
+		st->bytes_out = stats.ops[i].bytes_out;
+		st->bytes_in = stats.ops[i].bytes_in;
+		st->lat_min_us = stats.ops[i].hist.min;
+		st->lat_mean_us = hist_mean(&stats.ops[i].hist);
+		st->lat_p50_us = hist_percentile(&stats.ops[i].hist, 50.0);
+		st->lat_p90_us = hist_percentile(&stats.ops[i].hist, 90.0);
+		st->lat_p99_us = hist_percentile(&stats.ops[i].hist, 99.0);
+		st->lat_max_us = stats.ops[i].hist.max;
+	}
+	pthread_mutex_unlock(&stats.lock);
+
+	*nr = API_OP_MAX;
+
+	return 0;
+}
+
+/*
+ * Make the given request, subject to the rate limit. If HMRC says
+ * we're going too fast, honour its Retry-After (or back-off
+ * exponentially if it doesn't give one) and try again.
+ *
+ * Returns -ITSA_ERR_DEADLINE if the requests deadline passes before it
+ * completes or -ITSA_ERR_CANCELLED if it was cancelled before being
+ * sent.
+ *
+ * sent is set to whether it may have reached HMRC, i.e false if it
+ * never went out or was only ever turned away for going too fast.
+ *
+ * jbuf is set to libmtdac's response and should be free(3)'d.
+ */
+int api_exec(const struct api_req *req, char **jbuf, bool *sent)
+{
+	int retries = 0;
+	int err;
+
+	*jbuf = NULL;
+	*sent = false;
+
+	for (;;) {
+		int64_t tstart = itsa_trace_begin();
+		int secs;
+
+		err = acquire_token(req);
+		itsa_trace_end("api", "rate-limit", tstart);
+		if (err)
+			return err;
+
+		*sent = true;
+		err = make_req(req, jbuf);
+		account_bytes(req, *jbuf);
+
+		pthread_mutex_lock(&stats.lock);
+		stats.ops[req->op].requests++;
+		if (err)
+			stats.ops[req->op].errors++;
+		pthread_mutex_unlock(&stats.lock);
+
+		if (!err || retries == API_MAX_RETRIES || !*jbuf ||
+		    (int)mtd_http_status_code(*jbuf) !=
+		    HTTP_TOO_MANY_REQUESTS)
+			break;
+
+		/* It wasn't processed */
+		*sent = false;
+		secs = get_retry_after(*jbuf);
+		if (secs < 0)
+			secs = 1 << retries;
+		hold(secs);
+
+		free(*jbuf);
+		*jbuf = NULL;
+		retries++;
+
+		if (req->deadline && api_now() + secs * NS_SEC > req->deadline)
+			return -ITSA_ERR_DEADLINE;
+	}
+
+	return err;
+}
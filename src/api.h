@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * api.h - Central point for making requests to HMRC
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _API_H_
+#define _API_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "libitsa.h"
+
+struct mtd_cfg;
+
+#define API_NS_SEC		1000000000LL
+
+enum api_op {
+	API_SE_CREATE_PERIOD = 0,
+	API_SE_UPDATE_PERIOD,
+	API_SE_GET_ANNUAL_SUMMARY,
+	API_SE_UPDATE_ANNUAL_SUMMARY,
+	API_OB_LIST_PERIOD,
+	API_OB_LIST_EOPS,
+	API_IC_TRIGGER_CALC,
+	API_IC_GET_CALC,
+	API_IC_LIST_CALCS,
+	API_IC_FINAL_DECL,
+	API_BISS_GET_SUMMARY,
+	API_IBEOPS_SUBMIT_EOPS,
+	API_SA_LIST_ACCOUNTS,
+	API_SA_CREATE_ACCOUNT,
+	API_SA_GET_ANNUAL_SUMMARY,
+	API_SA_UPDATE_ANNUAL_SUMMARY,
+
+	API_OP_MAX
+};
+
+#define API_MAX_ARGS		3
+
+/*
+ * A single request. args are the string arguments to the corresponding
+ * libmtdac function, in order. body is the data for POST/PUT requests.
+ *
+ * deadline is the time (as returned by api_now()) by which the request
+ * must have completed, or 0 for none.
+ *
+ * If cancelled is set and becomes non-zero (followed by a call to
+ * api_wake()) before the request is sent, it's abandoned.
+ *
+ * mtd_cfg (& mtd_flags) are what the calling thread initialised
+ * libmtdac with, for when the request is made from another thread. If
+ * NULL, the default given to itsa_set_mtd_cfg() is used.
+ */
+struct api_req {
+	enum api_op op;
+	enum itsa_priority prio;
+	int64_t deadline;
+	const int *cancelled;
+
+	unsigned int mtd_flags;
+	const struct mtd_cfg *mtd_cfg;
+
+	const char *args[API_MAX_ARGS];
+	const char *body;
+};
+
+extern int64_t api_now(void);
+extern void api_cond_init(pthread_cond_t *cond);
+extern const char *api_op_name(enum api_op op);
+extern enum api_op api_op_from_name(const char *name);
+extern bool api_resendable(const struct api_req *req, int err,
+			   const char *jbuf, bool sent);
+extern bool api_rejected(int err, const char *jbuf);
+extern void api_wake(void);
+extern int api_delay(const struct api_req *req, int64_t ns);
+extern int api_exec(const struct api_req *req, char **jbuf, bool *sent);
+
+#endif /* _API_H_ */
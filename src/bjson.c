@@ -0,0 +1,450 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * bjson.c - Binary encoding of JSON
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ *
+ * A compact binary form of a JSON value, for keeping things locally
+ * that are quicker to load than to parse as text. Each value is a tag
+ * byte followed by
+ *
+ *	null, false, true	nothing
+ *	integer			zigzag varint
+ *	real			8 byte little endian IEEE 754 double
+ *	string			varint length, bytes
+ *	array			varint count, values
+ *	object			varint count, (key, value) pairs
+ *
+ * Keys are interned: the first time a key is seen it's given as a
+ * varint (length << 1) followed by its bytes, after that as a varint
+ * (index << 1 | 1) referring back to it. Calculations repeat the same
+ * keys over and over, so this roughly halves their size.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <jansson.h>
+
+#include "bjson.h"
+#include "hash.h"
+
+#define BJSON_MAX_DEPTH		64
+#define BJSON_KEYS_INIT		256	/* power of 2 */
+
+enum bjson_tag {
+	BJ_NULL = 0,
+	BJ_FALSE,
+	BJ_TRUE,
+	BJ_INT,
+	BJ_REAL,
+	BJ_STR,
+	BJ_ARRAY,
+	BJ_OBJECT,
+};
+
+struct bkey {
+	const char *key;
+	uint64_t idx;
+};
+
+struct benc {
+	unsigned char *buf;
+	size_t len;
+	size_t alloc;
+	bool oom;
+
+	/* Open addressed hash of the keys seen so far */
+	struct bkey *keys;
+	size_t nr_keys;
+	size_t keys_alloc;
+};
+
+struct bdec {
+	const unsigned char *buf;
+	size_t len;
+	size_t pos;
+
+	struct {
+		const char *key;
+		size_t len;
+	} *keys;
+	size_t nr_keys;
+	size_t keys_alloc;
+
+	char *scratch;
+	size_t scratch_sz;
+};
+
+static bool enc_grow(struct benc *e, size_t need)
+{
+	unsigned char *buf;
+	size_t alloc = e->alloc ? e->alloc : 4096;
+
+	if (e->oom)
+		return false;
+	if (e->len + need <= e->alloc)
+		return true;
+
+	while (e->len + need > alloc)
+		alloc *= 2;
+	buf = realloc(e->buf, alloc);
+	if (!buf) {
+		e->oom = true;
+		return false;
+	}
+	e->buf = buf;
+	e->alloc = alloc;
+
+	return true;
+}
+
+static void enc_bytes(struct benc *e, const void *data, size_t len)
+{
+	if (!enc_grow(e, len))
+		return;
+	memcpy(e->buf + e->len, data, len);
+	e->len += len;
+}
+
+static void enc_byte(struct benc *e, unsigned char byte)
+{
+	enc_bytes(e, &byte, 1);
+}
+
+static void enc_varint(struct benc *e, uint64_t val)
+{
+	unsigned char buf[10];
+	int n = 0;
+
+	do {
+		buf[n] = val & 0x7f;
+		val >>= 7;
+		if (val)
+			buf[n] |= 0x80;
+		n++;
+	} while (val);
+
+	enc_bytes(e, buf, n);
+}
+
+/* Returns the keys index if it's been seen before, else adds it */
+static bool enc_key_lookup(struct benc *e, const char *key, uint64_t *idx)
+{
+	size_t mask;
+	size_t i;
+
+	if (e->nr_keys * 2 >= e->keys_alloc) {
+		struct bkey *keys;
+		size_t alloc = e->keys_alloc ? e->keys_alloc * 2 :
+			       BJSON_KEYS_INIT;
+
+		keys = calloc(alloc, sizeof(*keys));
+		if (!keys) {
+			e->oom = true;
+			return false;
+		}
+		for (i = 0; i < e->keys_alloc; i++) {
+			size_t j;
+
+			if (!e->keys[i].key)
+				continue;
+			j = fnv1a(FNV1A_64_INIT, e->keys[i].key,
+				  strlen(e->keys[i].key)) & (alloc - 1);
+			while (keys[j].key)
+				j = (j + 1) & (alloc - 1);
+			keys[j] = e->keys[i];
+		}
+		free(e->keys);
+		e->keys = keys;
+		e->keys_alloc = alloc;
+	}
+
+	mask = e->keys_alloc - 1;
+	i = fnv1a(FNV1A_64_INIT, key, strlen(key)) & mask;
+	while (e->keys[i].key) {
+		if (strcmp(e->keys[i].key, key) == 0) {
+			*idx = e->keys[i].idx;
+			return true;
+		}
+		i = (i + 1) & mask;
+	}
+
+	/* The keys are owned by the tree being encoded */
+	e->keys[i].key = key;
+	e->keys[i].idx = e->nr_keys++;
+
+	return false;
+}
+
+static void enc_value(struct benc *e, const json_t *value, int depth)
+{
+	const char *key;
+	json_t *elem;
+	size_t index;
+	uint64_t u;
+	double d;
+	int i;
+
+	if (depth > BJSON_MAX_DEPTH) {
+		e->oom = true;
+		return;
+	}
+
+	switch (json_typeof(value)) {
+	case JSON_OBJECT:
+		enc_byte(e, BJ_OBJECT);
+		enc_varint(e, json_object_size(value));
+		json_object_foreach((json_t *)value, key, elem) {
+			uint64_t idx;
+
+			if (enc_key_lookup(e, key, &idx)) {
+				enc_varint(e, idx << 1 | 1);
+			} else {
+				enc_varint(e, (uint64_t)strlen(key) << 1);
+				enc_bytes(e, key, strlen(key));
+			}
+			enc_value(e, elem, depth + 1);
+		}
+		break;
+	case JSON_ARRAY:
+		enc_byte(e, BJ_ARRAY);
+		enc_varint(e, json_array_size(value));
+		json_array_foreach(value, index, elem)
+			enc_value(e, elem, depth + 1);
+		break;
+	case JSON_STRING:
+		enc_byte(e, BJ_STR);
+		enc_varint(e, json_string_length(value));
+		enc_bytes(e, json_string_value(value),
+			  json_string_length(value));
+		break;
+	case JSON_INTEGER:
+		enc_byte(e, BJ_INT);
+		u = (uint64_t)json_integer_value(value);
+		enc_varint(e, (u << 1) ^ (uint64_t)(json_integer_value(value) >>
+						    63));
+		break;
+	case JSON_REAL:
+		enc_byte(e, BJ_REAL);
+		d = json_real_value(value);
+		memcpy(&u, &d, sizeof(u));
+		for (i = 0; i < 8; i++)
+			enc_byte(e, (u >> (i * 8)) & 0xff);
+		break;
+	case JSON_TRUE:
+		enc_byte(e, BJ_TRUE);
+		break;
+	case JSON_FALSE:
+		enc_byte(e, BJ_FALSE);
+		break;
+	case JSON_NULL:
+		enc_byte(e, BJ_NULL);
+		break;
+	}
+}
+
+/* Returns a malloc'd buffer of *len bytes, or NULL */
+unsigned char *bjson_encode(const json_t *root, size_t *len)
+{
+	struct benc e = { NULL };
+
+	enc_value(&e, root, 0);
+	free(e.keys);
+	if (e.oom) {
+		free(e.buf);
+		return NULL;
+	}
+
+	*len = e.len;
+
+	return e.buf;
+}
+
+static bool dec_varint(struct bdec *d, uint64_t *val)
+{
+	int shift = 0;
+
+	*val = 0;
+	while (d->pos < d->len && shift < 64) {
+		unsigned char byte = d->buf[d->pos++];
+
+		*val |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return true;
+		shift += 7;
+	}
+
+	return false;
+}
+
+static bool dec_len(struct bdec *d, uint64_t *len)
+{
+	return dec_varint(d, len) && *len <= d->len - d->pos;
+}
+
+/* Object keys need to be nul terminated for jansson */
+static const char *dec_key(struct bdec *d, const char *key, size_t len)
+{
+	if (len + 1 > d->scratch_sz) {
+		char *scratch = realloc(d->scratch, len + 1);
+
+		if (!scratch)
+			return NULL;
+		d->scratch = scratch;
+		d->scratch_sz = len + 1;
+	}
+	memcpy(d->scratch, key, len);
+	d->scratch[len] = '\0';
+
+	return d->scratch;
+}
+
+static json_t *dec_object(struct bdec *d, int depth);
+static json_t *dec_value(struct bdec *d, int depth)
+{
+	json_t *value;
+	uint64_t u;
+	uint64_t n;
+	double dbl;
+	int i;
+
+	if (depth > BJSON_MAX_DEPTH || d->pos >= d->len)
+		return NULL;
+
+	switch (d->buf[d->pos++]) {
+	case BJ_NULL:
+		return json_null();
+	case BJ_FALSE:
+		return json_false();
+	case BJ_TRUE:
+		return json_true();
+	case BJ_INT:
+		if (!dec_varint(d, &u))
+			return NULL;
+		return json_integer((json_int_t)((u >> 1) ^ -(u & 1)));
+	case BJ_REAL:
+		if (d->len - d->pos < 8)
+			return NULL;
+		u = 0;
+		for (i = 0; i < 8; i++)
+			u |= (uint64_t)d->buf[d->pos++] << (i * 8);
+		memcpy(&dbl, &u, sizeof(dbl));
+		return json_real(dbl);
+	case BJ_STR:
+		if (!dec_len(d, &n))
+			return NULL;
+		value = json_stringn((const char *)d->buf + d->pos, n);
+		d->pos += n;
+		return value;
+	case BJ_ARRAY:
+		if (!dec_len(d, &n))
+			return NULL;
+		value = json_array();
+		while (value && n--) {
+			json_t *elem = dec_value(d, depth + 1);
+
+			if (!elem || json_array_append_new(value, elem)) {
+				json_decref(value);
+				return NULL;
+			}
+		}
+		return value;
+	case BJ_OBJECT:
+		return dec_object(d, depth);
+	}
+
+	return NULL;
+}
+
+static json_t *dec_object(struct bdec *d, int depth)
+{
+	json_t *obj;
+	uint64_t n;
+
+	/* Each member is at least 2 bytes */
+	if (!dec_len(d, &n) || n > (d->len - d->pos) / 2)
+		return NULL;
+
+	obj = json_object();
+	while (obj && n--) {
+		const char *key;
+		size_t klen;
+		json_t *value;
+		uint64_t v;
+
+		if (!dec_varint(d, &v))
+			goto out_err;
+		if (v & 1) {
+			if ((v >> 1) >= d->nr_keys)
+				goto out_err;
+			key = d->keys[v >> 1].key;
+			klen = d->keys[v >> 1].len;
+		} else {
+			klen = v >> 1;
+			if (klen > d->len - d->pos)
+				goto out_err;
+			key = (const char *)d->buf + d->pos;
+			d->pos += klen;
+
+			if (d->nr_keys == d->keys_alloc) {
+				size_t alloc = d->keys_alloc ?
+					       d->keys_alloc * 2 : 64;
+				void *keys = realloc(d->keys, alloc *
+						     sizeof(*d->keys));
+
+				if (!keys)
+					goto out_err;
+				d->keys = keys;
+				d->keys_alloc = alloc;
+			}
+			d->keys[d->nr_keys].key = key;
+			d->keys[d->nr_keys].len = klen;
+			d->nr_keys++;
+		}
+
+		value = dec_value(d, depth + 1);
+		if (!value)
+			goto out_err;
+		key = dec_key(d, key, klen);
+		if (!key) {
+			json_decref(value);
+			goto out_err;
+		}
+		/* This takes value, even if it fails */
+		if (json_object_set_new(obj, key, value))
+			goto out_err;
+	}
+
+	return obj;
+
+out_err:
+	json_decref(obj);
+
+	return NULL;
+}
+
+/*
+ * Decode the value at the start of buf, setting *used (if not NULL) to
+ * how many bytes it took up. Returns NULL if it's not valid.
+ */
+json_t *bjson_decode(const unsigned char *buf, size_t len, size_t *used)
+{
+	struct bdec d = { .buf = buf, .len = len };
+	json_t *root;
+
+	root = dec_value(&d, 0);
+	free(d.keys);
+	free(d.scratch);
+
+	if (root && used)
+		*used = d.pos;
+
+	return root;
+}
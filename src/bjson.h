@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * bjson.h - Binary encoding of JSON
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _BJSON_H_
+#define _BJSON_H_
+
+#include <stddef.h>
+
+#include <jansson.h>
+
+extern unsigned char *bjson_encode(const json_t *root, size_t *len);
+extern json_t *bjson_decode(const unsigned char *buf, size_t len,
+			    size_t *used);
+
+#endif /* _BJSON_H_ */
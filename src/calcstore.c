@@ -0,0 +1,425 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * calcstore.c - Local store of calculations
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ *
+ * Once HMRC have produced a calculation it never changes, so every one
+ * fetched is kept locally, to be shown again without asking HMRC and
+ * to give a history of calculations when they can't be reached.
+ *
+ * Each calculation is a file <dir>/<tax_year>/<calculation id> holding
+ *
+ *	"ITSC" <version> <metadata> <calculation>
+ *
+ * where metadata is the calculationId, taxYear, calculationType &
+ * calculationTimestamp as an object and both it and the calculation
+ * are bjson encoded. The metadata comes first so listing what's stored
+ * only needs to read the start of each file.
+ *
+ * Like the submitted index, this only applies when actually talking to
+ * HMRC.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <jansson.h>
+
+#include "libitsa.h"
+#include "calcstore.h"
+#include "bjson.h"
+
+#define CS_MAGIC		"ITSC"
+#define CS_MAGIC_LEN		4
+#define CS_VERSION		1
+#define CS_HDR_LEN		(CS_MAGIC_LEN + 1)
+
+/* More than enough for the metadata */
+#define CS_META_MAX		1024
+
+static struct {
+	pthread_mutex_t lock;
+
+	char *dir;
+} cs = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Tax years & calculation ids end up as path components */
+static bool cs_name_ok(const char *name)
+{
+	size_t len;
+
+	if (!name)
+		return false;
+
+	len = strlen(name);
+	if (len == 0 || len > NAME_MAX)
+		return false;
+
+	return strspn(name, "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+			    "abcdefghijklmnopqrstuvwxyz0123456789-") == len;
+}
+
+/*
+ * Put the path to the given calculation in path, or if cid is NULL,
+ * the tax year directory. Returns false if the store isn't in use.
+ *
+ * Must be called with cs.lock held
+ */
+static bool cs_path(const char *tax_year, const char *cid, char *path,
+		    size_t size)
+{
+	int len;
+
+	if (!cs.dir || !itsa_mtd_needed() || !cs_name_ok(tax_year) ||
+	    (cid && !cs_name_ok(cid)))
+		return false;
+
+	if (cid)
+		len = snprintf(path, size, "%s/%s/%s", cs.dir, tax_year, cid);
+	else
+		len = snprintf(path, size, "%s/%s", cs.dir, tax_year);
+
+	return len > 0 && (size_t)len < size;
+}
+
+static unsigned char *cs_read(const char *path, size_t max, size_t *len)
+{
+	unsigned char *buf = NULL;
+	struct stat sb;
+	ssize_t bytes;
+	size_t size;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &sb) == -1 || sb.st_size < CS_HDR_LEN)
+		goto out_close;
+
+	size = sb.st_size;
+	if (max && size > max)
+		size = max;
+	buf = malloc(size);
+	if (!buf)
+		goto out_close;
+
+	bytes = pread(fd, buf, size, 0);
+	if (bytes != (ssize_t)size ||
+	    memcmp(buf, CS_MAGIC, CS_MAGIC_LEN) != 0 ||
+	    buf[CS_MAGIC_LEN] != CS_VERSION) {
+		free(buf);
+		buf = NULL;
+		goto out_close;
+	}
+	*len = size;
+
+out_close:
+	close(fd);
+
+	return buf;
+}
+
+/*
+ * Look for the given calculation in the store.
+ *
+ * Returns 0 and the calculation in result (to be json_decref()'d) if
+ * found, -ITSA_ERR_NOT_FOUND otherwise.
+ */
+int cs_get(const char *tax_year, const char *cid, json_t **result)
+{
+	unsigned char *buf;
+	json_t *meta;
+	char path[PATH_MAX];
+	size_t len;
+	size_t used;
+
+	*result = NULL;
+
+	pthread_mutex_lock(&cs.lock);
+	if (!cs_path(tax_year, cid, path, sizeof(path))) {
+		pthread_mutex_unlock(&cs.lock);
+		return -ITSA_ERR_NOT_FOUND;
+	}
+	pthread_mutex_unlock(&cs.lock);
+
+	buf = cs_read(path, 0, &len);
+	if (!buf)
+		return -ITSA_ERR_NOT_FOUND;
+
+	meta = bjson_decode(buf + CS_HDR_LEN, len - CS_HDR_LEN, &used);
+	if (meta)
+		*result = bjson_decode(buf + CS_HDR_LEN + used,
+				       len - CS_HDR_LEN - used, NULL);
+	json_decref(meta);
+	free(buf);
+
+	return *result ? 0 : -ITSA_ERR_NOT_FOUND;
+}
+
+static int cs_write(int fd, const unsigned char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t bytes = write(fd, buf, len);
+
+		if (bytes == -1)
+			return -1;
+		buf += bytes;
+		len -= bytes;
+	}
+
+	return 0;
+}
+
+/* Keep the given calculation in the store, if it's in use */
+void cs_put(const char *tax_year, const char *cid, const json_t *calc)
+{
+	const json_t *md = json_object_get(calc, "metadata");
+	unsigned char *mbuf = NULL;
+	unsigned char *cbuf = NULL;
+	unsigned char hdr[CS_HDR_LEN];
+	json_t *meta;
+	char path[PATH_MAX];
+	char tpath[PATH_MAX];
+	size_t mlen;
+	size_t clen;
+	int fd;
+	int err;
+
+	pthread_mutex_lock(&cs.lock);
+	if (!cs_name_ok(cid) || !cs_path(tax_year, NULL, path, sizeof(path)))
+		goto out_unlock;
+
+	mkdir(cs.dir, 0700);
+	mkdir(path, 0700);
+	if (!cs_path(tax_year, cid, path, sizeof(path)))
+		goto out_unlock;
+
+	meta = json_pack("{s:s, s:s, s:s?, s:s?}",
+			 "calculationId", cid,
+			 "taxYear", tax_year,
+			 "calculationType",
+			 json_string_value(json_object_get(md,
+							   "calculationType")),
+			 "calculationTimestamp",
+			 json_string_value(json_object_get(md,
+						"calculationTimestamp")));
+	mbuf = bjson_encode(meta, &mlen);
+	json_decref(meta);
+	cbuf = bjson_encode(calc, &clen);
+	if (!mbuf || !cbuf)
+		goto out_unlock;
+
+	if (snprintf(tpath, sizeof(tpath), "%s.XXXXXX", path) >=
+	    (int)sizeof(tpath))
+		goto out_unlock;
+	fd = mkostemp(tpath, O_CLOEXEC);
+	if (fd == -1)
+		goto out_unlock;
+
+	memcpy(hdr, CS_MAGIC, CS_MAGIC_LEN);
+	hdr[CS_MAGIC_LEN] = CS_VERSION;
+	err = cs_write(fd, hdr, sizeof(hdr));
+	if (!err)
+		err = cs_write(fd, mbuf, mlen);
+	if (!err)
+		err = cs_write(fd, cbuf, clen);
+	close(fd);
+
+	if (err || rename(tpath, path) == -1)
+		unlink(tpath);
+
+out_unlock:
+	pthread_mutex_unlock(&cs.lock);
+	free(mbuf);
+	free(cbuf);
+}
+
+/* Read the metadata of the stored calculation at path into calc */
+static bool cs_read_meta(const char *path, struct itsa_calculation *calc)
+{
+	unsigned char *buf;
+	json_t *meta;
+	size_t len;
+
+	buf = cs_read(path, CS_META_MAX, &len);
+	if (!buf)
+		return false;
+
+	meta = bjson_decode(buf + CS_HDR_LEN, len - CS_HDR_LEN, NULL);
+	free(buf);
+	if (!meta)
+		return false;
+
+	calc->id = strdup(json_string_value(json_object_get(meta,
+						"calculationId")) ?: "");
+	calc->tax_year = strdup(json_string_value(json_object_get(meta,
+						"taxYear")) ?: "");
+	calc->type = strdup(json_string_value(json_object_get(meta,
+						"calculationType")) ?: "");
+	calc->timestamp = strdup(json_string_value(json_object_get(meta,
+						"calculationTimestamp")) ?: "");
+	json_decref(meta);
+
+	return true;
+}
+
+/* Add the calculations stored for tax_year to calcs */
+static int cs_list_year(const char *tax_year, struct itsa_calculation **calcs,
+			size_t *nr, size_t *alloc)
+{
+	DIR *dir;
+	struct dirent *d;
+	char path[PATH_MAX];
+
+	pthread_mutex_lock(&cs.lock);
+	if (!cs_path(tax_year, NULL, path, sizeof(path))) {
+		pthread_mutex_unlock(&cs.lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&cs.lock);
+
+	dir = opendir(path);
+	if (!dir)
+		return 0;
+
+	while ((d = readdir(dir))) {
+		char cpath[PATH_MAX];
+
+		/* Skips ., .. and anything half written */
+		if (!cs_name_ok(d->d_name))
+			continue;
+
+		if (*nr == *alloc) {
+			struct itsa_calculation *tmp;
+
+			*alloc = *alloc ? *alloc * 2 : 16;
+			tmp = realloc(*calcs, *alloc * sizeof(**calcs));
+			if (!tmp) {
+				closedir(dir);
+				return -ITSA_ERR_OS;
+			}
+			*calcs = tmp;
+		}
+
+		if (snprintf(cpath, sizeof(cpath), "%s/%s", path,
+			     d->d_name) >= (int)sizeof(cpath))
+			continue;
+		if (cs_read_meta(cpath, *calcs + *nr))
+			(*nr)++;
+	}
+	closedir(dir);
+
+	return 0;
+}
+
+static int cs_cmp(const void *p1, const void *p2)
+{
+	const struct itsa_calculation *c1 = p1;
+	const struct itsa_calculation *c2 = p2;
+	int ret;
+
+	ret = strcmp(c1->tax_year, c2->tax_year);
+	if (ret)
+		return ret;
+
+	return strcmp(c1->timestamp, c2->timestamp);
+}
+
+/*
+ * List the calculations in the store, optionally only those for the
+ * given tax year, oldest first. Nothing is listed if the store isn't in
+ * use.
+ *
+ * calcs should be freed with itsa_calculations_free()
+ */
+int itsa_list_stored_calculations(const char *tax_year,
+				  struct itsa_calculation **calcs, size_t *nr)
+{
+	size_t alloc = 0;
+	int err = 0;
+
+	*calcs = NULL;
+	*nr = 0;
+
+	if (tax_year) {
+		err = cs_list_year(tax_year, calcs, nr, &alloc);
+	} else {
+		DIR *dir;
+		struct dirent *d;
+
+		pthread_mutex_lock(&cs.lock);
+		dir = cs.dir && itsa_mtd_needed() ? opendir(cs.dir) : NULL;
+		pthread_mutex_unlock(&cs.lock);
+		if (!dir)
+			return 0;
+
+		while (!err && (d = readdir(dir))) {
+			if (cs_name_ok(d->d_name))
+				err = cs_list_year(d->d_name, calcs, nr,
+						   &alloc);
+		}
+		closedir(dir);
+	}
+	if (err) {
+		itsa_calculations_free(*calcs, *nr);
+		*calcs = NULL;
+		*nr = 0;
+		return err;
+	}
+
+	if (*nr > 1)
+		qsort(*calcs, *nr, sizeof(**calcs), cs_cmp);
+
+	return 0;
+}
+
+/*
+ * Get the given calculation from the store, unlike
+ * itsa_get_calculation() this never goes to HMRC.
+ *
+ * Returns 0 and the calculation in result (to be json_decref()'d) if
+ * it's stored, -ITSA_ERR_NOT_FOUND otherwise.
+ */
+int itsa_get_stored_calculation(const char *tax_year, const char *cid,
+				json_t **result)
+{
+	return cs_get(tax_year, cid, result);
+}
+
+/* Whether the given calculation is in the store */
+bool itsa_calculation_stored(const char *tax_year, const char *cid)
+{
+	char path[PATH_MAX];
+	bool stored;
+
+	pthread_mutex_lock(&cs.lock);
+	stored = cs_path(tax_year, cid, path, sizeof(path)) &&
+		 access(path, R_OK) == 0;
+	pthread_mutex_unlock(&cs.lock);
+
+	return stored;
+}
+
+/* Keep calculations in dir (created if needed), NULL turns it off */
+void itsa_set_calc_store(const char *dir)
+{
+	pthread_mutex_lock(&cs.lock);
+	free(cs.dir);
+	cs.dir = dir ? strdup(dir) : NULL;
+	pthread_mutex_unlock(&cs.lock);
+}
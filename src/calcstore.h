@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * calcstore.h - Local store of calculations
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _CALCSTORE_H_
+#define _CALCSTORE_H_
+
+#include <jansson.h>
+
+extern int cs_get(const char *tax_year, const char *cid, json_t **result);
+extern void cs_put(const char *tax_year, const char *cid, const json_t *calc);
+
+#endif /* _CALCSTORE_H_ */
@@ -0,0 +1,207 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * estimate.c - Local estimate of income tax & NICs
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ *
+ * Works out the income tax, Class 2 & Class 4 NICs due on a given
+ * self-employment profit, using the England, Wales & Northern Ireland
+ * rates for the tax year. It's only an estimate, there's no other
+ * income, reliefs or adjustments, but it's instant and doesn't need
+ * anything to have been submitted.
+ *
+ * Each tax year has its own entry in the rates table, years after the
+ * last one use its rates. When the rates change, add a new entry.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "estimate.h"
+
+#define POUNDS(p)		((p) * 100L)
+
+/* Rates are in basis points, i.e 1/100th of a percent */
+struct tax_rates {
+	const char *tax_year;
+
+	long personal_allowance;
+	long pa_taper;		/* Allowance reduced by £1 per £2 above */
+	long basic_band;
+	long additional;	/* Additional rate threshold */
+	int basic_rate;
+	int higher_rate;
+	int additional_rate;
+
+	long class2_weekly;	/* 0 for none */
+	long class2_threshold;
+
+	long class4_lower;
+	long class4_upper;
+	int class4_main_rate;
+	int class4_upper_rate;
+};
+
+static const struct tax_rates tax_rates[] = {
+	{
+		.tax_year		= "2021-22",
+		.personal_allowance	= POUNDS(12570),
+		.pa_taper		= POUNDS(100000),
+		.basic_band		= POUNDS(37700),
+		.additional		= POUNDS(150000),
+		.basic_rate		= 2000,
+		.higher_rate		= 4000,
+		.additional_rate	= 4500,
+		.class2_weekly		= 305,
+		.class2_threshold	= POUNDS(6515),
+		.class4_lower		= POUNDS(9568),
+		.class4_upper		= POUNDS(50270),
+		.class4_main_rate	= 900,
+		.class4_upper_rate	= 200,
+	}, {
+		.tax_year		= "2022-23",
+		.personal_allowance	= POUNDS(12570),
+		.pa_taper		= POUNDS(100000),
+		.basic_band		= POUNDS(37700),
+		.additional		= POUNDS(150000),
+		.basic_rate		= 2000,
+		.higher_rate		= 4000,
+		.additional_rate	= 4500,
+		.class2_weekly		= 315,
+		.class2_threshold	= POUNDS(11908),
+		.class4_lower		= POUNDS(11908),
+		.class4_upper		= POUNDS(50270),
+		/* The 1.25% Health & Social Care rise, averaged */
+		.class4_main_rate	= 973,
+		.class4_upper_rate	= 273,
+	}, {
+		.tax_year		= "2023-24",
+		.personal_allowance	= POUNDS(12570),
+		.pa_taper		= POUNDS(100000),
+		.basic_band		= POUNDS(37700),
+		.additional		= POUNDS(125140),
+		.basic_rate		= 2000,
+		.higher_rate		= 4000,
+		.additional_rate	= 4500,
+		.class2_weekly		= 345,
+		.class2_threshold	= POUNDS(12570),
+		.class4_lower		= POUNDS(12570),
+		.class4_upper		= POUNDS(50270),
+		.class4_main_rate	= 900,
+		.class4_upper_rate	= 200,
+	}, {
+		/* Class 2 is now only paid voluntarily */
+		.tax_year		= "2024-25",
+		.personal_allowance	= POUNDS(12570),
+		.pa_taper		= POUNDS(100000),
+		.basic_band		= POUNDS(37700),
+		.additional		= POUNDS(125140),
+		.basic_rate		= 2000,
+		.higher_rate		= 4000,
+		.additional_rate	= 4500,
+		.class2_weekly		= 0,
+		.class2_threshold	= 0,
+		.class4_lower		= POUNDS(12570),
+		.class4_upper		= POUNDS(50270),
+		.class4_main_rate	= 600,
+		.class4_upper_rate	= 200,
+	},
+};
+
+#define NR_TAX_RATES	(sizeof(tax_rates) / sizeof(tax_rates[0]))
+
+/* A tax year is YYYY-YY, e.g 2023-24 */
+bool tax_year_valid(const char *tax_year)
+{
+	int year;
+
+	if (strlen(tax_year) != 7 || tax_year[4] != '-' ||
+	    strspn(tax_year, "0123456789") != 4 ||
+	    strspn(tax_year + 5, "0123456789") != 2)
+		return false;
+
+	year = atoi(tax_year);
+
+	return atoi(tax_year + 5) == (year + 1) % 100;
+}
+
+static const struct tax_rates *lookup_rates(const char *tax_year)
+{
+	size_t i;
+
+	/* Which means they compare in order */
+	if (!tax_year_valid(tax_year) ||
+	    strcmp(tax_year, tax_rates[0].tax_year) < 0)
+		return NULL;
+
+	for (i = NR_TAX_RATES; i > 0; i--) {
+		if (strcmp(tax_year, tax_rates[i - 1].tax_year) >= 0)
+			return &tax_rates[i - 1];
+	}
+
+	return NULL;
+}
+
+/* The part of amount that lies between lower and upper */
+static long band(long amount, long lower, long upper)
+{
+	if (amount <= lower)
+		return 0;
+	if (upper && amount > upper)
+		amount = upper;
+
+	return amount - lower;
+}
+
+static long rate(long amount, int bp)
+{
+	return amount * bp / 10000;
+}
+
+/*
+ * Estimate the tax & NICs on profit (in pence) for tax_year.
+ *
+ * Returns -1 if tax_year isn't valid or there are no rates for it.
+ */
+int tax_estimate(const char *tax_year, long profit, struct tax_estimate *est)
+{
+	const struct tax_rates *r = lookup_rates(tax_year);
+	long pa;
+
+	memset(est, 0, sizeof(*est));
+	if (!r)
+		return -1;
+
+	est->rates = r->tax_year;
+	est->profit = profit > 0 ? profit : 0;
+
+	pa = r->personal_allowance;
+	if (est->profit > r->pa_taper)
+		pa -= (est->profit - r->pa_taper) / 2;
+	est->personal_allowance = pa > 0 ? pa : 0;
+	est->taxable = band(est->profit, est->personal_allowance, 0);
+
+	est->income_tax = rate(band(est->taxable, 0, r->basic_band),
+			       r->basic_rate);
+	est->income_tax += rate(band(est->taxable, r->basic_band,
+				     r->additional), r->higher_rate);
+	est->income_tax += rate(band(est->taxable, r->additional, 0),
+				r->additional_rate);
+
+	if (r->class2_weekly && est->profit >= r->class2_threshold)
+		est->class2 = r->class2_weekly * 52;
+
+	est->class4 = rate(band(est->profit, r->class4_lower,
+				r->class4_upper), r->class4_main_rate);
+	est->class4 += rate(band(est->profit, r->class4_upper, 0),
+			    r->class4_upper_rate);
+
+	est->total = est->income_tax + est->class2 + est->class4;
+
+	return 0;
+}
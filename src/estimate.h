@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * estimate.h - Local estimate of income tax & NICs
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _ESTIMATE_H_
+#define _ESTIMATE_H_
+
+#include <stdbool.h>
+
+/* Amounts are in pence */
+struct tax_estimate {
+	const char *rates;	/* The tax year whose rates were used */
+
+	long profit;
+	long personal_allowance;
+	long taxable;
+
+	long income_tax;
+	long class2;
+	long class4;
+	long total;
+};
+
+extern bool tax_year_valid(const char *tax_year);
+extern int tax_estimate(const char *tax_year, long profit,
+			struct tax_estimate *est);
+
+#endif /* _ESTIMATE_H_ */
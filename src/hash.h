@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * hash.h - Non-cryptographic hashing
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FNV1A_64_INIT		0xcbf29ce484222325ULL
+#define FNV1A_64_PRIME		0x100000001b3ULL
+
+static inline uint64_t fnv1a(uint64_t hash, const char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)buf[i];
+		hash *= FNV1A_64_PRIME;
+	}
+
+	return hash;
+}
+
+#endif /* _HASH_H_ */
@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * hist.c - HDR style histograms
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ *
+ * Log-linear buckets as in HdrHistogram. Values below HIST_SUB_BUCKETS
+ * are counted exactly, above that each power of two is split into
+ * HIST_SUB_BUCKETS linear buckets. So the recorded values are accurate
+ * to within 1/HIST_SUB_BUCKETS (~3%) across the whole range, in a fixed
+ * amount of space.
+ */
+
+#include <stdint.h>
+
+#include "hist.h"
+
+static int msb(uint64_t val)
+{
+	return 63 - __builtin_clzll(val);
+}
+
+static unsigned int hist_index(uint64_t val)
+{
+	int shift;
+
+	if (val < HIST_SUB_BUCKETS)
+		return val;
+
+	if (msb(val) >= HIST_MAX_BITS)
+		return HIST_NR_COUNTS - 1;
+
+	shift = msb(val) - HIST_SUB_BITS;
+
+	return HIST_SUB_BUCKETS + shift * HIST_SUB_BUCKETS +
+	       ((val >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* The highest value that would be counted in the given bucket */
+static uint64_t hist_value(unsigned int idx)
+{
+	unsigned int shift;
+	uint64_t sub;
+
+	if (idx < HIST_SUB_BUCKETS)
+		return idx;
+
+	shift = (idx - HIST_SUB_BUCKETS) / HIST_SUB_BUCKETS;
+	sub = idx % HIST_SUB_BUCKETS;
+
+	return ((HIST_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void hist_record(struct hist *hist, uint64_t val)
+{
+	hist->counts[hist_index(val)]++;
+
+	if (!hist->total || val < hist->min)
+		hist->min = val;
+	if (val > hist->max)
+		hist->max = val;
+	hist->total++;
+	hist->sum += val;
+}
+
+/*
+ * The value at the given percentile (0 - 100), or 0 if nothing has been
+ * recorded.
+ */
+uint64_t hist_percentile(const struct hist *hist, double pct)
+{
+	uint64_t want;
+	uint64_t seen = 0;
+	unsigned int i;
+
+	if (!hist->total)
+		return 0;
+
+	want = hist->total * pct / 100.0 + 0.5;
+	if (want < 1)
+		want = 1;
+
+	for (i = 0; i < HIST_NR_COUNTS; i++) {
+		seen += hist->counts[i];
+		if (seen >= want) {
+			uint64_t val = hist_value(i);
+
+			return val > hist->max ? hist->max : val;
+		}
+	}
+
+	return hist->max;
+}
+
+uint64_t hist_mean(const struct hist *hist)
+{
+	return hist->total ? hist->sum / hist->total : 0;
+}
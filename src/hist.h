@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * hist.h - HDR style histograms
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _HIST_H_
+#define _HIST_H_
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS		5
+#define HIST_SUB_BUCKETS	(1 << HIST_SUB_BITS)
+/* Enough for values up to 2^40 */
+#define HIST_MAX_BITS		40
+#define HIST_NR_COUNTS		(HIST_SUB_BUCKETS + \
+				 (HIST_MAX_BITS - HIST_SUB_BITS) * \
+				 HIST_SUB_BUCKETS)
+
+struct hist {
+	uint32_t counts[HIST_NR_COUNTS];
+
+	uint64_t total;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+};
+
+extern void hist_record(struct hist *hist, uint64_t val);
+extern uint64_t hist_percentile(const struct hist *hist, double pct);
+extern uint64_t hist_mean(const struct hist *hist);
+
+#endif /* _HIST_H_ */
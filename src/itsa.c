@@ -19,29 +19,38 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <spawn.h>
-#include <regex.h>
 #include <limits.h>
-
-#include <sqlite3.h>
+#include <sysexits.h>
+#include <pthread.h>
 
 #include <jansson.h>
 
 #include <libmtdac/mtd.h>
 #include <libmtdac/mtd-bd.h>
-#include <libmtdac/mtd-biss.h>
-#include <libmtdac/mtd-ibeops.h>
-#include <libmtdac/mtd-ic.h>
-#include <libmtdac/mtd-ob.h>
-#include <libmtdac/mtd-sa.h>
 
 #include <libac.h>
 
 #include "platform.h"
 #include "color.h"
+#include "libitsa.h"
+#include "agent.h"
+#include "pool.h"
+#include "render.h"
+#include "output.h"
+#include "schema.h"
+#include "jdiff.h"
+#include "estimate.h"
 
 #define PROD_NAME		"itsa"
 
 #define ITSA_CFG		".config/itsa/config.json"
+#define ITSA_HISTORY		".config/itsa/history"
+#define ITSA_STATS_LOG		".config/itsa/stats.ndjson"
+#define ITSA_SUBMITTED		".config/itsa/submitted%s.json"
+#define ITSA_QUEUE		".config/itsa/queue%s.ndjson"
+#define ITSA_CALCS		".config/itsa/calculations%s"
+
+#define STATS_LOG_MAX_SZ	(1024 * 1024)
 #define DEFAULT_EDITOR		"vi"
 
 #define list_for_each(cur, list)	for (cur = list; cur; cur = cur->next)
@@ -53,7 +62,10 @@
 #define STRUE			"#HI_GREEN#t#RST#"
 #define SFALSE			"#HI_RED#f#RST#"
 
-#define TAX_YEAR_SZ		7
+#define TAX_YEAR_SZ		ITSA_TAX_YEAR_SZ
+
+#define MAX_CMD_ARGS		16
+#define HISTORY_MAX		500
 
 #define INFO	"[#INFO#INFO#RST#] "
 #define FINAL_DECLARATION \
@@ -78,27 +90,78 @@ INFO "may have to pay financial penalties or face prosecution if I give false"\
 "\n"\
 INFO "information.\n"
 
-enum period_action {
-	PERIOD_CREATE,
-	PERIOD_UPDATE,
-};
-
 static struct {
 	const char *gnc;
 	const char *bid;
 	const char *bname;
 	const char *btype;
+
+	struct itsa_ctx *ctx;
+	struct timespec mtime;
+
+	/* All the configured businesses, for --all-businesses */
+	struct itsa_business *businesses;
+	size_t nr_businesses;
 } itsa_config;
+#define ITSA_CTX	itsa_config.ctx
 #define BUSINESS_ID	itsa_config.bid
 #define BUSINESS_NAME	itsa_config.bname
 #define BUSINESS_TYPE	itsa_config.btype
 
 static char const *extra_hdrs[5];
 
+static unsigned int mtd_flags;
+static const struct mtd_cfg *mtd_cfg;
+
+static struct {
+	bool all_businesses;
+	bool force;
+	bool queue;
+	int deadline;		/* seconds, -1 for the command default */
+	const char *select;	/* --select expressions */
+	const char *output;	/* --output format */
+
+	/* These persist for the life of the process */
+	bool stats;
+} opts;
+
+/* The time budget (ms) of the current command, 0 for none */
+static unsigned long cmd_deadline;
+
+/* Default time budgets (in seconds) for commands that talk to HMRC */
+static const struct {
+	const char *cmd;
+	unsigned int secs;
+} cmd_budgets[] = {
+	{ "list-periods",				 60 },
+	{ "create-period",				120 },
+	{ "update-period",				120 },
+	{ "update-annual-summary",			120 },
+	{ "get-end-of-period-statement-obligations",	 60 },
+	{ "submit-end-of-period-statement",		120 },
+	{ "submit-final-declaration",			300 },
+	{ "list-calculations",				120 },
+	{ "diff-calculations",				120 },
+	{ "view-end-of-year-estimate",			120 },
+	{ "view-biss-summary",				 60 },
+	{ "add-savings-account",			 60 },
+	{ "view-savings-accounts",			120 },
+	{ "amend-savings-account",			120 },
+	{ "flush-queue",				300 },
+	{ NULL, 0 }
+};
+
 static bool is_prod_api;
+static bool hedge_requests;
+static bool use_standin;
+static bool stats_log = true;
+static bool prefetching = true;
 
 static int JKEY_FW;
 
+/* The compiled --select for the current command, if any */
+static struct render_sel *selector;
+
 static void disp_usage(void)
 {
 	printf("Usage: itsa COMMAND [OPTIONS]\n\n");
@@ -108,83 +171,89 @@ static void disp_usage(void)
 	printf("\n");
 	printf("    switch-business\n");
 	printf("\n");
-	printf("    list-periods [<start> <end>]\n");
-	printf("    create-period [<start> <end>]\n");
+	printf("    list-periods [<start> <end>] [--all-businesses]\n");
+	printf("    create-period [<start> <end> | --backfill]\n");
 	printf("    update-period <period_id>\n");
 	printf("    update-annual-summary <tax_year>\n");
-	printf("    get-end-of-period-statement-obligations [<start> <end>]\n");
+	printf("    get-end-of-period-statement-obligations [<start> <end>] "
+	       "[--all-businesses]\n");
 	printf("    submit-end-of-period-statement <start> <end>\n");
 	printf("    submit-final-declaration <tax_year>\n");
 	printf("    list-calculations [tax_year]\n");
+	printf("    diff-calculations <calculation_id> <calculation_id> "
+	       "[tax_year]\n");
 	printf("    view-end-of-year-estimate\n");
+	printf("    estimate [tax_year [profit]]\n");
+	printf("    view-biss-summary <tax_year> [--all-businesses]\n");
 	printf("    add-savings-account\n");
 	printf("    view-savings-accounts [tax_year]\n");
 	printf("    amend-savings-account <tax_year>\n");
+	printf("\n");
+	printf("    list-queue\n");
+	printf("    flush-queue\n");
+	printf("    drop-queue <id>\n");
+	printf("\n");
+	printf("    shell\n");
+	printf("    batch <file>\n");
+	printf("\n");
+	printf("    agent <roster> [--submit] [--report <file>]\n");
+	printf("\n");
+	printf("Options\n");
+	printf("    --stats\n");
+	printf("    --deadline <secs>\n");
+	printf("    --force\n");
+	printf("    --queue\n");
+	printf("    --select <expr>[,<expr>...]\n");
+	printf("    --output <text|json|ndjson|csv>\n");
 }
 
 static void free_config(void)
 {
+	size_t i;
+
+	for (i = 0; i < itsa_config.nr_businesses; i++) {
+		struct itsa_business *bus = &itsa_config.businesses[i];
+
+		free((void *)bus->bid);
+		free((void *)bus->btype);
+		free((void *)bus->bname);
+		free((void *)bus->gnc);
+	}
+	free(itsa_config.businesses);
+
 	free((void *)itsa_config.gnc);
 	free((void *)itsa_config.bid);
 	free((void *)itsa_config.bname);
 	free((void *)itsa_config.btype);
-}
-
-/*
- * Simple wrapper around time(2) that allows to override the
- * current date.
- */
-static time_t xtime(void)
-{
-	const char *set_date = getenv("ITSA_SET_DATE");
-	struct tm tm = { 0 };
-
-	if (!set_date)
-		return time(NULL);
-
-	strptime(set_date, "%F", &tm);
-
-	return mktime(&tm);
-}
-
-static json_t *get_result_json(const char *buf)
-{
-	json_t *jarray;
-	json_t *root;
-	json_t *result;
 
-	jarray = json_loads(buf, 0, NULL);
-	root = json_array_get(jarray, json_array_size(jarray) - 1);
-	result = json_deep_copy(json_object_get(root, "result"));
-	json_decref(jarray);
+	itsa_ctx_free(itsa_config.ctx);
 
-	return result;
+	memset(&itsa_config, 0, sizeof(itsa_config));
 }
 
 /*
- * For doing request back-off, following the Fibonaci Sequence
- * (skipping 0)
+ * Read the users response. The time spent waiting on the user doesn't
+ * count towards the commands deadline.
  */
-static int next_fib(int last)
+static char *prompt_input(char *buf, int size)
 {
-	int Fn;
-	static int state;
-
-	if (last == -1) {
-		state = 0;
-		return 1;
-	}
+	int64_t tstart = itsa_trace_begin();
+	char *s;
 
-	Fn = state + last;
-	state = last;
+	if (ITSA_CTX)
+		itsa_ctx_pause_deadline(ITSA_CTX);
+	s = fgets(buf, size, stdin);
+	if (ITSA_CTX)
+		itsa_ctx_resume_deadline(ITSA_CTX);
+	itsa_trace_end("user", "prompt", tstart);
 
-	return Fn;
+	return s;
 }
 
 static const char *get_period_color(const char *start, const char *end,
 				    const char *due, bool met)
 {
-	time_t now = xtime();
+	time_t now = itsa_time();
 	time_t st;
 	time_t et;
 	time_t dt;
@@ -217,232 +286,63 @@ static const char *get_period_color(const char *start, const char *end,
 	return "#CHARC#";
 }
 
-static char *get_tax_year(const char *date, char *buf)
+static int get_data(const char *start, const char *end,
+		    struct itsa_period *period)
 {
-	struct tm tm = { 0 };
-	char year[5];
-	char year2[5];
-
-	if (!date) {
-		time_t now = xtime();
-		struct tm *ntm;
-
-		ntm = localtime(&now);
-		memcpy(&tm, ntm, sizeof(struct tm));
-	} else {
-		strptime(date, "%F", &tm);
-	}
-	strftime(year, sizeof(year), "%Y", &tm);
+	int64_t tstart = itsa_trace_begin();
+	size_t i;
+	int err;
 
-	/* tm_mon starts at 0, hence April = 3 */
-	if (tm.tm_mon < 3 || (tm.tm_mon <= 3 && tm.tm_mday <= 5)) {
-		tm.tm_year--;
-		strftime(year2, sizeof(year2), "%Y", &tm);
-		snprintf(buf, 8, "%s-%s", year2, year + 2);
-	} else {
-		tm.tm_year++;
-		strftime(year2, sizeof(year2), "%Y", &tm);
-		snprintf(buf, 8, "%s-%s", year, year2 + 2);
+	err = itsa_get_period(ITSA_CTX, start, end, period);
+	itsa_trace_end("db", "get_data", tstart);
+	if (err) {
+		printec("Couldn't get items for period. (%s)\n%s\n",
+			itsa_err2str(err), itsa_err_detail(ITSA_CTX));
+		return -1;
 	}
 
-	return buf;
-}
-
-/*
- * transactions.guid	-> splits.tx_guid	: Item value
- * splits.account_guid	-> accounts.guid	: Account type (in/out)
- */
-static void get_data(const char *start, const char *end, long *income,
-		     long *expenses)
-{
-	sqlite3_stmt *trans_stmt;
-	sqlite3_stmt *splits_stmt;
-	sqlite3_stmt *acc_stmt;
-	sqlite3 *db;
-	char sql[512];
-	ac_slist_t *i_list = NULL;
-	ac_slist_t *e_list = NULL;
-	ac_slist_t *p;
-
-	*income = *expenses = 0;
-
-	sqlite3_open(itsa_config.gnc, &db);
-	snprintf(sql, sizeof(sql),
-		 "SELECT * FROM transactions WHERE "
-		 "post_date >= ? AND post_date <= ?");
-	sqlite3_prepare_v2(db, sql, -1, &trans_stmt, NULL);
-	sqlite3_bind_text(trans_stmt, 1, start, strlen(start), SQLITE_STATIC);
-	sqlite3_bind_text(trans_stmt, 2, end, strlen(end), SQLITE_STATIC);
-
-	snprintf(sql, sizeof(sql),
-		 "SELECT value_num, account_guid FROM splits WHERE "
-		 "tx_guid = ? AND value_num > 0 LIMIT 1");
-	sqlite3_prepare_v2(db, sql, -1, &splits_stmt, NULL);
-
-	snprintf(sql, sizeof(sql),
-		 "SELECT account_type FROM accounts WHERE guid = ?");
-	sqlite3_prepare_v2(db, sql, -1, &acc_stmt, NULL);
-
-	while (sqlite3_step(trans_stmt) == SQLITE_ROW) {
-		char *item;
-		const char *account;
-		const unsigned char *date = sqlite3_column_text(trans_stmt, 3);
-		const unsigned char *desc = sqlite3_column_text(trans_stmt, 5);
-		const unsigned char *tx_guid =
-			sqlite3_column_text(trans_stmt, 0);
-		const unsigned char *account_guid;
-		long amnt;
-		int len;
-
-		sqlite3_bind_text(splits_stmt, 1, (const char *)tx_guid,
-				  sqlite3_column_bytes(trans_stmt, 0),
-				  SQLITE_STATIC);
-		sqlite3_step(splits_stmt);
-
-		amnt = sqlite3_column_int(splits_stmt, 0);
-		account_guid = sqlite3_column_text(splits_stmt, 1);
-		sqlite3_bind_text(acc_stmt, 1, (const char *)account_guid,
-				  sqlite3_column_bytes(splits_stmt, 1),
-				  SQLITE_STATIC);
-		sqlite3_step(acc_stmt);
-
-		len = asprintf(&item, "%.10s %-54s %7.2f", date, desc,
-			       amnt / 100.0f);
-		if (len == -1) {
-			printec("asprintf() failed in %s\n", __func__);
-			exit(EXIT_FAILURE);
-		}
-		account = (const char *)sqlite3_column_text(acc_stmt, 0);
-		if (strcmp(account, "BANK") == 0) {
-			*income += amnt;
-			ac_slist_add(&i_list, item);
-		} else if (strcmp(account, "EXPENSE") == 0) {
-			*expenses += amnt;
-			ac_slist_add(&e_list, item);
-		} else {
-			printec("Unknown account type : %s\n", account);
-			exit(EXIT_FAILURE);
+	if (output_structured()) {
+		for (i = 0; i < period->nr_items; i++) {
+			const struct itsa_item *item = &period->items[i];
+
+			output_record("item", json_pack(
+				"{s:s, s:s, s:s, s:s, s:s, s:f}",
+				"start", start, "end", end,
+				"date", item->date, "description", item->desc,
+				"category", item->type == ITSA_ITEM_INCOME ?
+					    "income" : "expense",
+				"amount", item->amount / 100.0));
 		}
-
-		sqlite3_reset(acc_stmt);
-		sqlite3_reset(splits_stmt);
+		return 0;
 	}
 
-	sqlite3_finalize(acc_stmt);
-	sqlite3_finalize(splits_stmt);
-	sqlite3_finalize(trans_stmt);
-	sqlite3_close(db);
-
 	printc("Items for period #BOLD#%s#RST# to #BOLD#%s#RST#\n\n",
 	       start, end);
 	printc("#GREEN#  Income(s) :-#RST#\n");
-	list_for_each(p, i_list)
-		printf("    %s\n", (char *)p->data);
+	for (i = 0; i < period->nr_items; i++) {
+		const struct itsa_item *item = &period->items[i];
+
+		if (item->type != ITSA_ITEM_INCOME)
+			continue;
+		printf("    %.10s %-54s %7.2f\n", item->date, item->desc,
+		       item->amount / 100.0f);
+	}
 	printc("#CHARC#%79s#RST#", "------------\n");
-	printc("#BOLD#%77.2f#RST#\n", *income / 100.0f);
+	printc("#BOLD#%77.2f#RST#\n", period->income / 100.0f);
 	printf("\n");
 	printc("#RED#  Expense(s) :-#RST#\n");
-	list_for_each(p, e_list)
-		printf("    %s\n", (char *)p->data);
-	printc("#CHARC#%79s#RST#", "------------\n");
-	printc("#BOLD#%77.2f#RST#\n", *expenses / 100.0f);
+	for (i = 0; i < period->nr_items; i++) {
+		const struct itsa_item *item = &period->items[i];
 
-	ac_slist_destroy(&i_list, free);
-	ac_slist_destroy(&e_list, free);
-}
-
-static void print_bread_crumb(const char *bread_crumb[])
-{
-	char str[192];
-	int len = 0;
-
-	if (!*bread_crumb) {
-		printc(" #BOLD#/#RST#\n");
-		return;
-	}
-
-	for ( ; *bread_crumb != NULL; bread_crumb++) {
-		snprintf(str + len, sizeof(str) - len, "%s / ", *bread_crumb);
-		len = strlen(str);
+		if (item->type != ITSA_ITEM_EXPENSE)
+			continue;
+		printf("    %.10s %-54s %7.2f\n", item->date, item->desc,
+		       item->amount / 100.0f);
 	}
-	str[len - 3] = '\0';
-	printc("#BOLD# %s#RST#\n", str);
-}
-
-#define MAX_BREAD_CRUMB_LVL		16
-static void print_json_tree(json_t *obj, const char *bread_crumb[], int level,
-			    bool (*print_json_tree_cb)(const char *key,
-						       json_t *value))
-{
-	const char *key;
-	json_t *value;
-	bool done_bread_crumb = false;
-
-	json_object_foreach(obj, key, value) {
-		char val[64];
-
-		switch (json_typeof(value)) {
-		case JSON_OBJECT:
-			bread_crumb[level] = key;
-			print_json_tree(value, bread_crumb, ++level,
-					print_json_tree_cb);
-			goto decr_level;
-		case JSON_ARRAY: {
-			json_t *aobj;
-			size_t index;
-			size_t size = json_array_size(value);
-
-			bread_crumb[level++] = key;
-			json_array_foreach(value, index, aobj) {
-				print_json_tree(aobj, bread_crumb, level,
-						print_json_tree_cb);
-				if (index < size - 1)
-					printf("\n");
-			}
-			goto decr_level;
-		}
-		case JSON_STRING:
-			snprintf(val, sizeof(val), "%s",
-				 json_string_value(value));
-			break;
-		case JSON_INTEGER:
-			snprintf(val, sizeof(val), "%lld",
-				 json_integer_value(value));
-			break;
-		case JSON_REAL:
-			snprintf(val, sizeof(val), "%.2f",
-				 json_real_value(value));
-			break;
-		case JSON_TRUE:
-		case JSON_FALSE:
-			snprintf(val, sizeof(val), "%s",
-				 json_is_true(value) ? "true" : "false");
-			break;
-		case JSON_NULL:
-			sprintf(val, "null");
-			break;
-		}
-
-		if (!done_bread_crumb) {
-			print_bread_crumb(bread_crumb);
-			done_bread_crumb = true;
-		}
-
-		if (print_json_tree_cb) {
-			bool printed;
-
-			printed = print_json_tree_cb(key, value);
-			if (printed)
-				continue;
-		}
-		printc("#CHARC# %*s :#RST# %s\n", JKEY_FW, key, val);
-		continue;
+	printc("#CHARC#%79s#RST#", "------------\n");
+	printc("#BOLD#%77.2f#RST#\n", period->expenses / 100.0f);
 
-decr_level:
-		level--;
-		bread_crumb[level] = NULL;
-		done_bread_crumb = false;
-	}
+	return 0;
 }
 
 static void display_messages(const json_t *msgs_obj, const char *fmt,
@@ -473,36 +373,34 @@ static int display_end_of_year_est(const char *tax_year, const char *cid)
 {
 	json_t *result;
 	json_t *obj;
-	char *jbuf;
-	const char *bread_crumb[MAX_BREAD_CRUMB_LVL + 1] = { NULL };
-	int ret = -1;
 	int err;
 
-	err = mtd_ic_get_calculation(tax_year, cid, &jbuf);
+	err = itsa_get_calculation(ITSA_CTX, tax_year, cid, &result);
 	if (err) {
 		printec("Couldn't get calculation. (%s)\n%s\n",
-			mtd_err2str(err), jbuf);
-		goto out_free_buf;
+			itsa_err2str(err), itsa_err_detail(ITSA_CTX));
+		return -1;
 	}
 
-	printsc("End of Year estimate for #BOLD#%s#RST#\n", cid);
+	obj = json_object_get(result, "calculation");
+	obj = json_object_get(obj, "endOfYearEstimate");
+	if (output_structured()) {
+		output_record("end-of-year-estimate", json_pack(
+			"{s:s, s:s, s:O?}", "tax_year", tax_year,
+			"calculation_id", cid, "estimate", obj));
+		json_decref(result);
+		return 0;
+	}
 
-	result = get_result_json(jbuf);
+	printsc("End of Year estimate for #BOLD#%s#RST#\n", cid);
 
 	JKEY_FW = 32;
 	printc("#BOLD# Summary#RST#:-\n");
-	obj = json_object_get(result, "calculation");
-	obj = json_object_get(obj, "endOfYearEstimate");
-	print_json_tree(obj, bread_crumb, 0, NULL);
+	render_json_tree(stdout, obj, JKEY_FW, NULL, selector);
 
 	json_decref(result);
 
-	ret = 0;
-
-out_free_buf:
-	free(jbuf);
-
-	return ret;
+	return 0;
 }
 
 static void display_calculation_messages(const json_t *msgs)
@@ -515,9 +413,12 @@ static void display_calculation_messages(const json_t *msgs)
 	display_messages(msgs, MSG_INFO, "info");
 }
 
-static void display_calculation(json_t *obj)
+/*
+ * sel is NULL when the whole calculation must be shown, e.g before
+ * making a final declaration.
+ */
+static void display_calculation(json_t *obj, const struct render_sel *sel)
 {
-	const char *bread_crumb[MAX_BREAD_CRUMB_LVL + 1];
 	json_t *tmp;
 	const json_t *msgs;
 
@@ -527,94 +428,72 @@ static void display_calculation(json_t *obj)
 	json_object_del(obj, "links");
 
 	JKEY_FW = 36;
-	memset(bread_crumb, 0, sizeof(char *) * MAX_BREAD_CRUMB_LVL);
-	print_json_tree(obj, bread_crumb, 0, NULL);
-	display_calculation_messages(msgs);
+	render_json_tree(stdout, obj, JKEY_FW, NULL, sel);
+	/* Only what was asked for */
+	if (!sel)
+		display_calculation_messages(msgs);
 }
 
-static int get_calculation(const char *tax_year, const char *cid)
+static void show_calculation(const char *tax_year, json_t *result)
 {
-	json_t *result;
-	char *jbuf;
-	int ret = -1;
-	int err;
-	int fib_sleep = -1;
-
-again:
-	err = mtd_ic_get_calculation(tax_year, cid, &jbuf);
-	if ((err && err != -MTD_ERR_REQUEST) ||
-	    (err == -MTD_ERR_REQUEST && fib_sleep == 5)) {
-		printec("Couldn't get calculation. (%s)\n%s\n",
-			mtd_err2str(err), jbuf);
-		goto out_free;
-	} else if (err == -MTD_ERR_REQUEST) {
-		fib_sleep = next_fib(fib_sleep);
-		printic("Trying to get calculation again in "
-			"#BOLD#%d#RST# second(s)\n", fib_sleep);
-		fflush(stdout);
-		sleep(fib_sleep);
-
-		goto again;
+	if (output_structured()) {
+		json_object_del(result, "links");
+		output_record("calculation-result", json_pack(
+			"{s:s, s:o}", "tax_year", tax_year,
+			"calculation", result));
+		return;
 	}
 
-	result = get_result_json(jbuf);
 	printsc("Calculation for #BOLD#%s#RST#\n", tax_year);
-	display_calculation(result);
+	display_calculation(result, selector);
 	json_decref(result);
-
-	ret = 0;
-
-out_free:
-	free(jbuf);
-
-	return ret;
 }
 
-static int final_declaration(int argc, char *argv[])
+static int get_calculation(const char *tax_year, const char *cid)
 {
 	json_t *result;
-	json_t *cid_obj;
-	char *jbuf;
-	char *s;
-	const char *cid;
-	char tyear[TAX_YEAR_SZ + 1];
-	char submit[32];
-	int ret = -1;
 	int err;
 
-	if (argc < 3) {
-		disp_usage();
+	err = itsa_get_calculation(ITSA_CTX, tax_year, cid, &result);
+	if (err) {
+		printec("Couldn't get calculation. (%s)\n%s\n",
+			itsa_err2str(err), itsa_err_detail(ITSA_CTX));
 		return -1;
 	}
 
-	snprintf(tyear, sizeof(tyear), "%s", argv[2]);
+	show_calculation(tax_year, result);
 
-	err = mtd_ic_trigger_calculation(tyear, "?finalDeclaration=true",
-					 &jbuf);
-	if (err) {
-		printec("Final declartion calculation failed. (%s)\n%s\n",
-			mtd_err2str(err), jbuf);
-		goto out_free_buf;
-	}
+	return 0;
+}
+
+static void calc_retry(void *user_data __unused, int secs)
+{
+	printic("Trying to get calculation again in "
+		"#BOLD#%d#RST# second(s)\n", secs);
+	fflush(stdout);
+}
 
-	result = get_result_json(jbuf);
-	cid_obj = json_object_get(result, "calculationId");
-	cid = json_string_value(cid_obj);
+static bool confirm_final_declaration(const json_t *data)
+{
+	const char *tyear;
+	char *s;
+	char submit[32];
 
-	printsc("Final declaration calculationId: #BOLD#%s#RST#\n", cid);
+	tyear = json_string_value(json_object_get(data, "taxYear"));
 
-	err = get_calculation(tyear, cid);
-	if (err)
-		goto out_free_json;
+	printsc("Final declaration calculationId: #BOLD#%s#RST#\n",
+		json_string_value(json_object_get(data, "calculationId")));
+	printsc("Calculation for #BOLD#%s#RST#\n", tyear);
+	display_calculation(json_object_get(data, "calculation"), NULL);
 
 	printf("\n");
 	printc(FINAL_DECLARATION);
 	printf("\n");
 	printcc("Submit 'Final Declaration' for this TAX return? (y/N)> ");
 
-	s = fgets(submit, sizeof(submit), stdin);
+	s = prompt_input(submit, sizeof(submit));
 	if (!s || (*submit != 'y' && *submit != 'Y'))
-		goto out_ok;
+		return false;
 
 	printf("\n");
 	printic("About to submit a #TANG#Final Declaration#RST# for "
@@ -624,217 +503,817 @@ static int final_declaration(int argc, char *argv[])
 	printf("\n");
 	printcc("Enter (without the quotes) 'i agree'> ");
 
-	s = fgets(submit, sizeof(submit), stdin);
+	s = prompt_input(submit, sizeof(submit));
 	if (!s || strcmp(submit, "i agree\n") != 0)
-		goto out_ok;
-
-	free(jbuf);
-
-	err = mtd_ic_final_decl(tyear, cid, &jbuf);
-	if (err) {
-		printec("Failed to submit 'Final Declaration'. (%s)\n%s\n",
-			mtd_err2str(err), jbuf);
-		goto out_free_json;
-	}
-
-	printsc("Final Declaration done.\n");
-
-out_ok:
-	ret = 0;
-
-out_free_json:
-	json_decref(result);
-
-out_free_buf:
-	free(jbuf);
+		return false;
 
-	return ret;
+	return true;
 }
 
-static int submit_eop_obligation(const char *start, const char *end)
+static bool confirm_eops(const json_t *data)
 {
-	ac_jsonw_t *json;
-	struct mtd_dsrc_ctx dsctx;
-	char *jbuf;
 	char *s;
 	char submit[3];
-	int ret = -1;
-	int err;
 
 	printcc("Submit End of Period Statement for #BOLD#%s#RST# to "
-		"#BOLD#%s#RST#\n\n", start, end);
+		"#BOLD#%s#RST#\n\n",
+		json_string_value(json_object_get(data, "start")),
+		json_string_value(json_object_get(data, "end")));
 	printcc("(y/N)> ");
 
-	s = fgets(submit, sizeof(submit), stdin);
+	s = prompt_input(submit, sizeof(submit));
 	if (!s || (*submit != 'y' && *submit != 'Y'))
-		return 0;
+		return false;
 
-	json = ac_jsonw_init();
-	ac_jsonw_add_str(json, "typeOfBusiness", BUSINESS_TYPE);
-	ac_jsonw_add_str(json, "businessId", BUSINESS_ID);
+	return true;
+}
 
-	ac_jsonw_add_object(json, "accountingPeriod");
-	ac_jsonw_add_str(json, "startDate", start);
-	ac_jsonw_add_str(json, "endDate", end);
-	ac_jsonw_end_object(json);
+static bool confirm(void *user_data __unused, enum itsa_confirm what,
+		    const json_t *data)
+{
+	switch (what) {
+	case ITSA_CONFIRM_FINAL_DECL:
+		return confirm_final_declaration(data);
+	case ITSA_CONFIRM_EOPS:
+		return confirm_eops(data);
+	}
 
-	ac_jsonw_add_bool(json, "finalised", true);
-	ac_jsonw_end(json);
+	return false;
+}
 
-	dsctx.data_src.buf = ac_jsonw_get(json);
-	dsctx.data_len = -1;
-	dsctx.src_type = MTD_DATA_SRC_BUF;
+static int final_declaration(int argc, char *argv[])
+{
+	int err;
 
-	err = mtd_ibeops_submit_eops(&dsctx, &jbuf);
-	if (err) {
-		printec("Couldn't submit End of Period Statement. (%s)\n%s\n",
-			mtd_err2str(err), jbuf);
-		goto out_free;
+	if (argc < 3) {
+		disp_usage();
+		return -1;
 	}
 
-	printsc("End of Period Statement submitted for #BOLD#%s#RST# to "
-		"#BOLD#%s#RST#\n", start, end);
-
-	ret = 0;
-
-out_free:
-	ac_jsonw_free(json);
-	free(jbuf);
+	err = itsa_final_declaration(ITSA_CTX, argv[2]);
+	if (err < 0) {
+		printec("Failed to submit 'Final Declaration'. (%s)\n%s\n",
+			itsa_err2str(err), itsa_err_detail(ITSA_CTX));
+		return -1;
+	} else if (err == 0) {
+		printsc("Final Declaration done.\n");
+	}
 
-	return ret;
+	return 0;
 }
 
-static int get_eop_obligations(int argc, char *argv[])
+static int submit_eop_obligation(const char *start, const char *end)
 {
-	json_t *result;
-	json_t *obs;
-	json_t *period;
-	char qs[192];
-	char *jbuf;
-	size_t index;
-	int ret = -1;
 	int err;
 
-	if (argc > 2 && argc < 4) {
-		disp_usage();
+	err = itsa_submit_eops(ITSA_CTX, start, end);
+	if (err < 0) {
+		printec("Couldn't submit End of Period Statement. (%s)\n%s\n",
+			itsa_err2str(err), itsa_err_detail(ITSA_CTX));
 		return -1;
+	} else if (err == 0) {
+		printsc("End of Period Statement submitted for #BOLD#%s#RST# "
+			"to #BOLD#%s#RST#\n", start, end);
+	} else if (err == ITSA_QUEUED) {
+		printic("Queued End of Period Statement for #BOLD#%s#RST# to "
+			"#BOLD#%s#RST#, send it later with "
+			"#BOLD#flush-queue#RST#\n", start, end);
 	}
 
-	snprintf(qs, sizeof(qs), "?typeOfBusiness=%s&businessId=%s",
-		 BUSINESS_TYPE, BUSINESS_ID);
-	if (argc > 2) {
-		int len = strlen(qs);
+	return 0;
+}
 
-		len += snprintf(qs + len, sizeof(qs) - len, "&fromDate=%s",
-				argv[2]);
-		snprintf(qs + len, sizeof(qs) - len, "&toDate=%s", argv[3]);
-	}
+/*
+ * --all-businesses support.
+ *
+ * Each business is queried from its own thread, with its own libmtdac
+ * session & libitsa context, the results are then merged for display.
+ */
+struct bus_job {
+	const struct itsa_business *bus;
+	int (*fn)(struct itsa_ctx *ctx, struct bus_job *job);
 
-	err = mtd_ob_list_end_of_period_obligations(qs, &jbuf);
-	if (err) {
-		printec("Couldn't get End of Period Statement(s). (%s)\n%s\n",
-			mtd_err2str(err), jbuf);
-		goto out_free;
-	}
+	/* Arguments */
+	const char *from;
+	const char *to;
+	const char *tax_year;
 
-	printsc("End of Period Statement Obligations\n");
+	/* Results */
+	int err;
+	char *err_detail;
+	struct itsa_obligation *obs;
+	size_t nr_obs;
+	json_t *result;
+};
 
-	result = get_result_json(jbuf);
-	obs = json_object_get(result, "obligations");
-	obs = json_array_get(obs, 0);
-	obs = json_object_get(obs, "obligationDetails");
+static const char *bus_label(const struct itsa_business *bus)
+{
+	return bus->bname ? bus->bname : bus->bid;
+}
 
-	printc("#CHARC#  %12s %11s %13s %15s %7s#RST#\n",
-	       "start", "end", "due", "status", "@" );
-	printc("#CHARC#"
-	       " ------------------------------------------------------------"
-	       "---------#RST#\n");
-	json_array_foreach(obs, index, period) {
-		json_t *start_obj = json_object_get(period, "periodStartDate");
-		json_t *end_obj = json_object_get(period, "periodEndDate");
-		json_t *due_obj = json_object_get(period, "dueDate");
-		json_t *recvd_obj = json_object_get(period, "receivedDate");
-		json_t *status_obj = json_object_get(period, "status");
-		const char *start = json_string_value(start_obj);
-		const char *end = json_string_value(end_obj);
-		const char *due = json_string_value(due_obj);
-		const char *recvd = json_string_value(recvd_obj);
-		const char *status = json_string_value(status_obj);
-		bool met = *status == 'F' ? true : false;
+static void bus_job_run(void *arg)
+{
+	struct bus_job *job = arg;
+	struct itsa_ctx *ctx;
+	int err;
 
-		printc("%s  %15s %12s %13s %9c%s#HI_GREEN#%15s#RST#\n",
-		       get_period_color(start, end, due, met),
-		       start, end, due, *status, "#RST#", met ? recvd : "");
-        }
+	if (itsa_mtd_needed()) {
+		err = mtd_init(mtd_flags & ~MTD_OPT_GLOBAL_INIT, mtd_cfg);
+		if (err) {
+			job->err = err;
+			return;
+		}
+	}
 
-	json_decref(result);
+	ctx = itsa_ctx_new(job->bus, NULL, NULL);
+	if (!ctx) {
+		job->err = -ITSA_ERR_OS;
+		goto out_deinit;
+	}
+	itsa_ctx_set_deadline(ctx, cmd_deadline);
 
-	ret = 0;
+	job->err = job->fn(ctx, job);
+	if (job->err)
+		job->err_detail = strdup(itsa_err_detail(ctx));
 
-out_free:
-	free(jbuf);
+	itsa_ctx_free(ctx);
 
-	return ret;
+out_deinit:
+	if (itsa_mtd_needed())
+		mtd_deinit();
 }
 
-static int biss_se_summary(const char *tax_year)
+static void free_bus_jobs(struct bus_job *jobs)
 {
-	json_t *result;
-	json_t *obj;
-	json_t *val;
-	char *jbuf;
-	const char *key;
-	char *plcolor = "#GREEN#";
-	char *pltext = "Profit";
-	int ret = -1;
-	int err;
+	size_t i;
 
-	err = mtd_biss_get_summary("self-employment", tax_year, BUSINESS_ID,
-				   &jbuf);
+	for (i = 0; i < itsa_config.nr_businesses; i++) {
+		free(jobs[i].err_detail);
+		itsa_obligations_free(jobs[i].obs, jobs[i].nr_obs);
+		json_decref(jobs[i].result);
+	}
+	free(jobs);
+}
+
+/*
+ * Run tmpl->fn for every configured business concurrently. Returns an
+ * array of itsa_config.nr_businesses jobs holding the results, which
+ * should be freed with free_bus_jobs().
+ */
+static struct bus_job *run_all_businesses(const struct bus_job *tmpl)
+{
+	struct bus_job *jobs;
+	struct pool *pool;
+	size_t i;
+
+	jobs = calloc(itsa_config.nr_businesses, sizeof(struct bus_job));
+	if (!jobs)
+		return NULL;
+
+	pool = pool_new(itsa_config.nr_businesses, NULL);
+	if (!pool) {
+		free(jobs);
+		return NULL;
+	}
+
+	for (i = 0; i < itsa_config.nr_businesses; i++) {
+		jobs[i] = *tmpl;
+		jobs[i].bus = &itsa_config.businesses[i];
+		if (pool_submit(pool, bus_job_run, &jobs[i]) == -1)
+			jobs[i].err = -ITSA_ERR_OS;
+	}
+	pool_wait(pool);
+	pool_free(pool);
+
+	return jobs;
+}
+
+/* Report any businesses that failed, returns the number that did */
+static int bus_jobs_errors(const struct bus_job *jobs, const char *what)
+{
+	size_t i;
+	int nr_failed = 0;
+
+	for (i = 0; i < itsa_config.nr_businesses; i++) {
+		const struct bus_job *job = &jobs[i];
+
+		if (!job->err)
+			continue;
+
+		printec("Couldn't get %s for #BOLD#%s#RST#. (%s)\n%s\n", what,
+			bus_label(job->bus), itsa_err2str(job->err),
+			job->err_detail ? job->err_detail : "");
+		nr_failed++;
+	}
+
+	return nr_failed;
+}
+
+/*
+ * Speculative prefetching.
+ *
+ * While we're waiting on the user at a prompt, fetch what they're most
+ * likely to want next, so it's there when they answer. This is done
+ * from a separate thread with its own context, at background priority
+ * so it never holds up anything interactive.
+ *
+ * The same is used to overlap things we know we'll need with other
+ * work, at whatever priority is given.
+ *
+ * Items are fetched in order. Taking one that hasn't been fetched yet
+ * cancels the rest (waiting for any request already in flight) and if
+ * it didn't get to it, the caller fetches it as normal, as it also does
+ * if the prefetch failed. Freeing the prefetch cancels anything not
+ * taken.
+ */
+#define PREFETCH_MAX		4
+
+typedef int (*prefetch_fn_t)(struct itsa_ctx *ctx, const char *arg1,
+			     const char *arg2, json_t **result);
+
+struct prefetch {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	struct pool *pool;
+	struct itsa_ctx *ctx;
+	prefetch_fn_t fn;
+
+	struct {
+		const char *arg1;
+		const char *arg2;
+
+		bool done;
+		int err;
+		json_t *result;
+	} items[PREFETCH_MAX];
+	int nr_items;
+	int current;
+	bool finished;
+};
+
+/* For pools whose threads talk to HMRC, each needs its own session */
+static void mtd_thread_init(void *data __unused)
+{
+	if (itsa_mtd_needed())
+		mtd_init(mtd_flags & ~MTD_OPT_GLOBAL_INIT, mtd_cfg);
+}
+
+static void mtd_thread_fini(void *data __unused)
+{
+	if (itsa_mtd_needed())
+		mtd_deinit();
+}
+
+static const struct pool_ops mtd_pool_ops = {
+	.thread_init = mtd_thread_init,
+	.thread_fini = mtd_thread_fini,
+};
+
+static void prefetch_run(void *arg)
+{
+	struct prefetch *pf = arg;
+	int i;
+
+	for (i = 0; i < pf->nr_items; i++) {
+		json_t *result = NULL;
+		int err;
+
+		pthread_mutex_lock(&pf->lock);
+		pf->current = i;
+		pthread_mutex_unlock(&pf->lock);
+
+		err = pf->fn(pf->ctx, pf->items[i].arg1, pf->items[i].arg2,
+			     &result);
+
+		pthread_mutex_lock(&pf->lock);
+		pf->items[i].done = true;
+		pf->items[i].err = err;
+		pf->items[i].result = result;
+		pthread_cond_broadcast(&pf->cond);
+		pthread_mutex_unlock(&pf->lock);
+
+		if (err == -ITSA_ERR_CANCELLED)
+			break;
+	}
+
+	pthread_mutex_lock(&pf->lock);
+	pf->finished = true;
+	pthread_cond_broadcast(&pf->cond);
+	pthread_mutex_unlock(&pf->lock);
+}
+
+static const struct itsa_business *cur_business(void)
+{
+	size_t i;
+
+	for (i = 0; i < itsa_config.nr_businesses; i++) {
+		if (strcmp(itsa_config.businesses[i].bid, BUSINESS_ID) == 0)
+			return &itsa_config.businesses[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Start fetching fn(arg1, arg2) for each of the nr (up to PREFETCH_MAX)
+ * pairs of args. The args must remain valid until the prefetch is freed.
+ *
+ * Returns NULL if it couldn't be started, the other prefetch functions
+ * are fine with that.
+ */
+static struct prefetch *__prefetch_start(prefetch_fn_t fn,
+					 const char * const *arg1,
+					 const char * const *arg2, int nr,
+					 enum itsa_priority prio)
+{
+	const struct itsa_business *bus = cur_business();
+	struct prefetch *pf;
+	int i;
+
+	if (!bus || nr < 1)
+		return NULL;
+
+	pf = calloc(1, sizeof(*pf));
+	if (!pf)
+		return NULL;
+
+	pf->ctx = itsa_ctx_new(bus, NULL, NULL);
+	if (!pf->ctx)
+		goto out_free;
+	itsa_ctx_set_priority(pf->ctx, prio);
+	itsa_ctx_set_deadline(pf->ctx, cmd_deadline);
+
+	pf->fn = fn;
+	pf->nr_items = nr < PREFETCH_MAX ? nr : PREFETCH_MAX;
+	for (i = 0; i < pf->nr_items; i++) {
+		pf->items[i].arg1 = arg1[i];
+		pf->items[i].arg2 = arg2 ? arg2[i] : NULL;
+	}
+	pthread_mutex_init(&pf->lock, NULL);
+	pthread_cond_init(&pf->cond, NULL);
+
+	pf->pool = pool_new(1, &mtd_pool_ops);
+	if (!pf->pool)
+		goto out_destroy;
+	if (pool_submit(pf->pool, prefetch_run, pf) == -1) {
+		pool_free(pf->pool);
+		goto out_destroy;
+	}
+
+	return pf;
+
+out_destroy:
+	pthread_cond_destroy(&pf->cond);
+	pthread_mutex_destroy(&pf->lock);
+	itsa_ctx_free(pf->ctx);
+out_free:
+	free(pf);
+
+	return NULL;
+}
+
+/* As above, at background priority, unless prefetching is disabled */
+static struct prefetch *prefetch_start(prefetch_fn_t fn,
+				       const char * const *arg1,
+				       const char * const *arg2, int nr)
+{
+	if (!prefetching)
+		return NULL;
+
+	return __prefetch_start(fn, arg1, arg2, nr, ITSA_PRIO_BACKGROUND);
+}
+
+/*
+ * Take the result of item idx if it was successfully prefetched, in
+ * which case result should be json_decref()'d. Returns false if it
+ * wasn't and the caller should fetch it itself.
+ */
+static bool prefetch_take(struct prefetch *pf, int idx, json_t **result)
+{
+	bool got;
+
+	if (!pf || idx >= pf->nr_items)
+		return false;
+
+	pthread_mutex_lock(&pf->lock);
+	if (!pf->items[idx].done && !pf->finished) {
+		/* Don't wait on things we don't want */
+		if (pf->current != idx)
+			itsa_ctx_cancel(pf->ctx);
+		while (!pf->items[idx].done && !pf->finished)
+			pthread_cond_wait(&pf->cond, &pf->lock);
+	}
+
+	got = pf->items[idx].done && !pf->items[idx].err;
+	if (got) {
+		*result = pf->items[idx].result;
+		pf->items[idx].result = NULL;
+	}
+	pthread_mutex_unlock(&pf->lock);
+
+	return got;
+}
+
+/* After a failed prefetch_take(), why it failed, 0 if it wasn't tried */
+static int prefetch_err(const struct prefetch *pf, int idx)
+{
+	if (!pf || idx >= pf->nr_items)
+		return 0;
+
+	return pf->items[idx].err;
+}
+
+static void prefetch_free(struct prefetch *pf)
+{
+	int i;
+
+	if (!pf)
+		return;
+
+	itsa_ctx_cancel(pf->ctx);
+	pool_free(pf->pool);
+
+	for (i = 0; i < pf->nr_items; i++)
+		json_decref(pf->items[i].result);
+	pthread_cond_destroy(&pf->cond);
+	pthread_mutex_destroy(&pf->lock);
+	itsa_ctx_free(pf->ctx);
+	free(pf);
+}
+
+struct bus_ob {
+	const struct itsa_business *bus;
+	const struct itsa_obligation *ob;
+};
+
+static int bus_ob_cmp(const void *p1, const void *p2)
+{
+	const struct bus_ob *o1 = p1;
+	const struct bus_ob *o2 = p2;
+	int ret;
+
+	ret = strcmp(o1->ob->start ? o1->ob->start : "",
+		     o2->ob->start ? o2->ob->start : "");
+	if (ret)
+		return ret;
+
+	return strcmp(bus_label(o1->bus), bus_label(o2->bus));
+}
+
+/*
+ * Merge the obligations from all the businesses into a single list,
+ * ordered by period start date.
+ */
+static struct bus_ob *merge_obligations(const struct bus_job *jobs,
+					size_t *nr)
+{
+	struct bus_ob *bobs;
+	size_t total = 0;
+	size_t i;
+
+	for (i = 0; i < itsa_config.nr_businesses; i++)
+		total += jobs[i].nr_obs;
+
+	*nr = 0;
+	bobs = calloc(total + 1, sizeof(struct bus_ob));
+	if (!bobs)
+		return NULL;
+
+	for (i = 0; i < itsa_config.nr_businesses; i++) {
+		size_t j;
+
+		for (j = 0; j < jobs[i].nr_obs; j++) {
+			bobs[*nr].bus = jobs[i].bus;
+			bobs[*nr].ob = &jobs[i].obs[j];
+			(*nr)++;
+		}
+	}
+	qsort(bobs, *nr, sizeof(struct bus_ob), bus_ob_cmp);
+
+	return bobs;
+}
+
+static int bus_list_period_obs(struct itsa_ctx *ctx, struct bus_job *job)
+{
+	return itsa_list_obligations(ctx, ITSA_OB_PERIOD, job->from, job->to,
+				     &job->obs, &job->nr_obs);
+}
+
+static int bus_list_eops_obs(struct itsa_ctx *ctx, struct bus_job *job)
+{
+	return itsa_list_obligations(ctx, ITSA_OB_EOPS, job->from, job->to,
+				     &job->obs, &job->nr_obs);
+}
+
+static int bus_get_biss_summary(struct itsa_ctx *ctx, struct bus_job *job)
+{
+	return itsa_get_biss_summary(ctx, job->tax_year, &job->result);
+}
+
+static void output_obligation(const char *type,
+			      const struct itsa_business *bus,
+			      const struct itsa_obligation *ob, bool met)
+{
+	char status[2] = { ob->status, '\0' };
+
+	output_record(type, json_pack("{s:s, s:s, s:s, s:s, s:s?, s:s, s:b}",
+				      "business", bus ? bus->bid : BUSINESS_ID,
+				      "start", ob->start, "end", ob->end,
+				      "due", ob->due,
+				      "received", ob->received,
+				      "status", status, "met", met));
+}
+
+static int get_eop_obligations_all(const char *from, const char *to)
+{
+	const struct bus_job tmpl = {
+		.fn = bus_list_eops_obs,
+		.from = from,
+		.to = to
+	};
+	struct bus_job *jobs;
+	struct bus_ob *bobs;
+	size_t nr_bobs;
+	size_t i;
+	int ret = 0;
+
+	jobs = run_all_businesses(&tmpl);
+	if (!jobs) {
+		printec("Couldn't query businesses\n");
+		return -1;
+	}
+	if (bus_jobs_errors(jobs, "End of Period Statement(s)"))
+		ret = -1;
+
+	bobs = merge_obligations(jobs, &nr_bobs);
+	if (!bobs) {
+		free_bus_jobs(jobs);
+		return -1;
+	}
+
+	if (output_structured()) {
+		for (i = 0; i < nr_bobs; i++)
+			output_obligation("eops-obligation", bobs[i].bus,
+					  bobs[i].ob, bobs[i].ob->status == 'F');
+		goto out_free;
+	}
+
+	printsc("End of Period Statement Obligations for all businesses\n");
+
+	printc("#CHARC#  %-16s %12s %11s %13s %15s %7s#RST#\n",
+	       "business", "start", "end", "due", "status", "@" );
+	printc("#CHARC#"
+	       " ------------------------------------------------------------"
+	       "----------------------------#RST#\n");
+	for (i = 0; i < nr_bobs; i++) {
+		const struct itsa_obligation *ob = bobs[i].ob;
+		bool met = ob->status == 'F';
+
+		printc("%s  %-16.16s %15s %12s %13s %9c%s"
+		       "#HI_GREEN#%15s#RST#\n",
+		       get_period_color(ob->start, ob->end, ob->due, met),
+		       bus_label(bobs[i].bus), ob->start, ob->end, ob->due,
+		       ob->status, "#RST#",
+		       met && ob->received ? ob->received : "");
+	}
+
+out_free:
+	free(bobs);
+	free_bus_jobs(jobs);
+
+	return ret;
+}
+
+static int get_eop_obligations(int argc, char *argv[])
+{
+	struct itsa_obligation *obs;
+	size_t nr_obs;
+	size_t i;
+	int err;
+
+	if (argc > 2 && argc < 4) {
+		disp_usage();
+		return -1;
+	}
+
+	if (opts.all_businesses)
+		return get_eop_obligations_all(argc > 2 ? argv[2] : NULL,
+					       argc > 2 ? argv[3] : NULL);
+
+	err = itsa_list_obligations(ITSA_CTX, ITSA_OB_EOPS,
+				    argc > 2 ? argv[2] : NULL,
+				    argc > 2 ? argv[3] : NULL, &obs, &nr_obs);
 	if (err) {
-		printec("Couldn't get BISS Self-Employment Annual Summary. "
-			"(%s)\n%s\n", mtd_err2str(err), jbuf);
+		printec("Couldn't get End of Period Statement(s). (%s)\n%s\n",
+			itsa_err2str(err), itsa_err_detail(ITSA_CTX));
+		return -1;
+	}
+
+	if (output_structured()) {
+		for (i = 0; i < nr_obs; i++)
+			output_obligation("eops-obligation", NULL, &obs[i],
+					  obs[i].status == 'F');
 		goto out_free;
 	}
 
+	printsc("End of Period Statement Obligations\n");
+
+	printc("#CHARC#  %12s %11s %13s %15s %7s#RST#\n",
+	       "start", "end", "due", "status", "@" );
+	printc("#CHARC#"
+	       " ------------------------------------------------------------"
+	       "---------#RST#\n");
+	for (i = 0; i < nr_obs; i++) {
+		const struct itsa_obligation *ob = &obs[i];
+		bool met = ob->status == 'F';
+
+		printc("%s  %15s %12s %13s %9c%s#HI_GREEN#%15s#RST#\n",
+		       get_period_color(ob->start, ob->end, ob->due, met),
+		       ob->start, ob->end, ob->due, ob->status, "#RST#",
+		       met && ob->received ? ob->received : "");
+	}
+
+out_free:
+	itsa_obligations_free(obs, nr_obs);
+
+	return 0;
+}
+
+static void biss_line(const struct itsa_biss *biss, int field,
+		      const char *name, double value)
+{
+	if (!((biss->present >> field) & 1))
+		return;
+	printc("#CHARC#%23s :#RST# %.2f\n", name, value);
+}
+
+static void show_biss_se_summary(const char *tax_year, json_t *result)
+{
+	struct itsa_biss biss;
+
+	if (output_structured()) {
+		output_record("biss", json_pack("{s:s, s:s, s:O}",
+						"business", BUSINESS_ID,
+						"tax_year", tax_year,
+						"summary", result));
+		json_decref(result);
+		return;
+	}
+
+	schema_decode(biss, result, &biss);
+	json_decref(result);
+
 	printsc("BISS Self-Employment Annual Summary for #BOLD#%s#RST# "
 		"#CHARC#/#RST# #BOLD#%s#RST#\n", BUSINESS_ID, tax_year);
 
-	result = get_result_json(jbuf);
-
 	printc("#BOLD# Total#RST#:-\n");
-	obj = json_object_get(result, "total");
-	json_object_foreach(obj, key, val)
-		printc("#CHARC#%23s :#RST# %.2f\n", key,
-		       json_number_value(val));
+	biss_line(&biss, SCHEMA_F_biss_income, "income", biss.income);
+	biss_line(&biss, SCHEMA_F_biss_expenses, "expenses", biss.expenses);
+	biss_line(&biss, SCHEMA_F_biss_additions, "additions",
+		  biss.additions);
+	biss_line(&biss, SCHEMA_F_biss_deductions, "deductions",
+		  biss.deductions);
 
 	printf("\n");
-	obj = json_object_get(result, "accountingAdjustments");
 	printc("#CHARC#%23s :#RST# %.2f\n", "accountingAdjustments",
-	       json_number_value(obj));
+	       biss.accounting_adjustments);
 
 	printf("\n");
-	obj = json_object_get(result, "profit");
-	if (!obj) {
-		obj = json_object_get(result, "loss");
-		plcolor = "#RED#";
-		pltext = "Loss";
+	if (SCHEMA_HAS(biss, &biss, loss_net)) {
+		printc("#RED# Loss#RST#:-\n");
+		biss_line(&biss, SCHEMA_F_biss_loss_net, "net",
+			  biss.loss_net);
+		biss_line(&biss, SCHEMA_F_biss_loss_taxable, "taxable",
+			  biss.loss_taxable);
+	} else {
+		printc("#GREEN# Profit#RST#:-\n");
+		biss_line(&biss, SCHEMA_F_biss_profit_net, "net",
+			  biss.profit_net);
+		biss_line(&biss, SCHEMA_F_biss_profit_taxable, "taxable",
+			  biss.profit_taxable);
 	}
-	printc("%s %s#RST#:-\n", plcolor, pltext);
-	json_object_foreach(obj, key, val)
-		printc("#CHARC#%23s :#RST# %.2f\n", key,
-		       json_number_value(val));
 
-	json_decref(result);
+	schema_free(biss, &biss);
+}
 
-	ret = 0;
+static int biss_se_summary(const char *tax_year)
+{
+	json_t *result;
+	int err;
+
+	err = itsa_get_biss_summary(ITSA_CTX, tax_year, &result);
+	if (err) {
+		printec("Couldn't get BISS Self-Employment Annual Summary. "
+			"(%s)\n%s\n", itsa_err2str(err),
+			itsa_err_detail(ITSA_CTX));
+		return -1;
+	}
+
+	show_biss_se_summary(tax_year, result);
+
+	return 0;
+}
+
+static int prefetch_biss(struct itsa_ctx *ctx, const char *tax_year,
+			 const char *unused __unused, json_t **result)
+{
+	return itsa_get_biss_summary(ctx, tax_year, result);
+}
+
+static int biss_se_summary_all(const char *tax_year)
+{
+	const struct bus_job tmpl = {
+		.fn = bus_get_biss_summary,
+		.tax_year = tax_year
+	};
+	struct bus_job *jobs;
+	double tincome = 0.0;
+	double texpenses = 0.0;
+	double tnet = 0.0;
+	size_t i;
+	int ret = 0;
+
+	jobs = run_all_businesses(&tmpl);
+	if (!jobs) {
+		printec("Couldn't query businesses\n");
+		return -1;
+	}
+	if (bus_jobs_errors(jobs, "BISS Self-Employment Annual Summary"))
+		ret = -1;
+
+	if (output_structured()) {
+		for (i = 0; i < itsa_config.nr_businesses; i++) {
+			const struct bus_job *job = &jobs[i];
+
+			if (job->err)
+				continue;
+			output_record("biss", json_pack(
+				"{s:s, s:s, s:O}", "business", job->bus->bid,
+				"tax_year", tax_year, "summary", job->result));
+		}
+		goto out_free;
+	}
+
+	printsc("BISS Self-Employment Annual Summary for all businesses "
+		"#CHARC#/#RST# #BOLD#%s#RST#\n", tax_year);
+
+	printc("#CHARC#  %-16s %14s %14s %14s %14s#RST#\n",
+	       "business", "income", "expenses", "adjustments", "net");
+	printc("#CHARC#"
+	       " ------------------------------------------------------------"
+	       "--------------#RST#\n");
+	for (i = 0; i < itsa_config.nr_businesses; i++) {
+		const struct bus_job *job = &jobs[i];
+		struct itsa_biss biss;
+		double net;
+
+		if (job->err)
+			continue;
+
+		schema_decode(biss, job->result, &biss);
+		if (SCHEMA_HAS(biss, &biss, profit_net))
+			net = biss.profit_net;
+		else
+			net = -biss.loss_net;
+
+		printc("  %-16.16s %14.2f %14.2f %14.2f %s%14.2f#RST#\n",
+		       bus_label(job->bus), biss.income, biss.expenses,
+		       biss.accounting_adjustments,
+		       net < 0.0 ? "#RED#" : "#GREEN#", net);
+
+		tincome += biss.income;
+		texpenses += biss.expenses;
+		tnet += net;
+
+		schema_free(biss, &biss);
+	}
+	printc("#CHARC#"
+	       " ------------------------------------------------------------"
+	       "--------------#RST#\n");
+	printc("  #BOLD#%-16s#RST# %14.2f %14.2f %14s %s%14.2f#RST#\n",
+	       "Total", tincome, texpenses, "",
+	       tnet < 0.0 ? "#RED#" : "#GREEN#", tnet);
 
 out_free:
-	free(jbuf);
+	free_bus_jobs(jobs);
 
 	return ret;
 }
 
+static int view_biss_summary(int argc, char *argv[])
+{
+	if (argc < 3) {
+		disp_usage();
+		return -1;
+	}
+
+	if (opts.all_businesses)
+		return biss_se_summary_all(argv[2]);
+
+	return biss_se_summary(argv[2]);
+}
+
 static const struct {
 	const char *exempt_code;
 	const char *desc;
@@ -848,7 +1327,19 @@ static const struct {
 	{ "006", "Under 16" }
 };
 
-static bool print_c4nic_excempt_type(const char *key, json_t *value)
+static const char *c4nic_exempt_desc(const char *code)
+{
+	int idx = code ? atoi(code) : 0;
+
+	if (idx < 1 || idx >= (int)(sizeof(class4_nic_ecode_map) /
+				    sizeof(class4_nic_ecode_map[0])))
+		return "Unknown";
+
+	return class4_nic_ecode_map[idx].desc;
+}
+
+static bool c4nic_excempt_type(const char *key, const json_t *value,
+			       char *buf, size_t size)
 {
 	const char *code;
 
@@ -856,70 +1347,57 @@ static bool print_c4nic_excempt_type(const char *key, json_t *value)
 		return false;
 
 	code = json_string_value(value);
-	printc("#CHARC# %*s :#RST# %s (%s)\n", JKEY_FW, key, code,
-	       class4_nic_ecode_map[atoi(code)].desc);
+	snprintf(buf, size, "%s (%s)", code ? code : "",
+		 c4nic_exempt_desc(code));
 
 	return true;
 }
 
 static int disp_annual_summary(json_t *root)
 {
-	const char *bread_crumb[MAX_BREAD_CRUMB_LVL + 1] = { NULL };
+	struct itsa_annual_summary as;
 
 	if (!root)
 		return -1;
 
 	JKEY_FW = 36;
-	print_json_tree(root, bread_crumb, 0, print_c4nic_excempt_type);
+	render_json_tree(stdout, root, JKEY_FW, c4nic_excempt_type, NULL);
+
+	schema_decode(annual_summary, root, &as);
+	if (SCHEMA_HAS(annual_summary, &as, class4_exempt)) {
+		printf("\n");
+		if (as.class4_exempt)
+			printic("Class 4 NICs : #BOLD#exempt#RST#, %s\n",
+				c4nic_exempt_desc(as.class4_exemption_code));
+		else
+			printic("Class 4 NICs : not exempt\n");
+	}
+	schema_free(annual_summary, &as);
 
 	return 0;
 }
 
 static int trigger_calculation(const char *tax_year)
 {
-	json_t *result;
-	json_t *cid_obj;
-	ac_jsonw_t *json;
-	char *jbuf;
-	const char *cid;
-	int ret = -1;
+	char *cid;
 	int err;
 
-	json = ac_jsonw_init();
-
-	ac_jsonw_add_str(json, "taxYear", tax_year);
-	ac_jsonw_end(json);
-
-	err = mtd_ic_trigger_calculation(tax_year, NULL, &jbuf);
+	err = itsa_trigger_calculation(ITSA_CTX, tax_year, false, &cid);
 	if (err) {
 		printec("Couldn't trigger calculation. (%s)\n%s\n",
-			mtd_err2str(err), jbuf);
-		goto out_free;
+			itsa_err2str(err), itsa_err_detail(ITSA_CTX));
+		return -1;
 	}
 
 	printsc("Triggered calculation for #BOLD#%s#RST#\n", tax_year);
 
-	result = get_result_json(jbuf);
-	cid_obj = json_object_get(result, "id");
-	cid = json_string_value(cid_obj);
-
 	err = get_calculation(tax_year, cid);
-	if (err) {
+	if (err)
 		printec("Couldn't get calculation for %s/%s.\n", cid,
 			tax_year);
-		goto out_free_json;
-	}
-
-	ret = 0;
-
-out_free_json:
-	json_decref(result);
-
-out_free:
-	ac_jsonw_free(json);
-	free(jbuf);
+	free(cid);
 
-	return ret;
+	return err;
 }
 
 static const char *get_editor(void)
@@ -935,10 +1413,39 @@ static const char *get_editor(void)
 }
 
 extern char **environ;
-static int annual_summary(const char *tax_year)
+
+/* Like prompts, time spent in the editor doesn't count to the deadline */
+static void run_editor(const char *path)
+{
+	const char *args[3] = { NULL };
+	int64_t tstart = itsa_trace_begin();
+	int child_pid;
+	int status;
+
+	args[0] = get_editor();
+	args[1] = path;
+
+	if (ITSA_CTX)
+		itsa_ctx_pause_deadline(ITSA_CTX);
+	posix_spawnp(&child_pid, args[0], NULL, NULL, (char * const *)args,
+		     environ);
+	waitpid(child_pid, &status, 0);
+	if (ITSA_CTX)
+		itsa_ctx_resume_deadline(ITSA_CTX);
+	itsa_trace_end("user", "editor", tstart);
+}
+
+/*
+ * If changed is given, it's set to whether what was submitted differs
+ * from what was originally retrieved.
+ *
+ * If cid is given, the calculation that's triggered after submitting is
+ * left for the caller to get, otherwise it's displayed here.
+ */
+static int annual_summary(const char *tax_year, bool *changed, char **cid)
 {
 	json_t *result;
-	char *jbuf;
+	json_t *orig;
 	char *s;
 	char tpath[PATH_MAX];
 	char submit[3] = "\0";
@@ -946,14 +1453,15 @@ static int annual_summary(const char *tax_year)
 	int ret = -1;
 	int err;
 
-	err = mtd_sa_se_get_annual_summary(BUSINESS_ID, tax_year, &jbuf);
-	if (err && mtd_http_status_code(jbuf) != MTD_HTTP_NOT_FOUND) {
+	err = itsa_get_annual_summary(ITSA_CTX, tax_year, &result);
+	if (err) {
 		printec("Couldn't get Annual Summary. (%s)\n%s\n",
-			mtd_err2str(err), jbuf);
-		goto out_free;
+			itsa_err2str(err), itsa_err_detail(ITSA_CTX));
+		return -1;
 	}
 
 	printsc("Annual Summary for #BOLD#%s#RST#\n", tax_year);
+	orig = json_deep_copy(result);
 
 	snprintf(tpath, sizeof(tpath), "/tmp/.itsa_annual_summary.tmp.%d.json",
 		 getpid());
@@ -961,63 +1469,72 @@ static int annual_summary(const char *tax_year)
 	if (tmpfd == -1) {
 		printec("Couldn't open %s in %s\n", tpath, __func__);
 		perror("open");
-		goto out_free;
+		goto out_free_json;
 	}
 
-	result = get_result_json(jbuf);
-	if (json_is_null(result))
-		result = json_pack("{}");
-
 again:
 	err = disp_annual_summary(result);
 	if (err)
-		goto out_free_json;
+		goto out_close;
 	json_dumpfd(result, tmpfd, JSON_INDENT(4));
 	lseek(tmpfd, 0, SEEK_SET);
 	printf("\n");
 	printcc("Submit (s), Edit (e), Quit (Q)> ");
-	s = fgets(submit, sizeof(submit), stdin);
+	s = prompt_input(submit, sizeof(submit));
 	if (!s)
 		goto again;
 
 	switch (*submit) {
 	case 's':
-	case 'S': {
-		struct mtd_dsrc_ctx dsctx = {
-			.data_src.fd = tmpfd,
-			.src_type = MTD_DATA_SRC_FD
-		};
-
-		free(jbuf);
-		err = mtd_sa_se_update_annual_summary(&dsctx, BUSINESS_ID,
-						      tax_year, &jbuf);
-		if (err) {
+	case 'S':
+		err = itsa_update_annual_summary(ITSA_CTX, tax_year, result);
+		if (err == ITSA_UNCHANGED) {
+			printic("Annual Summary for #BOLD#%s#RST# is unchanged "
+				"since last submitted, skipping (--force to "
+				"submit anyway)\n", tax_year);
+			if (changed)
+				*changed = false;
+			ret = 0;
+			break;
+		} else if (err == ITSA_QUEUED) {
+			printic("Queued Annual Summary for #BOLD#%s#RST#, "
+				"send it later with #BOLD#flush-queue#RST#\n",
+				tax_year);
+			ret = 0;
+			break;
+		} else if (err) {
 			printec("Couldn't update Annual Summary. (%s)\n%s\n",
-				mtd_err2str(err), jbuf);
-			goto out_free_json;
+				itsa_err2str(err), itsa_err_detail(ITSA_CTX));
+			goto out_close;
 		}
 
 		printsc("Updated Annual Summary for #BOLD#%s#RST#\n",
 			tax_year);
-
-		err = trigger_calculation(tax_year);
-		if (err)
-			goto out_free_json;
+		if (changed)
+			*changed = !json_equal(orig, result);
+
+		if (cid) {
+			err = itsa_trigger_calculation(ITSA_CTX, tax_year,
+						       false, cid);
+			if (err) {
+				printec("Couldn't trigger calculation. "
+					"(%s)\n%s\n", itsa_err2str(err),
+					itsa_err_detail(ITSA_CTX));
+				goto out_close;
+			}
+			printsc("Triggered calculation for #BOLD#%s#RST#\n",
+				tax_year);
+		} else {
+			err = trigger_calculation(tax_year);
+			if (err)
+				goto out_close;
+		}
 
 		ret = 0;
 		break;
-	}
 	case 'e':
 	case 'E': {
-		const char *args[3] = { NULL };
-		int child_pid;
-		int status;
-
-		args[0] = get_editor();
-		args[1] = tpath;
-		posix_spawnp(&child_pid, args[0], NULL, NULL,
-			     (char * const *)args, environ);
-		waitpid(child_pid, &status, 0);
+		run_editor(tpath);
 
 		json_decref(result);
 		result = json_loadfd(tmpfd, 0, NULL);
@@ -1025,7 +1542,7 @@ static int annual_summary(const char *tax_year)
 		if (err) {
 			printec("ftruncate failed in %s\n", __func__);
 			perror("ftruncate");
-			goto out_free_json;
+			goto out_close;
 		}
 		lseek(tmpfd, 0, SEEK_SET);
 
@@ -1036,25 +1553,101 @@ static int annual_summary(const char *tax_year)
 		break;
 	}
 
-out_free_json:
-	json_decref(result);
-
+out_close:
 	close(tmpfd);
 	unlink(tpath);
 
-out_free:
-	free(jbuf);
+out_free_json:
+	json_decref(result);
+	json_decref(orig);
 
 	return ret;
 }
 
+/*
+ * Look for the End of Period Statement obligation for start/end, giving
+ * its due & received dates and whether it's been met.
+ */
+static int prefetch_eops_ob(struct itsa_ctx *ctx, const char *start,
+			    const char *end, json_t **result)
+{
+	struct itsa_obligation *obs;
+	size_t nr_obs;
+	size_t i;
+	int err;
+
+	err = itsa_list_obligations(ctx, ITSA_OB_EOPS, start, end, &obs,
+				    &nr_obs);
+	if (err)
+		return err;
+
+	err = -ITSA_ERR_NOT_FOUND;
+	for (i = 0; i < nr_obs; i++) {
+		const struct itsa_obligation *ob = &obs[i];
+
+		if (strcmp(ob->start, start) != 0 || strcmp(ob->end, end) != 0)
+			continue;
+
+		*result = json_pack("{s:s?, s:s?, s:b}", "due", ob->due,
+				    "received", ob->received,
+				    "met", ob->status == 'F');
+		err = 0;
+		break;
+	}
+
+	itsa_obligations_free(obs, nr_obs);
+
+	return err;
+}
+
+static void check_eops_ob(struct prefetch *pf, const char *start,
+			  const char *end)
+{
+	json_t *ob;
+
+	if (!prefetch_take(pf, 0, &ob)) {
+		if (prefetch_err(pf, 0) == -ITSA_ERR_NOT_FOUND)
+			printic("No End of Period Statement obligation found "
+				"for #BOLD#%s#RST# to #BOLD#%s#RST#\n", start,
+				end);
+		return;
+	}
+
+	if (json_is_true(json_object_get(ob, "met"))) {
+		const char *received;
+
+		received = json_string_value(json_object_get(ob, "received"));
+		printic("End of Period Statement for #BOLD#%s#RST# to "
+			"#BOLD#%s#RST# already received on #BOLD#%s#RST#\n",
+			start, end, received ? received : "?");
+	}
+	json_decref(ob);
+}
+
+/*
+ * The stages here that don't depend on each other are overlapped.
+ *
+ * While the annual summary is being looked at/edited, the BISS summary
+ * and the EOP obligation are fetched. Once the annual summary has been
+ * submitted, the calculation is waited on while the BISS summary is
+ * displayed.
+ */
 static int submit_eop_statement(int argc, char *argv[])
 {
 	char *start;
 	char *end;
 	char *s;
+	char *cid = NULL;
 	char submit[3];
 	char tax_year[TAX_YEAR_SZ + 1];
+	const char *pf_tyear[1] = { tax_year };
+	const char *pf_cid[1];
+	struct prefetch *pf_biss;
+	struct prefetch *pf_ob;
+	struct prefetch *pf_calc = NULL;
+	json_t *result;
+	bool changed = true;
+	int ret = -1;
 	int err;
 
 	if (argc < 4) {
@@ -1070,25 +1663,72 @@ static int submit_eop_statement(int argc, char *argv[])
 	memcpy(tax_year + 5, end + 2, 2);
 	tax_year[TAX_YEAR_SZ] = '\0';
 
-	err = annual_summary(tax_year);
-	if (err)
-		return -1;
+	/*
+	 * The BISS is derived partly from the annual summary, so if
+	 * that gets changed, what we prefetched is stale.
+	 */
+	pf_biss = prefetch_start(prefetch_biss, pf_tyear, NULL, 1);
+	pf_ob = prefetch_start(prefetch_eops_ob, (const char **)&start,
+			       (const char **)&end, 1);
 
-	err = biss_se_summary(tax_year);
+	err = annual_summary(tax_year, &changed, &cid);
 	if (err)
-		return -1;
+		goto out_free;
+
+	/* No calculation if the annual summary was skipped or queued */
+	if (cid) {
+		pf_cid[0] = cid;
+		pf_calc = __prefetch_start(itsa_get_calculation, pf_tyear,
+					   pf_cid, 1, ITSA_PRIO_INTERACTIVE);
+		if (pf_calc)
+			printic("Waiting on calculation in the background\n");
+	}
+
+	if (!changed && prefetch_take(pf_biss, 0, &result)) {
+		show_biss_se_summary(tax_year, result);
+	} else {
+		err = biss_se_summary(tax_year);
+		if (err)
+			goto out_free;
+	}
+
+	printf("\n");
+	if (prefetch_take(pf_calc, 0, &result)) {
+		show_calculation(tax_year, result);
+	} else if (pf_calc) {
+		err = prefetch_err(pf_calc, 0);
+		printec("Couldn't get calculation for %s/%s. (%s)\n", cid,
+			tax_year, itsa_err2str(err));
+		goto out_free;
+	} else if (cid) {
+		err = get_calculation(tax_year, cid);
+		if (err)
+			goto out_free;
+	}
 
+	printf("\n");
+	check_eops_ob(pf_ob, start, end);
 	printc("\n" EOP_DECLARATION "\n", tax_year);
 	printcc("(y/N)> ");
-	s = fgets(submit, sizeof(submit), stdin);
-	if (!s || (*submit != 'y' && *submit != 'Y'))
-		return 0;
+	s = prompt_input(submit, sizeof(submit));
+	if (!s || (*submit != 'y' && *submit != 'Y')) {
+		ret = 0;
+		goto out_free;
+	}
 
 	err = submit_eop_obligation(start, end);
 	if (err)
-		return -1;
+		goto out_free;
 
-	return 0;
+	ret = 0;
+
+out_free:
+	prefetch_free(pf_calc);
+	prefetch_free(pf_ob);
+	prefetch_free(pf_biss);
+	free(cid);
+
+	return ret;
 }
 
 static int update_annual_summary(int argc, char *argv[])
@@ -1098,107 +1738,100 @@ static int update_annual_summary(int argc, char *argv[])
 		return -1;
 	}
 
-	return annual_summary(argv[2]);
+	return annual_summary(argv[2], NULL, NULL);
 }
 
-static int set_period(const char *start, const char *end, long income,
-		      long expenses, enum period_action action)
+static int set_period(const struct itsa_period *period,
+		      enum itsa_period_action action)
 {
-	ac_jsonw_t *json;
-	char *jbuf;
-	struct mtd_dsrc_ctx dsctx;
 	int err;
-	int ret = 0;
-
-	json = ac_jsonw_init();
-
-	ac_jsonw_add_str(json, "from", start);
-	ac_jsonw_add_str(json, "to", end);
 
-	ac_jsonw_add_object(json, "incomes");
-	ac_jsonw_add_object(json, "turnover");
-	ac_jsonw_add_real(json, "amount", income / 100.0f, 2);
-	ac_jsonw_end_object(json);
-	ac_jsonw_end_object(json);
+	err = itsa_set_period(ITSA_CTX, period, action);
+	if (err == ITSA_UNCHANGED) {
+		printf("\n");
+		printic("Period #BOLD#%s#RST# to #BOLD#%s#RST# is unchanged "
+			"since last submitted, skipping (--force to submit "
+			"anyway)\n", period->start, period->end);
+		return err;
+	} else if (err == ITSA_QUEUED) {
+		printf("\n");
+		printic("Queued period #BOLD#%s#RST# to #BOLD#%s#RST#, send it "
+			"later with #BOLD#flush-queue#RST#\n", period->start,
+			period->end);
+		return err;
+	} else if (err) {
+		printec("Failed to %s period. (%s)\n%s\n",
+			action == ITSA_PERIOD_CREATE ? "create" : "update",
+			itsa_err2str(err), itsa_err_detail(ITSA_CTX));
+		return -1;
+	}
 
-	ac_jsonw_add_real(json, "consolidatedExpenses", expenses / 100.0f, 2);
+	printf("\n");
+	printsc("%s period for #BOLD#%s#RST# to #BOLD#%s#RST#\n",
+		action == ITSA_PERIOD_CREATE ? "Created" : "Updated",
+		period->start, period->end);
 
-	ac_jsonw_end(json);
+	return 0;
+}
 
-	dsctx.data_src.buf = ac_jsonw_get(json);
-	dsctx.data_len = -1;
-	dsctx.src_type = MTD_DATA_SRC_BUF;
+/*
+ * Get the list of calculations from HMRC or, failing that, whatever
+ * calculations we have stored locally.
+ */
+static int list_calcs(const char *tax_year, struct itsa_calculation **calcs,
+		      size_t *nr)
+{
+	int err;
 
-	if (action == PERIOD_CREATE) {
-		err = mtd_sa_se_create_period(&dsctx, BUSINESS_ID, &jbuf);
-	} else {
-		char period_id[32];
+	err = itsa_list_calculations(ITSA_CTX, tax_year, calcs, nr);
+	if (!err)
+		return 0;
 
-		snprintf(period_id, sizeof(period_id), "%s_%s", start, end);
-		err = mtd_sa_se_update_period(&dsctx, BUSINESS_ID, period_id,
-					      &jbuf);
-	}
-	if (err) {
-		printec("Failed to %s period. (%s)\n%s\n",
-			action == PERIOD_CREATE ? "create" : "update",
-			mtd_err2str(err), jbuf);
-		ret = -1;
-	} else {
-		printf("\n");
-		printsc("%s period for #BOLD#%s#RST# to #BOLD#%s#RST#\n",
-		       action == PERIOD_CREATE ? "Created" : "Updated",
-		       start, end);
+	if (itsa_list_stored_calculations(tax_year, calcs, nr) == 0 &&
+	    *nr > 0) {
+		printic("Couldn't get calculations list. (%s)\n",
+			itsa_err2str(err));
+		printic("Showing the #BOLD#%zu#RST# stored calculation%s\n",
+			*nr, *nr == 1 ? "" : "s");
+		return 0;
 	}
 
-	ac_jsonw_free(json);
-	free(jbuf);
+	printec("Couldn't get calculations list. (%s)\n%s\n",
+		itsa_err2str(err), itsa_err_detail(ITSA_CTX));
 
-	return ret;
+	return err;
 }
 
 static int view_end_of_year_estimate(void)
 {
-	json_t *result;
-	json_t *obs;
-	char *jbuf;
+	struct itsa_calculation *calcs;
 	const char *cid = NULL;
 	char tyear[TAX_YEAR_SZ + 1];
-	char qs[20] = "\0";
 	size_t nr_calcs;
-	int err;
+	size_t i;
 	int ret = -1;
+	int err;
 
-	get_tax_year(NULL, tyear);
+	itsa_tax_year(NULL, tyear);
 
-	snprintf(qs, sizeof(qs), "?taxYear=%s", tyear);
-	err = mtd_ic_list_calculations(qs, &jbuf);
-	if (err) {
-		printec("Couldn't get calculations list. (%s)\n%s\n",
-			mtd_err2str(err), jbuf);
-		goto out_free_buf;
-	}
+	err = list_calcs(tyear, &calcs, &nr_calcs);
+	if (err)
+		return -1;
 
-	result = get_result_json(jbuf);
-	obs = json_object_get(result, "calculations");
-	nr_calcs = json_array_size(obs);
-	while (nr_calcs--) {
-		json_t *calc = json_array_get(obs, nr_calcs);
-		json_t *type = json_object_get(calc, "calculationType");
-		json_t *cid_obj;
+	for (i = nr_calcs; i > 0; i--) {
+		const struct itsa_calculation *calc = &calcs[i - 1];
 
-		if (strcmp(json_string_value(type), "inYear") != 0)
+		if (!calc->type || strcmp(calc->type, "inYear") != 0)
 			continue;
 
-		cid_obj = json_object_get(calc, "calculationId");
-		cid = json_string_value(cid_obj);
-
+		cid = calc->id;
 		break;
 	}
 
 	if (!cid) {
 		printec("No inYear calculation found for #BOLD#%s#RST#\n",
 			tyear);
-		goto out_free_json;
+		goto out_free;
 	}
 
 	printsc("Found inYear calculation for #BOLD#%s#RST#\n", tyear);
@@ -1206,133 +1839,511 @@ static int view_end_of_year_estimate(void)
 
 	ret = 0;
 
-out_free_json:
-	json_decref(result);
-
-out_free_buf:
-	free(jbuf);
+out_free:
+	itsa_calculations_free(calcs, nr_calcs);
 
 	return ret;
 }
 
-struct calc_id {
-	const char *id;
-	const char *tax_year;
-};
+/* Use HMRC's figure from calc, if it has it */
+static void est_hmrc(const struct itsa_calc *calc, int field, double val)
+{
+	if (calc && field >= 0 && ((calc->present >> field) & 1))
+		printf(" %12.2f", val);
+	else
+		printc(" #CHARC#%12s#RST#", "-");
+}
 
-static void free_calc_id(void *data)
+static void est_line(const char *name, long to_date, long year,
+		     const struct itsa_calc *calc, int field, double val,
+		     int eoy_field, double eoy_val)
 {
-	struct calc_id *cid = data;
+	printc("#CHARC#%23s :#RST# %12.2f", name, to_date / 100.0);
+	est_hmrc(calc, field, val);
+	printf(" %12.2f", year / 100.0);
+	est_hmrc(calc, eoy_field, eoy_val);
+	printf("\n");
+}
 
-	if (!cid)
-		return;
+static json_t *est_json(const struct tax_estimate *est)
+{
+	return json_pack("{s:f, s:f, s:f, s:f, s:f, s:f, s:f}",
+			 "profit", est->profit / 100.0,
+			 "personal_allowance", est->personal_allowance / 100.0,
+			 "taxable_income", est->taxable / 100.0,
+			 "income_tax", est->income_tax / 100.0,
+			 "class2_nics", est->class2 / 100.0,
+			 "class4_nics", est->class4 / 100.0,
+			 "total", est->total / 100.0);
+}
 
-	free((char *)cid->id);
-	free((char *)cid->tax_year);
-	free(cid);
+static json_t *est_hmrc_num(const struct itsa_calc *calc, int field,
+			    double val)
+{
+	return (calc->present >> field) & 1 ? json_real(val) : NULL;
+}
+
+static json_t *est_hmrc_json(const struct itsa_calc *calc)
+{
+	return json_pack("{s:s?, s:s?, s:o?, s:o?, s:o?, s:o?, s:o?, s:o?}",
+			 "calculation_id", calc->calculation_id,
+			 "timestamp", calc->timestamp,
+			 "total_income",
+			 est_hmrc_num(calc, SCHEMA_F_calc_total_income,
+				      calc->total_income),
+			 "income_tax",
+			 est_hmrc_num(calc, SCHEMA_F_calc_income_tax,
+				      calc->income_tax),
+			 "class2_nics",
+			 est_hmrc_num(calc, SCHEMA_F_calc_class2_nics,
+				      calc->class2_nics),
+			 "class4_nics",
+			 est_hmrc_num(calc, SCHEMA_F_calc_class4_nics,
+				      calc->class4_nics),
+			 "total_due",
+			 est_hmrc_num(calc, SCHEMA_F_calc_total_due,
+				      calc->total_due),
+			 "eoy_liability",
+			 est_hmrc_num(calc, SCHEMA_F_calc_eoy_liability,
+				      calc->eoy_liability));
+}
+
+/*
+ * How far through tax_year we are, 0.0 if it hasn't started, 1.0 if
+ * it's over.
+ */
+static double tax_year_elapsed(const char *tax_year)
+{
+	struct tm tm = { .tm_mon = 3, .tm_mday = 6, .tm_isdst = -1 };
+	time_t now = itsa_time();
+	time_t start;
+	time_t end;
+
+	tm.tm_year = atoi(tax_year) - 1900;
+	start = mktime(&tm);
+	tm.tm_year++;
+	tm.tm_isdst = -1;
+	end = mktime(&tm);
+
+	if (now <= start)
+		return 0.0;
+	if (now >= end)
+		return 1.0;
+
+	return (double)(now - start) / (end - start);
+}
+
+/*
+ * A local estimate of the income tax & NICs for a tax year, from the
+ * profit in the books so far (and projected for the whole year), or for
+ * a given profit. Checked against the latest stored HMRC calculation
+ * for the year, if there is one.
+ */
+static int estimate(int argc, char *argv[])
+{
+	struct itsa_period period;
+	struct itsa_calculation *calcs;
+	struct tax_estimate to_date;
+	struct tax_estimate year;
+	struct itsa_calc calc = { 0 };
+	const struct itsa_calc *hmrc = NULL;
+	json_t *result = NULL;
+	char tyear[TAX_YEAR_SZ + 1];
+	char start[ITSA_DATE_SZ + 1];
+	char end[ITSA_DATE_SZ + 1];
+	size_t nr_calcs;
+	double elapsed;
+	long profit;
+	bool what_if = argc > 3;
+	int err;
+
+	if (argc > 4) {
+		disp_usage();
+		return -1;
+	}
+
+	if (argc > 2 && !tax_year_valid(argv[2])) {
+		printec("Invalid tax year '%s', expected e.g 2023-24\n",
+			argv[2]);
+		return -1;
+	}
+
+	if (argc > 2)
+		snprintf(tyear, sizeof(tyear), "%s", argv[2]);
+	else
+		itsa_tax_year(NULL, tyear);
+
+	if (what_if) {
+		char *endp;
+		double p = strtod(argv[3], &endp);
+
+		if (*endp != '\0' || endp == argv[3]) {
+			printec("Invalid profit '%s'\n", argv[3]);
+			return -1;
+		}
+		profit = (long)(p * 100.0 + (p < 0 ? -0.5 : 0.5));
+		elapsed = 1.0;
+	} else {
+		snprintf(start, sizeof(start), "%.4s-04-06", tyear);
+		/* A valid tax year starts with a four digit year */
+		snprintf(end, sizeof(end), "%04u-04-05",
+			 (atoi(tyear) + 1U) % 10000);
+
+		err = itsa_get_period(ITSA_CTX, start, end, &period);
+		if (err) {
+			printec("Couldn't get items for tax year. (%s)\n%s\n",
+				itsa_err2str(err), itsa_err_detail(ITSA_CTX));
+			return -1;
+		}
+		profit = period.income - period.expenses;
+		itsa_period_free(&period);
+		elapsed = tax_year_elapsed(tyear);
+	}
+
+	if (tax_estimate(tyear, profit, &to_date) == -1) {
+		printec("No tax rates for tax year '%s'\n", tyear);
+		return -1;
+	}
+	/* Project the profit so far over the whole year */
+	if (elapsed > 0.0 && elapsed < 1.0)
+		profit = profit / elapsed;
+	tax_estimate(tyear, profit, &year);
+
+	/* Only what's stored, this doesn't go to HMRC */
+	err = itsa_list_stored_calculations(tyear, &calcs, &nr_calcs);
+	if (!err && nr_calcs > 0 &&
+	    itsa_get_stored_calculation(tyear, calcs[nr_calcs - 1].id,
+					&result) == 0) {
+		schema_decode(calc, result, &calc);
+		hmrc = &calc;
+	}
+	itsa_calculations_free(calcs, nr_calcs);
+
+	if (output_structured()) {
+		output_record("estimate", json_pack(
+			"{s:s, s:s, s:b, s:o, s:o, s:o?}",
+			"tax_year", tyear, "rates", to_date.rates,
+			"what_if", what_if,
+			"to_date", est_json(&to_date),
+			"full_year", est_json(&year),
+			"hmrc", hmrc ? est_hmrc_json(hmrc) : NULL));
+		goto out_free;
+	}
+
+	printsc("#TANG#Estimate#RST# for #BOLD#%s#RST# using %s rates\n",
+		tyear, to_date.rates);
+	printic("This is worked out locally, it's not an HMRC calculation\n");
+	if (what_if)
+		printic("For a profit of #BOLD#%.2f#RST#\n", to_date.profit /
+			100.0);
+
+	printf("\n");
+	printc("#BOLD#%23s   %12s %12s %12s %12s#RST#\n", "", "to date",
+	       "HMRC", "full year", "HMRC est");
+	est_line("profit", to_date.profit, year.profit, hmrc,
+		 SCHEMA_F_calc_total_income, calc.total_income,
+		 SCHEMA_F_calc_eoy_income, calc.eoy_income);
+	est_line("personal allowance", to_date.personal_allowance,
+		 year.personal_allowance, hmrc,
+		 SCHEMA_F_calc_total_allowances, calc.total_allowances,
+		 -1, 0.0);
+	est_line("taxable income", to_date.taxable, year.taxable, hmrc,
+		 SCHEMA_F_calc_taxable_income, calc.taxable_income,
+		 SCHEMA_F_calc_eoy_taxable_income, calc.eoy_taxable_income);
+	est_line("income tax", to_date.income_tax, year.income_tax, hmrc,
+		 SCHEMA_F_calc_income_tax, calc.income_tax,
+		 SCHEMA_F_calc_eoy_income_tax, calc.eoy_income_tax);
+	est_line("class 2 NICs", to_date.class2, year.class2, hmrc,
+		 SCHEMA_F_calc_class2_nics, calc.class2_nics, -1, 0.0);
+	est_line("class 4 NICs", to_date.class4, year.class4, hmrc,
+		 SCHEMA_F_calc_class4_nics, calc.class4_nics, -1, 0.0);
+	printc("#CHARC#%78s#RST#", "------------\n");
+	est_line("total", to_date.total, year.total, hmrc,
+		 SCHEMA_F_calc_total_due, calc.total_due,
+		 SCHEMA_F_calc_eoy_liability, calc.eoy_liability);
+
+	printf("\n");
+	if (hmrc)
+		printic("HMRC figures are from calculation #BOLD#%s#RST# "
+			"(%s)\n", calc.calculation_id ?: "",
+			calc.timestamp ?: "");
+	else
+		printic("No stored HMRC calculation for #BOLD#%s#RST# to "
+			"compare with\n", tyear);
+
+out_free:
+	if (hmrc)
+		schema_free(calc, &calc);
+	json_decref(result);
+
+	return 0;
 }
 
 static int list_calculations(int argc, char *argv[])
 {
+	struct itsa_calculation *calcs;
+	const struct itsa_calculation *calc;
+	const struct itsa_calculation *newest = NULL;
+	const char *pf_tyear;
+	const char *pf_cid;
+	struct prefetch *pf = NULL;
 	json_t *result;
-	json_t *obs;
-	json_t *calculation;
-	char *jbuf;
 	char *s;
-	char qs[20] = "\0";
 	char submit[4];
+	size_t nr_calcs;
 	size_t index;
-	ac_slist_t *calcs = NULL;
-	struct calc_id *cid;
 	int err;
-	int ret = -1;
 
-	if (argc == 3)
-		snprintf(qs, sizeof(qs), "?taxYear=%s", argv[2]);
+	err = list_calcs(argc == 3 ? argv[2] : NULL, &calcs, &nr_calcs);
+	if (err)
+		return -1;
 
-	err = mtd_ic_list_calculations(qs, &jbuf);
-	if (err) {
-		printec("Couldn't get calculations list. (%s)\n%s\n",
-			mtd_err2str(err), jbuf);
-		goto out_free_buf;
+	if (output_structured()) {
+		for (index = 0; index < nr_calcs; index++) {
+			calc = &calcs[index];
+			output_record("calculation", json_pack(
+				"{s:s, s:s, s:s?, s:s?}",
+				"tax_year", calc->tax_year, "id", calc->id,
+				"calculation_type", calc->type,
+				"timestamp", calc->timestamp));
+		}
+		goto out_free;
 	}
 
 	printsc("Got list of calculations\n");
 
-	result = get_result_json(jbuf);
-	obs = json_object_get(result, "calculations");
-
 	printc("#CHARC#  %3s %12s %26s %29s #RST#\n",
 	       "idx", "tax_year", "calculation_id", "type");
 	printc("#CHARC#"
 	       " ------------------------------------------------------------"
 	       "-----------------#RST#\n");
-	json_array_foreach(obs, index, calculation) {
-		json_t *id_obj = json_object_get(calculation,
-						 "calculationId");
-		json_t *type = json_object_get(calculation, "calculationType");
-		json_t *tax_year = json_object_get(calculation, "taxYear");
-		const char *id = json_string_value(id_obj);
-		const char *tyear = json_string_value(tax_year);
-
+	for (index = 0; index < nr_calcs; index++) {
+		calc = &calcs[index];
 		printc("  #BOLD#%2zu#RST#%13s %39s %18s\n",
-		       index + 1, tyear, id, json_string_value(type));
+		       index + 1, calc->tax_year, calc->id, calc->type);
+
+		if (calc->timestamp &&
+		    (!newest || strcmp(calc->timestamp, newest->timestamp) > 0))
+			newest = calc;
+	}
 
-		cid = malloc(sizeof(*cid));
-		cid->id = strdup(id);
-		cid->tax_year = strdup(tyear);
-		ac_slist_add(&calcs, cid);
-        }
+	/*
+	 * The latest calculation is the one most likely to be viewed,
+	 * unless it's already stored locally.
+	 */
+	if (newest && !itsa_calculation_stored(newest->tax_year, newest->id)) {
+		pf_tyear = newest->tax_year;
+		pf_cid = newest->id;
+		pf = prefetch_start(itsa_get_calculation, &pf_tyear, &pf_cid,
+				    1);
+	}
 
 	printf("\n");
 	printcc("Select a calculation to view (n) or quit (Q)> ");
-	s = fgets(submit, sizeof(submit), stdin);
+	s = prompt_input(submit, sizeof(submit));
 	if (!s || *submit < '1' || *submit > '9')
-		goto out_free_json;
+		goto out_free;
 
 	index = atoi(submit) - 1;
-	cid = ac_slist_nth_data(calcs, index);
-	get_calculation(cid->tax_year, cid->id);
+	if (index >= nr_calcs)
+		goto out_free;
+	calc = &calcs[index];
+	if (calc == newest && prefetch_take(pf, 0, &result))
+		show_calculation(calc->tax_year, result);
+	else
+		get_calculation(calc->tax_year, calc->id);
 
-out_free_json:
-	ac_slist_destroy(&calcs, free_calc_id);
-	json_decref(result);
+out_free:
+	prefetch_free(pf);
+	itsa_calculations_free(calcs, nr_calcs);
+
+	return 0;
+}
+
+/*
+ * diff-calculations <calculation_id> <calculation_id> [tax_year]
+ *
+ * Show what changed going from the first calculation to the second.
+ */
+static const char *json_val_str(const json_t *value, char *buf, size_t size)
+{
+	switch (json_typeof(value)) {
+	case JSON_STRING:
+		return json_string_value(value);
+	case JSON_INTEGER:
+		snprintf(buf, size, "%lld",
+			 (long long)json_integer_value(value));
+		return buf;
+	case JSON_REAL:
+		snprintf(buf, size, "%.2f", json_real_value(value));
+		return buf;
+	case JSON_TRUE:
+		return "true";
+	case JSON_FALSE:
+		return "false";
+	default:
+		return "null";
+	}
+}
+
+static void show_calc_diff(enum jdiff_op op, const char *path,
+			   const json_t *old, const json_t *new, void *data)
+{
+	static const char * const ops[] = {
+		[JDIFF_ADDED]	= "added",
+		[JDIFF_REMOVED]	= "removed",
+		[JDIFF_CHANGED]	= "changed",
+	};
+	unsigned int *nr = data;
+	bool numbers = json_is_number(old) && json_is_number(new);
+	double delta = json_number_value(new) - json_number_value(old);
+	char obuf[64];
+	char nbuf[64];
+
+	(*nr)++;
+
+	if (output_structured()) {
+		json_t *rec = json_pack("{s:s, s:s, s:O?, s:O?}",
+					"path", path, "change", ops[op],
+					"old", old, "new", new);
+
+		if (numbers)
+			json_object_set_new(rec, "delta", json_real(delta));
+		output_record("calculation-diff", rec);
+		return;
+	}
+
+	switch (op) {
+	case JDIFF_ADDED:
+		printc("#GREEN# + #RST#%s : %s\n", path,
+		       json_val_str(new, nbuf, sizeof(nbuf)));
+		break;
+	case JDIFF_REMOVED:
+		printc("#RED# - #RST#%s : %s\n", path,
+		       json_val_str(old, obuf, sizeof(obuf)));
+		break;
+	case JDIFF_CHANGED:
+		printc("#TANG# ~ #RST#%s : %s -> #BOLD#%s#RST#", path,
+		       json_val_str(old, obuf, sizeof(obuf)),
+		       json_val_str(new, nbuf, sizeof(nbuf)));
+		if (numbers)
+			printc(" (%s%+.2f#RST#)", delta < 0.0 ? "#RED#" :
+			       "#GREEN#", delta);
+		printf("\n");
+		break;
+	}
+}
+
+static int diff_calculations(int argc, char *argv[])
+{
+	const char *tax_year;
+	const char *cid2;
+	struct prefetch *pf;
+	char tyear[TAX_YEAR_SZ + 1];
+	json_t *a;
+	json_t *b = NULL;
+	unsigned int nr = 0;
+	int ret = -1;
+	int err;
+
+	if (argc < 4) {
+		disp_usage();
+		return -1;
+	}
+
+	if (argc > 4)
+		snprintf(tyear, sizeof(tyear), "%s", argv[4]);
+	else
+		itsa_tax_year(NULL, tyear);
+	tax_year = tyear;
+	cid2 = argv[3];
+
+	/* Get them both at the same time */
+	pf = __prefetch_start(itsa_get_calculation, &tax_year, &cid2, 1,
+			      ITSA_PRIO_INTERACTIVE);
+
+	err = itsa_get_calculation(ITSA_CTX, tyear, argv[2], &a);
+	if (err) {
+		printec("Couldn't get calculation %s. (%s)\n%s\n", argv[2],
+			itsa_err2str(err), itsa_err_detail(ITSA_CTX));
+		goto out_free;
+	}
+	if (!prefetch_take(pf, 0, &b)) {
+		err = itsa_get_calculation(ITSA_CTX, tyear, argv[3], &b);
+		if (err) {
+			printec("Couldn't get calculation %s. (%s)\n%s\n",
+				argv[3], itsa_err2str(err),
+				itsa_err_detail(ITSA_CTX));
+			goto out_free_a;
+		}
+	}
+
+	/* Not part of the calculation */
+	json_object_del(a, "links");
+	json_object_del(b, "links");
+
+	if (!output_structured())
+		printsc("Changes from #BOLD#%s#RST# to #BOLD#%s#RST#\n",
+			argv[2], argv[3]);
+	if (jdiff(a, b, show_calc_diff, &nr) == -1) {
+		printec("Out of memory\n");
+		goto out_free_b;
+	}
+	if (nr == 0)
+		printic("No differences\n");
 
 	ret = 0;
 
-out_free_buf:
-	free(jbuf);
+out_free_b:
+	json_decref(b);
+out_free_a:
+	json_decref(a);
+out_free:
+	prefetch_free(pf);
 
 	return ret;
 }
 
 static int __period_update(const char *start, const char *end,
-			   enum period_action action)
+			   enum itsa_period_action action)
 {
-	long income;
-	long expenses;
+	struct itsa_period period;
+	int ret = -1;
 	int err;
 	char *s;
 	char tyear[TAX_YEAR_SZ + 1];
 	char submit[3];
 
-	get_data(start, end, &income, &expenses);
+	err = get_data(start, end, &period);
+	if (err)
+		return -1;
 
 	printcc("Submit? (y/N)> ");
-	s = fgets(submit, sizeof(submit), stdin);
-        if (!s || (*submit != 'y' && *submit != 'Y'))
-                return 0;
+	s = prompt_input(submit, sizeof(submit));
+	if (!s || (*submit != 'y' && *submit != 'Y')) {
+		ret = 0;
+		goto out_free;
+	}
 
-	err = set_period(start, end, income, expenses, action);
-	if (err)
-		return -1;
+	err = set_period(&period, action);
+	if (err == ITSA_UNCHANGED || err == ITSA_QUEUED) {
+		ret = 0;
+		goto out_free;
+	} else if (err) {
+		goto out_free;
+	}
 
-	get_tax_year(start, tyear);
+	itsa_tax_year(start, tyear);
 	err = trigger_calculation(tyear);
 	if (err)
-		return -1;
+		goto out_free;
 
-	return 0;
+	ret = 0;
+
+out_free:
+	itsa_period_free(&period);
+
+	return ret;
 }
 
 static int update_period(int argc, char *argv[])
@@ -1351,7 +2362,7 @@ static int update_period(int argc, char *argv[])
 	memcpy(end, argv[2] + 11, 10);
 	end[10] = '\0';
 
-	err = __period_update(start, end, PERIOD_UPDATE);
+	err = __period_update(start, end, ITSA_PERIOD_UPDATE);
 	if (err)
 		return -1;
 
@@ -1360,53 +2371,248 @@ static int update_period(int argc, char *argv[])
 
 static int get_period(char **start, char **end)
 {
-	json_t *result;
-	json_t *obs;
-	json_t *period;
-	size_t index;
-	char qs[128];
-	char *jbuf;
+	struct itsa_obligation *obs;
+	size_t nr_obs;
+	size_t i;
+	int ret = -1;
+	int err;
+
+	err = itsa_list_obligations(ITSA_CTX, ITSA_OB_PERIOD, NULL, NULL,
+				    &obs, &nr_obs);
+	if (err) {
+		printec("Couldn't get list of obligations. (%s)\n%s\n",
+			itsa_err2str(err), itsa_err_detail(ITSA_CTX));
+		return -1;
+	}
+
+	for (i = 0; i < nr_obs; i++) {
+		if (obs[i].status == 'F')
+			continue;
+
+		*start = strdup(obs[i].start);
+		*end = strdup(obs[i].end);
+
+		ret = 0;
+		break;
+	}
+
+	itsa_obligations_free(obs, nr_obs);
+
+	return ret;
+}
+
+/*
+ * create-period --backfill
+ *
+ * Create all the open periods that have ended in one go. The
+ * obligations are listed once, the items for every period are pulled
+ * out in a single pass over the book and the periods are then created
+ * concurrently, with just the one calculation per tax year at the end.
+ */
+#define BACKFILL_THREADS	4
+
+struct backfill_job {
+	const struct itsa_period *period;
+
+	int err;
+	char *err_detail;
+};
+
+static void backfill_job_run(void *arg)
+{
+	struct backfill_job *job = arg;
+	struct itsa_ctx *ctx;
+
+	ctx = itsa_ctx_new(cur_business(), NULL, NULL);
+	if (!ctx) {
+		job->err = -ITSA_ERR_OS;
+		return;
+	}
+	itsa_ctx_set_deadline(ctx, cmd_deadline);
+
+	job->err = itsa_set_period(ctx, job->period, ITSA_PERIOD_CREATE);
+	if (job->err)
+		job->err_detail = strdup(itsa_err_detail(ctx));
+
+	itsa_ctx_free(ctx);
+}
+
+static int period_cmp(const void *p1, const void *p2)
+{
+	const struct itsa_period *a = p1;
+	const struct itsa_period *b = p2;
+
+	return strcmp(a->start, b->start);
+}
+
+static int get_backfill_periods(struct itsa_period **periods, size_t *nr)
+{
+	struct itsa_obligation *obs;
+	struct itsa_period *p;
+	char today[ITSA_DATE_SZ + 1];
+	time_t now = itsa_time();
+	size_t nr_obs;
+	size_t i;
 	int err;
+
+	strftime(today, sizeof(today), "%F", localtime(&now));
+
+	err = itsa_list_obligations(ITSA_CTX, ITSA_OB_PERIOD, NULL, NULL,
+				    &obs, &nr_obs);
+	if (err) {
+		printec("Couldn't get list of obligations. (%s)\n%s\n",
+			itsa_err2str(err), itsa_err_detail(ITSA_CTX));
+		return -1;
+	}
+
+	*periods = p = calloc(nr_obs ? nr_obs : 1, sizeof(**periods));
+	if (!p) {
+		itsa_obligations_free(obs, nr_obs);
+		return -1;
+	}
+
+	*nr = 0;
+	for (i = 0; i < nr_obs; i++) {
+		/* Not yet ended periods can't be created */
+		if (obs[i].status == 'F' || strcmp(obs[i].end, today) >= 0)
+			continue;
+
+		snprintf(p[*nr].start, sizeof(p[*nr].start), "%s",
+			 obs[i].start);
+		snprintf(p[*nr].end, sizeof(p[*nr].end), "%s", obs[i].end);
+		(*nr)++;
+	}
+	itsa_obligations_free(obs, nr_obs);
+
+	if (*nr == 0)
+		return 0;
+	qsort(p, *nr, sizeof(*p), period_cmp);
+
+	err = itsa_get_periods(ITSA_CTX, p, *nr);
+	if (err) {
+		printec("Couldn't get items for periods. (%s)\n%s\n",
+			itsa_err2str(err), itsa_err_detail(ITSA_CTX));
+		free(p);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int backfill_periods(void)
+{
+	struct itsa_period *periods;
+	struct backfill_job *jobs;
+	struct pool *pool;
+	char tyear[TAX_YEAR_SZ + 1];
+	char last_tyear[TAX_YEAR_SZ + 1] = "\0";
+	char submit[3];
+	char *s;
+	size_t nr_periods;
+	size_t i;
 	int ret = -1;
+	int err;
+
+	err = get_backfill_periods(&periods, &nr_periods);
+	if (err)
+		return -1;
+	if (nr_periods == 0) {
+		printic("No open periods to create\n");
+		free(periods);
+		return 0;
+	}
+
+	printsc("Open periods\n");
+	printc("#CHARC#  %12s %11s %7s %15s %15s#RST#\n",
+	       "start", "end", "items", "income", "expenses");
+	printc("#CHARC#"
+	       " ------------------------------------------------------------"
+	       "----#RST#\n");
+	for (i = 0; i < nr_periods; i++) {
+		const struct itsa_period *p = &periods[i];
+
+		printf("  %12s %11s %7zu %15.2f %15.2f\n", p->start, p->end,
+		       p->nr_items, p->income / 100.0f, p->expenses / 100.0f);
+	}
+
+	printf("\n");
+	printcc("Create these #BOLD#%zu#RST# period(s)? (y/N)> ",
+		nr_periods);
+	s = prompt_input(submit, sizeof(submit));
+	if (!s || (*submit != 'y' && *submit != 'Y')) {
+		ret = 0;
+		goto out_free_periods;
+	}
+
+	jobs = calloc(nr_periods, sizeof(*jobs));
+	if (!jobs)
+		goto out_free_periods;
 
-	snprintf(qs, sizeof(qs), "?typeOfBusiness=%s&businessId=%s",
-		 BUSINESS_TYPE, BUSINESS_ID);
-	err = mtd_ob_list_inc_and_expend_obligations(qs, &jbuf);
-	if (err) {
-		printec("Couldn't get list of obligations. (%s)\n%s\n",
-			mtd_err2str(err), jbuf);
-		goto out_free_jbuf;
+	pool = pool_new(nr_periods < BACKFILL_THREADS ? nr_periods :
+			BACKFILL_THREADS, &mtd_pool_ops);
+	if (!pool) {
+		printec("Couldn't create thread pool\n");
+		goto out_free_jobs;
 	}
+	for (i = 0; i < nr_periods; i++) {
+		jobs[i].period = &periods[i];
+		if (pool_submit(pool, backfill_job_run, &jobs[i]) == -1)
+			jobs[i].err = -ITSA_ERR_OS;
+	}
+	pool_free(pool);
 
-	result = get_result_json(jbuf);
-	obs = json_object_get(result, "obligations");
-	if (!obs)
-		goto out_free_json;
-	obs = json_array_get(obs, 0);
-	obs = json_object_get(obs, "obligationDetails");
-	json_array_foreach(obs, index, period) {
-		json_t *status;
-		json_t *start_obj;
-		json_t *end_obj;
-
-		status = json_object_get(period, "status");
-		if (strcmp(json_string_value(status), "Fulfilled") == 0)
+	ret = 0;
+	printf("\n");
+	for (i = 0; i < nr_periods; i++) {
+		const struct itsa_period *p = &periods[i];
+
+		if (jobs[i].err == ITSA_UNCHANGED) {
+			printic("Period #BOLD#%s#RST# to #BOLD#%s#RST# is "
+				"unchanged since last submitted, skipped\n",
+				p->start, p->end);
+			continue;
+		} else if (jobs[i].err == ITSA_QUEUED) {
+			printic("Queued period #BOLD#%s#RST# to "
+				"#BOLD#%s#RST#\n", p->start, p->end);
 			continue;
+		} else if (jobs[i].err) {
+			printec("Failed to create period #BOLD#%s#RST# to "
+				"#BOLD#%s#RST#. (%s)\n%s\n", p->start, p->end,
+				itsa_err2str(jobs[i].err),
+				jobs[i].err_detail ? jobs[i].err_detail : "");
+			ret = -1;
+			continue;
+		}
+		printsc("Created period for #BOLD#%s#RST# to #BOLD#%s#RST#\n",
+			p->start, p->end);
+	}
 
-		start_obj = json_object_get(period, "periodStartDate");
-		end_obj = json_object_get(period, "periodEndDate");
-		*start = strdup(json_string_value(start_obj));
-		*end = strdup(json_string_value(end_obj));
+	/* The periods are sorted, so just look for the tax year changing */
+	for (i = 0; i < nr_periods; i++) {
+		if (jobs[i].err)
+			continue;
 
-		ret = 0;
-		break;
-        }
+		itsa_tax_year(periods[i].start, tyear);
+		if (strcmp(tyear, last_tyear) == 0)
+			continue;
+		strcpy(last_tyear, tyear);
 
-out_free_json:
-	json_decref(result);
+		printf("\n");
+		err = trigger_calculation(tyear);
+		if (err)
+			ret = -1;
+	}
 
-out_free_jbuf:
-	free(jbuf);
+	for (i = 0; i < nr_periods; i++)
+		free(jobs[i].err_detail);
+
+out_free_jobs:
+	free(jobs);
+
+out_free_periods:
+	for (i = 0; i < nr_periods; i++)
+		itsa_period_free(&periods[i]);
+	free(periods);
 
 	return ret;
 }
@@ -1418,6 +2624,9 @@ static int create_period(int argc, char *argv[])
 	int ret = 0;
 	int err;
 
+	if (argc == 3 && strcmp(argv[2], "--backfill") == 0)
+		return backfill_periods();
+
 	if (argc > 2 && argc < 4) {
 		disp_usage();
 		return -1;
@@ -1430,7 +2639,7 @@ static int create_period(int argc, char *argv[])
 			return -1;
 	}
 
-	err = __period_update(start, end, PERIOD_CREATE);
+	err = __period_update(start, end, ITSA_PERIOD_CREATE);
 	if (err)
 		ret = -1;
 
@@ -1440,280 +2649,269 @@ static int create_period(int argc, char *argv[])
 	return ret;
 }
 
+static int list_periods_all(const char *from, const char *to)
+{
+	const struct bus_job tmpl = {
+		.fn = bus_list_period_obs,
+		.from = from,
+		.to = to
+	};
+	struct bus_job *jobs;
+	struct bus_ob *bobs;
+	size_t nr_bobs;
+	size_t i;
+	int ret = 0;
+
+	jobs = run_all_businesses(&tmpl);
+	if (!jobs) {
+		printec("Couldn't query businesses\n");
+		return -1;
+	}
+	if (bus_jobs_errors(jobs, "list of obligations"))
+		ret = -1;
+
+	bobs = merge_obligations(jobs, &nr_bobs);
+	if (!bobs) {
+		free_bus_jobs(jobs);
+		return -1;
+	}
+
+	if (output_structured()) {
+		for (i = 0; i < nr_bobs; i++)
+			output_obligation("period", bobs[i].bus, bobs[i].ob,
+					  bobs[i].ob->received != NULL);
+		goto out_free;
+	}
+
+	printc("#CHARC#  %-16s %14s %18s %11s %12s %8s#RST#\n",
+	       "business", "period_id", "start", "end", "due", "met" );
+	printc("#CHARC#"
+	       " ------------------------------------------------------------"
+	       "--------------------------#RST#\n");
+	for (i = 0; i < nr_bobs; i++) {
+		const struct itsa_obligation *ob = bobs[i].ob;
+		bool met = ob->received ? true : false;
+
+		printc("%s  %-16.16s %s_%-14s %-12s %-12s %-12s%s %s\n",
+		       get_period_color(ob->start, ob->end, ob->due, met),
+		       bus_label(bobs[i].bus), ob->start, ob->end, ob->start,
+		       ob->end, ob->due, "#RST#", met ? STRUE : SFALSE);
+	}
+
+out_free:
+	free(bobs);
+	free_bus_jobs(jobs);
+
+	return ret;
+}
+
 static int list_periods(int argc, char *argv[])
 {
-	json_t *result;
-	json_t *obs;
-	json_t *period;
-	char qs[192];
+	struct itsa_obligation *obs;
+	size_t nr_obs;
+	size_t i;
 	int err;
-	size_t index;
-	char *jbuf;
 
 	if (argc > 2 && argc < 4) {
 		disp_usage();
 		return -1;
 	}
 
-	snprintf(qs, sizeof(qs), "?typeOfBusiness=%s&businessId=%s",
-		 BUSINESS_TYPE, BUSINESS_ID);
-	if (argc > 2) {
-		int len = strlen(qs);
-
-		len += snprintf(qs + len, sizeof(qs) - len, "&fromDate=%s",
-				argv[2]);
-		snprintf(qs + len, sizeof(qs) - len, "&toDate=%s", argv[3]);
-	}
+	if (opts.all_businesses)
+		return list_periods_all(argc > 2 ? argv[2] : NULL,
+					argc > 2 ? argv[3] : NULL);
 
-	err = mtd_ob_list_inc_and_expend_obligations(qs, &jbuf);
+	err = itsa_list_obligations(ITSA_CTX, ITSA_OB_PERIOD,
+				    argc > 2 ? argv[2] : NULL,
+				    argc > 2 ? argv[3] : NULL, &obs, &nr_obs);
 	if (err) {
 		printec("Couldn't get list of obligations. (%s)\n%s\n",
-			mtd_err2str(err), jbuf);
-		free(jbuf);
+			itsa_err2str(err), itsa_err_detail(ITSA_CTX));
 		return -1;
 	}
 
-	result = get_result_json(jbuf);
-	obs = json_object_get(result, "obligations");
-	if (!obs)
+	if (output_structured()) {
+		for (i = 0; i < nr_obs; i++)
+			output_obligation("period", NULL, &obs[i],
+					  obs[i].received != NULL);
 		goto out_free;
-	obs = json_array_get(obs, 0);
-	obs = json_object_get(obs, "obligationDetails");
+	}
 
 	printc("#CHARC#  %14s %18s %11s %12s %8s#RST#\n",
 	       "period_id", "start", "end", "due", "met" );
 	printc("#CHARC#"
 	       " ------------------------------------------------------------"
 	       "---------#RST#\n");
-	json_array_foreach(obs, index, period) {
-		json_t *start_obj = json_object_get(period, "periodStartDate");
-		json_t *end_obj = json_object_get(period, "periodEndDate");
-		json_t *due_obj = json_object_get(period, "dueDate");
-		json_t *rec_obj = json_object_get(period, "receivedDate");
-		const char *start = json_string_value(start_obj);
-		const char *end = json_string_value(end_obj);
-		const char *due = json_string_value(due_obj);
+	for (i = 0; i < nr_obs; i++) {
+		const struct itsa_obligation *ob = &obs[i];
+		bool met = ob->received ? true : false;
 
 		printc("%s  %s_%-14s %-12s %-12s %-12s%s %s\n",
-		       get_period_color(start, end, due,
-					rec_obj ? true : false),
-		       start, end, start, end, due,
-		       "#RST#", rec_obj ? STRUE : SFALSE);
-        }
+		       get_period_color(ob->start, ob->end, ob->due, met),
+		       ob->start, ob->end, ob->start, ob->end, ob->due,
+		       "#RST#", met ? STRUE : SFALSE);
+	}
 
 out_free:
-	json_decref(result);
-	free(jbuf);
+	itsa_obligations_free(obs, nr_obs);
 
 	return 0;
 }
 
-#define SAVINGS_ACCOUNT_NAME_ALLOWED_CHARS	"A-Za-z0-9 &'()*,-./@£"
-#define SAVINGS_ACCOUNT_NAME_REGEX \
-	"^[" SAVINGS_ACCOUNT_NAME_ALLOWED_CHARS "]{1,32}$"
 static int add_savings_account(void)
 {
-	char *jbuf;
 	char *s;
 	char submit[33]; /* Max allowed account name is 32 chars (+ nul) */
-	ac_jsonw_t *json;
-	struct mtd_dsrc_ctx dsctx;
-	regex_t re;
-	regmatch_t pmatch[1];
-	int ret;
 	int err;
 
-	err = regcomp(&re, SAVINGS_ACCOUNT_NAME_REGEX, REG_EXTENDED);
-	if (err) {
-		perror("regcomp");
-		return -1;
-	}
-
 	printic("Enter a friendly account name, allowed characters are :-\n"
-		"\n\t#BOLD#" SAVINGS_ACCOUNT_NAME_ALLOWED_CHARS "#RST#\n");
+		"\n\t#BOLD#" ITSA_SAVINGS_ACCOUNT_NAME_CHARS "#RST#\n");
 
 again:
 	printf("\n");
 	printcc("Name> ");
-	s = fgets(submit, sizeof(submit), stdin);
+	s = prompt_input(submit, sizeof(submit));
 	if (!s || *submit == '\n')
 		return 0;
 
 	ac_str_chomp(submit);
-	ret = regexec(&re, submit, 1, pmatch, 0);
-	if (ret != 0) {
+	err = itsa_add_savings_account(ITSA_CTX, submit);
+	if (err == -ITSA_ERR_INVALID) {
 		printec("Invalid name\n");
 		goto again;
-	}
-
-	json = ac_jsonw_init();
-	ac_jsonw_add_str(json, "accountName", submit);
-	ac_jsonw_end(json);
-
-	dsctx.data_src.buf = ac_jsonw_get(json);
-	dsctx.data_len = -1;
-	dsctx.src_type = MTD_DATA_SRC_BUF;
-
-	ret = -1;
-	err = mtd_sa_sa_create_account(&dsctx, &jbuf);
-	if (err) {
+	} else if (err) {
 		printec("Couldn't add savings account. (%s)\n%s\n",
-			mtd_err2str(err), jbuf);
-		goto out_free;
+			itsa_err2str(err), itsa_err_detail(ITSA_CTX));
+		return -1;
 	}
 
 	printsc("Added savings account : #BOLD#%s#RST#\n", submit);
 
-	ret = 0;
-
-out_free:
-	regfree(&re);
-	ac_jsonw_free(json);
-	free(jbuf);
-
-	return ret;
+	return 0;
 }
 
 static int view_savings_accounts(int argc, char *argv[])
 {
-	json_t *result;
-	json_t *obs;
-	json_t *account;
+	struct itsa_savings_account *accounts;
 	char tyear[TAX_YEAR_SZ + 1];
-	char *jbuf;
-	size_t index;
-	int err;
+	size_t nr_accounts;
+	size_t i;
 	int ret = -1;
+	int err;
 
-	err = mtd_sa_sa_list_accounts(&jbuf);
-	if (err && mtd_http_status_code(jbuf) != MTD_HTTP_NOT_FOUND) {
+	err = itsa_list_savings_accounts(ITSA_CTX, &accounts, &nr_accounts);
+	if (err) {
 		printec("Couldn't get list of savings accounts. "
-			"(%s)\n%s\n", mtd_err2str(err), jbuf);
-		free(jbuf);
+			"(%s)\n%s\n", itsa_err2str(err),
+			itsa_err_detail(ITSA_CTX));
 		return -1;
 	}
 
 	if (argc < 3)
-		get_tax_year(NULL, tyear);
+		itsa_tax_year(NULL, tyear);
 	else
 		snprintf(tyear, sizeof(tyear), "%s", argv[2]);
 
-	printsc("Savings Accounts for #BOLD#%s#RST#\n", tyear);
+	if (!output_structured()) {
+		printsc("Savings Accounts for #BOLD#%s#RST#\n", tyear);
 
-	printc("\n#CHARC#  %8s %26s#RST#\n", "id", "name");
-	printc("#CHARC#"
-	       " ------------------------------------------------------------"
-	       "#RST#\n");
+		printc("\n#CHARC#  %8s %26s#RST#\n", "id", "name");
+		printc("#CHARC#"
+		       " ----------------------------------------------------"
+		       "--------#RST#\n");
+	}
 
-	result = get_result_json(jbuf);
-	obs = json_object_get(result, "savingsAccounts");
-	free(jbuf);
-	jbuf = NULL; /* avoid potential double free if no accounts */
-	json_array_foreach(obs, index, account) {
+	for (i = 0; i < nr_accounts; i++) {
+		const struct itsa_savings_account *acc = &accounts[i];
 		json_t *res;
-		json_t *id = json_object_get(account, "id");
-		json_t *name = json_object_get(account, "accountName");
 		json_t *taxed_amnt;
 		json_t *untaxed_amnt;
-		const char *said = json_string_value(id);
-		float taxed_int = -1.0;
-		float untaxed_int = -1.0;
 
-		err = mtd_sa_sa_get_annual_summary(said, tyear, &jbuf);
+		err = itsa_get_savings_summary(ITSA_CTX, acc->id, tyear, &res);
 		if (err) {
 			printec("Couldn't retrieve account details. "
-				"(%s)\n%s\n", mtd_err2str(err), jbuf);
-			free(jbuf);
+				"(%s)\n%s\n", itsa_err2str(err),
+				itsa_err_detail(ITSA_CTX));
 			goto out_free;
 		}
-		res = get_result_json(jbuf);
 		taxed_amnt = json_object_get(res, "taxedUkInterest");
 		untaxed_amnt = json_object_get(res, "untaxedUkInterest");
 
-		if (taxed_amnt)
-			taxed_int = json_real_value(taxed_amnt);
-		if (untaxed_amnt)
-			untaxed_int = json_real_value(untaxed_amnt);
+		if (output_structured()) {
+			output_record("savings-account", json_pack(
+				"{s:s, s:s, s:s, s:O?, s:O?}",
+				"id", acc->id, "name", acc->name,
+				"tax_year", tyear,
+				"taxedUkInterest", taxed_amnt,
+				"untaxedUkInterest", untaxed_amnt));
+			json_decref(res);
+			continue;
+		}
 
-		printf("  %-25s %-34s\n",
-		       json_string_value(id), json_string_value(name));
-		if (taxed_int >= 0.0f)
+		printf("  %-25s %-34s\n", acc->id, acc->name);
+		if (taxed_amnt)
 			printc("#CHARC#%25s#RST##BOLD#%12.2f#RST#\n",
-			       "taxedUkInterest : ", taxed_int);
-		if (untaxed_int >= 0.0f)
+			       "taxedUkInterest : ",
+			       json_real_value(taxed_amnt));
+		if (untaxed_amnt)
 			printc("#CHARC#%25s#RST##BOLD#%12.2f#RST#\n",
-			       "untaxedUkInterest : ", untaxed_int);
+			       "untaxedUkInterest : ",
+			       json_real_value(untaxed_amnt));
 		printf("\n");
 
 		json_decref(res);
-		free(jbuf);
-        }
+	}
 
 	ret = 0;
 
 out_free:
-	json_decref(result);
+	itsa_savings_accounts_free(accounts, nr_accounts);
 
 	return ret;
 }
 
-static int get_savings_accounts_list(ac_slist_t **accounts)
+static int get_savings_accounts_list(struct itsa_savings_account **accounts,
+				     size_t *nr_accounts)
 {
-	json_t *result;
-	json_t *obs;
-	json_t *account;
-	char *jbuf;
-	size_t index;
+	size_t i;
 	int err;
 
-	err = mtd_sa_sa_list_accounts(&jbuf);
+	err = itsa_list_savings_accounts(ITSA_CTX, accounts, nr_accounts);
 	if (err) {
 		printec("Couldn't get list of savings accounts. (%s)\n%s\n",
-			mtd_err2str(err), jbuf);
-		free(jbuf);
+			itsa_err2str(err), itsa_err_detail(ITSA_CTX));
 		return -1;
 	}
 
-	result = get_result_json(jbuf);
-	obs = json_object_get(result, "savingsAccounts");
-
 	printc("#CHARC#  idx %9s %26s#RST#\n", "id", "name");
 	printc("#CHARC#"
 	       " ------------------------------------------------------------"
 	       "---#RST#\n");
-	json_array_foreach(obs, index, account) {
-		json_t *id = json_object_get(account, "id");
-		json_t *name = json_object_get(account, "accountName");
-
-		printf("  %2zu    %-22s %s\n", index + 1,
-		       json_string_value(id), json_string_value(name));
-
-		ac_slist_add(accounts, strdup(json_string_value(id)));
-        }
-
-	json_decref(result);
-	free(jbuf);
+	for (i = 0; i < *nr_accounts; i++)
+		printf("  %2zu    %-22s %s\n", i + 1, (*accounts)[i].id,
+		       (*accounts)[i].name);
 
 	return 0;
 }
 
 static int amend_savings_account(int argc, char *argv[])
 {
-	struct mtd_dsrc_ctx dsctx;
-	ac_slist_t *accounts = NULL;
+	struct itsa_savings_account *accounts;
 	json_t *result;
 	json_t *taxed_int;
 	json_t *untaxed_int;
-	json_t *amnt = json_real(0.0f);
-	char *jbuf;
+	json_t *amnt;
 	char *s;
 	char submit[3];
 	char tpath[PATH_MAX];
 	const char *tyear;
 	const char *said;
 	const char *args[3] = { NULL };
-	int child_pid;
-	int status;
+	const char *pf_saids[PREFETCH_MAX];
+	const char *pf_tyears[PREFETCH_MAX];
+	struct prefetch *pf;
+	size_t nr_accounts;
+	size_t idx;
 	int tmpfd;
 	int ret = -1;
 	int err;
@@ -1725,38 +2923,54 @@ static int amend_savings_account(int argc, char *argv[])
 
 	tyear = argv[2];
 
-	get_savings_accounts_list(&accounts);
+	err = get_savings_accounts_list(&accounts, &nr_accounts);
+	if (err)
+		return -1;
+
+	for (idx = 0; idx < nr_accounts && idx < PREFETCH_MAX; idx++) {
+		pf_saids[idx] = accounts[idx].id;
+		pf_tyears[idx] = tyear;
+	}
+	pf = prefetch_start(itsa_get_savings_summary,
+			    pf_saids, pf_tyears, idx);
+
 	printf("\n");
 	printcc("Select account to edit (n) or quit (Q)> ");
-	s = fgets(submit, sizeof(submit), stdin);
+	s = prompt_input(submit, sizeof(submit));
 	if (!s || *submit < '1' || *submit > '9')
 		goto out_free_list;
 
-	said = ac_slist_nth_data(accounts, atoi(submit) - 1);
-	if (!said) {
+	idx = atoi(submit) - 1;
+	if (idx >= nr_accounts) {
 		printec("No such account index\n");
 		goto out_free_list;
 	}
-	err = mtd_sa_sa_get_annual_summary(said, tyear, &jbuf);
-	if (err && mtd_http_status_code(jbuf) != MTD_HTTP_NOT_FOUND) {
-		printec("Couldn't retrieve account details. (%s)\n%s\n",
-			mtd_err2str(err), jbuf);
-		goto out_free_jbuf;
-	}
-	if (mtd_http_status_code(jbuf) == MTD_HTTP_NOT_FOUND) {
+	said = accounts[idx].id;
+
+	if (prefetch_take(pf, idx, &result))
+		err = 0;
+	else
+		err = itsa_get_savings_summary(ITSA_CTX, said, tyear,
+					       &result);
+	prefetch_free(pf);
+	pf = NULL;
+	if (err == -ITSA_ERR_NOT_FOUND) {
 		printec("No such Savings Account\n");
-		goto out_free_jbuf;
+		goto out_free_list;
+	} else if (err) {
+		printec("Couldn't retrieve account details. (%s)\n%s\n",
+			itsa_err2str(err), itsa_err_detail(ITSA_CTX));
+		goto out_free_list;
 	}
 
-	result = get_result_json(jbuf);
-	if (!result)
-		result = json_pack("{}");
+	amnt = json_real(0.0f);
 	taxed_int = json_object_get(result, "taxedUkInterest");
 	if (!taxed_int)
 		json_object_set(result, "taxedUkInterest", amnt);
 	untaxed_int = json_object_get(result, "untaxedUkInterest");
 	if (!untaxed_int)
 		json_object_set(result, "untaxedUkInterest", amnt);
+	json_decref(amnt);
 
 	snprintf(tpath, sizeof(tpath),
 		 "/tmp/.itsa_savings_account.tmp.%d.json", getpid());
@@ -1764,26 +2978,36 @@ static int amend_savings_account(int argc, char *argv[])
 	if (tmpfd == -1) {
 		printec("Couldn't open %s in %s\n", tpath, __func__);
 		perror("open");
-		goto out_free_jbuf;
+		goto out_free_json;
 	}
 
 	json_dumpfd(result, tmpfd, JSON_INDENT(4));
 	lseek(tmpfd, 0, SEEK_SET);
 
-	args[0] = get_editor();
-	args[1] = tpath;
-	posix_spawnp(&child_pid, args[0], NULL, NULL, (char * const *)args,
-		     environ);
-	waitpid(child_pid, &status, 0);
+	run_editor(tpath);
 
-	dsctx.data_src.fd = tmpfd;
-	dsctx.src_type = MTD_DATA_SRC_FD;
+	json_decref(result);
+	result = json_loadfd(tmpfd, 0, NULL);
+	if (!result) {
+		printec("Couldn't parse %s\n", tpath);
+		goto out_close_tmpfd;
+	}
 
-	free(jbuf);
-	err = mtd_sa_sa_update_annual_summary(&dsctx, said, tyear, &jbuf);
-	if (err) {
+	err = itsa_update_savings_summary(ITSA_CTX, said, tyear, result);
+	if (err == ITSA_UNCHANGED) {
+		printic("Savings Account #BOLD#%s#RST# is unchanged since last "
+			"submitted, skipping (--force to submit anyway)\n",
+			said);
+		ret = 0;
+		goto out_close_tmpfd;
+	} else if (err == ITSA_QUEUED) {
+		printic("Queued Savings Account #BOLD#%s#RST#, send it later "
+			"with #BOLD#flush-queue#RST#\n", said);
+		ret = 0;
+		goto out_close_tmpfd;
+	} else if (err) {
 		printec("Couldn't update Savings Account. (%s)\n%s\n",
-			mtd_err2str(err), jbuf);
+			itsa_err2str(err), itsa_err_detail(ITSA_CTX));
 		goto out_close_tmpfd;
 	}
 
@@ -1797,17 +3021,271 @@ static int amend_savings_account(int argc, char *argv[])
 	close(tmpfd);
 	unlink(tpath);
 
+out_free_json:
 	json_decref(result);
 
-out_free_jbuf:
-	free(jbuf);
-
 out_free_list:
-	ac_slist_destroy(&accounts, free);
+	prefetch_free(pf);
+	itsa_savings_accounts_free(accounts, nr_accounts);
 
 	return ret;
 }
 
+static int list_queue(void)
+{
+	struct itsa_queue_entry *entries;
+	size_t nr;
+	size_t i;
+	int err;
+
+	err = itsa_queue_list(&entries, &nr);
+	if (err) {
+		printec("Couldn't read the queue. (%s)\n", itsa_err2str(err));
+		return -1;
+	}
+
+	if (nr == 0) {
+		printic("Nothing queued\n");
+		return 0;
+	}
+
+	if (output_structured()) {
+		for (i = 0; i < nr; i++) {
+			const struct itsa_queue_entry *e = &entries[i];
+
+			output_record("queue-entry", json_pack(
+				"{s:I, s:i, s:s, s:s?, s:s?, s:s, s:s, s:i, "
+				"s:s?}",
+				"id", (json_int_t)e->id, "stage", e->stage,
+				"op", e->op, "business", e->bid,
+				"config_dir", e->config_dir,
+				"args", e->args, "queued", e->queued,
+				"attempts", e->attempts,
+				"last_err", e->last_err));
+		}
+		goto out_free;
+	}
+
+	printsc("Queued submissions\n");
+	printc("#CHARC#  %4s %-26s %-36s %5s#RST#\n",
+	       "id", "op", "args", "tries");
+	printc("#CHARC#"
+	       " ------------------------------------------------------------"
+	       "--------------#RST#\n");
+	for (i = 0; i < nr; i++) {
+		const struct itsa_queue_entry *e = &entries[i];
+
+		printc("  #BOLD#%4lu#RST# %-26s %-36s %5d\n", e->id, e->op,
+		       e->args, e->attempts);
+		printc("#CHARC#       queued %s%s%s#RST#\n", e->queued,
+		       e->config_dir ? " for " : "",
+		       e->config_dir ? e->config_dir : "");
+		if (e->last_err)
+			printc("#RED#       %s#RST#\n", e->last_err);
+	}
+
+out_free:
+	itsa_queue_entries_free(entries, nr);
+
+	return 0;
+}
+
+/*
+ * flush-queue
+ *
+ * Send what's queued, a stage at a time so things go in after what they
+ * depend on, with everything in a stage sent concurrently. If anything
+ * for a business fails, its later stages are left in the queue.
+ */
+#define FLUSH_THREADS		4
+
+struct flush_job {
+	const struct itsa_queue_entry *entry;
+	bool skipped;
+
+	int err;
+	char *err_detail;
+};
+
+/*
+ * Each entry is sent with the credentials of whoever it was queued for,
+ * so the libmtdac session is per job rather than per thread.
+ */
+static void flush_job_run(void *arg)
+{
+	struct flush_job *job = arg;
+	struct itsa_ctx *ctx;
+	struct mtd_cfg cfg = *mtd_cfg;
+	unsigned int flags = mtd_flags & ~MTD_OPT_GLOBAL_INIT;
+	int err;
+
+	if (job->entry->config_dir)
+		cfg.config_dir = job->entry->config_dir;
+	if (itsa_mtd_needed()) {
+		err = mtd_init(flags, &cfg);
+		if (err) {
+			job->err = -ITSA_ERR_OS;
+			job->err_detail = strdup(mtd_err2str(err));
+			return;
+		}
+	}
+
+	ctx = itsa_ctx_new(cur_business(), NULL, NULL);
+	if (ctx && job->entry->config_dir &&
+	    itsa_ctx_set_mtd_cfg(ctx, flags, &cfg)) {
+		itsa_ctx_free(ctx);
+		ctx = NULL;
+	}
+	if (!ctx) {
+		job->err = -ITSA_ERR_OS;
+		goto out_deinit;
+	}
+	itsa_ctx_set_deadline(ctx, cmd_deadline);
+
+	job->err = itsa_queue_send(ctx, job->entry);
+	if (job->err)
+		job->err_detail = strdup(itsa_err_detail(ctx));
+
+	itsa_ctx_free(ctx);
+
+out_deinit:
+	if (itsa_mtd_needed())
+		mtd_deinit();
+}
+
+static bool flush_bid_failed(const struct flush_job *jobs, size_t nr,
+			     const char *bid, int stage)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++) {
+		if (jobs[i].entry->stage >= stage)
+			break;
+		if ((jobs[i].err || jobs[i].skipped) &&
+		    strcmp(jobs[i].entry->bid, bid) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+static int flush_queue(void)
+{
+	struct itsa_queue_entry *entries;
+	struct flush_job *jobs;
+	struct pool *pool;
+	size_t nr;
+	size_t i;
+	size_t j;
+	int nr_failed = 0;
+	int err;
+
+	err = itsa_queue_list(&entries, &nr);
+	if (err) {
+		printec("Couldn't read the queue. (%s)\n", itsa_err2str(err));
+		return -1;
+	}
+	if (nr == 0) {
+		printic("Nothing queued\n");
+		return 0;
+	}
+
+	jobs = calloc(nr, sizeof(*jobs));
+	if (!jobs) {
+		nr_failed = -1;
+		goto out_free_entries;
+	}
+
+	/* The entries are in stage order */
+	for (i = 0; i < nr; i = j) {
+		pool = pool_new(FLUSH_THREADS, NULL);
+		if (!pool) {
+			printec("Couldn't create thread pool\n");
+			nr_failed = -1;
+			break;
+		}
+		for (j = i; j < nr && entries[j].stage == entries[i].stage;
+		     j++) {
+			jobs[j].entry = &entries[j];
+			if (flush_bid_failed(jobs, nr, entries[j].bid,
+					     entries[j].stage)) {
+				jobs[j].skipped = true;
+				continue;
+			}
+			if (pool_submit(pool, flush_job_run, &jobs[j]) == -1)
+				jobs[j].err = -ITSA_ERR_OS;
+		}
+		pool_free(pool);
+	}
+
+	for (i = 0; i < nr && jobs[i].entry; i++) {
+		const struct itsa_queue_entry *e = &entries[i];
+
+		if (jobs[i].skipped) {
+			printic("Left #BOLD#%lu#RST# %s %s, waiting on an "
+				"earlier failure\n", e->id, e->op, e->args);
+			nr_failed++;
+		} else if (jobs[i].err == -ITSA_ERR_REJECTED) {
+			printec("Dropped #BOLD#%lu#RST# %s %s, HMRC rejected "
+				"it\n%s\n", e->id, e->op, e->args,
+				jobs[i].err_detail ? jobs[i].err_detail : "");
+			nr_failed++;
+		} else if (jobs[i].err) {
+			printec("Failed to send #BOLD#%lu#RST# %s %s. "
+				"(%s)\n%s\n", e->id, e->op, e->args,
+				itsa_err2str(jobs[i].err),
+				jobs[i].err_detail ? jobs[i].err_detail : "");
+			nr_failed++;
+		} else {
+			printsc("Sent #BOLD#%lu#RST# %s %s\n", e->id, e->op,
+				e->args);
+		}
+		free(jobs[i].err_detail);
+	}
+	free(jobs);
+
+	itsa_queue_compact();
+
+out_free_entries:
+	itsa_queue_entries_free(entries, nr);
+
+	return nr_failed ? -1 : 0;
+}
+
+/*
+ * drop-queue <id>
+ *
+ * For something that's never going to go in and is holding up what
+ * comes after it.
+ */
+static int drop_queue(int argc, char *argv[])
+{
+	char *endp;
+	unsigned long id;
+	int err;
+
+	if (argc != 3) {
+		disp_usage();
+		return -1;
+	}
+
+	id = strtoul(argv[2], &endp, 10);
+	if (*endp != '\0' || endp == argv[2]) {
+		printec("Invalid queue id '%s'\n", argv[2]);
+		return -1;
+	}
+
+	err = itsa_queue_drop(id, "Dropped by hand");
+	if (err) {
+		printec("Couldn't drop #BOLD#%lu#RST#. (%s)\n", id,
+			itsa_err2str(err));
+		return -1;
+	}
+	printsc("Dropped #BOLD#%lu#RST#\n", id);
+
+	return 0;
+}
+
 static int switch_business(void)
 {
 	json_t *lob;
@@ -1854,7 +3332,7 @@ static int switch_business(void)
 
 again:
 	printcc("Select a business to use as default (n)> ");
-	s = fgets(submit, sizeof(submit), stdin);
+	s = prompt_input(submit, sizeof(submit));
 	def_bus = atoi(submit);
 	if (!s || *s < '0' || *s > '9' ||
 	    def_bus > (int)json_array_size(lob))
@@ -1898,7 +3376,7 @@ static int set_business(void)
 		goto out_free;
 	}
 
-	result = get_result_json(jbuf);
+	result = itsa_result_json(jbuf);
 	lob = json_object_get(result, "listOfBusinesses");
 	if (json_array_size(lob) == 0) {
 		printec("set_business: No business(es) found.\n");
@@ -1941,7 +3419,7 @@ static int set_business(void)
 	if (json_array_size(lob) > 1) {
 again:
 		printcc("Select a business to use as default (n)> ");
-		s = fgets(submit, sizeof(submit), stdin);
+		s = prompt_input(submit, sizeof(submit));
 		def_bus = atoi(submit);
 		if (!s || *s < '0' || *s > '9' ||
 		    def_bus > (int)json_array_size(lob))
@@ -1951,7 +3429,7 @@ static int set_business(void)
 
 	printf("\n");
 	printcc("Enter the data source path for the default business> ");
-	s = fgets(submit, sizeof(submit), stdin);
+	s = prompt_input(submit, sizeof(submit));
 	ac_str_chomp(s);
 	bus = json_array_get(ba, def_bus);
 	json_object_set_new(bus, "gnc_sqlite", json_string(s));
@@ -2002,7 +3480,7 @@ static int do_init_all(const struct mtd_cfg *cfg)
 
 			printwc("Existing libmtdac config found @ %s\n", path);
 			printcc("Continue? (y/N)> ");
-			s = fgets(submit, sizeof(submit), stdin);
+			s = prompt_input(submit, sizeof(submit));
 			if (!s || (*submit != 'y' && *submit != 'Y'))
 				return 0;
 			printf("\n");
@@ -2045,8 +3523,13 @@ static void print_api_info(void)
 	struct tm tm;
 	char buf[32] = "\0";
 
+	/* Keep stdout to just the records */
+	if (opts.output && strcmp(opts.output, "text") != 0)
+		return;
+
 	printic("***\n");
 	printic("*** Using %s API\n",
+		use_standin ? "#BOLD#STAND-IN#RST#" :
 		is_prod_api ? "#RED#PRODUCTION#RST#" : "#TANG#TEST#RST#");
 	printic("***\n");
 	if (!BUSINESS_ID)
@@ -2065,15 +3548,23 @@ static void print_api_info(void)
 	printf("\n");
 }
 
+static const struct itsa_ops itsa_ops = {
+	.confirm = confirm,
+	.calc_retry = calc_retry
+};
+
 static int read_config(void)
 {
+	struct itsa_business bus;
 	json_t *root;
 	json_t *prod_api;
 	json_t *bidx_obj;
 	json_t *jobj;
 	json_t *bus_obj;
 	json_t *lob;
+	struct stat sb;
 	char path[PATH_MAX];
+	size_t index;
 	int ret = -1;
 
 	snprintf(path, sizeof(path), "%s/" ITSA_CFG, getenv("HOME"));
@@ -2083,9 +3574,58 @@ static int read_config(void)
 		printec("read_config: Unable to open config : %s\n", path);
 		return -1;
 	}
+	if (stat(path, &sb) == 0)
+		itsa_config.mtime = sb.st_mtim;
+
+	prod_api = json_object_get(root, "production_api");
+	is_prod_api = json_is_true(prod_api);
+
+	hedge_requests = json_is_true(json_object_get(root, "hedge_requests"));
+	stats_log = !json_is_false(json_object_get(root, "stats_log"));
+	prefetching = !json_is_false(json_object_get(root, "prefetch"));
+
+	/* Keep sandbox submissions separate from the real ones */
+	if (!json_is_false(json_object_get(root, "skip_unchanged"))) {
+		snprintf(path, sizeof(path), "%s/" ITSA_SUBMITTED,
+			 getenv("HOME"), is_prod_api ? "" : "-sandbox");
+		if (itsa_set_submit_index(path))
+			printec("read_config: Ignoring invalid %s\n", path);
+	} else {
+		itsa_set_submit_index(NULL);
+	}
+
+	if (!json_is_false(json_object_get(root, "offline_queue"))) {
+		snprintf(path, sizeof(path), "%s/" ITSA_QUEUE,
+			 getenv("HOME"), is_prod_api ? "" : "-sandbox");
+		itsa_set_queue(path);
+	} else {
+		itsa_set_queue(NULL);
+	}
+
+	if (!json_is_false(json_object_get(root, "calc_store"))) {
+		snprintf(path, sizeof(path), "%s/" ITSA_CALCS,
+			 getenv("HOME"), is_prod_api ? "" : "-sandbox");
+		itsa_set_calc_store(path);
+	} else {
+		itsa_set_calc_store(NULL);
+	}
 
-	prod_api = json_object_get(root, "production_api");
-	is_prod_api = json_is_true(prod_api);
+	jobj = json_object_get(root, "rate_limit");
+	if (jobj)
+		itsa_set_rate_limit(json_number_value(json_object_get(jobj,
+								      "rate")),
+				    json_integer_value(json_object_get(jobj,
+								       "burst")));
+
+	jobj = json_object_get(root, "api_backend");
+	if (json_is_string(jobj) &&
+	    strcmp(json_string_value(jobj), "standin") == 0) {
+		if (itsa_use_standin(json_object_get(root, "standin"))) {
+			printec("read_config: Couldn't set up the stand-in\n");
+			goto out_free;
+		}
+		use_standin = true;
+	}
 
 	bidx_obj = json_object_get(root, "business_idx");
 	if (!bidx_obj) {
@@ -2097,6 +3637,26 @@ static int read_config(void)
 		printec("read_config: No 'businesses' found.\n");
 		goto out_free;
 	}
+	itsa_config.businesses = calloc(json_array_size(lob) + 1,
+					sizeof(struct itsa_business));
+	if (!itsa_config.businesses) {
+		printec("read_config: Couldn't allocate businesses.\n");
+		goto out_free;
+	}
+	json_array_foreach(lob, index, bus_obj) {
+		struct itsa_business *b = &itsa_config.businesses[index];
+
+		jobj = json_object_get(bus_obj, "bid");
+		b->bid = strdup(json_string_value(jobj));
+		jobj = json_object_get(bus_obj, "type");
+		b->btype = strdup(json_string_value(jobj));
+		jobj = json_object_get(bus_obj, "name");
+		b->bname = jobj ? strdup(json_string_value(jobj)) : NULL;
+		jobj = json_object_get(bus_obj, "gnc_sqlite");
+		b->gnc = jobj ? strdup(json_string_value(jobj)) : NULL;
+		itsa_config.nr_businesses++;
+	}
+
 	bus_obj = json_array_get(lob, json_integer_value(bidx_obj));
 	jobj = json_object_get(bus_obj, "bid");
 	itsa_config.bid = strdup(json_string_value(jobj));
@@ -2107,6 +3667,16 @@ static int read_config(void)
 	jobj = json_object_get(bus_obj, "gnc_sqlite");
 	itsa_config.gnc = strdup(json_string_value(jobj));
 
+	bus.bid = itsa_config.bid;
+	bus.btype = itsa_config.btype;
+	bus.bname = itsa_config.bname;
+	bus.gnc = itsa_config.gnc;
+	itsa_config.ctx = itsa_ctx_new(&bus, &itsa_ops, NULL);
+	if (!itsa_config.ctx) {
+		printec("read_config: Couldn't allocate itsa context.\n");
+		goto out_free;
+	}
+
 	ret = 0;
 
 out_free:
@@ -2168,8 +3738,243 @@ static const char *get_conf_dir(char *path)
 	return path;
 }
 
+static void print_stats(void)
+{
+	struct itsa_op_stats *stats;
+	unsigned long requests = 0;
+	unsigned long errors = 0;
+	unsigned long hedged = 0;
+	unsigned long wins = 0;
+	size_t nr;
+	size_t i;
+	int err;
+
+	err = itsa_get_stats(&stats, &nr);
+	if (err)
+		return;
+
+	printc("\n#BOLD#Request statistics#RST#\n");
+	printc("#CHARC#  %-26s %9s %7s %7s %7s %6s#RST#\n",
+	       "operation", "requests", "errors", "hedged", "rate", "wins");
+	printc("#CHARC#"
+	       " ------------------------------------------------------------"
+	       "--------------#RST#\n");
+	for (i = 0; i < nr; i++) {
+		const struct itsa_op_stats *st = &stats[i];
+
+		if (!st->requests)
+			continue;
+
+		printc("  %-26s %9lu %7lu %7lu %6.1f%% %6lu\n", st->name,
+		       st->requests, st->errors, st->hedged,
+		       st->hedged * 100.0 / st->requests, st->hedge_wins);
+
+		requests += st->requests;
+		errors += st->errors;
+		hedged += st->hedged;
+		wins += st->hedge_wins;
+	}
+	printc("  #BOLD#%-26s#RST# %9lu %7lu %7lu %6.1f%% %6lu\n", "Total",
+	       requests, errors, hedged,
+	       requests ? hedged * 100.0 / requests : 0.0, wins);
+
+	printc("\n#CHARC#  %-26s %8s %8s %8s %8s %8s %8s#RST#\n",
+	       "latency (ms)", "min", "mean", "p50", "p90", "p99", "max");
+	printc("#CHARC#"
+	       " ------------------------------------------------------------"
+	       "--------------#RST#\n");
+	for (i = 0; i < nr; i++) {
+		const struct itsa_op_stats *st = &stats[i];
+
+		if (!st->requests)
+			continue;
+
+		printc("  %-26s %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n",
+		       st->name, st->lat_min_us / 1000.0,
+		       st->lat_mean_us / 1000.0, st->lat_p50_us / 1000.0,
+		       st->lat_p90_us / 1000.0, st->lat_p99_us / 1000.0,
+		       st->lat_max_us / 1000.0);
+	}
+
+	printc("\n#CHARC#  %-26s %12s %12s#RST#\n",
+	       "operation", "sent", "received");
+	printc("#CHARC#"
+	       " ------------------------------------------------------------"
+	       "--------------#RST#\n");
+	for (i = 0; i < nr; i++) {
+		const struct itsa_op_stats *st = &stats[i];
+
+		if (!st->requests)
+			continue;
+
+		printc("  %-26s %12llu %12llu\n", st->name, st->bytes_out,
+		       st->bytes_in);
+	}
+
+	free(stats);
+}
+
+/*
+ * Append this runs request statistics to the stats log, one JSON object
+ * per line. Once it grows past STATS_LOG_MAX_SZ it's moved aside to
+ * <log>.1 and a new one started.
+ */
+static void log_stats(const char *cmd)
+{
+	struct itsa_op_stats *stats;
+	struct stat sb;
+	struct tm tm;
+	json_t *root;
+	json_t *ops;
+	time_t now;
+	FILE *fp;
+	char path[PATH_MAX];
+	char old[PATH_MAX + 2];
+	char ts[32];
+	char *line;
+	size_t nr;
+	size_t i;
+	int err;
+
+	err = itsa_get_stats(&stats, &nr);
+	if (err)
+		return;
+
+	ops = json_object();
+	for (i = 0; i < nr; i++) {
+		const struct itsa_op_stats *st = &stats[i];
+
+		if (!st->requests)
+			continue;
+
+		json_object_set_new(ops, st->name, json_pack(
+			"{s:I, s:I, s:I, s:I, s:I,"
+			" s:{s:I, s:I, s:I, s:I, s:I, s:I}}",
+			"requests", (json_int_t)st->requests,
+			"errors", (json_int_t)st->errors,
+			"hedged", (json_int_t)st->hedged,
+			"bytes_out", (json_int_t)st->bytes_out,
+			"bytes_in", (json_int_t)st->bytes_in,
+			"latency_us",
+			"min", (json_int_t)st->lat_min_us,
+			"mean", (json_int_t)st->lat_mean_us,
+			"p50", (json_int_t)st->lat_p50_us,
+			"p90", (json_int_t)st->lat_p90_us,
+			"p99", (json_int_t)st->lat_p99_us,
+			"max", (json_int_t)st->lat_max_us));
+	}
+	free(stats);
+
+	/* Nothing went to HMRC */
+	if (json_object_size(ops) == 0) {
+		json_decref(ops);
+		return;
+	}
+
+	now = time(NULL);
+	localtime_r(&now, &tm);
+	strftime(ts, sizeof(ts), "%FT%T%z", &tm);
+	root = json_pack("{s:s, s:s, s:o}", "time", ts, "command", cmd,
+			 "ops", ops);
+
+	snprintf(path, sizeof(path), "%s/" ITSA_STATS_LOG, getenv("HOME"));
+	if (stat(path, &sb) == 0 && sb.st_size > STATS_LOG_MAX_SZ) {
+		snprintf(old, sizeof(old), "%s.1", path);
+		rename(path, old);
+	}
+
+	fp = fopen(path, "a");
+	line = json_dumps(root, JSON_COMPACT);
+	if (fp && line)
+		fprintf(fp, "%s\n", line);
+	if (fp)
+		fclose(fp);
+	free(line);
+	json_decref(root);
+}
+
+/*
+ * Pull out any global --options, leaving just the command and its
+ * arguments in argv. Returns the new argc.
+ */
+static int parse_opts(int argc, char *argv[])
+{
+	int i;
+	int j;
+
+	opts.all_businesses = false;
+	opts.force = false;
+	opts.queue = false;
+	opts.deadline = -1;
+	opts.select = NULL;
+	opts.output = NULL;
+
+	for (i = j = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--all-businesses") == 0) {
+			opts.all_businesses = true;
+			continue;
+		} else if (strcmp(argv[i], "--force") == 0) {
+			opts.force = true;
+			continue;
+		} else if (strcmp(argv[i], "--queue") == 0) {
+			opts.queue = true;
+			continue;
+		} else if (strcmp(argv[i], "--stats") == 0) {
+			opts.stats = true;
+			continue;
+		} else if (strncmp(argv[i], "--select=", 9) == 0) {
+			opts.select = argv[i] + 9;
+			continue;
+		} else if (strcmp(argv[i], "--select") == 0 && i + 1 < argc) {
+			opts.select = argv[++i];
+			continue;
+		} else if (strncmp(argv[i], "--output=", 9) == 0) {
+			opts.output = argv[i] + 9;
+			continue;
+		} else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+			opts.output = argv[++i];
+			continue;
+		} else if (strncmp(argv[i], "--deadline=", 11) == 0) {
+			opts.deadline = atoi(argv[i] + 11);
+			continue;
+		} else if (strcmp(argv[i], "--deadline") == 0 &&
+			   i + 1 < argc) {
+			opts.deadline = atoi(argv[++i]);
+			continue;
+		}
+		argv[j++] = argv[i];
+	}
+	argv[j] = NULL;
+
+	return j;
+}
+
+/*
+ * Set the deadline for the command about to be run, either from
+ * --deadline or the commands default budget.
+ */
+static void set_cmd_deadline(const char *cmd)
+{
+	int i;
+
+	cmd_deadline = 0;
+	if (opts.deadline >= 0) {
+		cmd_deadline = opts.deadline * 1000UL;
+	} else {
+		for (i = 0; cmd_budgets[i].cmd; i++) {
+			if (strcmp(cmd_budgets[i].cmd, cmd) != 0)
+				continue;
+			cmd_deadline = cmd_budgets[i].secs * 1000UL;
+			break;
+		}
+	}
+
+	if (ITSA_CTX)
+		itsa_ctx_set_deadline(ITSA_CTX, cmd_deadline);
+}
+
 #define IS_CMD(cmd)		(strcmp(cmd, argv[1]) == 0)
-static int dispatcher(int argc, char *argv[], const struct mtd_cfg *cfg)
+static int run_cmd(int argc, char *argv[], const struct mtd_cfg *cfg)
 {
 	if (IS_CMD("init"))
 		return do_init_all(cfg);
@@ -2193,24 +3998,390 @@ static int dispatcher(int argc, char *argv[], const struct mtd_cfg *cfg)
 		return final_declaration(argc, argv);
 	if (IS_CMD("list-calculations"))
 		return list_calculations(argc, argv);
+	if (IS_CMD("diff-calculations"))
+		return diff_calculations(argc, argv);
 	if (IS_CMD("view-end-of-year-estimate"))
 		return view_end_of_year_estimate();
+	if (IS_CMD("estimate"))
+		return estimate(argc, argv);
+	if (IS_CMD("view-biss-summary"))
+		return view_biss_summary(argc, argv);
 	if (IS_CMD("add-savings-account"))
 		return add_savings_account();
 	if (IS_CMD("view-savings-accounts"))
 		return view_savings_accounts(argc, argv);
 	if (IS_CMD("amend-savings-account"))
 		return amend_savings_account(argc, argv);
+	if (IS_CMD("list-queue"))
+		return list_queue();
+	if (IS_CMD("flush-queue"))
+		return flush_queue();
+	if (IS_CMD("drop-queue"))
+		return drop_queue(argc, argv);
+	if (IS_CMD("agent"))
+		return agent(argc, argv, mtd_flags & ~MTD_OPT_GLOBAL_INIT, cfg);
 
 	disp_usage();
 
 	return -1;
 }
 
+static int dispatcher(int argc, char *argv[], const struct mtd_cfg *cfg)
+{
+	int err;
+
+	set_cmd_deadline(argv[1]);
+	itsa_set_force(opts.force);
+	itsa_set_queue_always(opts.queue);
+
+	/* Compiled once, for however many calculations get shown */
+	if (opts.select) {
+		selector = render_sel_compile(opts.select);
+		if (!selector) {
+			printec("Invalid --select expression(s) '%s'\n",
+				opts.select);
+			return -1;
+		}
+	}
+
+	if (output_set_format(opts.output) == -1) {
+		printec("Unknown --output format '%s'\n", opts.output);
+		err = -1;
+		goto out_free;
+	}
+	if (output_start() == -1) {
+		printec("Couldn't set up --output\n");
+		err = -1;
+		goto out_free;
+	}
+
+	err = run_cmd(argc, argv, cfg);
+	output_finish();
+
+out_free:
+	render_sel_free(selector);
+	selector = NULL;
+
+	return err;
+}
+
+/*
+ * Re-read the config if it has changed underneath us, e.g by a
+ * switch-business command run from the shell.
+ */
+static int check_config(void)
+{
+	struct stat sb;
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/" ITSA_CFG, getenv("HOME"));
+	if (stat(path, &sb) == -1)
+		return -1;
+	if (sb.st_mtim.tv_sec == itsa_config.mtime.tv_sec &&
+	    sb.st_mtim.tv_nsec == itsa_config.mtime.tv_nsec)
+		return 0;
+
+	free_config();
+
+	return read_config();
+}
+
+struct history {
+	char *lines[HISTORY_MAX];
+	int nr;
+	FILE *fp;
+};
+
+static void history_add(struct history *hist, const char *line)
+{
+	int idx = hist->nr % HISTORY_MAX;
+
+	free(hist->lines[idx]);
+	hist->lines[idx] = strdup(line);
+	hist->nr++;
+
+	if (!hist->fp)
+		return;
+	fprintf(hist->fp, "%s\n", line);
+	fflush(hist->fp);
+}
+
+/* History entries are numbered from 1 */
+static const char *history_get(const struct history *hist, int n)
+{
+	if (n < 1 || n > hist->nr || n <= hist->nr - HISTORY_MAX)
+		return NULL;
+
+	return hist->lines[(n - 1) % HISTORY_MAX];
+}
+
+static void history_show(const struct history *hist)
+{
+	int i = hist->nr - HISTORY_MAX + 1;
+
+	for (i = i < 1 ? 1 : i; i <= hist->nr; i++)
+		printc("#CHARC#%5d#RST#  %s\n", i, history_get(hist, i));
+}
+
+/*
+ * Load the saved history and re-write the history file with only
+ * the last HISTORY_MAX entries, before re-opening it for append.
+ */
+static void history_init(struct history *hist)
+{
+	FILE *fp;
+	char path[PATH_MAX];
+	char line[LINE_MAX];
+	int i;
+
+	snprintf(path, sizeof(path), "%s/" ITSA_HISTORY, getenv("HOME"));
+
+	fp = fopen(path, "r");
+	if (fp) {
+		while (fgets(line, sizeof(line), fp))
+			history_add(hist, ac_str_chomp(line));
+		fclose(fp);
+	}
+
+	fp = fopen(path, "w");
+	if (!fp)
+		return;
+	for (i = hist->nr - HISTORY_MAX + 1; i <= hist->nr; i++) {
+		if (history_get(hist, i))
+			fprintf(fp, "%s\n", history_get(hist, i));
+	}
+	hist->fp = fp;
+}
+
+static void history_free(struct history *hist)
+{
+	int i;
+
+	for (i = 0; i < HISTORY_MAX; i++)
+		free(hist->lines[i]);
+	if (hist->fp)
+		fclose(hist->fp);
+}
+
+/*
+ * Split a command line into an argv[] array suitable for passing to
+ * dispatcher(), i.e argv[0] is the program name and argv[1] is the
+ * command.
+ *
+ * Arguments are separated by whitespace and may be quoted with either
+ * single or double quotes. A '#' at the start of an argument starts a
+ * comment.
+ *
+ * Modifies line in place and returns the new argc or -1 if there are
+ * too many arguments.
+ */
+static int split_cmdline(char *line, char *argv[], int max_args)
+{
+	char *ptr = line;
+	int argc = 0;
+
+	argv[argc++] = (char *)PROD_NAME;
+	for (;;) {
+		char *dst;
+		char quote = '\0';
+
+		while (*ptr == ' ' || *ptr == '\t' || *ptr == '\n')
+			ptr++;
+		if (*ptr == '\0' || *ptr == '#')
+			break;
+		if (argc == max_args)
+			return -1;
+
+		dst = argv[argc++] = ptr;
+		for ( ; *ptr != '\0'; ptr++) {
+			if (quote && *ptr == quote) {
+				quote = '\0';
+				continue;
+			} else if (!quote && (*ptr == '"' || *ptr == '\'')) {
+				quote = *ptr;
+				continue;
+			} else if (!quote && (*ptr == ' ' || *ptr == '\t' ||
+					      *ptr == '\n')) {
+				ptr++;
+				break;
+			}
+			*dst++ = *ptr;
+		}
+		*dst = '\0';
+	}
+	argv[argc] = NULL;
+
+	return argc;
+}
+
+/*
+ * Handle the shell built-in commands. Returns true if the line was
+ * handled, with *quit set if the shell should exit.
+ *
+ * History references (!! & !n) are expanded in place.
+ */
+static bool shell_builtin(struct history *hist, char *line, size_t size,
+			  bool *quit)
+{
+	const char *hline;
+
+	if (strcmp(line, "quit") == 0 || strcmp(line, "exit") == 0) {
+		*quit = true;
+		return true;
+	} else if (strcmp(line, "help") == 0) {
+		disp_usage();
+		printf("\n");
+		printf("    history\n");
+		printf("    !! | !<n>\n");
+		printf("    quit | exit\n");
+		return true;
+	} else if (strcmp(line, "history") == 0) {
+		history_show(hist);
+		return true;
+	} else if (*line != '!') {
+		return false;
+	}
+
+	if (strcmp(line, "!!") == 0)
+		hline = history_get(hist, hist->nr);
+	else
+		hline = history_get(hist, atoi(line + 1));
+	if (!hline) {
+		printec("%s: event not found\n", line);
+		return true;
+	}
+
+	snprintf(line, size, "%s", hline);
+	printf("%s\n", line);
+
+	return false;
+}
+
+/*
+ * Run multiple commands from the given stream over the one libmtdac
+ * context and config load.
+ *
+ * When interactive, a prompt is displayed, history is kept and a
+ * failing command doesn't stop the shell. Otherwise (batch mode)
+ * we stop at the first failing command.
+ */
+static int run_cmds(FILE *fp, bool interactive, const struct mtd_cfg *cfg)
+{
+	struct history hist = { .nr = 0 };
+	char line[LINE_MAX];
+	int lineno = 0;
+	int ret = 0;
+
+	if (interactive)
+		history_init(&hist);
+
+	for (;;) {
+		char *args[MAX_CMD_ARGS + 1];
+		char *s;
+		int64_t tstart;
+		bool quit = false;
+		int nr_args;
+		int err;
+
+		if (interactive) {
+			printc("#BOLD#itsa#RST# [#CHARC#%s#RST#]> ",
+			       BUSINESS_ID);
+			fflush(stdout);
+		}
+		tstart = interactive ? itsa_trace_begin() : 0;
+		s = fgets(line, sizeof(line), fp);
+		itsa_trace_end("user", "prompt", tstart);
+		if (!s)
+			break;
+		lineno++;
+		ac_str_chomp(line);
+
+		if (interactive) {
+			if (shell_builtin(&hist, line, sizeof(line), &quit)) {
+				if (quit)
+					break;
+				continue;
+			}
+			if (*line)
+				history_add(&hist, line);
+		}
+
+		nr_args = split_cmdline(line, args, MAX_CMD_ARGS);
+		if (nr_args == -1) {
+			printec("Too many arguments at line %d\n", lineno);
+			goto next;
+		}
+		nr_args = parse_opts(nr_args, args);
+		if (nr_args < 2)
+			continue;
+		/*
+		 * The agent uses the clients configs, not the one loaded
+		 * here with its submit index, queue & calculation store.
+		 */
+		if (strcmp(args[1], "shell") == 0 ||
+		    strcmp(args[1], "batch") == 0 ||
+		    strcmp(args[1], "agent") == 0) {
+			printec("%s can't be run from here\n", args[1]);
+			goto next;
+		}
+
+		if (!interactive)
+			printic("Running #BOLD#%s#RST# (line %d)\n",
+				args[1], lineno);
+		tstart = itsa_trace_begin();
+		err = dispatcher(nr_args, args, cfg);
+		itsa_trace_end("command", args[1], tstart);
+		if (check_config() == -1) {
+			ret = -1;
+			break;
+		}
+		if (!err)
+			continue;
+next:
+		if (interactive)
+			continue;
+		printec("Stopping at line %d\n", lineno);
+		ret = -1;
+		break;
+	}
+
+	if (interactive) {
+		printf("\n");
+		history_free(&hist);
+	}
+
+	return ret;
+}
+
+static int do_batch(int argc, char *argv[], const struct mtd_cfg *cfg)
+{
+	FILE *fp;
+	int ret;
+
+	if (argc < 3) {
+		disp_usage();
+		return -1;
+	}
+
+	fp = fopen(argv[2], "r");
+	if (!fp) {
+		printec("Couldn't open %s\n", argv[2]);
+		perror("fopen");
+		return -1;
+	}
+
+	ret = run_cmds(fp, false, cfg);
+	fclose(fp);
+
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	int err;
 	int ret = EXIT_SUCCESS;
+	int64_t tstart;
+	bool use_mtd;
 	unsigned int flags = MTD_OPT_GLOBAL_INIT;
 	char config_dir[PATH_MAX];
 	const char *log_level = getenv("ITSA_LOG_LEVEL");
@@ -2224,6 +4395,7 @@ int main(int argc, char *argv[])
 		.config_dir = get_conf_dir(config_dir)
 	};
 
+	argc = parse_opts(argc, argv);
 	if (argc < 2) {
 		disp_usage();
 		exit(EXIT_FAILURE);
@@ -2231,8 +4403,12 @@ int main(int argc, char *argv[])
 
 	set_colors();
 
-	if (!IS_CMD("init")) {
+	/* The agent uses the clients configs rather than our own */
+	if (!IS_CMD("init") && !IS_CMD("agent")) {
+		int64_t tstart = itsa_trace_begin();
+
 		err = read_config();
+		itsa_trace_end("config", "read_config", tstart);
 		if (err)
 			exit(EXIT_FAILURE);
 	}
@@ -2245,17 +4421,44 @@ int main(int argc, char *argv[])
 		flags |= MTD_OPT_LOG_INFO;
 
 	flags |= MTD_OPT_ACT_OTHER_DIRECT;
-	err = mtd_init(flags, &cfg);
-	if (err) {
-		printec("mtd_init: %s\n", mtd_err2str(err));
-		exit(EXIT_FAILURE);
+	mtd_flags = flags;
+	mtd_cfg = &cfg;
+	/* Replaying a recording or using the stand-in, we never talk to HMRC */
+	use_mtd = itsa_mtd_needed();
+	if (use_mtd) {
+		int64_t tstart = itsa_trace_begin();
+
+		err = mtd_init(flags, &cfg);
+		itsa_trace_end("config", "mtd_init", tstart);
+		if (err) {
+			printec("mtd_init: %s\n", mtd_err2str(err));
+			exit(EXIT_FAILURE);
+		}
 	}
 
-	err = dispatcher(argc, argv, &cfg);
-	if (err)
+	itsa_set_mtd_cfg(flags, &cfg);
+	itsa_set_hedging(hedge_requests);
+
+	tstart = itsa_trace_begin();
+	if (IS_CMD("shell"))
+		err = run_cmds(stdin, true, &cfg);
+	else if (IS_CMD("batch"))
+		err = do_batch(argc, argv, &cfg);
+	else
+		err = dispatcher(argc, argv, &cfg);
+	itsa_trace_end("command", argv[1], tstart);
+	if (err && ITSA_CTX && itsa_ctx_deadline_expired(ITSA_CTX))
+		ret = EX_TEMPFAIL;
+	else if (err)
 		ret = EXIT_FAILURE;
 
-	mtd_deinit();
+	if (opts.stats)
+		print_stats();
+	if (stats_log)
+		log_stats(argv[1]);
+
+	if (use_mtd)
+		mtd_deinit();
 	free_config();
 
 	exit(ret);
@@ -0,0 +1,169 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * jdiff.c - Structural diff of JSON trees
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ *
+ * The two trees are walked together, objects are aligned by key (each
+ * key of one being looked up in the other) and arrays by index, so it's
+ * linear in the size of the trees. Only the leaves that differ are
+ * reported, anything only in one tree is reported leaf by leaf as added
+ * or removed.
+ *
+ * Numbers are compared by value, so 100 and 100.0 are the same.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <jansson.h>
+
+#include "jdiff.h"
+
+struct jdiff {
+	char *path;
+	size_t len;
+	size_t alloc;
+	bool oom;
+
+	jdiff_cb_t cb;
+	void *data;
+};
+
+/* Appends to the path, returning the previous length to restore it */
+static size_t path_push(struct jdiff *d, const char *key, size_t index)
+{
+	size_t len = d->len;
+	char elem[32];
+	size_t need;
+
+	if (!key) {
+		snprintf(elem, sizeof(elem), "[%zu]", index);
+		key = elem;
+	}
+
+	need = len + strlen(key) + 2;
+	if (need > d->alloc) {
+		size_t alloc = d->alloc ? d->alloc : 128;
+		char *path;
+
+		while (alloc < need)
+			alloc *= 2;
+		path = realloc(d->path, alloc);
+		if (!path) {
+			d->oom = true;
+			return len;
+		}
+		d->path = path;
+		d->alloc = alloc;
+	}
+
+	d->len += sprintf(d->path + d->len, "%s%s",
+			  len && key != elem ? "." : "", key);
+
+	return len;
+}
+
+static void path_pop(struct jdiff *d, size_t len)
+{
+	d->len = len;
+	if (d->path)
+		d->path[len] = '\0';
+}
+
+static void diff_leaves(struct jdiff *d, enum jdiff_op op, const json_t *node)
+{
+	const char *key;
+	json_t *value;
+	size_t index;
+	size_t len;
+
+	if (json_is_object(node)) {
+		json_object_foreach((json_t *)node, key, value) {
+			len = path_push(d, key, 0);
+			diff_leaves(d, op, value);
+			path_pop(d, len);
+		}
+	} else if (json_is_array(node)) {
+		json_array_foreach(node, index, value) {
+			len = path_push(d, NULL, index);
+			diff_leaves(d, op, value);
+			path_pop(d, len);
+		}
+	} else if (!d->oom) {
+		d->cb(op, d->path ? d->path : "", op == JDIFF_ADDED ?
+		      NULL : node, op == JDIFF_ADDED ? node : NULL, d->data);
+	}
+}
+
+static void diff_node(struct jdiff *d, const json_t *a, const json_t *b)
+{
+	const char *key;
+	json_t *value;
+	size_t index;
+	size_t len;
+
+	if (json_is_object(a) && json_is_object(b)) {
+		json_object_foreach((json_t *)a, key, value) {
+			const json_t *bv = json_object_get(b, key);
+
+			len = path_push(d, key, 0);
+			if (bv)
+				diff_node(d, value, bv);
+			else
+				diff_leaves(d, JDIFF_REMOVED, value);
+			path_pop(d, len);
+		}
+		json_object_foreach((json_t *)b, key, value) {
+			if (json_object_get(a, key))
+				continue;
+			len = path_push(d, key, 0);
+			diff_leaves(d, JDIFF_ADDED, value);
+			path_pop(d, len);
+		}
+	} else if (json_is_array(a) && json_is_array(b)) {
+		size_t na = json_array_size(a);
+		size_t nb = json_array_size(b);
+
+		for (index = 0; index < na || index < nb; index++) {
+			len = path_push(d, NULL, index);
+			if (index >= na)
+				diff_leaves(d, JDIFF_ADDED,
+					    json_array_get(b, index));
+			else if (index >= nb)
+				diff_leaves(d, JDIFF_REMOVED,
+					    json_array_get(a, index));
+			else
+				diff_node(d, json_array_get(a, index),
+					  json_array_get(b, index));
+			path_pop(d, len);
+		}
+	} else if (json_is_number(a) && json_is_number(b)) {
+		if (json_number_value(a) != json_number_value(b) && !d->oom)
+			d->cb(JDIFF_CHANGED, d->path ? d->path : "", a, b,
+			      d->data);
+	} else if (json_is_object(a) || json_is_array(a) ||
+		   json_is_object(b) || json_is_array(b)) {
+		/* A change of shape */
+		diff_leaves(d, JDIFF_REMOVED, a);
+		diff_leaves(d, JDIFF_ADDED, b);
+	} else if (!json_equal((json_t *)a, (json_t *)b) && !d->oom) {
+		d->cb(JDIFF_CHANGED, d->path ? d->path : "", a, b, d->data);
+	}
+}
+
+/* Returns 0 or -1 if it ran out of memory part way through */
+int jdiff(const json_t *a, const json_t *b, jdiff_cb_t cb, void *data)
+{
+	struct jdiff d = { .cb = cb, .data = data };
+
+	diff_node(&d, a, b);
+	free(d.path);
+
+	return d.oom ? -1 : 0;
+}
@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * jdiff.h - Structural diff of JSON trees
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _JDIFF_H_
+#define _JDIFF_H_
+
+#include <jansson.h>
+
+enum jdiff_op {
+	JDIFF_ADDED,
+	JDIFF_REMOVED,
+	JDIFF_CHANGED,
+};
+
+/*
+ * Called for each leaf that differs. path is '.' separated with array
+ * indices as [n]. old is NULL for JDIFF_ADDED, new for JDIFF_REMOVED.
+ */
+typedef void (*jdiff_cb_t)(enum jdiff_op op, const char *path,
+			   const json_t *old, const json_t *new, void *data);
+
+extern int jdiff(const json_t *a, const json_t *b, jdiff_cb_t cb, void *data);
+
+#endif /* _JDIFF_H_ */
@@ -0,0 +1,1591 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * libitsa.c - Core itsa operations
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ *
+ * These are the operations that make up itsa, without any of the user
+ * interaction. Results are returned as structures (or jansson objects
+ * for the more free-form responses) and anything needing the users
+ * consent goes via the confirm() callback.
+ *
+ * Everything hangs off a struct itsa_ctx, so separate contexts can be
+ * used from separate threads. As with libmtdac itself, mtd_init() needs
+ * to have been called in the calling thread.
+ *
+ * All requests to HMRC go via api_exec() (api.c). Some state is global
+ * though, set up once and shared by all contexts in the process
+ *
+ *	- the rate limit & hedging (api.c)
+ *	- the default cfg request threads mtd_init() with, unless the
+ *	  context has its own (itsa_ctx_set_mtd_cfg())
+ *	- the stand-in or recording/replay in use (standin.c, record.c)
+ *	- the submit index (submitted.c)
+ *	- the offline queue (queue.c)
+ *	- the calculation store (calcstore.c)
+ *
+ * The last three are single files/directories, i.e one taxpayer's.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <regex.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <sqlite3.h>
+
+#include <jansson.h>
+
+#include <libmtdac/mtd.h>
+
+#include <libac.h>
+
+#include "libitsa.h"
+#include "api.h"
+#include "submitted.h"
+#include "queue.h"
+#include "calcstore.h"
+
+#define SAVINGS_ACCOUNT_NAME_REGEX \
+	"^[" ITSA_SAVINGS_ACCOUNT_NAME_CHARS "]{1,32}$"
+
+#define CALC_MAX_BACKOFF		5
+
+struct itsa_ctx {
+	struct itsa_business bus;
+
+	const struct itsa_ops *ops;
+	void *user_data;
+
+	enum itsa_priority prio;
+
+	int64_t deadline;
+	int64_t paused_at;
+	bool deadline_hit;
+
+	/*
+	 * Set from another thread by itsa_ctx_cancel(), which also wakes
+	 * anything waiting on cond.
+	 */
+	int cancelled;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* Our own copy of what to mtd_init() other threads with, if set */
+	unsigned int mtd_flags;
+	struct mtd_cfg *mtd_cfg;
+
+	sqlite3 *db;
+	sqlite3_stmt *trans_stmt;
+	sqlite3_stmt *splits_stmt;
+	sqlite3_stmt *acc_stmt;
+
+	char *err_detail;
+};
+
+static const char *itsa_errs[] = {
+	[ITSA_ERR_OS - ITSA_ERR_BASE]		= "Operating system error",
+	[ITSA_ERR_DB - ITSA_ERR_BASE]		= "Data source error",
+	[ITSA_ERR_ACCOUNT_TYPE - ITSA_ERR_BASE]	= "Unknown account type",
+	[ITSA_ERR_NOT_FOUND - ITSA_ERR_BASE]	= "Not found",
+	[ITSA_ERR_INVALID - ITSA_ERR_BASE]	= "Invalid data",
+	[ITSA_ERR_NO_CALC_ID - ITSA_ERR_BASE]	= "No calculation id returned",
+	[ITSA_ERR_DEADLINE - ITSA_ERR_BASE]	= "Deadline exceeded",
+	[ITSA_ERR_CANCELLED - ITSA_ERR_BASE]	= "Cancelled",
+	[ITSA_ERR_REJECTED - ITSA_ERR_BASE]	= "Rejected by HMRC",
+};
+
+const char *itsa_err2str(int err)
+{
+	int idx = -err - ITSA_ERR_BASE;
+
+	if (-err < ITSA_ERR_BASE)
+		return mtd_err2str(err);
+	if (idx >= (int)(sizeof(itsa_errs) / sizeof(itsa_errs[0])))
+		return "Unknown error";
+
+	return itsa_errs[idx];
+}
+
+/*
+ * Keep hold of the last response (or local error description) so
+ * the caller can get at the details of a failure.
+ *
+ * Takes ownership of buf.
+ */
+static void set_err_detail(struct itsa_ctx *ctx, char *buf)
+{
+	free(ctx->err_detail);
+	ctx->err_detail = buf;
+}
+
+static void set_err_detailf(struct itsa_ctx *ctx, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+static void set_err_detailf(struct itsa_ctx *ctx, const char *fmt, ...)
+{
+	va_list args;
+	char *buf;
+	int len;
+
+	va_start(args, fmt);
+	len = vasprintf(&buf, fmt, args);
+	va_end(args);
+
+	set_err_detail(ctx, len == -1 ? NULL : buf);
+}
+
+const char *itsa_err_detail(const struct itsa_ctx *ctx)
+{
+	return ctx->err_detail ? ctx->err_detail : "";
+}
+
+static char *jstrdup(const json_t *obj)
+{
+	const char *str = json_string_value(obj);
+
+	return str ? strdup(str) : NULL;
+}
+
+/*
+ * Simple wrapper around time(2) that allows to override the
+ * current date.
+ */
+time_t itsa_time(void)
+{
+	const char *set_date = getenv("ITSA_SET_DATE");
+	struct tm tm = { 0 };
+
+	if (!set_date)
+		return time(NULL);
+
+	strptime(set_date, "%F", &tm);
+
+	return mktime(&tm);
+}
+
+/*
+ * Returns the tax year (e.g 2021-22) the given date falls in, or the
+ * current tax year if date is NULL.
+ *
+ * buf should be at least ITSA_TAX_YEAR_SZ + 1 bytes.
+ */
+char *itsa_tax_year(const char *date, char *buf)
+{
+	struct tm tm = { 0 };
+	char year[5];
+	char year2[5];
+
+	if (!date) {
+		time_t now = itsa_time();
+
+		localtime_r(&now, &tm);
+	} else {
+		strptime(date, "%F", &tm);
+	}
+	strftime(year, sizeof(year), "%Y", &tm);
+
+	/* tm_mon starts at 0, hence April = 3 */
+	if (tm.tm_mon < 3 || (tm.tm_mon <= 3 && tm.tm_mday <= 5)) {
+		tm.tm_year--;
+		strftime(year2, sizeof(year2), "%Y", &tm);
+		snprintf(buf, ITSA_TAX_YEAR_SZ + 1, "%s-%s", year2, year + 2);
+	} else {
+		tm.tm_year++;
+		strftime(year2, sizeof(year2), "%Y", &tm);
+		snprintf(buf, ITSA_TAX_YEAR_SZ + 1, "%s-%s", year, year2 + 2);
+	}
+
+	return buf;
+}
+
+/*
+ * Just enough of a JSON scanner to find where things are in libmtdac's
+ * responses, without building any trees. These return a pointer to just
+ * past what they skipped or NULL if it's malformed.
+ */
+static const char *skip_ws(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' ||
+			   *p == '\r'))
+		p++;
+
+	return p;
+}
+
+static const char *skip_string(const char *p, const char *end)
+{
+	for (p++; p < end; p++) {
+		if (*p == '\\')
+			p++;
+		else if (*p == '"')
+			return p + 1;
+	}
+
+	return NULL;
+}
+
+static const char *skip_value(const char *p, const char *end)
+{
+	int depth = 0;
+
+	do {
+		if (p >= end)
+			return NULL;
+
+		switch (*p) {
+		case '"':
+			p = skip_string(p, end);
+			if (!p)
+				return NULL;
+			continue;
+		case '{':
+		case '[':
+			depth++;
+			break;
+		case '}':
+		case ']':
+			if (--depth < 0)
+				return NULL;
+			break;
+		case ',':
+		case ':':
+		case ' ':
+		case '\t':
+		case '\n':
+		case '\r':
+			if (depth == 0)
+				return NULL;
+			break;
+		default:
+			/* A bare number, true, false or null */
+			if (depth == 0) {
+				while (p < end && !strchr(",]} \t\n\r", *p))
+					p++;
+				return p;
+			}
+		}
+		p++;
+	} while (depth > 0);
+
+	return p;
+}
+
+/*
+ * Find the value of key in the object starting at p, setting vstart &
+ * vend to its extent.
+ */
+static bool find_member(const char *p, const char *end, const char *key,
+			const char **vstart, const char **vend)
+{
+	size_t klen = strlen(key);
+
+	p = skip_ws(p, end);
+	if (p >= end || *p != '{')
+		return false;
+
+	for (p = skip_ws(p + 1, end); p < end && *p == '"'; ) {
+		const char *kstart = p + 1;
+		bool match;
+
+		p = skip_string(p, end);
+		if (!p)
+			return false;
+		match = (size_t)(p - 1 - kstart) == klen &&
+			memcmp(kstart, key, klen) == 0;
+
+		p = skip_ws(p, end);
+		if (p >= end || *p != ':')
+			return false;
+		p = skip_ws(p + 1, end);
+		*vstart = p;
+		p = skip_value(p, end);
+		if (!p)
+			return false;
+		if (match) {
+			*vend = p;
+			return true;
+		}
+
+		p = skip_ws(p, end);
+		if (p < end && *p == ',')
+			p = skip_ws(p + 1, end);
+	}
+
+	return false;
+}
+
+/* Find the extent of the last element of the array in buf */
+static bool find_last_elem(const char *p, const char *end,
+			   const char **estart, const char **eend)
+{
+	bool found = false;
+
+	p = skip_ws(p, end);
+	if (p >= end || *p != '[')
+		return false;
+
+	for (p = skip_ws(p + 1, end); p < end && *p != ']'; ) {
+		const char *start = p;
+
+		p = skip_value(p, end);
+		if (!p)
+			return false;
+		*estart = start;
+		*eend = p;
+		found = true;
+
+		p = skip_ws(p, end);
+		if (p < end && *p == ',')
+			p = skip_ws(p + 1, end);
+	}
+
+	return found;
+}
+
+/*
+ * libmtdac returns an array of the request(s) made, we want the
+ * result of the last one.
+ *
+ * Calculations especially can be large, so rather than parsing the
+ * whole lot and copying out the bit we want, find where the result is
+ * and only parse that. If it can't be found that way, fall back to
+ * doing it the long way round.
+ */
+json_t *itsa_result_json(const char *buf)
+{
+	json_t *jarray;
+	json_t *root;
+	json_t *result;
+	const char *end;
+	const char *estart;
+	const char *eend;
+	const char *vstart;
+	const char *vend;
+	int64_t tstart = itsa_trace_begin();
+
+	if (!buf)
+		return NULL;
+
+	end = buf + strlen(buf);
+	if (find_last_elem(buf, end, &estart, &eend) &&
+	    find_member(estart, eend, "result", &vstart, &vend)) {
+		result = json_loadb(vstart, vend - vstart, JSON_DECODE_ANY,
+				    NULL);
+		if (result)
+			goto out;
+	}
+
+	jarray = json_loads(buf, 0, NULL);
+	root = json_array_get(jarray, json_array_size(jarray) - 1);
+	result = json_incref(json_object_get(root, "result"));
+	json_decref(jarray);
+
+out:
+	itsa_trace_end("json", "itsa_result_json", tstart);
+
+	return result;
+}
+
+struct itsa_ctx *itsa_ctx_new(const struct itsa_business *bus,
+			      const struct itsa_ops *ops, void *user_data)
+{
+	struct itsa_ctx *ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+
+	ctx->bus.bid = bus->bid ? strdup(bus->bid) : NULL;
+	ctx->bus.btype = bus->btype ? strdup(bus->btype) : NULL;
+	ctx->bus.bname = bus->bname ? strdup(bus->bname) : NULL;
+	ctx->bus.gnc = bus->gnc ? strdup(bus->gnc) : NULL;
+
+	ctx->ops = ops;
+	ctx->user_data = user_data;
+
+	pthread_mutex_init(&ctx->lock, NULL);
+	api_cond_init(&ctx->cond);
+
+	return ctx;
+}
+
+/*
+ * Requests made with this context from other threads (those with a
+ * deadline or that are hedged) initialise libmtdac with cfg, rather
+ * than the default given to itsa_set_mtd_cfg(). For when contexts in
+ * different threads are for different taxpayers, i.e config_dir's.
+ *
+ * cfg is copied (along with its config_dir), NULL reverts to the
+ * default.
+ */
+int itsa_ctx_set_mtd_cfg(struct itsa_ctx *ctx, unsigned int mtd_flags,
+			 const struct mtd_cfg *cfg)
+{
+	struct mtd_cfg *copy = NULL;
+
+	if (cfg) {
+		copy = malloc(sizeof(*copy));
+		if (!copy)
+			return -ITSA_ERR_OS;
+		*copy = *cfg;
+		if (cfg->config_dir) {
+			copy->config_dir = strdup(cfg->config_dir);
+			if (!copy->config_dir) {
+				free(copy);
+				return -ITSA_ERR_OS;
+			}
+		}
+	}
+
+	if (ctx->mtd_cfg)
+		free((void *)ctx->mtd_cfg->config_dir);
+	free(ctx->mtd_cfg);
+	ctx->mtd_cfg = copy;
+	ctx->mtd_flags = mtd_flags & ~MTD_OPT_GLOBAL_INIT;
+
+	return 0;
+}
+
+/* Whose credentials the context is using, NULL for the default */
+static const char *ctx_config_dir(const struct itsa_ctx *ctx)
+{
+	return ctx->mtd_cfg ? ctx->mtd_cfg->config_dir : NULL;
+}
+
+/*
+ * Set the priority of the requests made with this context. Background
+ * requests are held back while there are interactive ones waiting.
+ */
+void itsa_ctx_set_priority(struct itsa_ctx *ctx, enum itsa_priority prio)
+{
+	ctx->prio = prio;
+}
+
+/*
+ * Give the operations done with this context an overall time budget of
+ * ms milliseconds from now, 0 removes it. Anything still outstanding
+ * when it runs out fails with -ITSA_ERR_DEADLINE.
+ */
+void itsa_ctx_set_deadline(struct itsa_ctx *ctx, unsigned long ms)
+{
+	ctx->deadline = ms ? api_now() + (int64_t)ms * 1000000 : 0;
+	ctx->paused_at = 0;
+	ctx->deadline_hit = false;
+}
+
+/*
+ * Stop the clock, e.g while waiting on the user, who shouldn't eat
+ * into the budget.
+ */
+void itsa_ctx_pause_deadline(struct itsa_ctx *ctx)
+{
+	if (ctx->deadline && !ctx->paused_at)
+		ctx->paused_at = api_now();
+}
+
+void itsa_ctx_resume_deadline(struct itsa_ctx *ctx)
+{
+	if (!ctx->paused_at)
+		return;
+
+	ctx->deadline += api_now() - ctx->paused_at;
+	ctx->paused_at = 0;
+}
+
+/* Whether an operation has failed due to the deadline passing */
+bool itsa_ctx_deadline_expired(const struct itsa_ctx *ctx)
+{
+	return ctx->deadline_hit;
+}
+
+/*
+ * Cancel whatever is being done with the context, from any thread.
+ * Requests not yet sent (including those waiting on the rate limit or
+ * backing off waiting for a calculation) fail with -ITSA_ERR_CANCELLED,
+ * one already in flight is allowed to finish. The context can't be used for anything else after this.
+ */
+void itsa_ctx_cancel(struct itsa_ctx *ctx)
+{
+	pthread_mutex_lock(&ctx->lock);
+	__atomic_store_n(&ctx->cancelled, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+	api_wake();
+}
+
+static bool ctx_cancelled(struct itsa_ctx *ctx)
+{
+	return __atomic_load_n(&ctx->cancelled, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Wait for secs, or until the deadline or the context is cancelled.
+ * Returns -ITSA_ERR_CANCELLED if it was.
+ */
+static int ctx_sleep(struct itsa_ctx *ctx, int secs)
+{
+	int64_t until = api_now() + secs * API_NS_SEC;
+	struct timespec ts;
+
+	if (ctx->deadline && ctx->deadline < until)
+		until = ctx->deadline;
+	ts.tv_sec = until / API_NS_SEC;
+	ts.tv_nsec = until % API_NS_SEC;
+
+	pthread_mutex_lock(&ctx->lock);
+	while (!ctx_cancelled(ctx) && api_now() < until)
+		pthread_cond_timedwait(&ctx->cond, &ctx->lock, &ts);
+	pthread_mutex_unlock(&ctx->lock);
+
+	return ctx_cancelled(ctx) ? -ITSA_ERR_CANCELLED : 0;
+}
+
+/* sent is set to whether the request may have reached HMRC */
+static int __ctx_exec(struct itsa_ctx *ctx, struct api_req *req, char **jbuf,
+		      bool *sent)
+{
+	int err;
+
+	req->prio = ctx->prio;
+	req->deadline = ctx->deadline;
+	req->cancelled = &ctx->cancelled;
+	req->mtd_flags = ctx->mtd_flags;
+	req->mtd_cfg = ctx->mtd_cfg;
+
+	err = api_exec(req, jbuf, sent);
+	if (err == -ITSA_ERR_DEADLINE) {
+		ctx->deadline_hit = true;
+		set_err_detailf(ctx, "Deadline exceeded during %s",
+				api_op_name(req->op));
+		*jbuf = ctx->err_detail ? strdup(ctx->err_detail) : NULL;
+	} else if (err == -ITSA_ERR_CANCELLED) {
+		set_err_detailf(ctx, "Cancelled before %s",
+				api_op_name(req->op));
+		*jbuf = ctx->err_detail ? strdup(ctx->err_detail) : NULL;
+	}
+
+	return err;
+}
+
+static int ctx_exec(struct itsa_ctx *ctx, struct api_req *req, char **jbuf)
+{
+	bool sent;
+
+	return __ctx_exec(ctx, req, jbuf, &sent);
+}
+
+/*
+ * For submitting things.
+ *
+ * If key is given and it's the same as what was last submitted under
+ * it, it's skipped and ITSA_UNCHANGED returned.
+ *
+ * If it's to be queued, or couldn't be sent for what's likely a passing
+ * reason (and it's safe to send again, see api_resendable()), it's
+ * queued and ITSA_QUEUED returned.
+ */
+static int ctx_submit(struct itsa_ctx *ctx, struct api_req *req,
+		      const char *key, char **jbuf)
+{
+	bool sent;
+	int err;
+
+	*jbuf = NULL;
+	if (key && sub_unchanged(key, req->body))
+		return ITSA_UNCHANGED;
+
+	if (queue_always()) {
+		err = queue_add(ctx->bus.bid, ctx_config_dir(ctx), req, key);
+		return err ? err : ITSA_QUEUED;
+	}
+
+	err = __ctx_exec(ctx, req, jbuf, &sent);
+	if (!err && key) {
+		sub_record(key, req->body);
+	} else if (err && queue_enabled() && !ctx_cancelled(ctx) &&
+		   api_resendable(req, err, *jbuf, sent)) {
+		if (queue_add(ctx->bus.bid, ctx_config_dir(ctx), req,
+			      key) == 0)
+			err = ITSA_QUEUED;
+	}
+
+	return err;
+}
+
+/*
+ * Try sending something from the queue, recording the outcome. If HMRC
+ * rejected it outright, it's dropped from the queue and
+ * -ITSA_ERR_REJECTED returned.
+ *
+ * ctx must be set up (see itsa_ctx_set_mtd_cfg()) as whoever it was
+ * queued for, and the calling thread have done mtd_init() likewise.
+ */
+int itsa_queue_send(struct itsa_ctx *ctx, const struct itsa_queue_entry *entry)
+{
+	struct api_req req = { .op = api_op_from_name(entry->op) };
+	const char *key;
+	json_t *args;
+	char *jbuf;
+	int i;
+	int err;
+
+	if (req.op == API_OP_MAX) {
+		set_err_detailf(ctx, "Unknown queued operation : %s",
+				entry->op);
+		return -ITSA_ERR_INVALID;
+	}
+	/* Never send something under someone else's credentials */
+	if (strcmp(entry->config_dir ?: "", ctx_config_dir(ctx) ?: "") != 0) {
+		set_err_detailf(ctx, "Queued for %s",
+				entry->config_dir ?: "the default config");
+		return -ITSA_ERR_INVALID;
+	}
+
+	args = json_object_get(entry->req, "args");
+	for (i = 0; i < API_MAX_ARGS; i++)
+		req.args[i] = json_string_value(json_array_get(args, i));
+	req.body = json_string_value(json_object_get(entry->req, "body"));
+
+	err = ctx_exec(ctx, &req, &jbuf);
+	set_err_detail(ctx, jbuf);
+	if (err && api_rejected(err, jbuf)) {
+		/* It'll never go, so don't let it hold anything else up */
+		queue_dropped(entry->id, jbuf);
+		return -ITSA_ERR_REJECTED;
+	} else if (err) {
+		queue_failed(entry->id, ctx->err_detail ? ctx->err_detail :
+			     itsa_err2str(err));
+		return err;
+	}
+
+	/* The submit index is only the default taxpayer's */
+	key = json_string_value(json_object_get(entry->req, "key"));
+	if (key && !entry->config_dir)
+		sub_record(key, req.body);
+	queue_done(entry->id);
+
+	return 0;
+}
+
+void itsa_ctx_free(struct itsa_ctx *ctx)
+{
+	if (!ctx)
+		return;
+
+	sqlite3_finalize(ctx->acc_stmt);
+	sqlite3_finalize(ctx->splits_stmt);
+	sqlite3_finalize(ctx->trans_stmt);
+	sqlite3_close(ctx->db);
+
+	free((void *)ctx->bus.bid);
+	free((void *)ctx->bus.btype);
+	free((void *)ctx->bus.bname);
+	free((void *)ctx->bus.gnc);
+	free(ctx->err_detail);
+	itsa_ctx_set_mtd_cfg(ctx, 0, NULL);
+	pthread_cond_destroy(&ctx->cond);
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx);
+}
+
+static bool confirm(const struct itsa_ctx *ctx, enum itsa_confirm what,
+		    const json_t *data)
+{
+	if (!ctx->ops || !ctx->ops->confirm)
+		return false;
+
+	return ctx->ops->confirm(ctx->user_data, what, data);
+}
+
+/*
+ * The GnuCash book is opened on first use and kept open (along with
+ * the prepared statements) for the life of the context.
+ *
+ * transactions.guid	-> splits.tx_guid	: Item value
+ * splits.account_guid	-> accounts.guid	: Account type (in/out)
+ */
+static int open_db(struct itsa_ctx *ctx)
+{
+	int err;
+
+	if (ctx->db)
+		return 0;
+
+	err = sqlite3_open(ctx->bus.gnc, &ctx->db);
+	if (err)
+		goto out_err;
+
+	err = sqlite3_prepare_v2(ctx->db,
+				 "SELECT * FROM transactions WHERE "
+				 "post_date >= ? AND post_date <= ?", -1,
+				 &ctx->trans_stmt, NULL);
+	if (err)
+		goto out_err;
+
+	err = sqlite3_prepare_v2(ctx->db,
+				 "SELECT value_num, account_guid FROM splits "
+				 "WHERE tx_guid = ? AND value_num > 0 LIMIT 1",
+				 -1, &ctx->splits_stmt, NULL);
+	if (err)
+		goto out_err;
+
+	err = sqlite3_prepare_v2(ctx->db,
+				 "SELECT account_type FROM accounts WHERE "
+				 "guid = ?", -1, &ctx->acc_stmt, NULL);
+	if (err)
+		goto out_err;
+
+	return 0;
+
+out_err:
+	set_err_detailf(ctx, "%s: %s", ctx->bus.gnc, sqlite3_errstr(err));
+	sqlite3_finalize(ctx->acc_stmt);
+	sqlite3_finalize(ctx->splits_stmt);
+	sqlite3_finalize(ctx->trans_stmt);
+	sqlite3_close(ctx->db);
+	ctx->acc_stmt = ctx->splits_stmt = ctx->trans_stmt = NULL;
+	ctx->db = NULL;
+
+	return -ITSA_ERR_DB;
+}
+
+static int add_item(struct itsa_period *period, const char *date,
+		    const char *desc, long amount, enum itsa_item_type type)
+{
+	struct itsa_item *items;
+	struct itsa_item *item;
+
+	items = realloc(period->items,
+			sizeof(*items) * (period->nr_items + 1));
+	if (!items)
+		return -ITSA_ERR_OS;
+	period->items = items;
+
+	item = &items[period->nr_items];
+	snprintf(item->date, sizeof(item->date), "%s", date ? date : "");
+	item->desc = strdup(desc ? desc : "");
+	item->amount = amount;
+	item->type = type;
+
+	period->nr_items++;
+
+	return 0;
+}
+
+void itsa_period_free(struct itsa_period *period)
+{
+	size_t i;
+
+	for (i = 0; i < period->nr_items; i++)
+		free(period->items[i].desc);
+	free(period->items);
+
+	period->items = NULL;
+	period->nr_items = 0;
+}
+
+/*
+ * Find which of the periods (if any) a transaction posted on date
+ * belongs in, using the same comparison as the transactions query.
+ */
+static struct itsa_period *find_period(struct itsa_period *periods,
+				       size_t nr, const char *date)
+{
+	size_t i;
+
+	if (!date)
+		return NULL;
+
+	for (i = 0; i < nr; i++) {
+		if (strcmp(date, periods[i].start) >= 0 &&
+		    strcmp(date, periods[i].end) <= 0)
+			return &periods[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Sort the transactions between start & end into the given periods,
+ * in a single pass over the book.
+ */
+static int get_period_items(struct itsa_ctx *ctx, const char *start,
+			    const char *end, struct itsa_period *periods,
+			    size_t nr)
+{
+	int ret;
+
+	ret = open_db(ctx);
+	if (ret)
+		return ret;
+
+	sqlite3_bind_text(ctx->trans_stmt, 1, start, strlen(start),
+			  SQLITE_STATIC);
+	sqlite3_bind_text(ctx->trans_stmt, 2, end, strlen(end),
+			  SQLITE_STATIC);
+
+	while (sqlite3_step(ctx->trans_stmt) == SQLITE_ROW) {
+		const char *account;
+		const unsigned char *date =
+			sqlite3_column_text(ctx->trans_stmt, 3);
+		const unsigned char *desc =
+			sqlite3_column_text(ctx->trans_stmt, 5);
+		const unsigned char *tx_guid =
+			sqlite3_column_text(ctx->trans_stmt, 0);
+		const unsigned char *account_guid;
+		struct itsa_period *period;
+		enum itsa_item_type type;
+		long amnt;
+
+		period = find_period(periods, nr, (const char *)date);
+		if (!period)
+			continue;
+
+		sqlite3_bind_text(ctx->splits_stmt, 1, (const char *)tx_guid,
+				  sqlite3_column_bytes(ctx->trans_stmt, 0),
+				  SQLITE_STATIC);
+		sqlite3_step(ctx->splits_stmt);
+
+		amnt = sqlite3_column_int(ctx->splits_stmt, 0);
+		account_guid = sqlite3_column_text(ctx->splits_stmt, 1);
+		sqlite3_bind_text(ctx->acc_stmt, 1, (const char *)account_guid,
+				  sqlite3_column_bytes(ctx->splits_stmt, 1),
+				  SQLITE_STATIC);
+		sqlite3_step(ctx->acc_stmt);
+
+		account = (const char *)sqlite3_column_text(ctx->acc_stmt, 0);
+		if (account && strcmp(account, "BANK") == 0) {
+			type = ITSA_ITEM_INCOME;
+			period->income += amnt;
+		} else if (account && strcmp(account, "EXPENSE") == 0) {
+			type = ITSA_ITEM_EXPENSE;
+			period->expenses += amnt;
+		} else {
+			set_err_detailf(ctx, "Unknown account type : %s",
+					account ? account : "(null)");
+			ret = -ITSA_ERR_ACCOUNT_TYPE;
+		}
+		if (!ret)
+			ret = add_item(period, (const char *)date,
+				       (const char *)desc, amnt, type);
+
+		sqlite3_reset(ctx->acc_stmt);
+		sqlite3_reset(ctx->splits_stmt);
+
+		if (ret)
+			break;
+	}
+	sqlite3_reset(ctx->trans_stmt);
+
+	return ret;
+}
+
+/*
+ * Extract the income & expense items and totals for the given period
+ * from the GnuCash book.
+ *
+ * period should be freed with itsa_period_free()
+ */
+int itsa_get_period(struct itsa_ctx *ctx, const char *start, const char *end,
+		    struct itsa_period *period)
+{
+	int ret;
+
+	memset(period, 0, sizeof(*period));
+	snprintf(period->start, sizeof(period->start), "%s", start);
+	snprintf(period->end, sizeof(period->end), "%s", end);
+
+	ret = get_period_items(ctx, start, end, period, 1);
+	if (ret)
+		itsa_period_free(period);
+
+	return ret;
+}
+
+/*
+ * Like itsa_get_period() but for several periods at once, whose start &
+ * end must already be set. The book is only scanned once, covering from
+ * the earliest start to the latest end.
+ *
+ * Each period should be freed with itsa_period_free()
+ */
+int itsa_get_periods(struct itsa_ctx *ctx, struct itsa_period *periods,
+		     size_t nr)
+{
+	const char *start;
+	const char *end;
+	size_t i;
+	int ret;
+
+	if (nr == 0)
+		return 0;
+
+	start = periods[0].start;
+	end = periods[0].end;
+	for (i = 0; i < nr; i++) {
+		periods[i].income = periods[i].expenses = 0;
+		periods[i].items = NULL;
+		periods[i].nr_items = 0;
+
+		if (strcmp(periods[i].start, start) < 0)
+			start = periods[i].start;
+		if (strcmp(periods[i].end, end) > 0)
+			end = periods[i].end;
+	}
+
+	ret = get_period_items(ctx, start, end, periods, nr);
+	if (ret) {
+		for (i = 0; i < nr; i++)
+			itsa_period_free(&periods[i]);
+	}
+
+	return ret;
+}
+
+/*
+ * Create or update a period with HMRC.
+ *
+ * Returns ITSA_UNCHANGED or ITSA_QUEUED (see ctx_submit()).
+ */
+int itsa_set_period(struct itsa_ctx *ctx, const struct itsa_period *period,
+		    enum itsa_period_action action)
+{
+	struct api_req req = { .args[0] = ctx->bus.bid };
+	ac_jsonw_t *json;
+	char period_id[32];
+	char key[128];
+	char *jbuf;
+	int err;
+
+	json = ac_jsonw_init();
+
+	ac_jsonw_add_str(json, "from", period->start);
+	ac_jsonw_add_str(json, "to", period->end);
+
+	ac_jsonw_add_object(json, "incomes");
+	ac_jsonw_add_object(json, "turnover");
+	ac_jsonw_add_real(json, "amount", period->income / 100.0f, 2);
+	ac_jsonw_end_object(json);
+	ac_jsonw_end_object(json);
+
+	ac_jsonw_add_real(json, "consolidatedExpenses",
+			  period->expenses / 100.0f, 2);
+
+	ac_jsonw_end(json);
+
+	req.body = ac_jsonw_get(json);
+
+	if (action == ITSA_PERIOD_CREATE) {
+		req.op = API_SE_CREATE_PERIOD;
+	} else {
+		snprintf(period_id, sizeof(period_id), "%s_%s",
+			 period->start, period->end);
+		req.op = API_SE_UPDATE_PERIOD;
+		req.args[1] = period_id;
+	}
+	snprintf(key, sizeof(key), "period/%s/%s_%s", ctx->bus.bid,
+		 period->start, period->end);
+	err = ctx_submit(ctx, &req, key, &jbuf);
+	set_err_detail(ctx, jbuf);
+
+	ac_jsonw_free(json);
+
+	return err;
+}
+
+void itsa_obligations_free(struct itsa_obligation *obligations, size_t nr)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++) {
+		free(obligations[i].start);
+		free(obligations[i].end);
+		free(obligations[i].due);
+		free(obligations[i].received);
+	}
+	free(obligations);
+}
+
+/*
+ * List the obligations of the given type, optionally limited to the
+ * from/to date range.
+ *
+ * obligations should be freed with itsa_obligations_free()
+ */
+int itsa_list_obligations(struct itsa_ctx *ctx, enum itsa_obligation_type type,
+			  const char *from, const char *to,
+			  struct itsa_obligation **obligations, size_t *nr)
+{
+	struct api_req req = {
+		.op = type == ITSA_OB_PERIOD ? API_OB_LIST_PERIOD :
+					       API_OB_LIST_EOPS
+	};
+	json_t *result;
+	json_t *obs;
+	json_t *period;
+	char qs[192];
+	char *jbuf;
+	size_t index;
+	int len;
+	int err;
+
+	*obligations = NULL;
+	*nr = 0;
+
+	len = snprintf(qs, sizeof(qs), "?typeOfBusiness=%s&businessId=%s",
+		       ctx->bus.btype, ctx->bus.bid);
+	if (from && to)
+		snprintf(qs + len, sizeof(qs) - len, "&fromDate=%s&toDate=%s",
+			 from, to);
+
+	req.args[0] = qs;
+	err = ctx_exec(ctx, &req, &jbuf);
+	set_err_detail(ctx, jbuf);
+	if (err)
+		return err;
+
+	result = itsa_result_json(jbuf);
+	obs = json_object_get(result, "obligations");
+	obs = json_array_get(obs, 0);
+	obs = json_object_get(obs, "obligationDetails");
+
+	*obligations = calloc(json_array_size(obs) + 1,
+			      sizeof(struct itsa_obligation));
+	if (!*obligations) {
+		json_decref(result);
+		return -ITSA_ERR_OS;
+	}
+
+	json_array_foreach(obs, index, period) {
+		struct itsa_obligation *ob = *obligations + index;
+		json_t *status = json_object_get(period, "status");
+		json_t *recvd = json_object_get(period, "receivedDate");
+		const char *str = json_string_value(status);
+
+		ob->start = jstrdup(json_object_get(period,
+						    "periodStartDate"));
+		ob->end = jstrdup(json_object_get(period, "periodEndDate"));
+		ob->due = jstrdup(json_object_get(period, "dueDate"));
+		ob->received = jstrdup(recvd);
+		ob->status = str ? *str : '?';
+		ob->met = (str && *str == 'F') || recvd;
+	}
+	*nr = json_array_size(obs);
+
+	json_decref(result);
+
+	return 0;
+}
+
+/*
+ * For doing request back-off, following the Fibonaci Sequence
+ * (skipping 0)
+ */
+static int next_fib(int fib[2])
+{
+	int Fn = fib[0] + fib[1];
+
+	if (Fn == 0)
+		Fn = 1;
+	fib[0] = fib[1];
+	fib[1] = Fn;
+
+	return Fn;
+}
+
+/*
+ * Trigger a new calculation for the given tax year.
+ *
+ * cid is set to the new calculation id and should be free(3)'d.
+ */
+int itsa_trigger_calculation(struct itsa_ctx *ctx, const char *tax_year,
+			     bool final_decl, char **cid)
+{
+	struct api_req req = {
+		.op = API_IC_TRIGGER_CALC,
+		.args = { tax_year,
+			  final_decl ? "?finalDeclaration=true" : NULL }
+	};
+	json_t *result;
+	json_t *cid_obj;
+	char *jbuf;
+	int err;
+
+	*cid = NULL;
+
+	err = ctx_exec(ctx, &req, &jbuf);
+	set_err_detail(ctx, jbuf);
+	if (err)
+		return err;
+
+	result = itsa_result_json(jbuf);
+	cid_obj = json_object_get(result, "calculationId");
+	if (!cid_obj)
+		cid_obj = json_object_get(result, "id");
+	*cid = jstrdup(cid_obj);
+	json_decref(result);
+
+	if (!*cid)
+		return -ITSA_ERR_NO_CALC_ID;
+
+	return 0;
+}
+
+/*
+ * Get the given calculation. As calculations take a little while to
+ * become available after being triggered, we back-off & retry for a
+ * while.
+ *
+ * Calculations already in the local store are taken from there.
+ *
+ * result should be json_decref()'d
+ */
+int itsa_get_calculation(struct itsa_ctx *ctx, const char *tax_year,
+			 const char *cid, json_t **result)
+{
+	struct api_req req = {
+		.op = API_IC_GET_CALC,
+		.args = { tax_year, cid }
+	};
+	char *jbuf;
+	int fib[2] = { 0, 0 };
+	int fib_sleep = 0;
+	int err;
+
+	*result = NULL;
+
+	if (cs_get(tax_year, cid, result) == 0)
+		return 0;
+
+again:
+	err = ctx_exec(ctx, &req, &jbuf);
+	set_err_detail(ctx, jbuf);
+	if (err == -MTD_ERR_REQUEST && fib_sleep != CALC_MAX_BACKOFF) {
+		if (ctx_cancelled(ctx))
+			return -ITSA_ERR_CANCELLED;
+		fib_sleep = next_fib(fib);
+		if (ctx->deadline &&
+		    api_now() + fib_sleep * API_NS_SEC > ctx->deadline) {
+			ctx->deadline_hit = true;
+			set_err_detailf(ctx, "Deadline exceeded waiting for "
+					"calculation %s", cid);
+			return -ITSA_ERR_DEADLINE;
+		}
+		if (ctx->ops && ctx->ops->calc_retry)
+			ctx->ops->calc_retry(ctx->user_data, fib_sleep);
+		if (ctx_sleep(ctx, fib_sleep))
+			return -ITSA_ERR_CANCELLED;
+
+		goto again;
+	}
+	if (err)
+		return err;
+
+	*result = itsa_result_json(jbuf);
+	if (*result)
+		cs_put(tax_year, cid, *result);
+
+	return 0;
+}
+
+void itsa_calculations_free(struct itsa_calculation *calcs, size_t nr)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++) {
+		free(calcs[i].id);
+		free(calcs[i].tax_year);
+		free(calcs[i].type);
+		free(calcs[i].timestamp);
+	}
+	free(calcs);
+}
+
+/*
+ * List the calculations, optionally for the given tax year.
+ *
+ * calcs should be freed with itsa_calculations_free()
+ */
+int itsa_list_calculations(struct itsa_ctx *ctx, const char *tax_year,
+			   struct itsa_calculation **calcs, size_t *nr)
+{
+	struct api_req req = { .op = API_IC_LIST_CALCS };
+	json_t *result;
+	json_t *obs;
+	json_t *calculation;
+	char *jbuf;
+	char qs[20] = "\0";
+	size_t index;
+	int err;
+
+	*calcs = NULL;
+	*nr = 0;
+
+	if (tax_year)
+		snprintf(qs, sizeof(qs), "?taxYear=%s", tax_year);
+
+	req.args[0] = qs;
+	err = ctx_exec(ctx, &req, &jbuf);
+	set_err_detail(ctx, jbuf);
+	if (err)
+		return err;
+
+	result = itsa_result_json(jbuf);
+	obs = json_object_get(result, "calculations");
+
+	*calcs = calloc(json_array_size(obs) + 1,
+			sizeof(struct itsa_calculation));
+	if (!*calcs) {
+		json_decref(result);
+		return -ITSA_ERR_OS;
+	}
+
+	json_array_foreach(obs, index, calculation) {
+		struct itsa_calculation *calc = *calcs + index;
+
+		calc->id = jstrdup(json_object_get(calculation,
+						   "calculationId"));
+		calc->tax_year = jstrdup(json_object_get(calculation,
+							 "taxYear"));
+		calc->type = jstrdup(json_object_get(calculation,
+						     "calculationType"));
+		calc->timestamp = jstrdup(json_object_get(calculation,
+						"calculationTimestamp"));
+	}
+	*nr = json_array_size(obs);
+
+	json_decref(result);
+
+	return 0;
+}
+
+int itsa_get_biss_summary(struct itsa_ctx *ctx, const char *tax_year,
+			  json_t **result)
+{
+	struct api_req req = {
+		.op = API_BISS_GET_SUMMARY,
+		.args = { "self-employment", tax_year, ctx->bus.bid }
+	};
+	char *jbuf;
+	int err;
+
+	*result = NULL;
+
+	err = ctx_exec(ctx, &req, &jbuf);
+	set_err_detail(ctx, jbuf);
+	if (err)
+		return err;
+
+	*result = itsa_result_json(jbuf);
+
+	return 0;
+}
+
+/*
+ * Get the annual summary for the given tax year. If there isn't one
+ * yet, an empty object is returned.
+ */
+int itsa_get_annual_summary(struct itsa_ctx *ctx, const char *tax_year,
+			    json_t **result)
+{
+	struct api_req req = {
+		.op = API_SE_GET_ANNUAL_SUMMARY,
+		.args = { ctx->bus.bid, tax_year }
+	};
+	char *jbuf;
+	int err;
+
+	*result = NULL;
+
+	err = ctx_exec(ctx, &req, &jbuf);
+	set_err_detail(ctx, jbuf);
+	if (err && mtd_http_status_code(jbuf) != MTD_HTTP_NOT_FOUND)
+		return err;
+
+	*result = err ? NULL : itsa_result_json(jbuf);
+	if (!*result || json_is_null(*result)) {
+		json_decref(*result);
+		*result = json_object();
+	}
+
+	return 0;
+}
+
+/* Returns ITSA_UNCHANGED or ITSA_QUEUED (see ctx_submit()) */
+int itsa_update_annual_summary(struct itsa_ctx *ctx, const char *tax_year,
+			       const json_t *summary)
+{
+	struct api_req req = {
+		.op = API_SE_UPDATE_ANNUAL_SUMMARY,
+		.args = { ctx->bus.bid, tax_year }
+	};
+	char key[128];
+	char *jbuf;
+	char *buf;
+	int err;
+
+	buf = json_dumps(summary, JSON_INDENT(4));
+	if (!buf)
+		return -ITSA_ERR_INVALID;
+
+	snprintf(key, sizeof(key), "annual-summary/%s/%s", ctx->bus.bid,
+		 tax_year);
+	req.body = buf;
+	err = ctx_submit(ctx, &req, key, &jbuf);
+	set_err_detail(ctx, jbuf);
+	free(buf);
+
+	return err;
+}
+
+/*
+ * Submit an End of Period Statement for the given period.
+ *
+ * Returns 1 if it wasn't confirmed or ITSA_QUEUED.
+ */
+int itsa_submit_eops(struct itsa_ctx *ctx, const char *start, const char *end)
+{
+	struct api_req req = { .op = API_IBEOPS_SUBMIT_EOPS };
+	ac_jsonw_t *json;
+	json_t *data;
+	char *jbuf;
+	bool confirmed;
+	int err;
+
+	data = json_pack("{s:s, s:s}", "start", start, "end", end);
+	confirmed = confirm(ctx, ITSA_CONFIRM_EOPS, data);
+	json_decref(data);
+	if (!confirmed)
+		return 1;
+
+	json = ac_jsonw_init();
+	ac_jsonw_add_str(json, "typeOfBusiness", ctx->bus.btype);
+	ac_jsonw_add_str(json, "businessId", ctx->bus.bid);
+
+	ac_jsonw_add_object(json, "accountingPeriod");
+	ac_jsonw_add_str(json, "startDate", start);
+	ac_jsonw_add_str(json, "endDate", end);
+	ac_jsonw_end_object(json);
+
+	ac_jsonw_add_bool(json, "finalised", true);
+	ac_jsonw_end(json);
+
+	req.body = ac_jsonw_get(json);
+	err = ctx_submit(ctx, &req, NULL, &jbuf);
+	set_err_detail(ctx, jbuf);
+
+	ac_jsonw_free(json);
+
+	return err;
+}
+
+/*
+ * Trigger a final declaration calculation and if, after seeing it, the
+ * user confirms, submit the final declaration.
+ *
+ * The data passed to confirm() contains the taxYear, calculationId and
+ * the calculation.
+ *
+ * Returns 1 if it wasn't confirmed.
+ */
+int itsa_final_declaration(struct itsa_ctx *ctx, const char *tax_year)
+{
+	struct api_req req = {
+		.op = API_IC_FINAL_DECL,
+		.args[0] = tax_year
+	};
+	json_t *result;
+	json_t *data;
+	char *jbuf;
+	char *cid;
+	bool confirmed;
+	int err;
+
+	err = itsa_trigger_calculation(ctx, tax_year, true, &cid);
+	if (err)
+		return err;
+
+	err = itsa_get_calculation(ctx, tax_year, cid, &result);
+	if (err)
+		goto out_free_cid;
+
+	data = json_pack("{s:s, s:s, s:o}", "taxYear", tax_year,
+			 "calculationId", cid, "calculation", result);
+	confirmed = confirm(ctx, ITSA_CONFIRM_FINAL_DECL, data);
+	json_decref(data);
+	if (!confirmed) {
+		err = 1;
+		goto out_free_cid;
+	}
+
+	req.args[1] = cid;
+	err = ctx_exec(ctx, &req, &jbuf);
+	set_err_detail(ctx, jbuf);
+
+out_free_cid:
+	free(cid);
+
+	return err;
+}
+
+void itsa_savings_accounts_free(struct itsa_savings_account *accounts,
+				size_t nr)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++) {
+		free(accounts[i].id);
+		free(accounts[i].name);
+	}
+	free(accounts);
+}
+
+/*
+ * List the savings accounts. Having none is not an error.
+ *
+ * accounts should be freed with itsa_savings_accounts_free()
+ */
+int itsa_list_savings_accounts(struct itsa_ctx *ctx,
+			       struct itsa_savings_account **accounts,
+			       size_t *nr)
+{
+	struct api_req req = { .op = API_SA_LIST_ACCOUNTS };
+	json_t *result;
+	json_t *obs;
+	json_t *account;
+	char *jbuf;
+	size_t index;
+	int err;
+
+	*accounts = NULL;
+	*nr = 0;
+
+	err = ctx_exec(ctx, &req, &jbuf);
+	set_err_detail(ctx, jbuf);
+	if (err && mtd_http_status_code(jbuf) != MTD_HTTP_NOT_FOUND)
+		return err;
+
+	result = err ? NULL : itsa_result_json(jbuf);
+	obs = json_object_get(result, "savingsAccounts");
+
+	*accounts = calloc(json_array_size(obs) + 1,
+			   sizeof(struct itsa_savings_account));
+	if (!*accounts) {
+		json_decref(result);
+		return -ITSA_ERR_OS;
+	}
+
+	json_array_foreach(obs, index, account) {
+		struct itsa_savings_account *acc = *accounts + index;
+
+		acc->id = jstrdup(json_object_get(account, "id"));
+		acc->name = jstrdup(json_object_get(account, "accountName"));
+	}
+	*nr = json_array_size(obs);
+
+	json_decref(result);
+
+	return 0;
+}
+
+/*
+ * Add a new savings account with the given friendly name. The name
+ * is validated against ITSA_SAVINGS_ACCOUNT_NAME_CHARS and must be
+ * between 1 and 32 characters.
+ */
+int itsa_add_savings_account(struct itsa_ctx *ctx, const char *name)
+{
+	struct api_req req = { .op = API_SA_CREATE_ACCOUNT };
+	ac_jsonw_t *json;
+	regex_t re;
+	char *jbuf;
+	int err;
+
+	err = regcomp(&re, SAVINGS_ACCOUNT_NAME_REGEX, REG_EXTENDED);
+	if (err)
+		return -ITSA_ERR_OS;
+	err = regexec(&re, name, 0, NULL, 0);
+	regfree(&re);
+	if (err) {
+		set_err_detailf(ctx, "Invalid name : %s", name);
+		return -ITSA_ERR_INVALID;
+	}
+
+	json = ac_jsonw_init();
+	ac_jsonw_add_str(json, "accountName", name);
+	ac_jsonw_end(json);
+
+	req.body = ac_jsonw_get(json);
+	err = ctx_exec(ctx, &req, &jbuf);
+	set_err_detail(ctx, jbuf);
+
+	ac_jsonw_free(json);
+
+	return err;
+}
+
+/*
+ * Get the annual summary for the given savings account and tax year.
+ *
+ * Returns -ITSA_ERR_NOT_FOUND if there is no such account.
+ */
+int itsa_get_savings_summary(struct itsa_ctx *ctx, const char *said,
+			     const char *tax_year, json_t **result)
+{
+	struct api_req req = {
+		.op = API_SA_GET_ANNUAL_SUMMARY,
+		.args = { said, tax_year }
+	};
+	char *jbuf;
+	int err;
+
+	*result = NULL;
+
+	err = ctx_exec(ctx, &req, &jbuf);
+	set_err_detail(ctx, jbuf);
+	if (mtd_http_status_code(jbuf) == MTD_HTTP_NOT_FOUND)
+		return -ITSA_ERR_NOT_FOUND;
+	if (err)
+		return err;
+
+	*result = itsa_result_json(jbuf);
+	if (!*result)
+		*result = json_object();
+
+	return 0;
+}
+
+/* Returns ITSA_UNCHANGED or ITSA_QUEUED (see ctx_submit()) */
+int itsa_update_savings_summary(struct itsa_ctx *ctx, const char *said,
+				const char *tax_year, const json_t *summary)
+{
+	struct api_req req = {
+		.op = API_SA_UPDATE_ANNUAL_SUMMARY,
+		.args = { said, tax_year }
+	};
+	char key[128];
+	char *jbuf;
+	char *buf;
+	int err;
+
+	buf = json_dumps(summary, JSON_INDENT(4));
+	if (!buf)
+		return -ITSA_ERR_INVALID;
+
+	snprintf(key, sizeof(key), "savings/%s/%s", said, tax_year);
+	req.body = buf;
+	err = ctx_submit(ctx, &req, key, &jbuf);
+	set_err_detail(ctx, jbuf);
+	free(buf);
+
+	return err;
+}
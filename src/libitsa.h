@@ -0,0 +1,293 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * libitsa.h - Core itsa operations
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _LIBITSA_H_
+#define _LIBITSA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <jansson.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ITSA_TAX_YEAR_SZ		7
+#define ITSA_DATE_SZ			10
+
+#define ITSA_SAVINGS_ACCOUNT_NAME_CHARS	"A-Za-z0-9 &'()*,-./@£"
+
+/*
+ * Errors are returned as negative values. Anything below ITSA_ERR_BASE
+ * is a libmtdac error (enum mtd_error).
+ */
+#define ITSA_ERR_BASE			1000
+enum itsa_error {
+	ITSA_ERR_OS = ITSA_ERR_BASE,
+	ITSA_ERR_DB,
+	ITSA_ERR_ACCOUNT_TYPE,
+	ITSA_ERR_NOT_FOUND,
+	ITSA_ERR_INVALID,
+	ITSA_ERR_NO_CALC_ID,
+	ITSA_ERR_DEADLINE,
+	ITSA_ERR_CANCELLED,
+	ITSA_ERR_REJECTED,
+};
+
+/*
+ * Positive (i.e non-error) returns from functions that submit things,
+ * where noted.
+ */
+enum itsa_submit_status {
+	ITSA_UNCHANGED = 1,	/* Same as last submitted, so skipped */
+	ITSA_QUEUED,		/* Queued to be sent later */
+};
+
+enum itsa_period_action {
+	ITSA_PERIOD_CREATE,
+	ITSA_PERIOD_UPDATE,
+};
+
+enum itsa_obligation_type {
+	ITSA_OB_PERIOD,
+	ITSA_OB_EOPS,
+};
+
+enum itsa_item_type {
+	ITSA_ITEM_INCOME,
+	ITSA_ITEM_EXPENSE,
+};
+
+enum itsa_priority {
+	ITSA_PRIO_INTERACTIVE = 0,
+	ITSA_PRIO_BACKGROUND,
+
+	ITSA_PRIO_MAX
+};
+
+enum itsa_confirm {
+	ITSA_CONFIRM_EOPS,
+	ITSA_CONFIRM_FINAL_DECL,
+};
+
+struct itsa_business {
+	const char *bid;
+	const char *btype;
+	const char *bname;
+	const char *gnc;
+};
+
+struct itsa_item {
+	char date[ITSA_DATE_SZ + 1];
+	char *desc;
+	long amount;
+	enum itsa_item_type type;
+};
+
+/* Amounts are in pence */
+struct itsa_period {
+	char start[ITSA_DATE_SZ + 1];
+	char end[ITSA_DATE_SZ + 1];
+
+	long income;
+	long expenses;
+
+	struct itsa_item *items;
+	size_t nr_items;
+};
+
+struct itsa_obligation {
+	char *start;
+	char *end;
+	char *due;
+	char *received;
+	char status;
+	bool met;
+};
+
+struct itsa_calculation {
+	char *id;
+	char *tax_year;
+	char *type;
+	char *timestamp;
+};
+
+struct itsa_savings_account {
+	char *id;
+	char *name;
+};
+
+struct itsa_queue_entry {
+	unsigned long id;
+	int stage;		/* Sent in order of stage, then id */
+
+	char *op;
+	char *bid;
+	char *config_dir;	/* Whose it is, NULL for the default */
+	char *args;		/* Space separated, for display */
+	char *queued;
+
+	int attempts;
+	char *last_err;
+
+	json_t *req;		/* The request as queued */
+};
+
+struct itsa_op_stats {
+	const char *name;
+
+	unsigned long requests;
+	unsigned long errors;
+	unsigned long hedged;
+	unsigned long hedge_wins;
+
+	/* Request bodies sent & responses received, as libmtdac has them */
+	unsigned long long bytes_out;
+	unsigned long long bytes_in;
+
+	/* Latency of every attempt, successful or not, in microseconds */
+	unsigned long long lat_min_us;
+	unsigned long long lat_mean_us;
+	unsigned long long lat_p50_us;
+	unsigned long long lat_p90_us;
+	unsigned long long lat_p99_us;
+	unsigned long long lat_max_us;
+};
+
+struct itsa_ops {
+	/*
+	 * Called before anything is submitted that needs the users
+	 * consent. data contains what is about to be submitted.
+	 *
+	 * Return true to proceed. If not set, nothing that requires
+	 * confirmation will be submitted.
+	 */
+	bool (*confirm)(void *user_data, enum itsa_confirm what,
+			const json_t *data);
+	/* Called when waiting on a calculation to become available */
+	void (*calc_retry)(void *user_data, int secs);
+};
+
+struct itsa_ctx;
+struct mtd_cfg;
+
+#pragma GCC visibility push(default)
+
+extern struct itsa_ctx *itsa_ctx_new(const struct itsa_business *bus,
+				     const struct itsa_ops *ops,
+				     void *user_data);
+extern int itsa_ctx_set_mtd_cfg(struct itsa_ctx *ctx,
+				unsigned int mtd_flags,
+				const struct mtd_cfg *cfg);
+extern void itsa_ctx_set_priority(struct itsa_ctx *ctx,
+				  enum itsa_priority prio);
+extern void itsa_ctx_set_deadline(struct itsa_ctx *ctx, unsigned long ms);
+extern void itsa_ctx_pause_deadline(struct itsa_ctx *ctx);
+extern void itsa_ctx_resume_deadline(struct itsa_ctx *ctx);
+extern bool itsa_ctx_deadline_expired(const struct itsa_ctx *ctx);
+extern void itsa_ctx_cancel(struct itsa_ctx *ctx);
+extern void itsa_ctx_free(struct itsa_ctx *ctx);
+extern const char *itsa_err_detail(const struct itsa_ctx *ctx);
+extern const char *itsa_err2str(int err);
+
+extern time_t itsa_time(void);
+extern char *itsa_tax_year(const char *date, char *buf);
+extern json_t *itsa_result_json(const char *buf);
+extern void itsa_set_rate_limit(double rate, int burst);
+extern void itsa_set_mtd_cfg(unsigned int mtd_flags,
+			     const struct mtd_cfg *cfg);
+extern void itsa_set_hedging(bool enable);
+extern int itsa_get_stats(struct itsa_op_stats **stats, size_t *nr);
+extern bool itsa_mtd_needed(void);
+extern int itsa_use_standin(const json_t *cfg);
+extern int itsa_set_submit_index(const char *path);
+extern void itsa_set_force(bool force);
+extern void itsa_set_queue(const char *path);
+extern void itsa_set_queue_always(bool always);
+extern int64_t itsa_trace_begin(void);
+extern void itsa_trace_end(const char *cat, const char *name, int64_t start);
+
+extern int itsa_get_period(struct itsa_ctx *ctx, const char *start,
+			   const char *end, struct itsa_period *period);
+extern int itsa_get_periods(struct itsa_ctx *ctx, struct itsa_period *periods,
+			    size_t nr);
+extern void itsa_period_free(struct itsa_period *period);
+extern int itsa_set_period(struct itsa_ctx *ctx,
+			   const struct itsa_period *period,
+			   enum itsa_period_action action);
+
+extern int itsa_list_obligations(struct itsa_ctx *ctx,
+				 enum itsa_obligation_type type,
+				 const char *from, const char *to,
+				 struct itsa_obligation **obligations,
+				 size_t *nr);
+extern void itsa_obligations_free(struct itsa_obligation *obligations,
+				  size_t nr);
+
+extern int itsa_trigger_calculation(struct itsa_ctx *ctx,
+				    const char *tax_year, bool final_decl,
+				    char **cid);
+extern int itsa_get_calculation(struct itsa_ctx *ctx, const char *tax_year,
+				const char *cid, json_t **result);
+extern int itsa_list_calculations(struct itsa_ctx *ctx,
+				  const char *tax_year,
+				  struct itsa_calculation **calcs,
+				  size_t *nr);
+extern void itsa_calculations_free(struct itsa_calculation *calcs,
+				   size_t nr);
+extern void itsa_set_calc_store(const char *dir);
+extern int itsa_list_stored_calculations(const char *tax_year,
+					 struct itsa_calculation **calcs,
+					 size_t *nr);
+extern int itsa_get_stored_calculation(const char *tax_year, const char *cid,
+				       json_t **result);
+extern bool itsa_calculation_stored(const char *tax_year, const char *cid);
+
+extern int itsa_get_biss_summary(struct itsa_ctx *ctx, const char *tax_year,
+				 json_t **result);
+extern int itsa_get_annual_summary(struct itsa_ctx *ctx,
+				   const char *tax_year, json_t **result);
+extern int itsa_update_annual_summary(struct itsa_ctx *ctx,
+				      const char *tax_year,
+				      const json_t *summary);
+extern int itsa_submit_eops(struct itsa_ctx *ctx, const char *start,
+			    const char *end);
+extern int itsa_final_declaration(struct itsa_ctx *ctx,
+				  const char *tax_year);
+
+extern int itsa_list_savings_accounts(struct itsa_ctx *ctx,
+				      struct itsa_savings_account **accounts,
+				      size_t *nr);
+extern void itsa_savings_accounts_free(struct itsa_savings_account *accounts,
+				       size_t nr);
+extern int itsa_add_savings_account(struct itsa_ctx *ctx, const char *name);
+extern int itsa_get_savings_summary(struct itsa_ctx *ctx, const char *said,
+				    const char *tax_year, json_t **result);
+extern int itsa_update_savings_summary(struct itsa_ctx *ctx,
+				       const char *said,
+				       const char *tax_year,
+				       const json_t *summary);
+
+extern int itsa_queue_list(struct itsa_queue_entry **entries, size_t *nr);
+extern void itsa_queue_entries_free(struct itsa_queue_entry *entries,
+				    size_t nr);
+extern int itsa_queue_send(struct itsa_ctx *ctx,
+			   const struct itsa_queue_entry *entry);
+extern int itsa_queue_drop(unsigned long id, const char *why);
+extern void itsa_queue_compact(void);
+
+#pragma GCC visibility pop
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _LIBITSA_H_ */
@@ -0,0 +1,240 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * output.c - Machine readable output
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ *
+ * With --output=json|ndjson|csv, commands emit what they'd otherwise
+ * show in tables as flat records, each tagged with a type, e.g
+ *
+ *	{"type":"period","start":"2022-04-06","end":"2022-07-05",...}
+ *
+ * For the duration of the command the records get the real stdout all
+ * to themselves, while stdout is pointed at stderr so that everything
+ * else (messages, prompts etc) still reaches the user without getting
+ * mixed in with them.
+ *
+ *   json	A single array of the records
+ *   ndjson	A record per line
+ *   csv	A header line (taken from the first record of each type)
+ *		followed by a line per record, with a blank line before
+ *		the header of each new type. Nested values are given as
+ *		compact JSON.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <jansson.h>
+
+#include "output.h"
+
+static enum output_format output_fmt;
+
+/* Where the records go */
+static FILE *out_fp;
+static unsigned long nr_records;
+
+/* For CSV, the type and columns of the current table */
+static char *csv_type;
+static json_t *csv_cols;
+
+static const struct {
+	const char *name;
+	enum output_format fmt;
+} formats[] = {
+	{ "text",	OUTPUT_TEXT	},
+	{ "json",	OUTPUT_JSON	},
+	{ "ndjson",	OUTPUT_NDJSON	},
+	{ "csv",	OUTPUT_CSV	},
+	{ NULL,		0		}
+};
+
+int output_set_format(const char *name)
+{
+	int i;
+
+	output_fmt = OUTPUT_TEXT;
+	if (!name)
+		return 0;
+
+	for (i = 0; formats[i].name; i++) {
+		if (strcmp(formats[i].name, name) != 0)
+			continue;
+		output_fmt = formats[i].fmt;
+		return 0;
+	}
+
+	return -1;
+}
+
+bool output_structured(void)
+{
+	return out_fp != NULL;
+}
+
+/*
+ * Called before each command, takes the real stdout for the records
+ * and points stdout at stderr.
+ */
+int output_start(void)
+{
+	int fd;
+
+	if (output_fmt == OUTPUT_TEXT)
+		return 0;
+
+	fflush(stdout);
+	fd = dup(STDOUT_FILENO);
+	if (fd == -1)
+		return -1;
+	out_fp = fdopen(fd, "w");
+	if (!out_fp) {
+		close(fd);
+		return -1;
+	}
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+
+	nr_records = 0;
+
+	return 0;
+}
+
+void output_finish(void)
+{
+	if (!out_fp)
+		return;
+
+	if (output_fmt == OUTPUT_JSON)
+		fputs(nr_records ? "\n]\n" : "[]\n", out_fp);
+
+	fflush(stdout);
+	fflush(out_fp);
+	dup2(fileno(out_fp), STDOUT_FILENO);
+	fclose(out_fp);
+	out_fp = NULL;
+
+	free(csv_type);
+	csv_type = NULL;
+	json_decref(csv_cols);
+	csv_cols = NULL;
+}
+
+static void csv_field(const char *str)
+{
+	const char *ptr;
+
+	if (!strpbrk(str, ",\"\r\n") && *str != ' ' &&
+	    (!*str || str[strlen(str) - 1] != ' ')) {
+		fputs(str, out_fp);
+		return;
+	}
+
+	fputc('"', out_fp);
+	for (ptr = str; *ptr; ptr++) {
+		if (*ptr == '"')
+			fputc('"', out_fp);
+		fputc(*ptr, out_fp);
+	}
+	fputc('"', out_fp);
+}
+
+static void csv_value(const json_t *value)
+{
+	char *str;
+
+	switch (json_typeof(value)) {
+	case JSON_STRING:
+		csv_field(json_string_value(value));
+		break;
+	case JSON_NULL:
+		break;
+	default:
+		str = json_dumps(value, JSON_COMPACT | JSON_ENCODE_ANY);
+		if (!str)
+			break;
+		csv_field(str);
+		free(str);
+	}
+}
+
+static void csv_record(const json_t *rec)
+{
+	const char *type = json_string_value(json_object_get(rec, "type"));
+	const char *key;
+	json_t *value;
+	json_t *col;
+	size_t i;
+
+	if (!csv_type || strcmp(csv_type, type) != 0) {
+		if (csv_type)
+			fputc('\n', out_fp);
+		free(csv_type);
+		csv_type = strdup(type);
+		json_decref(csv_cols);
+		csv_cols = json_array();
+
+		json_object_foreach((json_t *)rec, key, value) {
+			json_array_append_new(csv_cols, json_string(key));
+			if (json_array_size(csv_cols) > 1)
+				fputc(',', out_fp);
+			csv_field(key);
+		}
+		fputc('\n', out_fp);
+	}
+
+	/* Keep to the columns of the header */
+	json_array_foreach(csv_cols, i, col) {
+		if (i > 0)
+			fputc(',', out_fp);
+		value = json_object_get(rec, json_string_value(col));
+		if (value)
+			csv_value(value);
+	}
+	fputc('\n', out_fp);
+}
+
+/* Emits a record of the given type, takes the reference to rec */
+void output_record(const char *type, json_t *rec)
+{
+	json_t *out;
+	char *str;
+
+	if (!out_fp || !rec)
+		goto out_free;
+
+	/* The type goes first */
+	out = json_pack("{s:s}", "type", type);
+	json_object_update(out, rec);
+
+	switch (output_fmt) {
+	case OUTPUT_JSON:
+		str = json_dumps(out, JSON_COMPACT);
+		if (str)
+			fprintf(out_fp, "%s\n  %s", nr_records ? "," : "[",
+				str);
+		free(str);
+		break;
+	case OUTPUT_NDJSON:
+		json_dumpf(out, out_fp, JSON_COMPACT);
+		fputc('\n', out_fp);
+		break;
+	case OUTPUT_CSV:
+		csv_record(out);
+		break;
+	case OUTPUT_TEXT:
+		break;
+	}
+	nr_records++;
+
+	json_decref(out);
+
+out_free:
+	json_decref(rec);
+}
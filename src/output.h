@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * output.h - Machine readable output
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _OUTPUT_H_
+#define _OUTPUT_H_
+
+#include <stdbool.h>
+
+#include <jansson.h>
+
+enum output_format {
+	OUTPUT_TEXT = 0,
+	OUTPUT_JSON,
+	OUTPUT_NDJSON,
+	OUTPUT_CSV,
+};
+
+extern int output_set_format(const char *name);
+extern bool output_structured(void);
+extern int output_start(void);
+extern void output_finish(void);
+extern void output_record(const char *type, json_t *rec);
+
+#endif /* _OUTPUT_H_ */
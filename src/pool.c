@@ -0,0 +1,308 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * pool.c - Work-stealing thread pool
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ *
+ * Each worker has its own queue of jobs. Jobs submitted from outside
+ * the pool are spread round-robin over the workers, jobs submitted by
+ * a worker go on its own queue.
+ *
+ * A worker takes jobs from the back of its own queue and when that's
+ * empty, steals from the front of the other workers queues. So one
+ * slow job (e.g a client with a lot of transactions or a slow API
+ * response) doesn't hold up the jobs queued up behind it.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+#define QUEUE_ALLOC_SZ		16
+
+struct job {
+	void (*fn)(void *arg);
+	void *arg;
+};
+
+struct queue {
+	pthread_mutex_t lock;
+
+	struct job *jobs;
+	size_t head;
+	size_t tail;
+	size_t alloc;
+};
+
+struct worker {
+	pthread_t tid;
+	struct pool *pool;
+	int id;
+};
+
+struct pool {
+	struct worker *workers;
+	struct queue *queues;
+	int nr_threads;
+
+	const struct pool_ops *ops;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t idle_cond;
+	unsigned long queued;	/* jobs sitting in the queues */
+	unsigned long pending;	/* jobs queued or running */
+	unsigned int next;
+	bool stop;
+};
+
+static __thread const struct worker *this_worker;
+
+static int queue_push(struct queue *queue, const struct job *job)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&queue->lock);
+
+	if (queue->tail == queue->alloc) {
+		size_t nr = queue->tail - queue->head;
+
+		if (queue->head > 0) {
+			memmove(queue->jobs, queue->jobs + queue->head,
+				nr * sizeof(struct job));
+		} else {
+			struct job *jobs;
+
+			jobs = realloc(queue->jobs, (queue->alloc +
+					QUEUE_ALLOC_SZ) * sizeof(struct job));
+			if (!jobs) {
+				ret = -1;
+				goto out_unlock;
+			}
+			queue->jobs = jobs;
+			queue->alloc += QUEUE_ALLOC_SZ;
+		}
+		queue->head = 0;
+		queue->tail = nr;
+	}
+	queue->jobs[queue->tail++] = *job;
+
+out_unlock:
+	pthread_mutex_unlock(&queue->lock);
+
+	return ret;
+}
+
+/* Take a job from the back of our own queue */
+static bool queue_pop(struct queue *queue, struct job *job)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->tail > queue->head) {
+		*job = queue->jobs[--queue->tail];
+		found = true;
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return found;
+}
+
+/* Take a job from the front of another workers queue */
+static bool queue_steal(struct queue *queue, struct job *job)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->tail > queue->head) {
+		*job = queue->jobs[queue->head++];
+		found = true;
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return found;
+}
+
+static bool get_job(const struct worker *worker, struct job *job)
+{
+	struct pool *pool = worker->pool;
+	int i;
+
+	if (queue_pop(&pool->queues[worker->id], job))
+		return true;
+
+	for (i = 1; i < pool->nr_threads; i++) {
+		int victim = (worker->id + i) % pool->nr_threads;
+
+		if (queue_steal(&pool->queues[victim], job))
+			return true;
+	}
+
+	return false;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *worker = arg;
+	struct pool *pool = worker->pool;
+
+	this_worker = worker;
+
+	if (pool->ops && pool->ops->thread_init)
+		pool->ops->thread_init(pool->ops->data);
+
+	for (;;) {
+		struct job job;
+
+		if (get_job(worker, &job)) {
+			pthread_mutex_lock(&pool->lock);
+			pool->queued--;
+			pthread_mutex_unlock(&pool->lock);
+
+			job.fn(job.arg);
+
+			pthread_mutex_lock(&pool->lock);
+			if (--pool->pending == 0)
+				pthread_cond_broadcast(&pool->idle_cond);
+			pthread_mutex_unlock(&pool->lock);
+
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->stop && pool->queued == 0)
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+		if (pool->stop && pool->queued == 0) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	if (pool->ops && pool->ops->thread_fini)
+		pool->ops->thread_fini(pool->ops->data);
+
+	return NULL;
+}
+
+/*
+ * Submit a job to the pool.
+ *
+ * Returns 0 on success or -1 on failure.
+ */
+int pool_submit(struct pool *pool, void (*fn)(void *arg), void *arg)
+{
+	struct job job = { .fn = fn, .arg = arg };
+	int qidx;
+	int err;
+
+	if (this_worker && this_worker->pool == pool) {
+		qidx = this_worker->id;
+	} else {
+		pthread_mutex_lock(&pool->lock);
+		qidx = pool->next++ % pool->nr_threads;
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	err = queue_push(&pool->queues[qidx], &job);
+	if (err)
+		return -1;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->queued++;
+	pool->pending++;
+	pthread_cond_signal(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+/* Wait for all submitted jobs to complete */
+void pool_wait(struct pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending > 0)
+		pthread_cond_wait(&pool->idle_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Runs any outstanding jobs then stops the worker threads */
+void pool_free(struct pool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nr_threads; i++) {
+		if (pool->workers[i].pool)
+			pthread_join(pool->workers[i].tid, NULL);
+		pthread_mutex_destroy(&pool->queues[i].lock);
+		free(pool->queues[i].jobs);
+	}
+
+	pthread_cond_destroy(&pool->idle_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->lock);
+
+	free(pool->queues);
+	free(pool->workers);
+	free(pool);
+}
+
+struct pool *pool_new(int nr_threads, const struct pool_ops *ops)
+{
+	struct pool *pool;
+	int i;
+
+	if (nr_threads < 1)
+		nr_threads = 1;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pool->workers = calloc(nr_threads, sizeof(struct worker));
+	pool->queues = calloc(nr_threads, sizeof(struct queue));
+	if (!pool->workers || !pool->queues) {
+		free(pool->workers);
+		free(pool->queues);
+		free(pool);
+		return NULL;
+	}
+
+	pool->nr_threads = nr_threads;
+	pool->ops = ops;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->idle_cond, NULL);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_mutex_init(&pool->queues[i].lock, NULL);
+
+	for (i = 0; i < nr_threads; i++) {
+		struct worker *worker = &pool->workers[i];
+		int err;
+
+		worker->pool = pool;
+		worker->id = i;
+		err = pthread_create(&worker->tid, NULL, worker_thread,
+				     worker);
+		if (err) {
+			worker->pool = NULL;
+			pool_free(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * pool.h - Work-stealing thread pool
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+struct pool;
+
+struct pool_ops {
+	/* Called in each worker thread when it starts & before it exits */
+	void (*thread_init)(void *data);
+	void (*thread_fini)(void *data);
+	void *data;
+};
+
+extern struct pool *pool_new(int nr_threads, const struct pool_ops *ops);
+extern int pool_submit(struct pool *pool, void (*fn)(void *arg), void *arg);
+extern void pool_wait(struct pool *pool);
+extern void pool_free(struct pool *pool);
+
+#endif /* _POOL_H_ */
@@ -0,0 +1,549 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * queue.c - Queue of submissions to be sent to HMRC later
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ *
+ * Submissions (periods, annual summaries, EOP statements & savings
+ * account summaries) that couldn't be sent because HMRC couldn't be
+ * reached (or were asked to be queued) are appended, fully prepared, to
+ * a queue file to be sent later. Those that aren't safe to send twice
+ * (creating periods & EOP statements) are only queued if they can't
+ * have reached HMRC, see api_resendable().
+ *
+ * The file is append only, one JSON object per line, either
+ *
+ *	{"id": 1, "queued": "<time>", "bid": "<business id>",
+ *	 "config_dir": "<dir>", "op": "se-create-period", "args": [...],
+ *	 "body": "...", "key": "<submitted index key>"}
+ *
+ * for a queued submission, config_dir being whose credentials it's to be
+ * sent with (see itsa_ctx_set_mtd_cfg()), absent for the default. Or
+ *
+ *	{"id": 1, "done": "<time>"}
+ *	{"id": 1, "failed": "<time>", "err": "..."}
+ *	{"id": 1, "dropped": "<time>", "err": "..."}
+ *
+ * recording the outcome of trying to send it, dropped being for what
+ * HMRC rejected outright (and so will never go) or was dropped by hand.
+ * What's still pending is what's been queued and not done or dropped.
+ *
+ * More than one process may be using the queue, e.g a scheduled --queue
+ * run and a flush-queue, so it's flock(2)'d while it's read or appended
+ * to and ids are worked out afresh from what's in it each time.
+ *
+ * Things are sent in stages, periods first, then annual summaries and
+ * finally EOP statements, which depend on the former being in.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <jansson.h>
+
+#include "libitsa.h"
+#include "api.h"
+#include "queue.h"
+
+static struct {
+	pthread_mutex_t lock;
+
+	char *path;
+	bool always;
+} queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int op_stage(enum api_op op)
+{
+	switch (op) {
+	case API_SE_CREATE_PERIOD:
+	case API_SE_UPDATE_PERIOD:
+		return 0;
+	case API_SE_UPDATE_ANNUAL_SUMMARY:
+	case API_SA_UPDATE_ANNUAL_SUMMARY:
+		return 1;
+	case API_IBEOPS_SUBMIT_EOPS:
+		return 2;
+	default:
+		return -1;
+	}
+}
+
+static void queue_time(char *buf, size_t size)
+{
+	time_t now = itsa_time();
+	struct tm tm;
+
+	strftime(buf, size, "%FT%T%z", localtime_r(&now, &tm));
+}
+
+/*
+ * Open & lock the queue, closing the returned fd unlocks it. Returns -1
+ * on error.
+ *
+ * Must be called with queue.lock held.
+ */
+static int queue_open(void)
+{
+	for (;;) {
+		struct stat fsb;
+		struct stat sb;
+		int fd;
+
+		fd = open(queue.path, O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC,
+			  0600);
+		if (fd == -1)
+			return -1;
+		if (flock(fd, LOCK_EX) == -1) {
+			close(fd);
+			return -1;
+		}
+
+		/* It may have been compacted while we waited on the lock */
+		if (fstat(fd, &fsb) == 0 && stat(queue.path, &sb) == 0 &&
+		    fsb.st_dev == sb.st_dev && fsb.st_ino == sb.st_ino)
+			return fd;
+		close(fd);
+	}
+}
+
+/* Must be called with the queue open */
+static int queue_append(int fd, json_t *rec)
+{
+	char *line;
+	size_t len;
+	ssize_t bytes;
+
+	line = json_dumps(rec, JSON_COMPACT);
+	if (!line)
+		return -ITSA_ERR_OS;
+
+	len = strlen(line);
+	line[len++] = '\n';
+	bytes = write(fd, line, len);
+	free(line);
+
+	return bytes == (ssize_t)len ? 0 : -ITSA_ERR_OS;
+}
+
+/*
+ * Read the queue, returning an object of the pending entries keyed by
+ * id, with attempts & last_err filled in, and the highest id used.
+ *
+ * Must be called with the queue open.
+ */
+static json_t *queue_load(int fd, unsigned long *max_id)
+{
+	FILE *fp;
+	json_t *pending = json_object();
+	char *line = NULL;
+	size_t size = 0;
+	int rfd;
+
+	*max_id = 0;
+
+	rfd = dup(fd);
+	if (rfd == -1)
+		return pending;
+	fp = fdopen(rfd, "r");
+	if (!fp) {
+		close(rfd);
+		return pending;
+	}
+	rewind(fp);
+
+	while (getline(&line, &size, fp) != -1) {
+		json_t *rec = json_loads(line, 0, NULL);
+		json_t *entry;
+		json_int_t id;
+		char key[32];
+
+		id = json_integer_value(json_object_get(rec, "id"));
+		if (!rec || id <= 0) {
+			json_decref(rec);
+			continue;
+		}
+		if ((unsigned long)id > *max_id)
+			*max_id = id;
+
+		snprintf(key, sizeof(key), "%lld", (long long)id);
+		entry = json_object_get(pending, key);
+		if (json_object_get(rec, "op")) {
+			json_object_set_new(rec, "attempts", json_integer(0));
+			json_object_set(pending, key, rec);
+		} else if (json_object_get(rec, "done") ||
+			   json_object_get(rec, "dropped")) {
+			json_object_del(pending, key);
+		} else if (entry && json_object_get(rec, "failed")) {
+			json_int_t attempts = json_integer_value(
+				json_object_get(entry, "attempts"));
+
+			json_object_set_new(entry, "attempts",
+					    json_integer(attempts + 1));
+			json_object_set(entry, "last_err",
+					json_object_get(rec, "err"));
+		}
+		json_decref(rec);
+	}
+	free(line);
+	fclose(fp);
+
+	return pending;
+}
+
+bool queue_enabled(void)
+{
+	bool enabled;
+
+	pthread_mutex_lock(&queue.lock);
+	enabled = queue.path;
+	pthread_mutex_unlock(&queue.lock);
+
+	/* Not much point queuing things for the stand-in or a replay */
+	return enabled && itsa_mtd_needed();
+}
+
+bool queue_always(void)
+{
+	bool always;
+
+	pthread_mutex_lock(&queue.lock);
+	always = queue.always;
+	pthread_mutex_unlock(&queue.lock);
+
+	return always && queue_enabled();
+}
+
+int queue_add(const char *bid, const char *config_dir,
+	      const struct api_req *req, const char *key)
+{
+	json_t *rec = NULL;
+	json_t *args;
+	char queued[32];
+	unsigned long max_id;
+	int i;
+	int fd;
+	int err = -ITSA_ERR_OS;
+
+	if (op_stage(req->op) < 0)
+		return -ITSA_ERR_INVALID;
+
+	args = json_array();
+	for (i = 0; i < API_MAX_ARGS && req->args[i]; i++)
+		json_array_append_new(args, json_string(req->args[i]));
+
+	pthread_mutex_lock(&queue.lock);
+	fd = queue_open();
+	if (fd == -1) {
+		json_decref(args);
+		goto out_unlock;
+	}
+	json_decref(queue_load(fd, &max_id));
+
+	queue_time(queued, sizeof(queued));
+	rec = json_pack("{s:I, s:s, s:s, s:s?, s:s, s:o, s:s?, s:s?}",
+			"id", (json_int_t)max_id + 1, "queued", queued,
+			"bid", bid, "config_dir", config_dir,
+			"op", api_op_name(req->op), "args", args,
+			"body", req->body, "key", key);
+	err = queue_append(fd, rec);
+	close(fd);
+
+out_unlock:
+	pthread_mutex_unlock(&queue.lock);
+	json_decref(rec);
+
+	return err;
+}
+
+/* Append what happened to entry id, what being "done", "failed" etc */
+static int queue_outcome(unsigned long id, const char *what,
+			 const char *err)
+{
+	json_t *rec;
+	char when[32];
+	int fd;
+	int ret = -ITSA_ERR_OS;
+
+	queue_time(when, sizeof(when));
+	rec = json_pack("{s:I, s:s, s:s?}", "id", (json_int_t)id,
+			what, when, "err", err);
+
+	pthread_mutex_lock(&queue.lock);
+	fd = queue.path ? queue_open() : -1;
+	if (fd != -1) {
+		ret = queue_append(fd, rec);
+		close(fd);
+	}
+	pthread_mutex_unlock(&queue.lock);
+
+	json_decref(rec);
+
+	return ret;
+}
+
+void queue_done(unsigned long id)
+{
+	queue_outcome(id, "done", NULL);
+}
+
+void queue_failed(unsigned long id, const char *err)
+{
+	queue_outcome(id, "failed", err ? err : "");
+}
+
+void queue_dropped(unsigned long id, const char *err)
+{
+	queue_outcome(id, "dropped", err ? err : "");
+}
+
+static int entry_cmp(const void *p1, const void *p2)
+{
+	const struct itsa_queue_entry *a = p1;
+	const struct itsa_queue_entry *b = p2;
+
+	if (a->stage != b->stage)
+		return a->stage - b->stage;
+
+	return a->id < b->id ? -1 : a->id > b->id;
+}
+
+/*
+ * Get what's pending in the queue, in the order it should be sent.
+ *
+ * entries should be freed with itsa_queue_entries_free()
+ */
+int itsa_queue_list(struct itsa_queue_entry **entries, size_t *nr)
+{
+	json_t *pending;
+	json_t *rec;
+	const char *key;
+	unsigned long max_id;
+	size_t i = 0;
+	int fd;
+
+	*entries = NULL;
+	*nr = 0;
+
+	pthread_mutex_lock(&queue.lock);
+	if (!queue.path) {
+		pthread_mutex_unlock(&queue.lock);
+		return -ITSA_ERR_NOT_FOUND;
+	}
+	fd = queue_open();
+	if (fd == -1) {
+		pthread_mutex_unlock(&queue.lock);
+		return -ITSA_ERR_OS;
+	}
+	pending = queue_load(fd, &max_id);
+	close(fd);
+	pthread_mutex_unlock(&queue.lock);
+
+	if (json_object_size(pending) == 0)
+		goto out_free;
+
+	*entries = calloc(json_object_size(pending), sizeof(**entries));
+	if (!*entries) {
+		json_decref(pending);
+		return -ITSA_ERR_OS;
+	}
+
+	json_object_foreach(pending, key, rec) {
+		struct itsa_queue_entry *e = &(*entries)[i++];
+		const char *op = json_string_value(json_object_get(rec, "op"));
+		const char *bid = json_string_value(json_object_get(rec, "bid"));
+		const char *dir = json_string_value(json_object_get(rec,
+								    "config_dir"));
+		const char *queued = json_string_value(json_object_get(rec,
+								       "queued"));
+		const char *err;
+		json_t *args = json_object_get(rec, "args");
+		json_t *arg;
+		size_t index;
+		size_t len = 0;
+
+		e->id = json_integer_value(json_object_get(rec, "id"));
+		e->stage = op_stage(api_op_from_name(op ? op : ""));
+		e->op = strdup(op ? op : "");
+		e->bid = strdup(bid ? bid : "");
+		e->config_dir = dir ? strdup(dir) : NULL;
+		e->queued = strdup(queued ? queued : "");
+		e->attempts = json_integer_value(json_object_get(rec,
+								 "attempts"));
+		err = json_string_value(json_object_get(rec, "last_err"));
+		e->last_err = err ? strdup(err) : NULL;
+
+		e->args = calloc(1, 1);
+		json_array_foreach(args, index, arg) {
+			const char *str = json_string_value(arg);
+			size_t alen = strlen(str ? str : "");
+			char *tmp = realloc(e->args, len + alen + 2);
+
+			if (!tmp)
+				break;
+			e->args = tmp;
+			sprintf(e->args + len, "%s%s", index ? " " : "",
+				str ? str : "");
+			len = strlen(e->args);
+		}
+
+		e->req = json_incref(rec);
+	}
+	*nr = i;
+	qsort(*entries, *nr, sizeof(**entries), entry_cmp);
+
+out_free:
+	json_decref(pending);
+
+	return 0;
+}
+
+void itsa_queue_entries_free(struct itsa_queue_entry *entries, size_t nr)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++) {
+		free(entries[i].op);
+		free(entries[i].bid);
+		free(entries[i].config_dir);
+		free(entries[i].args);
+		free(entries[i].queued);
+		free(entries[i].last_err);
+		json_decref(entries[i].req);
+	}
+	free(entries);
+}
+
+/*
+ * Mark entry id as dropped, so it's never sent. For things HMRC will
+ * never accept, that would otherwise hold up the rest of the queue.
+ */
+int itsa_queue_drop(unsigned long id, const char *why)
+{
+	json_t *pending;
+	unsigned long max_id;
+	char key[32];
+	int fd;
+	int err;
+
+	pthread_mutex_lock(&queue.lock);
+	if (!queue.path) {
+		pthread_mutex_unlock(&queue.lock);
+		return -ITSA_ERR_NOT_FOUND;
+	}
+	fd = queue_open();
+	if (fd == -1) {
+		pthread_mutex_unlock(&queue.lock);
+		return -ITSA_ERR_OS;
+	}
+
+	pending = queue_load(fd, &max_id);
+	snprintf(key, sizeof(key), "%lu", id);
+	if (json_object_get(pending, key)) {
+		json_t *rec;
+		char dropped[32];
+
+		queue_time(dropped, sizeof(dropped));
+		rec = json_pack("{s:I, s:s, s:s}", "id", (json_int_t)id,
+				"dropped", dropped, "err", why ? why : "");
+		err = queue_append(fd, rec);
+		json_decref(rec);
+	} else {
+		err = -ITSA_ERR_NOT_FOUND;
+	}
+	json_decref(pending);
+	close(fd);
+	pthread_mutex_unlock(&queue.lock);
+
+	return err;
+}
+
+/*
+ * Once everything in the queue has been sent, move it aside (to
+ * <path>.1) so it doesn't grow forever.
+ *
+ * The new queue starts with a record of the last id used, so ids are
+ * never reused. It's put in place with a rename() over the old one, so
+ * there's always a queue at path for others waiting on the lock to find.
+ */
+void itsa_queue_compact(void)
+{
+	json_t *pending;
+	json_t *rec;
+	char path[PATH_MAX];
+	char tpath[PATH_MAX];
+	char done[32];
+	unsigned long max_id;
+	int tfd;
+	int fd;
+	int err;
+
+	pthread_mutex_lock(&queue.lock);
+	if (!queue.path)
+		goto out_unlock;
+	fd = queue_open();
+	if (fd == -1)
+		goto out_unlock;
+
+	pending = queue_load(fd, &max_id);
+	if (json_object_size(pending) > 0 || max_id == 0)
+		goto out_close;
+
+	if (snprintf(path, sizeof(path), "%s.1", queue.path) >=
+	    (int)sizeof(path) ||
+	    snprintf(tpath, sizeof(tpath), "%s.XXXXXX", queue.path) >=
+	    (int)sizeof(tpath))
+		goto out_close;
+	tfd = mkostemp(tpath, O_APPEND | O_CLOEXEC);
+	if (tfd == -1)
+		goto out_close;
+
+	queue_time(done, sizeof(done));
+	rec = json_pack("{s:I, s:s}", "id", (json_int_t)max_id, "done", done);
+	err = queue_append(tfd, rec);
+	json_decref(rec);
+	close(tfd);
+
+	unlink(path);
+	if (err || link(queue.path, path) == -1 ||
+	    rename(tpath, queue.path) == -1)
+		unlink(tpath);
+
+out_close:
+	json_decref(pending);
+	close(fd);
+out_unlock:
+	pthread_mutex_unlock(&queue.lock);
+}
+
+/*
+ * Use the queue at path, NULL to not queue anything. If always is set,
+ * submissions are always queued rather than sent.
+ */
+void itsa_set_queue(const char *path)
+{
+	pthread_mutex_lock(&queue.lock);
+	free(queue.path);
+	queue.path = path ? strdup(path) : NULL;
+	pthread_mutex_unlock(&queue.lock);
+}
+
+void itsa_set_queue_always(bool always)
+{
+	pthread_mutex_lock(&queue.lock);
+	queue.always = always;
+	pthread_mutex_unlock(&queue.lock);
+}
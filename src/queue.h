@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * queue.h - Queue of submissions to be sent to HMRC later
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _QUEUE_H_
+#define _QUEUE_H_
+
+#include <stdbool.h>
+
+#include "api.h"
+
+extern bool queue_enabled(void);
+extern bool queue_always(void);
+extern int queue_add(const char *bid, const char *config_dir,
+		     const struct api_req *req, const char *key);
+extern void queue_done(unsigned long id);
+extern void queue_failed(unsigned long id, const char *err);
+extern void queue_dropped(unsigned long id, const char *err);
+
+#endif /* _QUEUE_H_ */
@@ -0,0 +1,259 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * record.c - Record & replay requests to HMRC
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ *
+ * With ITSA_RECORD=<dir> set, every request made to HMRC is saved along
+ * with libmtdac's response and how long it took, one file per request.
+ *
+ * With ITSA_REPLAY=<dir> set, nothing goes to HMRC, responses are served
+ * from a previous recording instead. Setting ITSA_REPLAY_LATENCY to a
+ * factor (1 being as recorded) also waits for the recorded latency
+ * before answering.
+ *
+ * Recordings are named
+ *
+ *	<op>-<hash>-<seq>.json
+ *
+ * where hash is a FNV-1a hash of the requests arguments & body and seq
+ * counts up for each identical request, so e.g repeatedly fetching a
+ * calculation until it's ready replays the same way. Should a replay
+ * make more identical requests than were recorded, the last response is
+ * given again.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <jansson.h>
+
+#include "libitsa.h"
+#include "api.h"
+#include "record.h"
+#include "hash.h"
+
+struct rec_seq {
+	enum api_op op;
+	uint64_t hash;
+	unsigned int next;
+	int last;		/* last replayed seq, -1 for none */
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_once_t once;
+
+	const char *record_dir;
+	const char *replay_dir;
+	double latency_factor;
+
+	struct rec_seq *seqs;
+	size_t nr_seqs;
+} rec = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.once = PTHREAD_ONCE_INIT,
+};
+
+static void rec_init(void)
+{
+	const char *factor = getenv("ITSA_REPLAY_LATENCY");
+
+	rec.replay_dir = getenv("ITSA_REPLAY");
+	if (rec.replay_dir && !*rec.replay_dir)
+		rec.replay_dir = NULL;
+	/* Replaying takes precedence, there'd be nothing new to record */
+	if (!rec.replay_dir) {
+		rec.record_dir = getenv("ITSA_RECORD");
+		if (rec.record_dir && !*rec.record_dir)
+			rec.record_dir = NULL;
+	}
+
+	if (factor)
+		rec.latency_factor = atof(factor);
+}
+
+bool rec_recording(void)
+{
+	pthread_once(&rec.once, rec_init);
+
+	return rec.record_dir;
+}
+
+bool rec_replaying(void)
+{
+	pthread_once(&rec.once, rec_init);
+
+	return rec.replay_dir;
+}
+
+static uint64_t req_hash(const struct api_req *req)
+{
+	uint64_t hash = FNV1A_64_INIT;
+	int i;
+
+	/* Separate the fields so ("ab", "c") & ("a", "bc") differ */
+	for (i = 0; i < API_MAX_ARGS; i++) {
+		const char *arg = req->args[i] ? req->args[i] : "\x1e";
+
+		hash = fnv1a(hash, arg, strlen(arg));
+		hash = fnv1a(hash, "\x1f", 1);
+	}
+	if (req->body)
+		hash = fnv1a(hash, req->body, strlen(req->body));
+
+	return hash;
+}
+
+/* Must be called with rec.lock held */
+static struct rec_seq *get_seq(enum api_op op, uint64_t hash)
+{
+	struct rec_seq *seqs;
+	size_t i;
+
+	for (i = 0; i < rec.nr_seqs; i++) {
+		if (rec.seqs[i].op == op && rec.seqs[i].hash == hash)
+			return &rec.seqs[i];
+	}
+
+	seqs = realloc(rec.seqs, (rec.nr_seqs + 1) * sizeof(struct rec_seq));
+	if (!seqs)
+		return NULL;
+	rec.seqs = seqs;
+	rec.seqs[rec.nr_seqs].op = op;
+	rec.seqs[rec.nr_seqs].hash = hash;
+	rec.seqs[rec.nr_seqs].next = 0;
+	rec.seqs[rec.nr_seqs].last = -1;
+
+	return &rec.seqs[rec.nr_seqs++];
+}
+
+static void rec_path(char *path, size_t size, const char *dir,
+		     enum api_op op, uint64_t hash, unsigned int seq)
+{
+	snprintf(path, size, "%s/%s-%016llx-%u.json", dir, api_op_name(op),
+		 (unsigned long long)hash, seq);
+}
+
+/*
+ * Save the request & its response. Failures here are not fatal to the
+ * request itself, the recording will just be missing that one.
+ */
+void rec_record(const struct api_req *req, int err, const char *jbuf,
+		int64_t latency)
+{
+	struct rec_seq *seq;
+	uint64_t hash = req_hash(req);
+	unsigned int nr;
+	char path[PATH_MAX];
+	char tmp[PATH_MAX + 8];
+	json_t *args;
+	json_t *root;
+	int i;
+
+	pthread_mutex_lock(&rec.lock);
+	seq = get_seq(req->op, hash);
+	nr = seq ? seq->next++ : 0;
+	pthread_mutex_unlock(&rec.lock);
+	if (!seq)
+		return;
+
+	args = json_array();
+	for (i = 0; i < API_MAX_ARGS; i++)
+		json_array_append_new(args, req->args[i] ?
+				      json_string(req->args[i]) : json_null());
+
+	/*
+	 * The response is kept as libmtdac gave it to us, it's what we'll
+	 * be handing back on replay.
+	 */
+	root = json_pack("{s:s, s:o, s:o, s:i, s:I, s:o}",
+			 "op", api_op_name(req->op),
+			 "args", args,
+			 "body", req->body ? json_string(req->body) :
+					     json_null(),
+			 "err", err,
+			 "latency_ns", (json_int_t)latency,
+			 "response", jbuf ? json_string(jbuf) : json_null());
+	if (!root)
+		return;
+
+	rec_path(path, sizeof(path), rec.record_dir, req->op, hash, nr);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (json_dump_file(root, tmp, JSON_INDENT(4)) == 0 &&
+	    rename(tmp, path) == -1)
+		unlink(tmp);
+	json_decref(root);
+}
+
+static json_t *load_recording(const struct api_req *req)
+{
+	struct rec_seq *seq;
+	uint64_t hash = req_hash(req);
+	char path[PATH_MAX];
+	json_t *root = NULL;
+
+	pthread_mutex_lock(&rec.lock);
+	seq = get_seq(req->op, hash);
+	if (!seq)
+		goto out_unlock;
+
+	rec_path(path, sizeof(path), rec.replay_dir, req->op, hash,
+		 seq->next);
+	root = json_load_file(path, 0, NULL);
+	if (root) {
+		seq->last = seq->next++;
+	} else if (seq->last >= 0) {
+		rec_path(path, sizeof(path), rec.replay_dir, req->op, hash,
+			 seq->last);
+		root = json_load_file(path, 0, NULL);
+	}
+
+out_unlock:
+	pthread_mutex_unlock(&rec.lock);
+
+	return root;
+}
+
+/*
+ * Answer the request from the recording, as libmtdac would have done.
+ *
+ * Returns -ITSA_ERR_NOT_FOUND if there is no recording of it.
+ */
+int rec_replay(const struct api_req *req, char **jbuf)
+{
+	json_t *root;
+	json_t *resp;
+	int64_t latency;
+	int err;
+
+	*jbuf = NULL;
+
+	root = load_recording(req);
+	if (!root)
+		return -ITSA_ERR_NOT_FOUND;
+
+	latency = json_integer_value(json_object_get(root, "latency_ns")) *
+		  rec.latency_factor;
+	if (api_delay(req, latency) == -ITSA_ERR_DEADLINE) {
+		json_decref(root);
+		return -ITSA_ERR_DEADLINE;
+	}
+
+	err = json_integer_value(json_object_get(root, "err"));
+	resp = json_object_get(root, "response");
+	if (json_is_string(resp))
+		*jbuf = strdup(json_string_value(resp));
+	json_decref(root);
+
+	return err;
+}
@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * record.h - Record & replay requests to HMRC
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "api.h"
+
+extern bool rec_recording(void);
+extern bool rec_replaying(void);
+extern void rec_record(const struct api_req *req, int err, const char *jbuf,
+		       int64_t latency);
+extern int rec_replay(const struct api_req *req, char **jbuf);
+
+#endif /* _RECORD_H_ */
@@ -0,0 +1,580 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * render.c - Display JSON trees
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ *
+ * Objects are displayed as a list of key : value lines, each run of
+ * them headed by the path (bread crumb) to the object they're in,
+ * e.g
+ *
+ *	 calculation / taxCalculation / incomeTax
+ *	       totalIncomeReceived : 24000
+ *	            totalAllowance : 12570
+ *
+ * Array elements are displayed in turn, separated by a blank line.
+ *
+ * Calculations can run to hundreds of lines, so rather than colourising
+ * & writing out each line separately, the colour codes are looked up
+ * once and everything is built up in a single buffer, which is written
+ * out in one go at the end. The tree is walked with an explicit stack
+ * so there's no limit on how deep it can go.
+ *
+ * A selector (--select) can be given to only show parts of the tree.
+ * It's a comma separated list of paths (as shown in the bread crumbs,
+ * but separated by '.'), where '*' matches any key and a leading '..'
+ * matches at any depth. Array elements are stepped through as if they
+ * weren't there. The expressions are compiled once into a list of
+ * segments and as the tree is walked each object carries the set of
+ * (expression, segment) states its path has reached. Anything under a
+ * key that leaves no states alive is skipped without being looked at,
+ * everything under a key that completes an expression is shown.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include <jansson.h>
+
+#include "libitsa.h"
+#include "color.h"
+#include "render.h"
+
+#define RBUF_ALLOC_SZ		4096
+
+struct rbuf {
+	char *buf;
+	size_t len;
+	size_t alloc;
+	bool oom;
+};
+
+struct frame {
+	const json_t *node;
+	void *iter;		/* For objects */
+	size_t index;		/* For arrays */
+	bool owns_key;		/* Whether it pushed a path element */
+	bool crumb_done;
+
+	/* For --select */
+	bool selected;		/* Everything under here is wanted */
+	size_t st_base;		/* Its range of selector states */
+	size_t st_nr;
+	size_t st_owned;	/* How many of those it pushed */
+	size_t mark;		/* Output length at the last array element */
+};
+
+struct stack {
+	void *elems;
+	size_t nr;
+	size_t alloc;
+	size_t elem_sz;
+};
+
+static bool rbuf_grow(struct rbuf *rb, size_t need)
+{
+	char *buf;
+	size_t alloc = rb->alloc ? rb->alloc : RBUF_ALLOC_SZ;
+
+	if (rb->oom)
+		return false;
+	if (rb->len + need < rb->alloc)
+		return true;
+
+	while (rb->len + need >= alloc)
+		alloc *= 2;
+	buf = realloc(rb->buf, alloc);
+	if (!buf) {
+		rb->oom = true;
+		return false;
+	}
+	rb->buf = buf;
+	rb->alloc = alloc;
+
+	return true;
+}
+
+static void rbuf_add(struct rbuf *rb, const char *str)
+{
+	size_t len = strlen(str);
+
+	if (!rbuf_grow(rb, len))
+		return;
+	memcpy(rb->buf + rb->len, str, len);
+	rb->len += len;
+}
+
+static void rbuf_printf(struct rbuf *rb, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+static void rbuf_printf(struct rbuf *rb, const char *fmt, ...)
+{
+	va_list args;
+	int len;
+
+	/* Usually it'll fit first time */
+	if (!rbuf_grow(rb, 128))
+		return;
+	va_start(args, fmt);
+	len = vsnprintf(rb->buf + rb->len, rb->alloc - rb->len, fmt, args);
+	va_end(args);
+	if (len < 0)
+		return;
+
+	if ((size_t)len >= rb->alloc - rb->len) {
+		if (!rbuf_grow(rb, len + 1))
+			return;
+		va_start(args, fmt);
+		vsnprintf(rb->buf + rb->len, rb->alloc - rb->len, fmt, args);
+		va_end(args);
+	}
+	rb->len += len;
+}
+
+static void *stack_push(struct stack *st)
+{
+	if (st->nr == st->alloc) {
+		size_t alloc = st->alloc ? st->alloc * 2 : 16;
+		void *elems = realloc(st->elems, alloc * st->elem_sz);
+
+		if (!elems)
+			return NULL;
+		st->elems = elems;
+		st->alloc = alloc;
+	}
+
+	return (char *)st->elems + st->nr++ * st->elem_sz;
+}
+
+static void *stack_top(const struct stack *st)
+{
+	if (st->nr == 0)
+		return NULL;
+
+	return (char *)st->elems + (st->nr - 1) * st->elem_sz;
+}
+
+struct colors {
+	char *charc;
+	char *bold;
+	char *rst;
+};
+
+static void add_bread_crumb(struct rbuf *rb, const struct stack *path,
+			    const struct colors *c)
+{
+	const char **keys = path->elems;
+	size_t i;
+
+	if (path->nr == 0) {
+		rbuf_printf(rb, " %s/%s\n", c->bold, c->rst);
+		return;
+	}
+
+	rbuf_printf(rb, "%s ", c->bold);
+	for (i = 0; i < path->nr; i++)
+		rbuf_printf(rb, "%s%s", i ? " / " : "", keys[i]);
+	rbuf_printf(rb, "%s\n", c->rst);
+}
+
+static void add_leaf(struct rbuf *rb, const char *key, const json_t *value,
+		     int key_width, render_val_cb_t val_cb,
+		     const struct colors *c)
+{
+	char val[128];
+
+	rbuf_printf(rb, "%s %*s :%s ", c->charc, key_width, key, c->rst);
+
+	if (val_cb && val_cb(key, value, val, sizeof(val))) {
+		rbuf_add(rb, val);
+		goto out;
+	}
+
+	switch (json_typeof(value)) {
+	case JSON_STRING:
+		rbuf_add(rb, json_string_value(value));
+		break;
+	case JSON_INTEGER:
+		rbuf_printf(rb, "%lld", (long long)json_integer_value(value));
+		break;
+	case JSON_REAL:
+		rbuf_printf(rb, "%.2f", json_real_value(value));
+		break;
+	case JSON_TRUE:
+		rbuf_add(rb, "true");
+		break;
+	case JSON_FALSE:
+		rbuf_add(rb, "false");
+		break;
+	default:
+		rbuf_add(rb, "null");
+		break;
+	}
+
+out:
+	rbuf_add(rb, "\n");
+}
+
+struct sel_seg {
+	const char *name;
+	bool any;		/* "*" */
+	bool descend;		/* Preceded by "..", matches at any depth */
+};
+
+struct sel_expr {
+	struct sel_seg *segs;
+	unsigned int nr;
+};
+
+struct render_sel {
+	struct sel_expr *exprs;
+	unsigned int nr;
+
+	char *buf;		/* The segment names point into this */
+};
+
+/* How far along an expression a node's path has matched */
+struct sel_state {
+	unsigned int expr;
+	unsigned int seg;
+};
+
+/*
+ * Parse a single expression, e.g
+ *
+ *	calculation.taxCalculation.totalIncomeTaxAndNicsDue
+ *	$..taxableIncome
+ *	calculation.*.incomeTax
+ *
+ * in place, splitting it up into its segments.
+ */
+static int sel_parse_expr(struct sel_expr *expr, char *p)
+{
+	bool descend = false;
+
+	while (*p == ' ')
+		p++;
+	if (*p == '$')
+		p++;
+	if (*p == '.') {
+		p++;
+		if (*p == '.') {
+			descend = true;
+			p++;
+		}
+	}
+
+	/* There can't be more segments than characters */
+	expr->segs = calloc(strlen(p) + 1, sizeof(struct sel_seg));
+	if (!expr->segs)
+		return -1;
+
+	for (;;) {
+		struct sel_seg *seg = &expr->segs[expr->nr++];
+		size_t span;
+		size_t len;
+		char end;
+
+		while (*p == ' ')
+			p++;
+		span = len = strcspn(p, ".");
+		end = p[span];
+		while (len > 0 && p[len - 1] == ' ')
+			len--;
+		if (len == 0)
+			return -1;
+		p[len] = '\0';
+
+		seg->name = p;
+		seg->any = strcmp(p, "*") == 0;
+		seg->descend = descend;
+
+		if (end == '\0')
+			break;
+
+		p += span + 1;
+		descend = false;
+		if (*p == '.') {
+			descend = true;
+			p++;
+		}
+	}
+
+	return 0;
+}
+
+struct render_sel *render_sel_compile(const char *spec)
+{
+	struct render_sel *sel;
+	char *expr;
+	char *saveptr;
+	size_t nr = 1;
+	const char *ptr;
+
+	sel = calloc(1, sizeof(*sel));
+	if (!sel)
+		return NULL;
+	sel->buf = strdup(spec);
+	if (!sel->buf)
+		goto out_err;
+
+	for (ptr = spec; *ptr; ptr++)
+		if (*ptr == ',')
+			nr++;
+	sel->exprs = calloc(nr, sizeof(struct sel_expr));
+	if (!sel->exprs)
+		goto out_err;
+
+	for (expr = strtok_r(sel->buf, ",", &saveptr); expr;
+	     expr = strtok_r(NULL, ",", &saveptr)) {
+		if (sel_parse_expr(&sel->exprs[sel->nr++], expr) == -1)
+			goto out_err;
+	}
+	if (sel->nr == 0)
+		goto out_err;
+
+	return sel;
+
+out_err:
+	render_sel_free(sel);
+
+	return NULL;
+}
+
+void render_sel_free(struct render_sel *sel)
+{
+	unsigned int i;
+
+	if (!sel)
+		return;
+
+	for (i = 0; i < sel->nr; i++)
+		free(sel->exprs[i].segs);
+	free(sel->exprs);
+	free(sel->buf);
+	free(sel);
+}
+
+static int sel_add_state(struct stack *states, size_t base, unsigned int expr,
+			 unsigned int seg)
+{
+	const struct sel_state *st = states->elems;
+	struct sel_state *new;
+	size_t i;
+
+	for (i = base; i < states->nr; i++)
+		if (st[i].expr == expr && st[i].seg == seg)
+			return 0;
+
+	new = stack_push(states);
+	if (!new)
+		return -1;
+	new->expr = expr;
+	new->seg = seg;
+
+	return 0;
+}
+
+/*
+ * Step the states [from, from + nr) over key, pushing the resulting
+ * states onto the stack.
+ *
+ * Returns 1 if an expression has been matched in full, i.e everything
+ * under key is wanted, 0 if not and -1 on error.
+ */
+static int sel_step(const struct render_sel *sel, struct stack *states,
+		    size_t from, size_t nr, const char *key)
+{
+	size_t base = states->nr;
+	size_t i;
+
+	for (i = from; i < from + nr; i++) {
+		struct sel_state st = ((struct sel_state *)states->elems)[i];
+		const struct sel_expr *expr = &sel->exprs[st.expr];
+		const struct sel_seg *seg = &expr->segs[st.seg];
+
+		if (seg->descend &&
+		    sel_add_state(states, base, st.expr, st.seg) == -1)
+			return -1;
+		if (!seg->any && strcmp(seg->name, key) != 0)
+			continue;
+		if (st.seg + 1 == expr->nr)
+			return 1;
+		if (sel_add_state(states, base, st.expr, st.seg + 1) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+static struct frame *push_frame(struct stack *frames, const json_t *node,
+				bool owns_key, bool selected,
+				size_t st_base, size_t st_nr, size_t st_owned)
+{
+	struct frame *f = stack_push(frames);
+
+	if (!f)
+		return NULL;
+
+	f->node = node;
+	f->iter = json_is_object(node) ?
+		json_object_iter((json_t *)node) : NULL;
+	f->index = 0;
+	f->owns_key = owns_key;
+	f->crumb_done = false;
+	f->selected = selected;
+	f->st_base = st_base;
+	f->st_nr = st_nr;
+	f->st_owned = st_owned;
+	f->mark = 0;
+
+	return f;
+}
+
+static void pop_frame(struct stack *frames, struct stack *path,
+		      struct stack *states)
+{
+	struct frame *f = stack_top(frames);
+	bool owns_key = f->owns_key;
+
+	states->nr -= f->st_owned;
+	frames->nr--;
+	if (!owns_key)
+		return;
+
+	/* Back in the parent object, which needs its bread crumb again */
+	path->nr--;
+	f = stack_top(frames);
+	if (f)
+		f->crumb_done = false;
+}
+
+void render_json_tree(FILE *fp, const json_t *root, int key_width,
+		      render_val_cb_t val_cb, const struct render_sel *sel)
+{
+	struct rbuf rb = { NULL };
+	struct stack frames = { .elem_sz = sizeof(struct frame) };
+	struct stack path = { .elem_sz = sizeof(const char *) };
+	struct stack states = { .elem_sz = sizeof(struct sel_state) };
+	struct colors c;
+	unsigned int i;
+	bool sep = false;
+	int64_t tstart = itsa_trace_begin();
+
+	c.charc = tc_cstring("#CHARC#");
+	c.bold = tc_cstring("#BOLD#");
+	c.rst = tc_cstring("#RST#");
+	if (!c.charc || !c.bold || !c.rst)
+		goto out_free;
+
+	for (i = 0; sel && i < sel->nr; i++) {
+		if (sel_add_state(&states, 0, i, 0) == -1)
+			goto out_free;
+	}
+	if (!push_frame(&frames, root, false, !sel, 0, states.nr, states.nr))
+		goto out_free;
+
+	while (frames.nr > 0 && !rb.oom) {
+		struct frame *f = stack_top(&frames);
+		const json_t *value;
+		const char *name;
+		const char **key;
+		bool selected = f->selected;
+		size_t base = states.nr;
+		int ret;
+
+		if (json_is_array(f->node)) {
+			if (f->index == json_array_size(f->node)) {
+				sep = false;
+				pop_frame(&frames, &path, &states);
+				continue;
+			}
+			/*
+			 * With a selector, only separate elements that had
+			 * something shown, once there's more to show.
+			 */
+			if (f->index > 0 && !sel)
+				rbuf_add(&rb, "\n");
+			else if (f->index > 0 && rb.len != f->mark)
+				sep = true;
+			f->mark = rb.len;
+			/* Array elements don't take part in the path */
+			value = json_array_get(f->node, f->index++);
+			if (!push_frame(&frames, value, false, selected,
+					f->st_base, f->st_nr, 0))
+				break;
+			continue;
+		}
+
+		if (!f->iter) {
+			pop_frame(&frames, &path, &states);
+			continue;
+		}
+
+		name = json_object_iter_key(f->iter);
+		value = json_object_iter_value(f->iter);
+		if (!selected) {
+			ret = sel_step(sel, &states, f->st_base, f->st_nr, name);
+			if (ret == -1)
+				break;
+			if (ret == 1) {
+				selected = true;
+				states.nr = base;
+			}
+		}
+		/* Nothing wanted under here */
+		if (!selected && states.nr == base) {
+			f->iter = json_object_iter_next((json_t *)f->node,
+							f->iter);
+			continue;
+		}
+
+		if (json_is_object(value) || json_is_array(value)) {
+			key = stack_push(&path);
+			if (!key)
+				break;
+			*key = name;
+			f->iter = json_object_iter_next((json_t *)f->node,
+							f->iter);
+			/* f may be moved by this */
+			if (!push_frame(&frames, value, true, selected, base,
+					states.nr - base, states.nr - base))
+				break;
+			continue;
+		}
+
+		states.nr = base;
+		f->iter = json_object_iter_next((json_t *)f->node, f->iter);
+		if (!selected)
+			continue;
+
+		if (sep) {
+			rbuf_add(&rb, "\n");
+			sep = false;
+		}
+		if (!f->crumb_done) {
+			add_bread_crumb(&rb, &path, &c);
+			f->crumb_done = true;
+		}
+		add_leaf(&rb, name, value, key_width, val_cb, &c);
+	}
+
+	if (!rb.oom && rb.len)
+		fwrite(rb.buf, 1, rb.len, fp);
+
+out_free:
+	free(rb.buf);
+	free(frames.elems);
+	free(path.elems);
+	free(states.elems);
+	free(c.charc);
+	free(c.bold);
+	free(c.rst);
+
+	itsa_trace_end("render", "render_json_tree", tstart);
+}
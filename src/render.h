@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * render.h - Display JSON trees
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _RENDER_H_
+#define _RENDER_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include <jansson.h>
+
+/*
+ * Called for each leaf, if it returns true, buf (of size bytes) holds
+ * the value to show rather than the default.
+ */
+typedef bool (*render_val_cb_t)(const char *key, const json_t *value,
+				char *buf, size_t size);
+
+/* A compiled --select expression list */
+struct render_sel;
+
+extern struct render_sel *render_sel_compile(const char *spec);
+extern void render_sel_free(struct render_sel *sel);
+
+/* sel may be NULL to show everything */
+extern void render_json_tree(FILE *fp, const json_t *root, int key_width,
+			     render_val_cb_t val_cb,
+			     const struct render_sel *sel);
+
+#endif /* _RENDER_H_ */
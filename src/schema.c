@@ -0,0 +1,150 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * schema.c - Typed decoding of MTD responses
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ *
+ * The schemas (schemas.def) are turned into C structs and field tables
+ * at build time by the preprocessor. A response is then decoded into
+ * its struct by walking the tree once, only going into the objects
+ * that lead to a field, rather than looking up each value in turn from
+ * the top. Anything not in the schema is ignored and the fields that
+ * were found are marked in the present bitmap.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <jansson.h>
+
+#include "schema.h"
+
+#define SCHEMA_PATH_MAX		256
+
+#define SCHEMA(name) \
+	_Static_assert(SCHEMA_F_##name##_NR <= 64, \
+		       "schema " #name " has too many fields"); \
+	static const struct schema_field name##_fields[] = {
+#define FIELD(schema, member, type, path) \
+		{ path, SCHEMA_##type, offsetof(struct itsa_##schema, member) },
+#define END_SCHEMA(sname) \
+	}; \
+	const struct schema schema_##sname = { \
+		.name = #sname, \
+		.fields = sname##_fields, \
+		.nr_fields = SCHEMA_F_##sname##_NR, \
+		.size = sizeof(struct itsa_##sname) \
+	};
+#include "schemas.def"
+#undef SCHEMA
+#undef FIELD
+#undef END_SCHEMA
+
+static void set_field(const struct schema_field *field, const json_t *value,
+		      char *obj, uint64_t *present, size_t idx)
+{
+	void *ptr = obj + field->offset;
+
+	switch (field->type) {
+	case SCHEMA_STR:
+		if (!json_is_string(value))
+			return;
+		*(char **)ptr = strdup(json_string_value(value));
+		if (!*(char **)ptr)
+			return;
+		break;
+	case SCHEMA_NUM:
+		if (!json_is_number(value))
+			return;
+		*(double *)ptr = json_number_value(value);
+		break;
+	case SCHEMA_INT:
+		if (!json_is_integer(value))
+			return;
+		*(long long *)ptr = json_integer_value(value);
+		break;
+	case SCHEMA_BOOL:
+		if (!json_is_boolean(value))
+			return;
+		*(bool *)ptr = json_is_true(value);
+		break;
+	}
+
+	*present |= 1ULL << idx;
+}
+
+static void decode_obj(const struct schema *schema, const json_t *node,
+		       char *path, size_t len, char *obj)
+{
+	const char *key;
+	json_t *value;
+
+	json_object_foreach((json_t *)node, key, value) {
+		size_t klen = strlen(key);
+		size_t plen = len + (len ? 1 : 0) + klen;
+		bool descend = false;
+		size_t i;
+
+		if (plen >= SCHEMA_PATH_MAX)
+			continue;
+		if (len)
+			path[len] = '.';
+		memcpy(path + len + (len ? 1 : 0), key, klen + 1);
+
+		for (i = 0; i < schema->nr_fields; i++) {
+			const struct schema_field *field = &schema->fields[i];
+
+			if (strncmp(field->path, path, plen) != 0)
+				continue;
+			if (field->path[plen] == '\0')
+				set_field(field, value, obj,
+					  (uint64_t *)obj, i);
+			else if (field->path[plen] == '.')
+				descend = true;
+		}
+
+		if (descend && json_is_object(value))
+			decode_obj(schema, value, path, plen, obj);
+	}
+	path[len] = '\0';
+}
+
+/*
+ * Decode root into obj (a struct itsa_<schema>), which is zeroed first.
+ * Returns the number of fields found.
+ */
+int __schema_decode(const struct schema *schema, const json_t *root,
+		    void *obj)
+{
+	char path[SCHEMA_PATH_MAX] = "\0";
+	uint64_t present;
+
+	memset(obj, 0, schema->size);
+	if (!json_is_object(root))
+		return 0;
+
+	decode_obj(schema, root, path, 0, obj);
+
+	memcpy(&present, obj, sizeof(present));
+
+	return __builtin_popcountll(present);
+}
+
+void __schema_free(const struct schema *schema, void *obj)
+{
+	size_t i;
+
+	for (i = 0; i < schema->nr_fields; i++) {
+		const struct schema_field *field = &schema->fields[i];
+
+		if (field->type != SCHEMA_STR)
+			continue;
+		free(*(char **)((char *)obj + field->offset));
+	}
+}
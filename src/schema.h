@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * schema.h - Typed decoding of MTD responses
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _SCHEMA_H_
+#define _SCHEMA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <jansson.h>
+
+enum schema_type {
+	SCHEMA_STR,
+	SCHEMA_NUM,
+	SCHEMA_INT,
+	SCHEMA_BOOL,
+};
+
+struct schema_field {
+	const char *path;
+	enum schema_type type;
+	size_t offset;
+};
+
+struct schema {
+	const char *name;
+	const struct schema_field *fields;
+	size_t nr_fields;
+	size_t size;
+};
+
+#define SCHEMA_CTYPE_STR	char *
+#define SCHEMA_CTYPE_NUM	double
+#define SCHEMA_CTYPE_INT	long long
+#define SCHEMA_CTYPE_BOOL	bool
+
+/* The field numbers, for the present bitmap */
+#define SCHEMA(name)			enum {
+#define FIELD(schema, member, type, path) \
+					SCHEMA_F_##schema##_##member,
+#define END_SCHEMA(name)		SCHEMA_F_##name##_NR };
+#include "schemas.def"
+#undef SCHEMA
+#undef FIELD
+#undef END_SCHEMA
+
+/* The structs, e.g struct itsa_calc */
+#define SCHEMA(name)			struct itsa_##name { \
+						uint64_t present;
+#define FIELD(schema, member, type, path) \
+						SCHEMA_CTYPE_##type member;
+#define END_SCHEMA(name)		};
+#include "schemas.def"
+#undef SCHEMA
+#undef FIELD
+#undef END_SCHEMA
+
+#define SCHEMA(name)			extern const struct schema \
+						schema_##name;
+#define FIELD(schema, member, type, path)
+#define END_SCHEMA(name)
+#include "schemas.def"
+#undef SCHEMA
+#undef FIELD
+#undef END_SCHEMA
+
+/* Whether member was in the response, e.g SCHEMA_HAS(calc, c, total_due) */
+#define SCHEMA_HAS(schema, obj, member) \
+	(((obj)->present >> SCHEMA_F_##schema##_##member) & 1)
+
+#define schema_decode(name, root, obj) \
+	__schema_decode(&schema_##name, root, obj)
+#define schema_free(name, obj)	__schema_free(&schema_##name, obj)
+
+extern int __schema_decode(const struct schema *schema, const json_t *root,
+			   void *obj);
+extern void __schema_free(const struct schema *schema, void *obj);
+
+#endif /* _SCHEMA_H_ */
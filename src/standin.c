@@ -0,0 +1,1041 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * standin.c - In-process stand-in for the HMRC MTD API
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ *
+ * A stateful imitation of the parts of the API itsa uses; obligations,
+ * self-employment periods & annual summaries, calculations (which take
+ * a while to become ready), BISS, EOPS, final declarations and savings
+ * accounts. Responses are made to look like what libmtdac would give
+ * us, so everything above api.c is none the wiser.
+ *
+ * This allows running things like agent-scale batches and the polling
+ * in itsa_get_calculation() without going anywhere near HMRC.
+ *
+ * The state is kept in a jansson object which can be kept in a file
+ * so it carries over between runs. Only one process should use a given
+ * state file at a time.
+ *
+ * Request latency (plus some jitter), server errors & throttling can
+ * be injected.
+ *
+ * Tax is only roughly worked out at the basic rate, the numbers are
+ * there to have something to look at, not to be relied upon.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include <jansson.h>
+
+#include <libmtdac/mtd.h>
+
+#include "libitsa.h"
+#include "api.h"
+#include "standin.h"
+
+#define STANDIN_DEF_CALC_READY_MS	2000
+
+#define PERSONAL_ALLOWANCE		12570.0
+#define BASIC_RATE			0.2
+
+#define HTTP_OK				200
+#define HTTP_CREATED			201
+#define HTTP_ACCEPTED			202
+#define HTTP_NO_CONTENT			204
+#define HTTP_BAD_REQUEST		400
+#define HTTP_FORBIDDEN			403
+#define HTTP_NOT_FOUND			404
+#define HTTP_TOO_MANY_REQUESTS		429
+#define HTTP_INTERNAL_SERVER_ERROR	500
+
+struct obligation_spec {
+	const char *start;
+	const char *end;
+	const char *due;
+
+	/* Years relative to the start of the tax year */
+	int start_yoff;
+	int end_yoff;
+	int due_yoff;
+};
+
+static const struct obligation_spec quarters[] = {
+	{ "04-06", "07-05", "08-05", 0, 0, 0 },
+	{ "07-06", "10-05", "11-05", 0, 0, 0 },
+	{ "10-06", "01-05", "02-05", 0, 1, 1 },
+	{ "01-06", "04-05", "05-05", 1, 1, 1 },
+};
+
+static const struct obligation_spec eops_period = {
+	"04-06", "04-05", "01-31", 0, 1, 2
+};
+
+static struct {
+	pthread_mutex_t lock;
+	bool enabled;
+
+	char *state_file;
+	json_t *state;
+
+	unsigned int latency_ms;
+	unsigned int jitter_ms;
+	double failure_rate;	/* fraction of requests to fail with a 500 */
+	double throttle_rate;	/* fraction of requests to get a 429 */
+	unsigned int calc_ready_ms;
+
+	unsigned short xsubi[3];
+} standin = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+bool standin_enabled(void)
+{
+	return standin.enabled;
+}
+
+/*
+ * Use the stand-in instead of HMRC. cfg is an (optional) object like
+ *
+ * {
+ *     "state_file": "/path/to/state.json",
+ *     "latency_ms": 200,
+ *     "jitter_ms": 100,
+ *     "failure_rate": 0.01,
+ *     "throttle_rate": 0.01,
+ *     "calc_ready_ms": 2000,
+ *     "seed": 42
+ * }
+ *
+ * Without a state_file, the state only lasts as long as the process.
+ */
+int itsa_use_standin(const json_t *cfg)
+{
+	const char *state_file;
+	json_t *jobj;
+	int ret = 0;
+
+	pthread_mutex_lock(&standin.lock);
+
+	json_decref(standin.state);
+	standin.state = NULL;
+	free(standin.state_file);
+	standin.state_file = NULL;
+
+	state_file = json_string_value(json_object_get(cfg, "state_file"));
+	if (state_file) {
+		standin.state_file = strdup(state_file);
+		if (!standin.state_file) {
+			ret = -ITSA_ERR_OS;
+			goto out_unlock;
+		}
+		standin.state = json_load_file(state_file, 0, NULL);
+	}
+	if (!standin.state)
+		standin.state = json_object();
+
+	standin.latency_ms = json_integer_value(json_object_get(cfg,
+								"latency_ms"));
+	standin.jitter_ms = json_integer_value(json_object_get(cfg,
+							       "jitter_ms"));
+	standin.failure_rate = json_number_value(json_object_get(cfg,
+							"failure_rate"));
+	standin.throttle_rate = json_number_value(json_object_get(cfg,
+							"throttle_rate"));
+	jobj = json_object_get(cfg, "calc_ready_ms");
+	standin.calc_ready_ms = jobj ? json_integer_value(jobj) :
+				       STANDIN_DEF_CALC_READY_MS;
+
+	/* A fixed seed makes the injected latency & failures repeatable */
+	jobj = json_object_get(cfg, "seed");
+	if (jobj) {
+		json_int_t seed = json_integer_value(jobj);
+
+		standin.xsubi[0] = seed & 0xffff;
+		standin.xsubi[1] = (seed >> 16) & 0xffff;
+		standin.xsubi[2] = (seed >> 32) & 0xffff;
+	} else {
+		standin.xsubi[0] = time(NULL) & 0xffff;
+		standin.xsubi[1] = getpid() & 0xffff;
+		standin.xsubi[2] = 0x330e;
+	}
+
+	standin.enabled = true;
+
+out_unlock:
+	pthread_mutex_unlock(&standin.lock);
+
+	return ret;
+}
+
+/* The following must all be called with standin.lock held */
+
+static void save_state(void)
+{
+	char tmp[PATH_MAX];
+
+	if (!standin.state_file)
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", standin.state_file);
+	if (json_dump_file(standin.state, tmp, JSON_INDENT(4)) == 0 &&
+	    rename(tmp, standin.state_file) == -1)
+		unlink(tmp);
+}
+
+/* Get the named object/array from the state, creating it if need be */
+static json_t *state_get(json_t *obj, const char *name, bool array)
+{
+	json_t *jobj = json_object_get(obj, name);
+
+	if (jobj)
+		return jobj;
+
+	jobj = array ? json_array() : json_object();
+	json_object_set_new(obj, name, jobj);
+
+	return jobj;
+}
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static char *today(char *buf, size_t size)
+{
+	time_t now = itsa_time();
+	struct tm tm;
+
+	localtime_r(&now, &tm);
+	strftime(buf, size, "%F", &tm);
+
+	return buf;
+}
+
+static char *timestamp(char *buf, size_t size)
+{
+	time_t now = itsa_time();
+	struct tm tm;
+
+	gmtime_r(&now, &tm);
+	strftime(buf, size, "%FT%T.000Z", &tm);
+
+	return buf;
+}
+
+/* The year the current tax year started in */
+static int current_tax_year(void)
+{
+	time_t now = itsa_time();
+	struct tm tm;
+
+	localtime_r(&now, &tm);
+	if (tm.tm_mon > 3 || (tm.tm_mon == 3 && tm.tm_mday >= 6))
+		return tm.tm_year + 1900;
+
+	return tm.tm_year + 1900 - 1;
+}
+
+static bool in_tax_year(const char *date, int year)
+{
+	/* Room for any int year, so there's no truncating */
+	char start[32];
+	char end[32];
+
+	if (!date)
+		return false;
+
+	snprintf(start, sizeof(start), "%d-04-06", year);
+	snprintf(end, sizeof(end), "%d-04-05", year + 1);
+
+	return strcmp(date, start) >= 0 && strcmp(date, end) <= 0;
+}
+
+static double round2(double val)
+{
+	return (long long)(val * 100.0 + (val < 0.0 ? -0.5 : 0.5)) / 100.0;
+}
+
+/* Get key's value from a "?a=b&c=d" style query string */
+static bool qs_get(const char *qs, const char *key, char *buf, size_t size)
+{
+	size_t klen = strlen(key);
+	const char *p = qs;
+
+	while (p && *p) {
+		if (*p == '?' || *p == '&')
+			p++;
+		if (strncmp(p, key, klen) == 0 && p[klen] == '=') {
+			size_t len;
+
+			p += klen + 1;
+			len = strcspn(p, "&");
+			if (len >= size)
+				len = size - 1;
+			memcpy(buf, p, len);
+			buf[len] = '\0';
+
+			return true;
+		}
+		p = strchr(p, '&');
+	}
+
+	return false;
+}
+
+static void new_uuid(char *buf, size_t size)
+{
+	snprintf(buf, size, "%08lx-%04lx-4%03lx-%04lx-%08lx%04lx",
+		 nrand48(standin.xsubi) & 0xffffffff,
+		 nrand48(standin.xsubi) & 0xffff,
+		 nrand48(standin.xsubi) & 0xfff,
+		 (nrand48(standin.xsubi) & 0x3fff) | 0x8000,
+		 nrand48(standin.xsubi) & 0xffffffff,
+		 nrand48(standin.xsubi) & 0xffff);
+}
+
+static void new_savings_id(char *buf, size_t size)
+{
+	static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+	size_t i;
+
+	snprintf(buf, size, "SAVKB");
+	for (i = strlen(buf); i < 15 && i < size - 1; i++)
+		buf[i] = chars[nrand48(standin.xsubi) % (sizeof(chars) - 1)];
+	buf[i] = '\0';
+}
+
+/*
+ * Build the response as libmtdac would; an array of the requests made,
+ * with the result of each. Takes ownership of result.
+ */
+static int reply(const struct api_req *req, int status, json_t *result,
+		 char **jbuf)
+{
+	json_t *jarray;
+	json_t *rec;
+	char url[64];
+
+	snprintf(url, sizeof(url), "standin:///%s", api_op_name(req->op));
+	rec = json_pack("{s:s, s:i}", "url", url, "status_code", status);
+	if (result)
+		json_object_set_new(rec, "result", result);
+	if (status == HTTP_TOO_MANY_REQUESTS)
+		json_object_set_new(rec, "headers",
+				    json_pack("{s:s}", "Retry-After", "1"));
+
+	jarray = json_array();
+	json_array_append_new(jarray, rec);
+	*jbuf = json_dumps(jarray, JSON_COMPACT);
+	json_decref(jarray);
+
+	return status >= HTTP_BAD_REQUEST ? -MTD_ERR_REQUEST : 0;
+}
+
+static int reply_err(const struct api_req *req, int status, const char *code,
+		     const char *message, char **jbuf)
+{
+	return reply(req, status, json_pack("{s:s, s:s}", "code", code,
+					    "message", message), jbuf);
+}
+
+static int reply_not_found(const struct api_req *req, char **jbuf)
+{
+	return reply_err(req, HTTP_NOT_FOUND, "MATTER_NOT_FOUND",
+			 "The remote endpoint has indicated that no data can "
+			 "be found", jbuf);
+}
+
+static int reply_bad_body(const struct api_req *req, char **jbuf)
+{
+	return reply_err(req, HTTP_BAD_REQUEST,
+			 "RULE_INCORRECT_OR_EMPTY_BODY_SUBMITTED",
+			 "An empty or non-matching body was submitted", jbuf);
+}
+
+static void period_totals(json_t *period, double *income, double *expenses)
+{
+	json_t *incomes = json_object_get(period, "incomes");
+	json_t *exps = json_object_get(period, "expenses");
+	json_t *val;
+	const char *key;
+
+	*income = json_number_value(json_object_get(json_object_get(incomes,
+						"turnover"), "amount")) +
+		  json_number_value(json_object_get(json_object_get(incomes,
+						"other"), "amount"));
+
+	*expenses = json_number_value(json_object_get(period,
+						      "consolidatedExpenses"));
+	json_object_foreach(exps, key, val)
+		*expenses += json_number_value(json_object_get(val, "amount"));
+}
+
+/*
+ * Total up the periods within the given tax year for the business, or
+ * all of them if bid is NULL.
+ *
+ * Returns the number of periods found.
+ */
+static int tax_year_totals(const char *bid, int year, double *income,
+			   double *expenses)
+{
+	json_t *periods = state_get(standin.state, "periods", false);
+	json_t *list;
+	const char *key;
+	int nr = 0;
+
+	*income = *expenses = 0.0;
+
+	json_object_foreach(periods, key, list) {
+		json_t *period;
+		size_t index;
+
+		if (bid && strcmp(key, bid) != 0)
+			continue;
+
+		json_array_foreach(list, index, period) {
+			double pinc;
+			double pexp;
+
+			if (!in_tax_year(json_string_value(json_object_get(
+						period, "from")), year))
+				continue;
+
+			period_totals(period, &pinc, &pexp);
+			*income += pinc;
+			*expenses += pexp;
+			nr++;
+		}
+	}
+
+	return nr;
+}
+
+static double savings_interest(const char *tax_year)
+{
+	json_t *summaries = state_get(standin.state, "savings_annual", false);
+	json_t *summary;
+	const char *key;
+	double interest = 0.0;
+
+	json_object_foreach(summaries, key, summary) {
+		const char *ty = strchr(key, ':');
+
+		if (!ty || strcmp(ty + 1, tax_year) != 0)
+			continue;
+
+		interest += json_number_value(json_object_get(summary,
+							"taxedUkInterest"));
+		interest += json_number_value(json_object_get(summary,
+							"untaxedUkInterest"));
+	}
+
+	return interest;
+}
+
+static json_t *find_by(json_t *list, const char *key, const char *val)
+{
+	json_t *item;
+	size_t index;
+
+	json_array_foreach(list, index, item) {
+		const char *str = json_string_value(json_object_get(item, key));
+
+		if (str && strcmp(str, val) == 0)
+			return item;
+	}
+
+	return NULL;
+}
+
+static int se_create_period(const struct api_req *req, char **jbuf)
+{
+	json_t *periods = state_get(standin.state, "periods", false);
+	json_t *list = state_get(periods, req->args[0], true);
+	json_t *body = json_loads(req->body ? req->body : "", 0, NULL);
+	json_t *period;
+	const char *from = json_string_value(json_object_get(body, "from"));
+	const char *to = json_string_value(json_object_get(body, "to"));
+	char period_id[32];
+	char date[16];
+	size_t index;
+
+	if (!from || !to || strcmp(from, to) > 0) {
+		json_decref(body);
+		return reply_bad_body(req, jbuf);
+	}
+
+	json_array_foreach(list, index, period) {
+		const char *pfrom = json_string_value(json_object_get(period,
+								      "from"));
+		const char *pto = json_string_value(json_object_get(period,
+								    "to"));
+
+		if (strcmp(to, pfrom) < 0 || strcmp(from, pto) > 0)
+			continue;
+
+		json_decref(body);
+		return reply_err(req, HTTP_BAD_REQUEST,
+				 "RULE_OVERLAPPING_PERIOD",
+				 "Period overlaps with existing periods",
+				 jbuf);
+	}
+
+	snprintf(period_id, sizeof(period_id), "%s_%s", from, to);
+	json_object_set_new(body, "periodId", json_string(period_id));
+	json_object_set_new(body, "submitted",
+			    json_string(today(date, sizeof(date))));
+	json_array_append_new(list, body);
+	save_state();
+
+	return reply(req, HTTP_CREATED,
+		     json_pack("{s:s}", "periodId", period_id), jbuf);
+}
+
+static int se_update_period(const struct api_req *req, char **jbuf)
+{
+	json_t *periods = state_get(standin.state, "periods", false);
+	json_t *period;
+	json_t *body;
+	json_t *val;
+	const char *key;
+
+	period = find_by(json_object_get(periods, req->args[0]), "periodId",
+			 req->args[1]);
+	if (!period)
+		return reply_not_found(req, jbuf);
+
+	body = json_loads(req->body ? req->body : "", 0, NULL);
+	if (!json_is_object(body)) {
+		json_decref(body);
+		return reply_bad_body(req, jbuf);
+	}
+
+	json_object_foreach(body, key, val) {
+		if (strcmp(key, "from") == 0 || strcmp(key, "to") == 0)
+			continue;
+		json_object_set(period, key, val);
+	}
+	json_decref(body);
+	save_state();
+
+	return reply(req, HTTP_OK, NULL, jbuf);
+}
+
+static int annual_get(const struct api_req *req, const char *which,
+		      bool empty_ok, char **jbuf)
+{
+	json_t *summaries = state_get(standin.state, which, false);
+	json_t *summary;
+	char key[128];
+
+	snprintf(key, sizeof(key), "%s:%s", req->args[0], req->args[1]);
+	summary = json_object_get(summaries, key);
+	if (!summary && !empty_ok)
+		return reply_not_found(req, jbuf);
+
+	return reply(req, HTTP_OK, summary ? json_deep_copy(summary) :
+					     json_object(), jbuf);
+}
+
+static int annual_update(const struct api_req *req, const char *which,
+			 char **jbuf)
+{
+	json_t *summaries = state_get(standin.state, which, false);
+	json_t *body;
+	char key[128];
+
+	body = json_loads(req->body ? req->body : "", 0, NULL);
+	if (!json_is_object(body)) {
+		json_decref(body);
+		return reply_bad_body(req, jbuf);
+	}
+
+	snprintf(key, sizeof(key), "%s:%s", req->args[0], req->args[1]);
+	json_object_set_new(summaries, key, body);
+	save_state();
+
+	return reply(req, HTTP_OK, NULL, jbuf);
+}
+
+static void add_obligation(json_t *details, json_t *list, int year,
+			   const struct obligation_spec *spec,
+			   const char *skey, const char *ekey,
+			   const char *from, const char *to)
+{
+	json_t *ob;
+	json_t *item;
+	const char *recvd = NULL;
+	char start[16];
+	char end[16];
+	char due[16];
+	size_t index;
+
+	snprintf(start, sizeof(start), "%d-%s", year + spec->start_yoff,
+		 spec->start);
+	snprintf(end, sizeof(end), "%d-%s", year + spec->end_yoff, spec->end);
+	snprintf(due, sizeof(due), "%d-%s", year + spec->due_yoff, spec->due);
+
+	if (*from && *to && (strcmp(end, from) < 0 || strcmp(start, to) > 0))
+		return;
+
+	json_array_foreach(list, index, item) {
+		const char *s = json_string_value(json_object_get(item, skey));
+		const char *e = json_string_value(json_object_get(item, ekey));
+
+		if (s && e && strcmp(s, start) == 0 && strcmp(e, end) == 0) {
+			recvd = json_string_value(json_object_get(item,
+								  "submitted"));
+			break;
+		}
+	}
+
+	ob = json_pack("{s:s, s:s, s:s, s:s}", "periodStartDate", start,
+		       "periodEndDate", end, "dueDate", due,
+		       "status", recvd ? "F" : "O");
+	if (recvd)
+		json_object_set_new(ob, "receivedDate", json_string(recvd));
+	json_array_append_new(details, ob);
+}
+
+/* Obligations for the previous & current tax years */
+static int ob_list(const struct api_req *req, bool eops, char **jbuf)
+{
+	json_t *details = json_array();
+	json_t *list;
+	char btype[64] = "\0";
+	char bid[64] = "\0";
+	char from[16] = "\0";
+	char to[16] = "\0";
+	int year = current_tax_year();
+	int y;
+
+	qs_get(req->args[0], "typeOfBusiness", btype, sizeof(btype));
+	qs_get(req->args[0], "businessId", bid, sizeof(bid));
+	qs_get(req->args[0], "fromDate", from, sizeof(from));
+	qs_get(req->args[0], "toDate", to, sizeof(to));
+
+	list = json_object_get(json_object_get(standin.state,
+					       eops ? "eops" : "periods"),
+			       bid);
+
+	for (y = year - 1; y <= year; y++) {
+		size_t i;
+
+		if (eops) {
+			add_obligation(details, list, y, &eops_period,
+				       "startDate", "endDate", from, to);
+			continue;
+		}
+
+		for (i = 0; i < sizeof(quarters) / sizeof(quarters[0]); i++)
+			add_obligation(details, list, y, &quarters[i],
+				       "from", "to", from, to);
+	}
+
+	return reply(req, HTTP_OK,
+		     json_pack("{s:[{s:s, s:s, s:o}]}",
+			       "obligations",
+			       "typeOfBusiness", btype,
+			       "businessId", bid,
+			       "obligationDetails", details), jbuf);
+}
+
+static json_t *calculate(const char *cid, const char *tax_year,
+			 const char *type, const char *ts)
+{
+	double income;
+	double expenses;
+	double profit;
+	double total;
+	double allowance;
+	double taxable;
+	double tax;
+
+	tax_year_totals(NULL, atoi(tax_year), &income, &expenses);
+	profit = income > expenses ? income - expenses : 0.0;
+	total = round2(profit + savings_interest(tax_year));
+	allowance = total < PERSONAL_ALLOWANCE ? total : PERSONAL_ALLOWANCE;
+	taxable = round2(total - allowance);
+	tax = round2(taxable * BASIC_RATE);
+
+	return json_pack("{s:{s:s, s:s, s:s, s:s, s:s},"
+			 " s:{s:{s:{s:f, s:f, s:f, s:f}, s:f},"
+			 "    s:{s:f, s:f, s:f, s:f}},"
+			 " s:{s:[{s:s, s:s}]}}",
+			 "metadata",
+			 "calculationId", cid,
+			 "taxYear", tax_year,
+			 "requestedBy", "customer",
+			 "calculationType", type,
+			 "calculationTimestamp", ts,
+			 "calculation",
+			 "taxCalculation",
+			 "incomeTax",
+			 "totalIncomeReceivedFromAllSources", total,
+			 "totalAllowancesAndDeductions", allowance,
+			 "totalTaxableIncome", taxable,
+			 "incomeTaxCharged", tax,
+			 "totalIncomeTaxAndNicsDue", tax,
+			 "endOfYearEstimate",
+			 "totalEstimatedIncome", total,
+			 "totalTaxableIncome", taxable,
+			 "incomeTaxAmount", tax,
+			 "totalEstimatedLiability", tax,
+			 "messages",
+			 "info",
+			 "id", "C00000",
+			 "text", "Calculated by the itsa stand-in, basic rate "
+				 "only");
+}
+
+static int ic_trigger(const struct api_req *req, char **jbuf)
+{
+	json_t *calcs = state_get(standin.state, "calculations", true);
+	const char *type = "inYear";
+	char cid[40];
+	char ts[32];
+
+	if (req->args[1] && strstr(req->args[1], "finalDeclaration=true"))
+		type = "crystallisation";
+
+	new_uuid(cid, sizeof(cid));
+	timestamp(ts, sizeof(ts));
+	json_array_append_new(calcs,
+			      json_pack("{s:s, s:s, s:s, s:s, s:I, s:o}",
+					"calculationId", cid,
+					"taxYear", req->args[0],
+					"calculationType", type,
+					"calculationTimestamp", ts,
+					"readyAt", (json_int_t)(now_ms() +
+						standin.calc_ready_ms),
+					"result", calculate(cid, req->args[0],
+							    type, ts)));
+	save_state();
+
+	return reply(req, HTTP_ACCEPTED,
+		     json_pack("{s:s}", "calculationId", cid), jbuf);
+}
+
+/* Only ready calculations for the tax year are visible */
+static json_t *find_calc(const char *tax_year, const char *cid)
+{
+	json_t *calc;
+
+	calc = find_by(json_object_get(standin.state, "calculations"),
+		       "calculationId", cid);
+	if (!calc || strcmp(json_string_value(json_object_get(calc,
+							"taxYear")),
+			    tax_year) != 0)
+		return NULL;
+	if (json_integer_value(json_object_get(calc, "readyAt")) > now_ms())
+		return NULL;
+
+	return calc;
+}
+
+static int ic_get(const struct api_req *req, char **jbuf)
+{
+	json_t *calc = find_calc(req->args[0], req->args[1]);
+
+	if (!calc)
+		return reply_not_found(req, jbuf);
+
+	return reply(req, HTTP_OK,
+		     json_deep_copy(json_object_get(calc, "result")), jbuf);
+}
+
+static int ic_list(const struct api_req *req, char **jbuf)
+{
+	json_t *list = json_array();
+	json_t *calc;
+	char tax_year[16] = "\0";
+	size_t index;
+
+	qs_get(req->args[0], "taxYear", tax_year, sizeof(tax_year));
+
+	json_array_foreach(json_object_get(standin.state, "calculations"),
+			   index, calc) {
+		const char *ty = json_string_value(json_object_get(calc,
+								   "taxYear"));
+
+		if (*tax_year && strcmp(ty, tax_year) != 0)
+			continue;
+
+		json_array_append_new(list, json_pack(
+			"{s:O, s:O, s:O, s:s, s:O}",
+			"calculationId", json_object_get(calc,
+							 "calculationId"),
+			"calculationTimestamp", json_object_get(calc,
+						"calculationTimestamp"),
+			"calculationType", json_object_get(calc,
+							   "calculationType"),
+			"requestedBy", "customer",
+			"taxYear", json_object_get(calc, "taxYear")));
+	}
+
+	if (json_array_size(list) == 0) {
+		json_decref(list);
+		return reply_not_found(req, jbuf);
+	}
+
+	return reply(req, HTTP_OK, json_pack("{s:o}", "calculations", list),
+		     jbuf);
+}
+
+static int ic_final_decl(const struct api_req *req, char **jbuf)
+{
+	json_t *decls = state_get(standin.state, "final_declarations", false);
+	json_t *calc = find_calc(req->args[0], req->args[1]);
+	char ts[32];
+
+	if (!calc)
+		return reply_not_found(req, jbuf);
+	if (strcmp(json_string_value(json_object_get(calc, "calculationType")),
+		   "crystallisation") != 0)
+		return reply_err(req, HTTP_BAD_REQUEST,
+				 "RULE_INCORRECT_CALCULATION_TYPE",
+				 "The calculation is not a final declaration "
+				 "calculation", jbuf);
+	if (json_object_get(decls, req->args[0]))
+		return reply_err(req, HTTP_FORBIDDEN,
+				 "RULE_FINAL_DECLARATION_RECEIVED",
+				 "A final declaration has already been "
+				 "received for this tax year", jbuf);
+
+	json_object_set_new(decls, req->args[0],
+			    json_pack("{s:s, s:s}",
+				      "calculationId", req->args[1],
+				      "submitted",
+				      timestamp(ts, sizeof(ts))));
+	save_state();
+
+	return reply(req, HTTP_NO_CONTENT, NULL, jbuf);
+}
+
+static int biss_get(const struct api_req *req, char **jbuf)
+{
+	double income;
+	double expenses;
+	double net;
+
+	if (tax_year_totals(req->args[2], atoi(req->args[1]), &income,
+			    &expenses) == 0)
+		return reply_not_found(req, jbuf);
+
+	income = round2(income);
+	expenses = round2(expenses);
+	net = round2(income - expenses);
+
+	return reply(req, HTTP_OK,
+		     json_pack("{s:{s:f, s:f}, s:f, s:{s:f, s:f}}",
+			       "total",
+			       "income", income,
+			       "expenses", expenses,
+			       "accountingAdjustments", 0.0,
+			       net < 0.0 ? "loss" : "profit",
+			       "net", net < 0.0 ? -net : net,
+			       "taxable", net < 0.0 ? -net : net), jbuf);
+}
+
+static int ibeops_submit(const struct api_req *req, char **jbuf)
+{
+	json_t *eops = state_get(standin.state, "eops", false);
+	json_t *list;
+	json_t *item;
+	json_t *body;
+	const char *bid;
+	const char *start;
+	const char *end;
+	char date[16];
+	size_t index;
+
+	body = json_loads(req->body ? req->body : "", 0, NULL);
+	bid = json_string_value(json_object_get(body, "businessId"));
+	start = json_string_value(json_object_get(json_object_get(body,
+				"accountingPeriod"), "startDate"));
+	end = json_string_value(json_object_get(json_object_get(body,
+				"accountingPeriod"), "endDate"));
+	if (!bid || !start || !end) {
+		json_decref(body);
+		return reply_bad_body(req, jbuf);
+	}
+
+	list = state_get(eops, bid, true);
+	json_array_foreach(list, index, item) {
+		if (strcmp(json_string_value(json_object_get(item,
+						"startDate")), start) != 0)
+			continue;
+
+		json_decref(body);
+		return reply_err(req, HTTP_FORBIDDEN,
+				 "RULE_ALREADY_SUBMITTED",
+				 "An End of Period Statement has already "
+				 "been submitted for this period", jbuf);
+	}
+
+	json_array_append_new(list,
+			      json_pack("{s:s, s:s, s:s}",
+					"startDate", start,
+					"endDate", end,
+					"submitted", today(date,
+							   sizeof(date))));
+	json_decref(body);
+	save_state();
+
+	return reply(req, HTTP_NO_CONTENT, NULL, jbuf);
+}
+
+static int sa_list(const struct api_req *req, char **jbuf)
+{
+	json_t *accounts = json_object_get(standin.state, "savings");
+
+	if (json_array_size(accounts) == 0)
+		return reply_not_found(req, jbuf);
+
+	return reply(req, HTTP_OK,
+		     json_pack("{s:O}", "savingsAccounts", accounts), jbuf);
+}
+
+static int sa_create(const struct api_req *req, char **jbuf)
+{
+	json_t *accounts = state_get(standin.state, "savings", true);
+	json_t *body;
+	const char *name;
+	char said[16];
+
+	body = json_loads(req->body ? req->body : "", 0, NULL);
+	name = json_string_value(json_object_get(body, "accountName"));
+	if (!name) {
+		json_decref(body);
+		return reply_bad_body(req, jbuf);
+	}
+	if (find_by(accounts, "accountName", name)) {
+		json_decref(body);
+		return reply_err(req, HTTP_FORBIDDEN,
+				 "RULE_DUPLICATE_ACCOUNT_NAME",
+				 "Duplicate account name given for supplied "
+				 "NINO", jbuf);
+	}
+
+	new_savings_id(said, sizeof(said));
+	json_array_append_new(accounts, json_pack("{s:s, s:s}", "id", said,
+						  "accountName", name));
+	json_decref(body);
+	save_state();
+
+	return reply(req, HTTP_CREATED,
+		     json_pack("{s:s}", "savingsAccountId", said), jbuf);
+}
+
+static int sa_annual(const struct api_req *req, bool update, char **jbuf)
+{
+	if (!find_by(json_object_get(standin.state, "savings"), "id",
+		     req->args[0]))
+		return reply_not_found(req, jbuf);
+
+	if (update)
+		return annual_update(req, "savings_annual", jbuf);
+
+	return annual_get(req, "savings_annual", true, jbuf);
+}
+
+static int dispatch(const struct api_req *req, char **jbuf)
+{
+	switch (req->op) {
+	case API_SE_CREATE_PERIOD:
+		return se_create_period(req, jbuf);
+	case API_SE_UPDATE_PERIOD:
+		return se_update_period(req, jbuf);
+	case API_SE_GET_ANNUAL_SUMMARY:
+		return annual_get(req, "se_annual", false, jbuf);
+	case API_SE_UPDATE_ANNUAL_SUMMARY:
+		return annual_update(req, "se_annual", jbuf);
+	case API_OB_LIST_PERIOD:
+		return ob_list(req, false, jbuf);
+	case API_OB_LIST_EOPS:
+		return ob_list(req, true, jbuf);
+	case API_IC_TRIGGER_CALC:
+		return ic_trigger(req, jbuf);
+	case API_IC_GET_CALC:
+		return ic_get(req, jbuf);
+	case API_IC_LIST_CALCS:
+		return ic_list(req, jbuf);
+	case API_IC_FINAL_DECL:
+		return ic_final_decl(req, jbuf);
+	case API_BISS_GET_SUMMARY:
+		return biss_get(req, jbuf);
+	case API_IBEOPS_SUBMIT_EOPS:
+		return ibeops_submit(req, jbuf);
+	case API_SA_LIST_ACCOUNTS:
+		return sa_list(req, jbuf);
+	case API_SA_CREATE_ACCOUNT:
+		return sa_create(req, jbuf);
+	case API_SA_GET_ANNUAL_SUMMARY:
+		return sa_annual(req, false, jbuf);
+	case API_SA_UPDATE_ANNUAL_SUMMARY:
+		return sa_annual(req, true, jbuf);
+	case API_OP_MAX:
+		break;
+	}
+
+	*jbuf = NULL;
+
+	return -MTD_ERR_REQUEST;
+}
+
+/*
+ * Answer the request as HMRC would, after the configured latency and
+ * possibly with an injected failure.
+ */
+int standin_req(const struct api_req *req, char **jbuf)
+{
+	int64_t latency;
+	double roll;
+	int err;
+
+	*jbuf = NULL;
+
+	pthread_mutex_lock(&standin.lock);
+	latency = standin.latency_ms;
+	if (standin.jitter_ms)
+		latency += nrand48(standin.xsubi) % (standin.jitter_ms + 1);
+	roll = erand48(standin.xsubi);
+	pthread_mutex_unlock(&standin.lock);
+
+	if (api_delay(req, latency * 1000000) == -ITSA_ERR_DEADLINE)
+		return -ITSA_ERR_DEADLINE;
+
+	if (roll < standin.throttle_rate)
+		return reply_err(req, HTTP_TOO_MANY_REQUESTS,
+				 "MESSAGE_THROTTLED_OUT",
+				 "The application has exceeded the rate limit",
+				 jbuf);
+	if (roll < standin.throttle_rate + standin.failure_rate)
+		return reply_err(req, HTTP_INTERNAL_SERVER_ERROR,
+				 "INTERNAL_SERVER_ERROR",
+				 "An internal server error occurred", jbuf);
+
+	pthread_mutex_lock(&standin.lock);
+	err = dispatch(req, jbuf);
+	pthread_mutex_unlock(&standin.lock);
+
+	return err;
+}
@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * standin.h - In-process stand-in for the HMRC MTD API
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _STANDIN_H_
+#define _STANDIN_H_
+
+#include <stdbool.h>
+
+#include "api.h"
+
+extern bool standin_enabled(void);
+extern int standin_req(const struct api_req *req, char **jbuf);
+
+#endif /* _STANDIN_H_ */
@@ -0,0 +1,195 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * submitted.c - Index of what's been submitted to HMRC
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ *
+ * Periods, annual summaries and savings account summaries are submitted
+ * whole, so sending the same thing again achieves nothing other than
+ * using up requests and prompting yet another calculation.
+ *
+ * So, for each thing submitted, a hash of a canonical form (sorted keys,
+ * no whitespace) of what was sent is kept in an index file, which is a
+ * JSON object like
+ *
+ *	{
+ *	    "period/<business_id>/<start>_<end>": {
+ *	        "hash": "<fnv-1a 64 hex>",
+ *	        "submitted": "<date & time>"
+ *	    },
+ *	    ...
+ *	}
+ *
+ * and anything that hashes the same as last time is skipped, unless
+ * forced.
+ *
+ * This only applies when actually talking to HMRC, not when replaying a
+ * recording or using the stand-in.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include <jansson.h>
+
+#include "libitsa.h"
+#include "submitted.h"
+#include "hash.h"
+
+static struct {
+	pthread_mutex_t lock;
+
+	char *path;
+	json_t *index;
+	bool force;
+} sub = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void sub_hash(const char *body, char *hash, size_t size)
+{
+	json_t *root;
+	char *canon = NULL;
+	uint64_t h = FNV1A_64_INIT;
+
+	root = json_loads(body, 0, NULL);
+	if (root)
+		canon = json_dumps(root, JSON_COMPACT | JSON_SORT_KEYS);
+	json_decref(root);
+
+	if (canon)
+		h = fnv1a(h, canon, strlen(canon));
+	else
+		h = fnv1a(h, body, strlen(body));
+	free(canon);
+
+	snprintf(hash, size, "%016llx", (unsigned long long)h);
+}
+
+/* Must be called with sub.lock held */
+static void sub_save(void)
+{
+	char tpath[PATH_MAX];
+	int err;
+
+	snprintf(tpath, sizeof(tpath), "%s.tmp", sub.path);
+	err = json_dump_file(sub.index, tpath, JSON_INDENT(4) |
+			     JSON_SORT_KEYS);
+	if (err)
+		return;
+
+	rename(tpath, sub.path);
+}
+
+/*
+ * Returns true if what's in body is the same as what was last
+ * successfully submitted for key.
+ */
+bool sub_unchanged(const char *key, const char *body)
+{
+	const char *last;
+	char hash[17];
+	bool unchanged = false;
+
+	if (!body)
+		return false;
+
+	pthread_mutex_lock(&sub.lock);
+	if (!sub.index || sub.force || !itsa_mtd_needed())
+		goto out_unlock;
+
+	last = json_string_value(json_object_get(json_object_get(sub.index,
+								 key),
+						 "hash"));
+	if (!last)
+		goto out_unlock;
+
+	sub_hash(body, hash, sizeof(hash));
+	unchanged = strcmp(hash, last) == 0;
+
+out_unlock:
+	pthread_mutex_unlock(&sub.lock);
+
+	return unchanged;
+}
+
+/* Note that body was successfully submitted for key */
+void sub_record(const char *key, const char *body)
+{
+	char hash[17];
+	char submitted[32];
+	time_t now = itsa_time();
+	struct tm tm;
+
+	if (!body)
+		return;
+
+	pthread_mutex_lock(&sub.lock);
+	if (!sub.index || !itsa_mtd_needed())
+		goto out_unlock;
+
+	sub_hash(body, hash, sizeof(hash));
+	strftime(submitted, sizeof(submitted), "%FT%T%z",
+		 localtime_r(&now, &tm));
+	json_object_set_new(sub.index, key,
+			    json_pack("{s:s, s:s}", "hash", hash,
+				      "submitted", submitted));
+	sub_save();
+
+out_unlock:
+	pthread_mutex_unlock(&sub.lock);
+}
+
+/*
+ * Use the index at path (created if needed) to skip submitting things
+ * that haven't changed since they were last submitted. NULL turns it
+ * off.
+ */
+int itsa_set_submit_index(const char *path)
+{
+	json_t *index = NULL;
+	int ret = 0;
+
+	pthread_mutex_lock(&sub.lock);
+	json_decref(sub.index);
+	sub.index = NULL;
+	free(sub.path);
+	sub.path = NULL;
+
+	if (!path)
+		goto out_unlock;
+
+	index = json_load_file(path, 0, NULL);
+	if (!index)
+		index = json_object();
+	if (!json_is_object(index)) {
+		json_decref(index);
+		ret = -ITSA_ERR_INVALID;
+		goto out_unlock;
+	}
+
+	sub.path = strdup(path);
+	sub.index = index;
+
+out_unlock:
+	pthread_mutex_unlock(&sub.lock);
+
+	return ret;
+}
+
+/* Submit things even if they're unchanged, e.g for --force */
+void itsa_set_force(bool force)
+{
+	pthread_mutex_lock(&sub.lock);
+	sub.force = force;
+	pthread_mutex_unlock(&sub.lock);
+}
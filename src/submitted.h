@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * submitted.h - Index of what's been submitted to HMRC
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _SUBMITTED_H_
+#define _SUBMITTED_H_
+
+#include <stdbool.h>
+
+extern bool sub_unchanged(const char *key, const char *body);
+extern void sub_record(const char *key, const char *body);
+
+#endif /* _SUBMITTED_H_ */
@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * trace.c - Timeline of what itsa is spending its time on
+ *
+ * Copyright (c) 2021 - 2022	 Andrew Clayton <andrew@digital-domain.net>
+ *
+ * With ITSA_TRACE=<file> set, spans of interest (reading the config,
+ * extracting data from GnuCash, each request to HMRC, parsing and
+ * displaying responses, waiting on the user...) are written to file in
+ * the Chrome trace event format, for loading into chrome://tracing or
+ * https://ui.perfetto.dev
+ *
+ * Events are written out as they complete. The format allows for the
+ * closing ']' of the array to be missing, so a trace is still usable if
+ * we don't get as far as exiting normally.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <jansson.h>
+
+#include "libitsa.h"
+#include "api.h"
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_once_t once;
+
+	FILE *fp;
+	int pid;
+	int next_tid;
+} trace = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.once = PTHREAD_ONCE_INIT,
+};
+
+/* Small sequential thread ids read better in a trace viewer */
+static __thread int trace_tid;
+
+static void trace_fini(void)
+{
+	pthread_mutex_lock(&trace.lock);
+	fprintf(trace.fp, "\n]\n");
+	fclose(trace.fp);
+	trace.fp = NULL;
+	pthread_mutex_unlock(&trace.lock);
+}
+
+static void trace_init(void)
+{
+	const char *path = getenv("ITSA_TRACE");
+
+	if (!path || !*path)
+		return;
+
+	trace.fp = fopen(path, "w");
+	if (!trace.fp)
+		return;
+
+	trace.pid = getpid();
+	fprintf(trace.fp, "[{\"name\":\"process_name\",\"ph\":\"M\","
+		"\"pid\":%d,\"args\":{\"name\":\"itsa\"}}", trace.pid);
+	fflush(trace.fp);
+
+	atexit(trace_fini);
+}
+
+/*
+ * Start a span, returns its start time or 0 if we're not tracing. Pass
+ * this to itsa_trace_end().
+ */
+int64_t itsa_trace_begin(void)
+{
+	pthread_once(&trace.once, trace_init);
+
+	return trace.fp ? api_now() : 0;
+}
+
+void itsa_trace_end(const char *cat, const char *name, int64_t start)
+{
+	int64_t end;
+	json_t *event;
+
+	if (!start)
+		return;
+
+	end = api_now();
+	if (!trace_tid)
+		trace_tid = __sync_add_and_fetch(&trace.next_tid, 1);
+
+	/* Times are in microseconds */
+	event = json_pack("{s:s, s:s, s:s, s:f, s:f, s:i, s:i}",
+			  "name", name, "cat", cat, "ph", "X",
+			  "ts", start / 1000.0, "dur", (end - start) / 1000.0,
+			  "pid", trace.pid, "tid", trace_tid);
+	if (!event)
+		return;
+
+	pthread_mutex_lock(&trace.lock);
+	if (trace.fp) {
+		fprintf(trace.fp, ",\n");
+		json_dumpf(event, trace.fp, JSON_COMPACT);
+		fflush(trace.fp);
+	}
+	pthread_mutex_unlock(&trace.lock);
+
+	json_decref(event);
+}